@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   benchmark_db.c
+ * @brief  Compare the database drivers on the greylisting path.
+ * @author Mikey Austin
+ * @date   2015
+ *
+ * A synthetic population of grey tuples, whitelisted and trapped addresses
+ * is loaded at each table size, then get hits, get misses, updates,
+ * deletes, an iterator walk and a scan are timed. Each result is printed
+ * as a tab separated line of driver, size, operation, count, seconds and
+ * rate.
+ *
+ * Without a configuration file, each embedded driver built is run against
+ * a scratch directory. Otherwise the database section of the supplied
+ * file is used, which must name a local server for the networked drivers.
+ * The entries loaded are deleted again before moving on, but the database
+ * should be a scratch one all the same.
+ */
+
+#include "../src/config.h"
+
+#include <greyd_config.h>
+#include <greydb.h>
+#include <list.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIZES "1000,10000,100000"
+#define SAMPLES 5000
+#define LOAD_TXN 1000 /* Entries loaded per transaction. */
+#define SEED 100
+#define DB_DIR "/tmp/greyd_benchmark_db"
+
+struct entry {
+    struct DB_key key;
+    struct DB_val val;
+    char ip[INET6_ADDRSTRLEN];
+    char helo[32];
+    char from[40];
+    char to[40];
+};
+
+static void run(Config_T config, const char* driver, int size, int samples);
+static void populate(struct entry* entries, int size, time_t now);
+static void load(DB_handle_T db, struct entry* entries, int size);
+static void shuffle(int* order, int size);
+static void check_local(Config_T config);
+static void report(const char* driver, int size, const char* op, int count,
+    struct timespec* begin);
+
+int main(int argc, char* argv[])
+{
+    Config_T config = Config_create();
+    char *conf = NULL, *sizes = NULL, *size, *driver;
+    char *drivers[] = {
+#ifdef WITH_LMDB
+        "greyd_lmdb.la",
+#endif
+#ifdef WITH_SQLITE
+        "greyd_sqlite.la",
+#endif
+#ifdef WITH_BDB
+        "greyd_bdb.la",
+#endif
+#ifdef WITH_BDB_SQL
+        "greyd_bdb_sql.la",
+#endif
+        NULL
+    };
+    int samples = SAMPLES, option, i;
+
+    while ((option = getopt(argc, argv, "c:s:n:")) != -1) {
+        switch (option) {
+        case 'c':
+            conf = optarg;
+            break;
+
+        case 's':
+            sizes = strdup(optarg);
+            break;
+
+        case 'n':
+            samples = atoi(optarg);
+            break;
+
+        default:
+            fprintf(stderr, "usage: %s [-c config] [-s size,...] "
+                            "[-n samples] [driver ...]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (conf) {
+        Config_load_file(config, conf);
+    } else {
+        system("rm -rf " DB_DIR);
+        Config_set_int(config, "drop_privs", NULL, 0);
+        Config_set_str(config, "path", "database", DB_DIR);
+        Config_set_str(config, "db_name", "database", "benchmark.db");
+    }
+    check_local(config);
+
+    if (sizes == NULL && (sizes = strdup(SIZES)) == NULL)
+        err(1, "strdup");
+
+    printf("# driver\tsize\top\tcount\tseconds\trate\n");
+    for (size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+        if (argc > 0) {
+            for (i = 0; i < argc; i++)
+                run(config, argv[i], atoi(size), samples);
+        } else if (conf) {
+            driver = Config_get_str(config, "driver", "database", NULL);
+            run(config, driver, atoi(size), samples);
+        } else {
+            for (i = 0; drivers[i]; i++)
+                run(config, drivers[i], atoi(size), samples);
+        }
+    }
+
+    Config_destroy(&config);
+    free(sizes);
+    return 0;
+}
+
+static void
+run(Config_T config, const char* driver, int size, int samples)
+{
+    DB_handle_T db;
+    DB_itr_T itr;
+    List_T white, white6, trapped;
+    struct entry *entries, miss;
+    struct DB_key key;
+    struct DB_val val;
+    struct timespec begin;
+    time_t now = time(NULL), white_exp = 2678400;
+    int *order, i, walked;
+
+    if (driver == NULL)
+        errx(1, "no database driver configured");
+
+    if (samples > size)
+        samples = size;
+
+    if ((entries = calloc(size, sizeof(*entries))) == NULL
+        || (order = calloc(size, sizeof(*order))) == NULL)
+        err(1, "calloc");
+
+    populate(entries, size, now);
+    for (i = 0; i < size; i++)
+        order[i] = i;
+    shuffle(order, size);
+
+    Config_set_str(config, "driver", "database", (char*)driver);
+    db = DB_init(config);
+    DB_open(db, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    load(db, entries, size);
+    report(driver, size, "load", size, &begin);
+
+    /* Lookups are made outside of a transaction, as the greylister's are. */
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < samples; i++) {
+        if (DB_get(db, &entries[order[i]].key, &val) != GREYDB_FOUND)
+            errx(1, "%s: entry %d not found", driver, order[i]);
+    }
+    report(driver, size, "get_hit", samples, &begin);
+
+    miss.key.type = DB_KEY_TUPLE;
+    miss.key.data.gt.ip = miss.ip;
+    miss.key.data.gt.helo = "miss.example.com";
+    miss.key.data.gt.from = "nobody@example.com";
+    miss.key.data.gt.to = "nobody@example.org";
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < samples; i++) {
+        snprintf(miss.ip, sizeof(miss.ip), "172.%d.%d.%d", 16 + (i >> 16) % 16,
+            (i >> 8) & 0xff, i & 0xff);
+        if (DB_get(db, &miss.key, &val) != GREYDB_NOT_FOUND)
+            errx(1, "%s: unexpected entry %s", driver, miss.ip);
+    }
+    report(driver, size, "get_miss", samples, &begin);
+
+    /* Each update is a get then a put in its own transaction. */
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < samples; i++) {
+        DB_start_txn(db);
+        DB_get(db, &entries[order[i]].key, &val);
+        val.data.gd.bcount++;
+        DB_put(db, &entries[order[i]].key, &val);
+        DB_commit_txn(db);
+    }
+    report(driver, size, "put", samples, &begin);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    DB_start_txn(db);
+    walked = 0;
+    if ((itr = DB_get_itr(db, DB_ENTRIES)) != NULL) {
+        while (DB_itr_next(itr, &key, &val) != GREYDB_NOT_FOUND)
+            walked++;
+        DB_close_itr(&itr);
+    }
+    DB_commit_txn(db);
+    report(driver, size, "iterate", walked, &begin);
+
+    /*
+     * Nothing has expired or passed, so the scan only builds the
+     * lists and leaves the entries as they are.
+     */
+    white = List_create(free);
+    white6 = List_create(free);
+    trapped = List_create(free);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    DB_start_txn(db);
+    DB_scan(db, &now, white, white6, trapped, &white_exp);
+    DB_commit_txn(db);
+    report(driver, size, "scan", size, &begin);
+
+    List_destroy(&white);
+    List_destroy(&white6);
+    List_destroy(&trapped);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < samples; i++) {
+        DB_start_txn(db);
+        DB_del(db, &entries[order[i]].key);
+        DB_commit_txn(db);
+    }
+    report(driver, size, "delete", samples, &begin);
+
+    /* Leave the database as it was found for the next run. */
+    DB_start_txn(db);
+    for (i = samples; i < size; i++) {
+        DB_del(db, &entries[order[i]].key);
+        if ((i - samples + 1) % LOAD_TXN == 0) {
+            DB_commit_txn(db);
+            DB_start_txn(db);
+        }
+    }
+    DB_commit_txn(db);
+
+    DB_close(&db);
+    free(entries);
+    free(order);
+}
+
+/*
+ * Most entries are grey tuples, followed by whitelisted IPv4 and IPv6
+ * addresses and trapped addresses, in roughly the proportions seen on a
+ * busy MX. Expiry and pass times are all in the future.
+ */
+static void
+populate(struct entry* entries, int size, time_t now)
+{
+    struct entry* e;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        e = entries + i;
+        e->val.type = DB_VAL_GREY;
+        e->val.data.gd.first = now;
+
+        switch (i % 20) {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            snprintf(e->ip, sizeof(e->ip), "10.%d.%d.%d", 128 + (i >> 16) % 128,
+                (i >> 8) & 0xff, i & 0xff);
+            e->key.type = DB_KEY_IP;
+            e->key.data.s = e->ip;
+            e->val.data.gd.pass = now;
+            e->val.data.gd.expire = now + 2678400;
+            e->val.data.gd.pcount = 1 + i % 7;
+            break;
+
+        case 4:
+            snprintf(e->ip, sizeof(e->ip), "2001:db8::%x", i);
+            e->key.type = DB_KEY_IP;
+            e->key.data.s = e->ip;
+            e->val.data.gd.pass = now;
+            e->val.data.gd.expire = now + 2678400;
+            e->val.data.gd.pcount = 1;
+            break;
+
+        case 5:
+        case 6:
+            snprintf(e->ip, sizeof(e->ip), "10.%d.%d.%d", (i >> 16) % 128,
+                (i >> 8) & 0xff, i & 0xff);
+            e->key.type = DB_KEY_IP;
+            e->key.data.s = e->ip;
+            e->val.data.gd.pass = now + 86400;
+            e->val.data.gd.expire = now + 86400;
+            e->val.data.gd.bcount = 1;
+            e->val.data.gd.pcount = -1;
+            break;
+
+        default:
+            snprintf(e->ip, sizeof(e->ip), "10.%d.%d.%d", (i >> 16) % 128,
+                (i >> 8) & 0xff, i & 0xff);
+            snprintf(e->helo, sizeof(e->helo), "mail%d.example.com", i % 997);
+            snprintf(e->from, sizeof(e->from), "sender%d@example%d.com",
+                i % 5003, i % 89);
+            snprintf(e->to, sizeof(e->to), "user%d@example.org", i % 211);
+            e->key.type = DB_KEY_TUPLE;
+            e->key.data.gt.ip = e->ip;
+            e->key.data.gt.helo = e->helo;
+            e->key.data.gt.from = e->from;
+            e->key.data.gt.to = e->to;
+            e->val.data.gd.pass = now + 600;
+            e->val.data.gd.expire = now + 14400;
+            e->val.data.gd.bcount = 1 + i % 3;
+            break;
+        }
+    }
+}
+
+static void
+load(DB_handle_T db, struct entry* entries, int size)
+{
+    int i;
+
+    DB_start_txn(db);
+    for (i = 0; i < size; i++) {
+        if (DB_put(db, &entries[i].key, &entries[i].val) != GREYDB_OK)
+            errx(1, "could not load entry %d", i);
+
+        if ((i + 1) % LOAD_TXN == 0) {
+            DB_commit_txn(db);
+            DB_start_txn(db);
+        }
+    }
+    DB_commit_txn(db);
+}
+
+/*
+ * Visit the entries in a random but repeatable order, so that ordered
+ * stores get no help from locality.
+ */
+static void
+shuffle(int* order, int size)
+{
+    int i, j, tmp;
+
+    srand(SEED);
+    for (i = size - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/*
+ * Only local servers may be used, either over a socket or the loopback
+ * interface.
+ */
+static void
+check_local(Config_T config)
+{
+    char* host = Config_get_str(config, "host", "database", NULL);
+
+    if (host == NULL || *host == '/'
+        || strcmp(host, "localhost") == 0
+        || strcmp(host, "127.0.0.1") == 0
+        || strcmp(host, "::1") == 0)
+        return;
+
+    errx(1, "refusing to benchmark against non-local host %s", host);
+}
+
+static void
+report(const char* driver, int size, const char* op, int count,
+    struct timespec* begin)
+{
+    struct timespec end;
+    double secs;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+
+    printf("%s\t%d\t%s\t%d\t%.6lf\t%.0lf\n", driver, size, op, count, secs,
+        secs > 0 ? count / secs : 0);
+    fflush(stdout);
+}
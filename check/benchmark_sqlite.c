@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   benchmark_sqlite.c
+ * @brief  Measure SQLite driver get/put rates under a concurrent scanner.
+ * @author Mikey Austin
+ * @date   2015
+ *
+ * A child process scans the database in a loop, as the greylister's
+ * scanner would, whilst the parent updates grey tuples one transaction
+ * at a time, as the reader would. This is run with the default SQLite
+ * settings and then with the tuning options enabled.
+ */
+
+#include <config_lexer.h>
+#include <config_parser.h>
+#include <grey.h>
+#include <greyd_config.h>
+#include <greydb.h>
+#include <lexer_source.h>
+#include <list.h>
+
+#include <err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENTRIES 5000
+#define SCAN_INTERVAL 100000 /* In microseconds. */
+#define DB_DIR "/tmp/greyd_benchmark_sqlite"
+
+static void run(const char* name, const char* tuning, int entries);
+static void scan_loop(Config_T config, int ready);
+static double elapsed(struct timespec* begin);
+
+int main(int argc, char* argv[])
+{
+    int entries = ENTRIES;
+
+    /* First arg is the number of tuples to update. */
+    if (argc > 1)
+        entries = atoi(argv[1]);
+
+    run("default", "", entries);
+    run("tuned",
+        "  journal_mode = \"wal\",\n"
+        "  synchronous  = \"normal\",\n"
+        "  mmap_size    = 67108864,\n"
+        "  cache_size   = 4096,\n"
+        "  busy_timeout = 5000,\n",
+        entries);
+
+    return 0;
+}
+
+static void
+run(const char* name, const char* tuning, int entries)
+{
+    Config_T config = Config_create();
+    Config_parser_T parser;
+    DB_handle_T db;
+    struct DB_key key;
+    struct DB_val val;
+    struct timespec begin;
+    char *conf, ip[INET_ADDRSTRLEN], helo[64];
+    double put_secs, get_secs;
+    int i, status, ready[2];
+    char c;
+    pid_t pid;
+
+    asprintf(&conf, "drop_privs = 0\n"
+                    "section database {\n"
+                    "%s"
+                    "  driver  = \"greyd_sqlite.la\",\n"
+                    "  path    = \"" DB_DIR "\",\n"
+                    "  db_name = \"benchmark_%s.db\"\n"
+                    "}\n",
+        tuning, name);
+    parser = Config_parser_create(
+        Config_lexer_create(Lexer_source_create_from_str(conf, strlen(conf))));
+    Config_parser_start(parser, config);
+    Config_parser_destroy(&parser);
+
+    system("rm -rf " DB_DIR);
+
+    /* Create the schema before the scanner starts. */
+    db = DB_init(config);
+    DB_open(db, 0);
+
+    if (pipe(ready) == -1)
+        err(1, "pipe");
+
+    fflush(stdout);
+    switch ((pid = fork())) {
+    case -1:
+        err(1, "fork");
+
+    case 0:
+        close(ready[0]);
+        scan_loop(config, ready[1]);
+        _exit(0);
+    }
+
+    /* Wait for the scanner to open the database. */
+    close(ready[1]);
+    if (read(ready[0], &c, 1) != 1)
+        errx(1, "scanner failed to start");
+    close(ready[0]);
+
+    key.type = DB_KEY_TUPLE;
+    key.data.gt.ip = ip;
+    key.data.gt.helo = helo;
+    key.data.gt.from = "sender@example.com";
+    key.data.gt.to = "recipient@example.org";
+
+    /* Each update is a get then a put in its own transaction. */
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < entries; i++) {
+        snprintf(ip, sizeof(ip), "10.%d.%d.%d", (i >> 16) & 0xff,
+            (i >> 8) & 0xff, i & 0xff);
+        snprintf(helo, sizeof(helo), "mail%d.example.com", i % 100);
+
+        DB_start_txn(db);
+        if (DB_get(db, &key, &val) != GREYDB_FOUND) {
+            memset(&val, 0, sizeof(val));
+            val.type = DB_VAL_GREY;
+            val.data.gd.first = time(NULL);
+            val.data.gd.pass = val.data.gd.expire = time(NULL) + 3600;
+        }
+        val.data.gd.bcount++;
+        DB_put(db, &key, &val);
+        DB_commit_txn(db);
+    }
+    put_secs = elapsed(&begin);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < entries; i++) {
+        snprintf(ip, sizeof(ip), "10.%d.%d.%d", (i >> 16) & 0xff,
+            (i >> 8) & 0xff, i & 0xff);
+        snprintf(helo, sizeof(helo), "mail%d.example.com", i % 100);
+        DB_get(db, &key, &val);
+    }
+    get_secs = elapsed(&begin);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    DB_close(&db);
+
+    printf("%-8s %d updates in %.3lf s (%.0lf/s), %d gets in %.3lf s "
+           "(%.0lf/s)\n",
+        name, entries, put_secs, entries / put_secs, entries, get_secs,
+        entries / get_secs);
+
+    Config_destroy(&config);
+    free(conf);
+}
+
+static void
+scan_loop(Config_T config, int ready)
+{
+    DB_handle_T db = DB_init(config);
+    List_T white, white6, trapped;
+    time_t now, white_exp = 86400;
+
+    DB_open(db, 0);
+    write(ready, "", 1);
+    close(ready);
+
+    for (;;) {
+        white = List_create(free);
+        white6 = List_create(free);
+        trapped = List_create(free);
+
+        now = time(NULL);
+        DB_open(db, 0);
+        DB_start_txn(db);
+        DB_scan(db, &now, white, white6, trapped, &white_exp);
+        DB_commit_txn(db);
+
+        List_destroy(&white);
+        List_destroy(&white6);
+        List_destroy(&trapped);
+        usleep(SCAN_INTERVAL);
+    }
+}
+
+static double
+elapsed(struct timespec* begin)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec)
+        + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   benchmark_sync.c
+ * @brief  Measure the sync engine's receive throughput.
+ * @author Mikey Austin
+ * @date   2014
+ *
+ * Sync packets built by a sending engine are captured, then replayed
+ * over the loopback interface by a child process whilst the receiving
+ * engine drains them.
+ */
+
+#include <config_lexer.h>
+#include <config_parser.h>
+#include <grey.h>
+#include <greyd_config.h>
+#include <lexer_source.h>
+#include <sync.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT 18025
+#define ENTRIES 5000
+#define ROUNDS 200
+#define MAX_PACKETS 1024
+
+static Config_T load_config(const char* conf);
+
+int main(int argc, char* argv[])
+{
+    Sync_engine_T sender, receiver;
+    Config_T send_conf, recv_conf;
+    struct Grey_tuple gt;
+    struct sockaddr_in addr;
+    struct timespec begin, end;
+    struct pollfd pfd;
+    static unsigned char packets[MAX_PACKETS][SYNC_MAXSIZE];
+    int lens[MAX_PACKETS];
+    int fd, i, r, npackets = 0, rounds = ROUNDS, rcvbuf = 1 << 24;
+    char ip[INET_ADDRSTRLEN];
+    double spent;
+    FILE* devnull;
+    pid_t pid;
+
+    /* First arg is the number of replay rounds. */
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+
+    send_conf = load_config(
+        "section sync {\n"
+        "  enable         = 1,\n"
+        "  verify         = 0,\n"
+        "  port           = 18025,\n"
+        "  hosts          = [ \"127.0.0.1\" ],\n"
+        "  flush_interval = 60000\n"
+        "}\n");
+
+    recv_conf = load_config(
+        "section grey {\n"
+        "  enable = 1\n"
+        "}\n"
+        "section sync {\n"
+        "  enable       = 1,\n"
+        "  verify       = 0,\n"
+        "  port         = 18025,\n"
+        "  bind_address = \"127.0.0.1\"\n"
+        "}\n");
+
+    /* Capture the sender's packets on the sync port. */
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+        err(1, "socket");
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        err(1, "bind");
+
+    if ((sender = Sync_init(send_conf)) == NULL || Sync_start(sender) == -1)
+        errx(1, "could not start sending sync engine");
+
+    for (i = 0; i < ENTRIES; i++) {
+        snprintf(ip, sizeof(ip), "10.%d.%d.%d", (i >> 16) & 0xff,
+            (i >> 8) & 0xff, i & 0xff);
+        if (i % 2) {
+            Sync_white(sender, ip, time(NULL), time(NULL) + 3600, 0);
+        } else {
+            gt.ip = ip;
+            gt.helo = "mail.example.com";
+            gt.from = "sender@example.com";
+            gt.to = "recipient@example.org";
+            Sync_update(sender, &gt, time(NULL), 1);
+        }
+    }
+    Sync_flush(sender);
+
+    while (npackets < MAX_PACKETS
+        && (lens[npackets] = recv(fd, packets[npackets], SYNC_MAXSIZE,
+                MSG_DONTWAIT))
+            > 0) {
+        npackets++;
+    }
+    close(fd);
+
+    printf("%d entries captured in %d packets\n", ENTRIES, npackets);
+
+    if ((receiver = Sync_init(recv_conf)) == NULL
+        || Sync_start(receiver) == -1) {
+        errx(1, "could not start receiving sync engine");
+    }
+
+    /* Give the receiver room to absorb bursts from the replay. */
+    if (setsockopt(receiver->sync_fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+            sizeof(rcvbuf))
+        == -1) {
+        setsockopt(receiver->sync_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+            sizeof(rcvbuf));
+    }
+
+    /* Replay the captured packets from a child process. */
+    fflush(stdout);
+    switch ((pid = fork())) {
+    case -1:
+        err(1, "fork");
+
+    case 0:
+        if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+            err(1, "socket");
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < npackets; i++) {
+                while (sendto(fd, packets[i], lens[i], 0,
+                           (struct sockaddr*)&addr, sizeof(addr))
+                    == -1) {
+                    usleep(100);
+                }
+            }
+        }
+        exit(0);
+    }
+
+    if ((devnull = fopen("/dev/null", "w")) == NULL)
+        err(1, "fopen");
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = receiver->sync_fd;
+    pfd.events = POLLIN;
+
+    /* Time from the first packet until the replay goes quiet. */
+    if (poll(&pfd, 1, 5000) < 1)
+        errx(1, "no packets received");
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    do {
+        Sync_recv(receiver, devnull);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    } while (poll(&pfd, 1, 1000) > 0);
+
+    spent = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    waitpid(pid, NULL, 0);
+    printf("%lu of %d packets received (%lu entries) in %lf seconds\n",
+        receiver->packets_recv, npackets * rounds, receiver->tlvs_recv, spent);
+    if (spent > 0) {
+        printf("%.0lf packets/s, %.0lf entries/s\n",
+            receiver->packets_recv / spent, receiver->tlvs_recv / spent);
+    }
+
+    fclose(devnull);
+    Sync_stop(&sender);
+    Sync_stop(&receiver);
+    Config_destroy(&send_conf);
+    Config_destroy(&recv_conf);
+
+    return 0;
+}
+
+static Config_T
+load_config(const char* conf)
+{
+    Config_T config = Config_create();
+    Config_parser_T parser;
+
+    parser = Config_parser_create(
+        Config_lexer_create(Lexer_source_create_from_str(conf, strlen(conf))));
+    Config_parser_start(parser, config);
+    Config_parser_destroy(&parser);
+
+    return config;
+}
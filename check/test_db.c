@@ -44,11 +44,12 @@ int main(int argc, char* argv[])
     Lexer_T l;
     Config_parser_T cp;
     Config_T c;
-    struct DB_key key1, key2;
-    struct DB_val val1, val2, val3;
+    struct DB_key key1, key2, keys[4], many_keys[23];
+    struct DB_val val1, val2, val3, vals[4], vals2[4], many_vals[23];
+    char many_ips[23][16], long_helo[251], long_from[251];
     struct Grey_tuple gt;
     struct Grey_data gd, gd2;
-    int ret, i = 0;
+    int ret, found[4], many_found[23], i = 0;
     char* conf_tmpl = "drop_privs = 0\n"
                       "section database {\n"
                       "  driver = \"%s\",\n"
@@ -80,7 +81,7 @@ int main(int argc, char* argv[])
         printf("Error unlinking test DB: %s\n", strerror(errno));
     }
 
-    TEST_START(56);
+    TEST_START(76);
 
     db = DB_init(c);
     DB_open(db, GREYDB_RW);
@@ -247,6 +248,45 @@ int main(int argc, char* argv[])
     DB_close_itr(&itr);
     TEST_OK((itr == NULL), "Iterator close OK");
 
+    /*
+     * Resume an iteration of the entries after its first key, for the
+     * drivers which support it.
+     */
+    struct DB_key resume;
+    int repeated = 0;
+
+    if ((itr = DB_get_itr_after(db, NULL)) == NULL) {
+        TEST_OK(1, "Resumable iteration not supported");
+        TEST_OK(1, "Resumable iteration not supported");
+    } else {
+        DB_itr_next(itr, &key1, &val1);
+        resume.type = DB_KEY_TUPLE;
+        resume.data.gt.ip = strdup(key1.data.gt.ip);
+        resume.data.gt.helo = strdup(key1.data.gt.helo);
+        resume.data.gt.from = strdup(key1.data.gt.from);
+        resume.data.gt.to = strdup(key1.data.gt.to);
+        for (i = 1; DB_itr_next(itr, &key1, &val1) == GREYDB_FOUND; i++)
+            ;
+        DB_close_itr(&itr);
+        TEST_OK((i == 3), "Resumable iteration found all entries");
+
+        itr = DB_get_itr_after(db, &resume);
+        for (i = 0; DB_itr_next(itr, &key1, &val1) == GREYDB_FOUND; i++) {
+            if (!strcmp(key1.data.gt.ip, resume.data.gt.ip)
+                && !strcmp(key1.data.gt.to, resume.data.gt.to)) {
+                repeated = 1;
+            }
+        }
+        DB_close_itr(&itr);
+        TEST_OK((i == 2 && !repeated),
+            "Resumed iteration started after the key");
+
+        free(resume.data.gt.ip);
+        free(resume.data.gt.helo);
+        free(resume.data.gt.from);
+        free(resume.data.gt.to);
+    }
+
     /* Iterate over just the permitted domains. */
     itr = DB_get_itr(db, DB_DOMAINS);
     memset(&key1, 0, sizeof(key1));
@@ -297,6 +337,144 @@ int main(int argc, char* argv[])
     TEST_OK((itr->current == -1), "truncated ok");
     DB_close_itr(&itr);
 
+    /* Test the batched entry points over a mixture of key types. */
+    memset(keys, 0, sizeof(keys));
+    memset(vals, 0, sizeof(vals));
+    keys[0].type = DB_KEY_IP;
+    keys[0].data.s = "10.0.0.1";
+    keys[1].type = DB_KEY_TUPLE;
+    keys[1].data.gt.ip = "10.0.0.2";
+    keys[1].data.gt.helo = "batch.greyd.org";
+    keys[1].data.gt.from = "batch@greyd.org";
+    keys[1].data.gt.to = "batch@hotmail.com";
+    keys[2].type = DB_KEY_MAIL;
+    keys[2].data.s = "batchtrap@hotmail.com";
+    keys[3].type = DB_KEY_IP;
+    keys[3].data.s = "10.0.0.3";
+    for (i = 0; i < 3; i++) {
+        vals[i].type = DB_VAL_GREY;
+        vals[i].data.gd.first = 10 + i;
+        vals[i].data.gd.pcount = (i == 2 ? -2 : i);
+    }
+
+    ret = DB_put_many(db, keys, vals, 3);
+    TEST_OK((ret == GREYDB_OK), "put many ok");
+
+    memset(vals2, 0, sizeof(vals2));
+    ret = DB_get_many(db, keys, vals2, found, 4);
+    TEST_OK((ret == GREYDB_OK), "get many ok");
+    TEST_OK((found[0] == GREYDB_FOUND && vals2[0].data.gd.first == 10),
+        "get many ip ok");
+    TEST_OK((found[1] == GREYDB_FOUND && vals2[1].data.gd.first == 11
+                && vals2[1].data.gd.pcount == 1),
+        "get many tuple ok");
+    TEST_OK((found[2] == GREYDB_FOUND), "get many spamtrap ok");
+    TEST_OK((found[3] == GREYDB_NOT_FOUND), "get many missing ok");
+
+    /* Batched writes within a transaction are visible and rolled back. */
+    DB_start_txn(db);
+    vals[0].data.gd.first = 20;
+    DB_put_many(db, keys, vals, 1);
+    DB_get_many(db, keys, vals2, found, 1);
+    TEST_OK((found[0] == GREYDB_FOUND && vals2[0].data.gd.first == 20),
+        "get many in txn ok");
+    DB_rollback_txn(db);
+
+    DB_get_many(db, keys, vals2, found, 1);
+    TEST_OK((found[0] == GREYDB_FOUND && vals2[0].data.gd.first == 10),
+        "put many rollback ok");
+
+    /* The missing key is ignored. */
+    ret = DB_del_many(db, keys, 4);
+    TEST_OK((ret == GREYDB_OK), "del many ok");
+
+    ret = DB_get_many(db, keys, vals2, found, 4);
+    TEST_OK((ret == GREYDB_OK), "get many after del ok");
+    TEST_OK((found[0] == GREYDB_NOT_FOUND && found[1] == GREYDB_NOT_FOUND
+                && found[2] == GREYDB_NOT_FOUND
+                && found[3] == GREYDB_NOT_FOUND),
+        "del many removed all");
+
+    /* Single lookups and deletes after a batched write in a txn. */
+    vals[3].type = DB_VAL_GREY;
+    vals[3].data.gd.first = 30;
+    DB_put(db, &keys[3], &vals[3]);
+
+    DB_start_txn(db);
+    vals[0].data.gd.first = 40;
+    DB_put(db, &keys[0], &vals[0]);
+    ret = DB_get(db, &keys[3], &val1);
+    TEST_OK((ret == GREYDB_FOUND && val1.data.gd.first == 30),
+        "get after put in txn ok");
+    DB_del(db, &keys[3]);
+    DB_commit_txn(db);
+
+    ret = DB_get(db, &keys[0], &val1);
+    TEST_OK((ret == GREYDB_FOUND && val1.data.gd.first == 40),
+        "put kept after del in txn");
+    TEST_OK((DB_get(db, &keys[3], &val1) == GREYDB_NOT_FOUND),
+        "del after put in txn ok");
+
+    /* A partial batch spanning the smaller batch sizes. */
+    memset(many_keys, 0, sizeof(many_keys));
+    memset(many_vals, 0, sizeof(many_vals));
+    for (i = 0; i < 23; i++) {
+        snprintf(many_ips[i], sizeof(many_ips[i]), "10.1.0.%d", i);
+        many_keys[i].type = DB_KEY_IP;
+        many_keys[i].data.s = many_ips[i];
+        many_vals[i].type = DB_VAL_GREY;
+        many_vals[i].data.gd.first = 100 + i;
+    }
+
+    DB_start_txn(db);
+    DB_put_many(db, many_keys, many_vals, 23);
+    DB_commit_txn(db);
+
+    memset(many_vals, 0, sizeof(many_vals));
+    DB_get_many(db, many_keys, many_vals, many_found, 23);
+    for (i = 0; i < 23; i++) {
+        if (many_found[i] != GREYDB_FOUND
+            || many_vals[i].data.gd.first != 100 + i) {
+            break;
+        }
+    }
+    TEST_OK((i == 23), "partial batch put ok");
+
+    ret = DB_del_many(db, many_keys, 23);
+    TEST_OK((ret == GREYDB_OK), "partial batch del ok");
+
+    /* Long tuples sharing a prefix beyond the maximum key size. */
+    memset(long_helo, 'h', sizeof(long_helo) - 1);
+    long_helo[sizeof(long_helo) - 1] = '\0';
+    memset(long_from, 'f', sizeof(long_from) - 1);
+    long_from[sizeof(long_from) - 1] = '\0';
+    memset(keys, 0, sizeof(keys));
+    memset(vals, 0, sizeof(vals));
+    for (i = 0; i < 2; i++) {
+        keys[i].type = DB_KEY_TUPLE;
+        keys[i].data.gt.ip = "10.2.0.1";
+        keys[i].data.gt.helo = long_helo;
+        keys[i].data.gt.from = long_from;
+        keys[i].data.gt.to = (i == 0 ? "first@greyd.org" : "second@greyd.org");
+        vals[i].type = DB_VAL_GREY;
+        vals[i].data.gd.first = 200 + i;
+        DB_put(db, &keys[i], &vals[i]);
+    }
+
+    ret = DB_get_many(db, keys, vals2, found, 2);
+    TEST_OK((ret == GREYDB_OK && found[0] == GREYDB_FOUND
+                && found[1] == GREYDB_FOUND
+                && vals2[0].data.gd.first == 200
+                && vals2[1].data.gd.first == 201),
+        "long tuples with shared prefix kept apart");
+
+    DB_del(db, &keys[0]);
+    TEST_OK((DB_get(db, &keys[0], &val1) == GREYDB_NOT_FOUND
+                && DB_get(db, &keys[1], &val1) == GREYDB_FOUND
+                && val1.data.gd.first == 201),
+        "long tuple del ok");
+    DB_del(db, &keys[1]);
+
     DB_close(&db);
     Config_destroy(&c);
     Config_parser_destroy(&cp);
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   test_fw_nftables.c
+ * @brief  Unit tests for the nftables firewall driver.
+ * @author Mikey Austin
+ * @date   2015
+ *
+ * These tests modify the running ruleset, so must be run in a private
+ * network namespace via the test-nftables script. The set contents are
+ * checked against the output of "nft list set".
+ */
+
+#include "../src/config.h"
+
+#include "test.h"
+#include <config_lexer.h>
+#include <config_parser.h>
+#include <firewall.h>
+#include <greyd_config.h>
+#include <lexer.h>
+#include <list.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define TEST_TABLE "greyd_test"
+#define TEST_SET "greyd-whitelist"
+#define TEST_SET_V6 "greyd-whitelist-ipv6"
+#define TEST_LOG_PORT 2525 /* Logged to the inbound group by test-nftables. */
+
+static int set_count(const char* set_name, const char* elem);
+static void load_list(List_T list, const char** cidrs);
+static void send_syn(const char* addr, int port);
+
+int main(int argc, char* argv[])
+{
+    FW_handle_T fw;
+    Lexer_source_T ls;
+    Lexer_T l;
+    Config_parser_T cp;
+    Config_T c;
+    List_T cidrs, logged;
+    struct List_entry* entry;
+    int ret, found;
+    const char* initial[] = { "10.1.0.1", "172.16.0.0/12", "192.168.10.0/24",
+        NULL };
+    const char* replaced[] = { "10.2.0.1", "192.168.20.0/24", NULL };
+    const char* added[] = { "10.3.0.1", "192.168.30.0/24", NULL };
+    const char* deleted[] = { "10.2.0.1", "10.4.0.1", NULL };
+    const char* initial_v6[] = { "2001:db8::1", "2001:db8:1::/48", NULL };
+    const char* deleted_v6[] = { "2001:db8::1", NULL };
+    char* conf = "drop_privs = 0\n"
+                 "section firewall {\n"
+                 "  driver = \"greyd_nftables.la\",\n"
+                 "  table = \"" TEST_TABLE "\",\n"
+                 "  track_outbound = 0,\n"
+                 "  log_qthreshold = 1\n"
+                 "}";
+
+    c = Config_create();
+    if (argc > 1 && !strcmp(argv[1], "-")) {
+        /* Read from stdin. */
+        ls = Lexer_source_create_from_fd(0);
+    } else {
+        ls = Lexer_source_create_from_str(conf, strlen(conf));
+    }
+    l = Config_lexer_create(ls);
+    cp = Config_parser_create(l);
+    Config_parser_start(cp, c);
+
+    TEST_START(25);
+
+    fw = FW_open(c);
+    TEST_OK(fw != NULL, "firewall handle opened");
+    if (fw == NULL)
+        return 1;
+
+    cidrs = List_create(NULL);
+
+    /* Test a replace into a set that does not yet exist. */
+    load_list(cidrs, initial);
+    ret = FW_replace(fw, TEST_SET, cidrs, AF_INET);
+    TEST_OK(ret == 3, "replace into a new set ok");
+    TEST_OK(set_count(TEST_SET, NULL) == 3, "new set has all elements");
+    TEST_OK(set_count(TEST_SET, "10.1.0.1") == 1, "address loaded");
+    TEST_OK(set_count(TEST_SET, "172.16.0.0/12") == 1, "cidr loaded");
+    TEST_OK(set_count(TEST_SET, "192.168.10.0/24") == 1, "cidr loaded");
+
+    /* Test that a replace drops the previous contents. */
+    load_list(cidrs, replaced);
+    ret = FW_replace(fw, TEST_SET, cidrs, AF_INET);
+    TEST_OK(ret == 2, "replace into an existing set ok");
+    TEST_OK(set_count(TEST_SET, NULL) == 2, "replaced set has new elements only");
+    TEST_OK(set_count(TEST_SET, "10.1.0.1") == 0, "old address removed");
+    TEST_OK(set_count(TEST_SET, "192.168.20.0/24") == 1, "new cidr loaded");
+
+    /* Test an add delta. */
+    load_list(cidrs, added);
+    ret = FW_add(fw, TEST_SET, cidrs, AF_INET);
+    TEST_OK(ret == 2, "add delta ok");
+    TEST_OK(set_count(TEST_SET, NULL) == 4, "existing elements kept on add");
+    TEST_OK(set_count(TEST_SET, "10.3.0.1") == 1, "added address present");
+    TEST_OK(set_count(TEST_SET, "192.168.30.0/24") == 1, "added cidr present");
+
+    /* Test a delete delta, including an address not in the set. */
+    load_list(cidrs, deleted);
+    ret = FW_del(fw, TEST_SET, cidrs, AF_INET);
+    TEST_OK(ret == 1, "delete delta with an absent address ok");
+    TEST_OK(set_count(TEST_SET, NULL) == 3, "other elements kept on delete");
+    TEST_OK(set_count(TEST_SET, "10.2.0.1") == 0, "deleted address removed");
+
+    ret = FW_del(fw, TEST_SET, cidrs, AF_INET);
+    TEST_OK(ret == 0, "repeated delete is not an error");
+
+    /* Test the IPv6 set. */
+    load_list(cidrs, initial_v6);
+    ret = FW_replace(fw, TEST_SET_V6, cidrs, AF_INET6);
+    TEST_OK(ret == 2, "IPv6 replace ok");
+    TEST_OK(set_count(TEST_SET_V6, "2001:db8:1::/48") == 1, "IPv6 cidr loaded");
+
+    load_list(cidrs, deleted_v6);
+    ret = FW_del(fw, TEST_SET_V6, cidrs, AF_INET6);
+    TEST_OK(ret == 1, "IPv6 delete delta ok");
+    TEST_OK(set_count(TEST_SET_V6, NULL) == 1, "IPv6 address removed");
+    TEST_OK(set_count(TEST_SET, NULL) == 3, "IPv4 set unaffected");
+
+    /* Test that logged packets are captured. */
+    FW_start_log_capture(fw);
+    send_syn("127.0.0.1", TEST_LOG_PORT);
+    logged = FW_capture_log(fw, -1);
+    TEST_OK(logged != NULL && List_size(logged) > 0, "logged packet captured");
+
+    found = 0;
+    if (logged != NULL) {
+        LIST_EACH(logged, entry)
+        {
+            if (!strcmp(List_entry_value(entry), "127.0.0.1"))
+                found = 1;
+        }
+    }
+    TEST_OK(found, "logged source address captured");
+    FW_end_log_capture(fw);
+
+    List_destroy(&cidrs);
+    FW_close(&fw);
+    Config_destroy(&c);
+    Config_parser_destroy(&cp);
+
+    TEST_COMPLETE;
+}
+
+/*
+ * Count the elements of the set listed by nft, or just the occurrences
+ * of the specified element. Returns -1 if the set could not be listed.
+ */
+static int
+set_count(const char* set_name, const char* elem)
+{
+    FILE* out;
+    char *cmd, buf[8192], *elems, *tok, *last;
+    const char* nft;
+    size_t len;
+    int count = 0;
+
+    if ((nft = getenv("NFT")) == NULL)
+        nft = "nft";
+
+    if (asprintf(&cmd, "%s list set inet %s %s 2>/dev/null", nft, TEST_TABLE,
+            set_name)
+        < 0)
+        return -1;
+
+    out = popen(cmd, "r");
+    free(cmd);
+    if (out == NULL)
+        return -1;
+
+    len = fread(buf, 1, sizeof(buf) - 1, out);
+    buf[len] = '\0';
+    if (pclose(out) != 0)
+        return -1;
+
+    /* An empty set has no elements line. */
+    if ((elems = strstr(buf, "elements = {")) == NULL)
+        return 0;
+    elems += strlen("elements = {");
+    if ((last = strchr(elems, '}')) != NULL)
+        *last = '\0';
+
+    for (tok = strtok(elems, ", \t\n"); tok != NULL;
+         tok = strtok(NULL, ", \t\n")) {
+        if (elem == NULL || !strcmp(tok, elem))
+            count++;
+    }
+
+    return count;
+}
+
+static void
+load_list(List_T list, const char** cidrs)
+{
+    List_remove_all(list);
+    while (*cidrs != NULL)
+        List_insert_after(list, (void*)*cidrs++);
+}
+
+/*
+ * Start a connection to the address, so that the inbound SYN is logged.
+ * Nothing is listening, so the connection is simply reset.
+ */
+static void
+send_syn(const char* addr, int port)
+{
+    struct sockaddr_in sin;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    inet_pton(AF_INET, addr, &sin.sin_addr);
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    connect(fd, (struct sockaddr*)&sin, sizeof(sin));
+    close(fd);
+}
@@ -0,0 +1,2 @@
+#!/bin/sh
+/bin/sh ./test-nftables test_fw_nftables
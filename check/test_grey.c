@@ -34,11 +34,13 @@
 #include <greydb.h>
 #include <lexer.h>
 #include <list.h>
+#include <sync.h>
 
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -49,6 +51,7 @@ static void write_grey(char*, char*, char*, char*, char*, FILE*);
 static void write_trap(char* source, char* ip, long expires, FILE* grey_out);
 static void write_white(char* source, char* ip, long expires, FILE* grey_out);
 static void add_spamtrap(char* trapaddr, Config_T config);
+static long transfer_snapshot(Config_T from, Config_T to, long* sent);
 static void tally_database(Config_T c, int* total_entries, int* total_white, int* total_grey,
     int* total_trapped, int* total_spamtrap, int* total_white_passed,
     int* total_white_blocked, int* total_grey_passed, int* total_grey_blocked);
@@ -66,7 +69,10 @@ int main(int argc, char* argv[])
     Greylister_T greylister;
     Config_T c, message;
     Config_section_T section;
-    int ret, grey[2], trap[2], fw[2], i;
+    int ret, grey[2], trap[2], fw[2], fw_status[2], i;
+    char* fw_resync_msg = "type=\"resync\"\n"
+                          "name=\"greyd-whitelist\"\n"
+                          "af=2\n%\n";
     FILE *grey_in, *grey_out, *trap_out;
     pid_t reader_pid;
     char* domain;
@@ -89,7 +95,7 @@ int main(int argc, char* argv[])
                              "  db_name = \"test_grey_%s.db\"\n"
                              "}";
 
-    TEST_START(34);
+    TEST_START(54);
 
     asprintf(&conf, conf_tmpl, DB_DRIVER, DB_DRIVER);
     c = Config_create();
@@ -236,6 +242,22 @@ int main(int argc, char* argv[])
     write_grey("192.179.21.3", "1.2.2.34", "jackiemclean.net", "m@jackiemclean.net",
         "notrap@domain4.com", grey_out);
 
+    /*
+     * A batch received via sync, with repeated addresses which must be
+     * applied in order: the white entry is updated and the trap deleted.
+     */
+    fprintf(grey_out,
+        "type = %d\n"
+        "sync = 0\n"
+        "entries = [\"white\",\"5.5.5.1\",\"4.3.2.9\",\"%ld\",\"0\","
+        "\"trap\",\"5.5.5.2\",\"4.3.2.9\",\"%ld\",\"0\","
+        "\"white\",\"5.5.5.1\",\"4.3.2.9\",\"%ld\",\"0\","
+        "\"trap\",\"5.5.5.2\",\"4.3.2.9\",\"0\",\"1\"]\n"
+        "%%\n",
+        GREY_MSG_SYNC, (long)time(NULL) + 3600, (long)time(NULL) + 3600,
+        (long)time(NULL) + 3600);
+    fflush(grey_out);
+
     /* Forcing a parse error will kill the reader process. */
     fprintf(grey_out, "==\n");
     fclose(grey_out);
@@ -252,16 +274,29 @@ int main(int argc, char* argv[])
     tally_database(c, &total_entries, &total_white, &total_grey, &total_trapped, &total_spamtrap,
         &total_white_passed, &total_white_blocked, &total_grey_passed, &total_grey_blocked);
 
-    TEST_OK(total_entries == 17, "Total entries as expected");
-    TEST_OK(total_white == 5, "Total white as expected");
+    TEST_OK(total_entries == 18, "Total entries as expected");
+    TEST_OK(total_white == 6, "Total white as expected");
     TEST_OK(total_grey == 3, "Total grey as expected");
     TEST_OK(total_trapped == 6, "Total trapped entries as expected");
     TEST_OK(total_spamtrap == 1, "Total spamtraps as expected");
-    TEST_OK(total_white_passed == 3, "Total white passed as expected");
+    TEST_OK(total_white_passed == 4, "Total white passed as expected");
     TEST_OK(total_white_blocked == 0, "Total white blocked as expected");
     TEST_OK(total_grey_passed == 0, "Total grey passed as expected");
     TEST_OK(total_grey_blocked == 6, "Total grey blocked as expected");
 
+    /* The sync batch's repeated addresses were applied in order. */
+    db = DB_init(c);
+    DB_open(db, 0);
+    key.type = DB_KEY_IP;
+    key.data.s = "5.5.5.1";
+    TEST_OK((DB_get(db, &key, &val) == GREYDB_FOUND
+                && val.data.gd.pcount == 1),
+        "Sync batch white entry updated");
+    key.data.s = "5.5.5.2";
+    TEST_OK((DB_get(db, &key, &val) == GREYDB_NOT_FOUND),
+        "Sync batch trap entry deleted");
+    DB_close(&db);
+
     /*
      * Update some grey entry expiry times to simulate different conditions.
      */
@@ -348,16 +383,195 @@ int main(int argc, char* argv[])
     tally_database(c, &total_entries, &total_white, &total_grey, &total_trapped, &total_spamtrap,
         &total_white_passed, &total_white_blocked, &total_grey_passed, &total_grey_blocked);
 
-    TEST_OK(total_entries == 14, "Total entries as expected");
-    TEST_OK(total_white == 5, "Total white as expected");
+    TEST_OK(total_entries == 15, "Total entries as expected");
+    TEST_OK(total_white == 6, "Total white as expected");
     TEST_OK(total_grey == 1, "Total grey as expected");
     TEST_OK(total_trapped == 5, "Total trapped entries as expected");
     TEST_OK(total_spamtrap == 1, "Total spamtraps as expected");
-    TEST_OK(total_white_passed == 3, "Total white passed as expected");
+    TEST_OK(total_white_passed == 4, "Total white passed as expected");
     TEST_OK(total_white_blocked == 2, "Total white blocked as expected");
     TEST_OK(total_grey_passed == 0, "Total grey passed as expected");
     TEST_OK(total_grey_blocked == 2, "Total grey blocked as expected");
 
+    /*
+     * Test that an incremental scan only reports the changed entries,
+     * for the drivers which support it.
+     */
+    time_t now = time(NULL) + 1, since = now;
+    List_T white = List_create(free), white6 = List_create(free);
+    List_T trapped = List_create(free), removed = List_create(free);
+
+    key.type = DB_KEY_IP;
+    key.data.s = "5.6.7.8";
+    val.type = DB_VAL_GREY;
+    val.data.gd.first = since;
+    val.data.gd.pass = now - 1;
+    val.data.gd.expire = now + 3600;
+    val.data.gd.bcount = 0;
+    val.data.gd.pcount = 0;
+
+    db = greylister->db_handle;
+    DB_open(db, 0);
+    DB_start_txn(db);
+    DB_put(db, &key, &val);
+    ret = DB_scan_changes(db, &now, &since, white, white6, trapped, removed,
+        &greylister->white_exp);
+    DB_commit_txn(db);
+
+    TEST_OK(ret == GREYDB_NOT_FOUND || ret == GREYDB_OK,
+        "Incremental scan ran ok");
+    TEST_OK(ret == GREYDB_NOT_FOUND
+            || (List_size(white) == 1
+                && !strcmp(List_entry_value(white->head), "5.6.7.8")),
+        "Incremental scan found new white entry only");
+    TEST_OK(ret == GREYDB_NOT_FOUND
+            || (List_size(trapped) == 0 && List_size(removed) == 0),
+        "Incremental scan found no trapped or removed entries");
+
+    List_destroy(&white);
+    List_destroy(&white6);
+    List_destroy(&trapped);
+    List_destroy(&removed);
+
+    /*
+     * A subsequent scan should only send the new whitelist entry to the
+     * firewall, rather than replacing the whole set.
+     */
+    fclose(greylister->fw_out);
+    pipe(fw);
+    greylister->fw_out = fdopen(fw[1], "w");
+
+    if (Grey_scan_db(greylister) < 0)
+        return 1;
+
+    message_source = Lexer_source_create_from_fd(fw[0]);
+    message_lexer = Config_lexer_create(message_source);
+    message_parser = Config_parser_create(message_lexer);
+    message = Config_create();
+
+    ret = Config_parser_start(message_parser, message);
+    TEST_OK((ret == CONFIG_PARSER_OK), "Parsed whitelist update message");
+    TEST_OK(!strcmp(Config_get_str(message, "type", NULL, ""), "add"),
+        "whitelist update type ok");
+    ips = Config_get_list(message, "ips", NULL);
+    TEST_OK(List_size(ips) == 1, "whitelist update size ok");
+    TEST_OK(!strcmp(cv_str(List_entry_value(ips->head)), "5.6.7.8"),
+        "whitelist update address ok");
+
+    Config_destroy(&message);
+    Config_parser_destroy(&message_parser);
+
+    /*
+     * A failed update reported by the firewall process should cause the
+     * whole set to be replaced on the next scan.
+     */
+    fclose(greylister->fw_out);
+    pipe(fw);
+    greylister->fw_out = fdopen(fw[1], "w");
+    pipe(fw_status);
+    greylister->fw_status_fd = fw_status[0];
+    write(fw_status[1], fw_resync_msg, strlen(fw_resync_msg));
+    close(fw_status[1]);
+
+    if (Grey_scan_db(greylister) < 0)
+        return 1;
+
+    message_source = Lexer_source_create_from_fd(fw[0]);
+    message_lexer = Config_lexer_create(message_source);
+    message_parser = Config_parser_create(message_lexer);
+    message = Config_create();
+
+    ret = Config_parser_start(message_parser, message);
+    TEST_OK(ret == CONFIG_PARSER_OK
+            && !strcmp(Config_get_str(message, "type", NULL, ""), "replace"),
+        "whitelist replaced after reported failure");
+
+    Config_destroy(&message);
+    Config_parser_destroy(&message_parser);
+
+    /*
+     * Bootstrap a second database from a snapshot of the first.
+     */
+    int snap_white, snap_grey, snap_trapped, snap_unused;
+    long sent, applied;
+    char* snap_conf;
+    Config_T snap_c = Config_create();
+
+    asprintf(&snap_conf, "drop_privs = 0\n"
+                         "section sync {\n"
+                         "  enable = 1,\n"
+                         "  verify = 0\n"
+                         "}\n"
+                         "section database {\n"
+                         "  driver = \"%s\",\n"
+                         "  path   = \"/tmp/greyd_test_grey\",\n"
+                         "  db_name = \"test_grey_snapshot_%s.db\"\n"
+                         "}",
+        DB_DRIVER, DB_DRIVER);
+    message_parser = Config_parser_create(Config_lexer_create(
+        Lexer_source_create_from_str(snap_conf, strlen(snap_conf))));
+    Config_parser_start(message_parser, snap_c);
+    Config_parser_destroy(&message_parser);
+
+    asprintf(&db_path, "%s/%s", Config_get_str(snap_c, "path", "database", NULL),
+        Config_get_str(snap_c, "db_name", "database", NULL));
+    unlink(db_path);
+    free(db_path);
+
+    tally_database(c, &total_entries, &total_white, &total_grey, &total_trapped,
+        &total_spamtrap, &total_white_passed, &total_white_blocked,
+        &total_grey_passed, &total_grey_blocked);
+
+    applied = transfer_snapshot(c, snap_c, &sent);
+    TEST_OK(sent == total_white + total_grey + total_trapped,
+        "Snapshot sent all entries");
+    TEST_OK(applied == sent, "Snapshot applied all entries");
+
+    tally_database(snap_c, &snap_unused, &snap_white, &snap_grey,
+        &snap_trapped, &snap_unused, &snap_unused, &snap_unused,
+        &snap_unused, &snap_unused);
+    TEST_OK(snap_white == total_white, "Snapshot white entries as expected");
+    TEST_OK(snap_grey == total_grey, "Snapshot grey entries as expected");
+    TEST_OK(snap_trapped == total_trapped,
+        "Snapshot trapped entries as expected");
+
+    /* Entries already present are not replaced by older copies. */
+    applied = transfer_snapshot(c, snap_c, &sent);
+    TEST_OK(sent > 0, "Second snapshot sent entries");
+    TEST_OK(applied == 0, "Second snapshot applied no entries");
+
+    /* A larger database is sent over several chunks. */
+    long prev_sent = sent;
+    char snap_ip[INET_ADDRSTRLEN];
+
+    db = DB_init(c);
+    DB_open(db, 0);
+    DB_start_txn(db);
+    key.type = DB_KEY_IP;
+    key.data.s = snap_ip;
+    val.type = DB_VAL_GREY;
+    memset(&val.data.gd, 0, sizeof(val.data.gd));
+    val.data.gd.expire = time(NULL) + 3600;
+    for (i = 0; i < 3000; i++) {
+        snprintf(snap_ip, sizeof(snap_ip), "10.20.%d.%d", i / 250, i % 250);
+        DB_put(db, &key, &val);
+    }
+    DB_commit_txn(db);
+    DB_close(&db);
+
+    applied = transfer_snapshot(c, snap_c, &sent);
+    TEST_OK(sent == prev_sent + 3000, "Chunked snapshot sent all entries");
+    TEST_OK(applied == 3000, "Chunked snapshot applied new entries");
+
+    /* Without a sync key the snapshot server is refused. */
+    Sync_engine_T snap_syncer = Sync_init(snap_c);
+    TEST_OK(Sync_snapshot_listen(snap_syncer) == -1,
+        "Snapshot server refused without a key");
+    Sync_stop(&snap_syncer);
+
+    Config_destroy(&snap_c);
+    free(snap_conf);
+
 cleanup:
     Grey_finish(&greylister);
     TEST_OK((greylister == NULL), "Greylister destroyed successfully");
@@ -490,3 +704,49 @@ write_trap(char* source, char* ip, long expires, FILE* grey_out)
 {
     write_non_grey(GREY_MSG_TRAP, source, ip, expires, grey_out);
 }
+
+/*
+ * Stream a snapshot of one database into another over a socket pair,
+ * returning the number of entries applied.
+ */
+static long
+transfer_snapshot(Config_T from, Config_T to, long* sent)
+{
+    Sync_engine_T syncer;
+    DB_handle_T db;
+    int fds[2], status;
+    long applied;
+    pid_t pid;
+
+    *sent = -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        return -1;
+
+    /* The number of entries sent is reported back over the socket. */
+    switch ((pid = fork())) {
+    case -1:
+        return -1;
+
+    case 0:
+        close(fds[1]);
+        syncer = Sync_init(to);
+        db = DB_init(from);
+        *sent = Sync_snapshot_send(syncer, fds[0], db);
+        write(fds[0], sent, sizeof(*sent));
+        DB_close(&db);
+        Sync_stop(&syncer);
+        _exit(0);
+    }
+
+    close(fds[0]);
+    syncer = Sync_init(to);
+    db = DB_init(to);
+    applied = Sync_snapshot_recv(syncer, fds[1], db);
+    read(fds[1], sent, sizeof(*sent));
+    waitpid(pid, &status, 0);
+    DB_close(&db);
+    Sync_stop(&syncer);
+    close(fds[1]);
+
+    return applied;
+}
@@ -33,6 +33,7 @@
 #include <unistd.h>
 
 static void destroy_blacklist(struct Hash_entry* entry);
+static void record_message(Config_T message, void* arg);
 
 int main(void)
 {
@@ -41,8 +42,13 @@ int main(void)
     List_T ips, ips2;
     Blacklist_T bl, bl2;
     struct Greyd_state state;
+    struct Greyd_msg_buf mb;
+    int ids[4] = { 0, 0, 0, 0 }, i, ret;
+    char* msgs = "id=1\ndst=\"10.0.0.1\"\n%\n"
+                 "id=2\ndst=\"10.0.0.2\"\n%\n"
+                 "id=3\nd";
 
-    TEST_START(9);
+    TEST_START(15);
 
     pipe(com);
     out = fdopen(com[1], "w");
@@ -74,6 +80,40 @@ int main(void)
     TEST_OK(!strcmp(bl2->message, "you 2 are blacklisted"), "blacklist msg ok");
     TEST_OK(bl2->count == 1, "blacklist entries count ok");
 
+    /*
+     * Several messages may arrive in a single read, with a trailing
+     * partial message completed by a later read.
+     */
+    memset(&mb, 0, sizeof(mb));
+    write(com[1], msgs, strlen(msgs));
+    TEST_OK(Greyd_read_messages(com[0], &mb, record_message, ids) == 2,
+        "two complete messages read");
+    TEST_OK(ids[1] == 1 && ids[2] == 1 && ids[3] == 0, "message ids ok");
+
+    write(com[1], "st=\"10.0.0.3\"\n%\n", 16);
+    TEST_OK(Greyd_read_messages(com[0], &mb, record_message, ids) == 1,
+        "partial message completed");
+    TEST_OK(ids[3] == 1 && mb.len == 0, "completed message id ok");
+
+    /* A message larger than the initial buffer is read whole. */
+    write(com[1], "id=2\ndst=\"10.0.0.2\"\nips=[", 25);
+    for (i = 0; i < 1000; i++)
+        write(com[1], "\"10.0.0.100\",", 13);
+    write(com[1], "\"10.0.0.100\"]\n%\n", 16);
+    for (i = 0; (ret = Greyd_read_messages(com[0], &mb, record_message,
+                     ids))
+         == 0
+         && i < 10;
+         i++)
+        ;
+    TEST_OK(ret == 1 && ids[2] == 2 && mb.size > GREYD_MSG_BUF_SIZE,
+        "large message read");
+
+    fclose(out);
+    TEST_OK(Greyd_read_messages(com[0], &mb, record_message, ids) == -1,
+        "end of file ok");
+    Greyd_free_messages(&mb);
+
     List_destroy(&ips);
     List_destroy(&ips2);
     Hash_destroy(&state.blacklists);
@@ -88,3 +128,14 @@ destroy_blacklist(struct Hash_entry* entry)
         Blacklist_destroy((Blacklist_T*)&entry->v);
     }
 }
+
+static void
+record_message(Config_T message, void* arg)
+{
+    int* ids = arg;
+    int id = Config_get_int(message, "id", NULL, 0);
+    char* dst = Config_get_str(message, "dst", NULL, "");
+
+    if (id > 0 && id < 4 && strlen(dst) > 0)
+        ids[id]++;
+}
@@ -58,7 +58,7 @@ int main(void)
     /* Test hash creation. */
     hash = Hash_create(HASH_SIZE, destroy);
 
-    TEST_START(19);
+    TEST_START(22);
 
     /* Create a hash string keys to string values. */
     TEST_OK((hash->size == HASH_SIZE), "Hash size is set correctly");
@@ -145,6 +145,38 @@ int main(void)
     /* Destroy the hash. */
     Hash_destroy(&hash);
 
+    /*
+     * Deleting from the middle of a run of colliding keys must not hide
+     * the keys which follow it. A NULL destructor is also permitted.
+     */
+    hash = Hash_create(HASH_SIZE, NULL);
+    for (i = 0; i < 1000; i++) {
+        asprintf(&key, "10.0.%d.%d", i / 256, i % 256);
+        Hash_insert(hash, key, hash);
+        free(key);
+    }
+
+    for (i = 0; i < 1000; i += 2) {
+        asprintf(&key, "10.0.%d.%d", i / 256, i % 256);
+        Hash_delete(hash, key);
+        free(key);
+    }
+    TEST_OK((hash->num_entries == 500), "Hash entries deleted as expected");
+
+    for (i = 1, s = (char*)hash; i < 1000 && s != NULL; i += 2) {
+        asprintf(&key, "10.0.%d.%d", i / 256, i % 256);
+        s = Hash_get(hash, key);
+        free(key);
+    }
+    TEST_OK((s != NULL), "Remaining entries found after deletes");
+
+    asprintf(&key, "10.0.%d.%d", 0, 0);
+    s = Hash_get(hash, key);
+    free(key);
+    TEST_OK((s == NULL), "Deleted entry not found");
+
+    Hash_destroy(&hash);
+
     TEST_COMPLETE;
 }
 
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   test_stats.c
+ * @brief  Unit tests for the runtime statistics.
+ * @author Mikey Austin
+ * @date   2014
+ */
+
+#include "test.h"
+#include <blacklist.h>
+#include <greyd.h>
+#include <hash.h>
+#include <list.h>
+#include <stats.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void destroy_blacklist(struct Hash_entry* entry);
+
+int main(void)
+{
+    struct Stats_histogram hist;
+    struct Greyd_state state;
+    Blacklist_T bl;
+    List_T ips;
+    FILE *out, *cfg_out;
+    char* buf = NULL;
+    size_t len = 0;
+    int com[2];
+
+    TEST_START(16);
+
+    memset(&hist, 0, sizeof(hist));
+    Stats_observe(&hist, 0.00005);
+    Stats_observe(&hist, 0.003);
+    Stats_observe(&hist, 0.003);
+    Stats_observe(&hist, 60);
+
+    TEST_OK(hist.count == 4, "histogram count ok");
+    TEST_OK(hist.buckets[0] == 1, "smallest bucket ok");
+    TEST_OK(hist.buckets[5] == 2, "middle bucket ok");
+    TEST_OK(hist.buckets[STATS_BUCKETS] == 1, "overflow bucket ok");
+
+    out = open_memstream(&buf, &len);
+    Stats_write_histogram(out, "test_seconds", "A test.", &hist);
+    Stats_write_counter(out, "test_total", "Counted.", "list", "a\"b", 7);
+    Stats_write_counter(out, "test_total", NULL, "list", "c", 8);
+    fclose(out);
+
+    TEST_OK(strstr(buf, "# TYPE test_seconds histogram\n") != NULL,
+        "histogram type ok");
+    TEST_OK(strstr(buf, "test_seconds_bucket{le=\"0.0025\"} 1\n") != NULL,
+        "cumulative bucket below ok");
+    TEST_OK(strstr(buf, "test_seconds_bucket{le=\"0.005\"} 3\n") != NULL,
+        "cumulative bucket ok");
+    TEST_OK(strstr(buf, "test_seconds_bucket{le=\"+Inf\"} 4\n") != NULL,
+        "infinite bucket ok");
+    TEST_OK(strstr(buf, "test_seconds_count 4\n") != NULL,
+        "histogram count written");
+    TEST_OK(strstr(buf, "test_total{list=\"a\\\"b\"} 7\n") != NULL,
+        "label value escaped");
+    TEST_OK(strstr(strstr(buf, "# HELP test_total") + 1, "# HELP test_total")
+            == NULL,
+        "single header for labelled samples");
+    free(buf);
+    buf = NULL;
+
+    /*
+     * Check the hit counts survive reloading a blacklist.
+     */
+    memset(&state, 0, sizeof(state));
+    state.blacklists = Hash_create(10, destroy_blacklist);
+    pipe(com);
+    cfg_out = fdopen(com[1], "w");
+
+    ips = List_create(NULL);
+    List_insert_after(ips, "10.0.0.0/8");
+    Greyd_send_config(cfg_out, "test_bl", "you are blacklisted", ips);
+    Greyd_process_config(com[0], &state);
+
+    bl = Hash_get(state.blacklists, "test_bl");
+    bl->hits = 3;
+    state.stats.accepts = 5;
+
+    Greyd_send_config(cfg_out, "test_bl", "you are blacklisted", ips);
+    Greyd_process_config(com[0], &state);
+    TEST_OK(((Blacklist_T)Hash_get(state.blacklists, "test_bl"))->hits == 3,
+        "hits kept across reload");
+
+    out = open_memstream(&buf, &len);
+    Greyd_write_stats(out, &state);
+    fclose(out);
+
+    TEST_OK(strstr(buf, "greyd_blacklist_hits_total{blacklist=\"test_bl\"} 3\n")
+            != NULL,
+        "blacklist hits written");
+    TEST_OK(strstr(buf, "greyd_config_reload_seconds_count 2\n") != NULL,
+        "reloads timed");
+    free(buf);
+    buf = NULL;
+
+    /* The greylister reports the increase in its sync counters. */
+    write(com[1], "sync_packets_sent=2\nsync_entries_sent=5\n"
+                  "sync_updates_suppressed=3\n%\n"
+                  "sync_updates_suppressed=4\n%\n",
+        96);
+    Greyd_read_messages(com[0], &state.grey_stats_buf,
+        Greyd_process_grey_stats, &state);
+
+    out = open_memstream(&buf, &len);
+    Greyd_write_stats(out, &state);
+    fclose(out);
+
+    TEST_OK(strstr(buf, "greyd_sync_updates_suppressed_total 7\n") != NULL,
+        "sync suppressed updates written");
+    TEST_OK(strstr(buf, "greyd_sync_entries_sent_total 5\n") != NULL
+            && strstr(buf, "greyd_sync_packets_received_total 0\n") != NULL,
+        "sync counters written");
+
+    free(buf);
+    Greyd_free_messages(&state.grey_stats_buf);
+    fclose(cfg_out);
+    close(com[0]);
+    List_destroy(&ips);
+    Hash_destroy(&state.blacklists);
+
+    TEST_COMPLETE;
+}
+
+static void
+destroy_blacklist(struct Hash_entry* entry)
+{
+    if (entry && entry->v) {
+        Blacklist_destroy((Blacklist_T*)&entry->v);
+    }
+}
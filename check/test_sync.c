@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   test_sync.c
+ * @brief  Unit tests for the sync engine.
+ * @author Mikey Austin
+ * @date   2014
+ */
+
+#include "test.h"
+#include <config_lexer.h>
+#include <config_parser.h>
+#include <grey.h>
+#include <greyd_config.h>
+#include <lexer_source.h>
+#include <sync.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+int main(void)
+{
+    Config_T c;
+    Config_parser_T cp;
+    Sync_engine_T engine;
+    struct Grey_tuple gt, gt2;
+    time_t now = time(NULL);
+    char* conf = "section sync {\n"
+                 "  enable          = 1,\n"
+                 "  verify          = 0,\n"
+                 "  flush_interval  = 60000,\n"
+                 "  suppress_window = 60\n"
+                 "}\n";
+    char* loop_conf = "section sync {\n"
+                      "  enable          = 1,\n"
+                      "  verify          = 0,\n"
+                      "  bind_address    = \"127.0.0.1\",\n"
+                      "  hosts           = [ \"127.0.0.1\" ],\n"
+                      "  port            = 18327,\n"
+                      "  flush_interval  = 60000\n"
+                      "}\n"
+                      "section grey {\n"
+                      "  enable = 1\n"
+                      "}\n";
+    char long_to[300], *buf = NULL;
+    size_t len = 0;
+    struct pollfd pfd;
+    Config_T message;
+    List_T entries;
+    FILE* out;
+
+    TEST_START(11);
+
+    c = Config_create();
+    cp = Config_parser_create(
+        Config_lexer_create(Lexer_source_create_from_str(conf, strlen(conf))));
+    Config_parser_start(cp, c);
+
+    engine = Sync_init(c);
+    TEST_OK(engine != NULL, "Sync engine created");
+    TEST_OK(engine->suppress_window == 60, "Suppression window configured");
+
+    gt.ip = "1.2.3.4";
+    gt.helo = "mail.example.com";
+    gt.from = "sender@example.com";
+    gt.to = "recipient@example.org";
+    gt2 = gt;
+    gt2.to = "other@example.org";
+
+    Sync_update(engine, &gt, now, 0);
+    TEST_OK(engine->pkt_tlvs == 1, "First update queued");
+
+    Sync_update(engine, &gt, now + 10, 0);
+    TEST_OK(engine->pkt_tlvs == 1 && engine->updates_suppressed == 1,
+        "Repeated update suppressed");
+
+    Sync_update(engine, &gt2, now + 10, 0);
+    TEST_OK(engine->pkt_tlvs == 2, "Update to another tuple queued");
+
+    Sync_update(engine, &gt, now + 20, 1);
+    TEST_OK(engine->pkt_tlvs == 3, "Changed update queued");
+
+    Sync_update(engine, &gt, now + 90, 0);
+    TEST_OK(engine->pkt_tlvs == 4, "Update queued after the window");
+
+    Sync_white(engine, gt.ip, now + 90, now + 3600, 0);
+    TEST_OK(engine->pkt_tlvs == 5 && engine->updates_suppressed == 1,
+        "White entries are never suppressed");
+
+    Sync_stop(&engine);
+    Config_parser_destroy(&cp);
+    Config_destroy(&c);
+
+    /*
+     * Received strings are escaped in the message to the greylister, and
+     * entries it could not read back are dropped.
+     */
+    c = Config_create();
+    cp = Config_parser_create(Config_lexer_create(
+        Lexer_source_create_from_str(loop_conf, strlen(loop_conf))));
+    Config_parser_start(cp, c);
+    Config_parser_destroy(&cp);
+
+    engine = Sync_init(c);
+    TEST_OK(engine != NULL && Sync_start(engine) != -1,
+        "Loopback sync engine started");
+
+    memset(long_to, 'a', sizeof(long_to) - 1);
+    long_to[sizeof(long_to) - 1] = '\0';
+    gt.helo = "\"quoted\" \\ 100%";
+    Sync_update(engine, &gt, now, 1);
+    gt2.to = long_to;
+    Sync_update(engine, &gt2, now, 1);
+    Sync_flush(engine);
+
+    pfd.fd = engine->sync_fd;
+    pfd.events = POLLIN;
+    poll(&pfd, 1, 1000);
+
+    out = open_memstream(&buf, &len);
+    Sync_recv(engine, out);
+    fclose(out);
+
+    message = Config_create();
+    cp = Config_parser_create(
+        Config_lexer_create(Lexer_source_create_from_str(buf, len)));
+    Config_parser_start(cp, message);
+    entries = Config_get_list(message, "entries", NULL);
+    TEST_OK(entries != NULL && List_size(entries) == GREY_MSG_SYNC_FIELDS,
+        "Entry with long fields dropped");
+    TEST_OK(entries != NULL
+            && !strcmp(cv_str(List_entry_value(entries->head->next->next)),
+                gt.helo),
+        "Quoted helo received intact");
+
+    Config_destroy(&message);
+    Config_parser_destroy(&cp);
+    free(buf);
+    Sync_stop(&engine);
+    Config_destroy(&c);
+
+    TEST_COMPLETE;
+}
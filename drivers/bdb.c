@@ -49,6 +49,16 @@
 #define DEFAULT_DB "greyd.db"
 #define CURSORS 3 /* One for each database plus a sentinel. */
 
+/*
+ * The entry states in the state index. White & trapped addresses are
+ * keyed by the state followed by the address, and grey tuples by the
+ * state followed by their big-endian pass time.
+ */
+#define STATE_WHITE 'w'
+#define STATE_TRAP 't'
+#define STATE_GREY 'g'
+#define TIME_LEN 8
+
 /**
  * The internal bdb driver handle.
  */
@@ -57,6 +67,8 @@ struct bdb_handle {
     DB* db;
     DB* spamtraps;
     DB* domains;
+    DB* expiry; /**< Secondary index of entries by expiry time. */
+    DB* state; /**< Secondary index of entries by state. */
     DB_TXN* txn;
 };
 
@@ -79,13 +91,23 @@ static void pack_val(struct DB_val* val, DBT* dbval);
 static void unpack_key(struct DB_key* key, DBT* dbkey);
 static void unpack_val(struct DB_val* val, DBT* dbval);
 static int check_partial_dom(DB_handle_T handle, const char* part);
+static int open_index(DB_handle_T handle, DB** index, const char* prefix,
+    int (*callback)(DB*, const DBT*, const DBT*, DBT*));
+static int expiry_key(DB* index, const DBT* pkey, const DBT* pdata,
+    DBT* skey);
+static int state_key(DB* index, const DBT* pkey, const DBT* pdata,
+    DBT* skey);
+static void pack_time(unsigned char* buf, time_t t);
+static time_t unpack_time(const unsigned char* buf);
+static int write_many(DB_handle_T handle, struct DB_key* keys,
+    struct DB_val* vals, int n);
 
 extern void
 Mod_db_init(DB_handle_T handle)
 {
     struct bdb_handle* bh;
     char* path;
-    int ret, flags, uid_changed = 0;
+    int ret, flags, cache_size, uid_changed = 0;
 
     path = Config_get_str(handle->config, "path", "database", DEFAULT_PATH);
     if (mkdir(path, 0700) == -1) {
@@ -109,6 +131,8 @@ Mod_db_init(DB_handle_T handle)
     bh->db = NULL;
     bh->spamtraps = NULL;
     bh->domains = NULL;
+    bh->expiry = NULL;
+    bh->state = NULL;
 
     /*
      * We want to create the environment as the database user.
@@ -127,6 +151,15 @@ Mod_db_init(DB_handle_T handle)
             db_strerror(ret));
     }
 
+    /* The cache size only applies when the environment is created. */
+    cache_size = Config_get_int(handle->config, "cache_size", "database", 0);
+    if (cache_size > 0
+        && (ret = bh->env->set_cachesize(bh->env, cache_size / (1 << 30),
+                cache_size % (1 << 30), 1))
+            != 0) {
+        i_warning("could not set db cache size: %s", db_strerror(ret));
+    }
+
     flags = DB_CREATE
         | DB_INIT_TXN
         | DB_INIT_LOCK
@@ -152,7 +185,7 @@ Mod_db_open(DB_handle_T handle, int flags)
     struct bdb_handle* bh = handle->dbh;
     char *db_name, *err_log_path, *db_spamtraps, *db_domains;
     FILE* err_log;
-    int ret, open_flags;
+    int ret, open_flags, page_size;
 
     if (bh->db != NULL)
         return;
@@ -173,6 +206,13 @@ Mod_db_open(DB_handle_T handle, int flags)
         goto cleanup;
     }
 
+    /* The page size only applies when a database is created. */
+    page_size = Config_get_int(handle->config, "page_size", "database", 0);
+    if (page_size > 0
+        && (ret = bh->db->set_pagesize(bh->db, page_size)) != 0) {
+        i_warning("could not set db page size: %s", db_strerror(ret));
+    }
+
     open_flags = (flags & GREYDB_RO ? DB_RDONLY : DB_CREATE) | DB_AUTO_COMMIT;
 
     /* Main entries database. */
@@ -199,6 +239,17 @@ Mod_db_open(DB_handle_T handle, int flags)
         goto cleanup;
     }
 
+    /*
+     * The secondary indexes are maintained by every writer, and are
+     * built from the entries the first time they are opened. Read-only
+     * handles have no use for them.
+     */
+    if (!(flags & GREYDB_RO)
+        && (open_index(handle, &bh->expiry, "expiry", expiry_key) != 0
+            || open_index(handle, &bh->state, "state", state_key) != 0)) {
+        goto cleanup;
+    }
+
     free(db_spamtraps);
     free(db_domains);
 
@@ -285,6 +336,11 @@ Mod_db_close(DB_handle_T handle)
     struct bdb_handle* bh;
 
     if ((bh = handle->dbh) != NULL) {
+        /* The secondaries must be closed before their primary. */
+        if (bh->expiry)
+            bh->expiry->close(bh->expiry, 0);
+        if (bh->state)
+            bh->state->close(bh->state, 0);
         if (bh->db)
             bh->db->close(bh->db, 0);
         if (bh->spamtraps)
@@ -431,6 +487,19 @@ Mod_db_del(DB_handle_T handle, struct DB_key* key)
     return GREYDB_ERR;
 }
 
+extern int
+Mod_db_put_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    return write_many(handle, keys, vals, n);
+}
+
+extern int
+Mod_db_del_many(DB_handle_T handle, struct DB_key* keys, int n)
+{
+    return write_many(handle, keys, NULL, n);
+}
+
 extern void
 Mod_db_get_itr(DB_itr_T itr, int types)
 {
@@ -565,97 +634,154 @@ extern int
 Mod_scan_db(DB_handle_T handle, time_t* now, List_T whitelist,
     List_T whitelist_ipv6, List_T traplist, time_t* white_exp)
 {
-    DB_itr_T itr;
-    List_T list;
+    struct bdb_handle* bh = handle->dbh;
+    DBC* cursor = NULL;
+    DBT skey, pkey, pdata, tkey, tdata;
     struct DB_key key, wkey;
     struct DB_val val, wval;
-    struct Grey_tuple gt;
     struct Grey_data gd;
-    int ret = GREYDB_OK;
+    unsigned char start[1 + TIME_LEN], trap[1 + INET6_ADDRSTRLEN], *sk;
+    List_T list;
+    size_t len;
+    int ret, res = GREYDB_ERR;
+
+    if (bh->expiry == NULL || bh->state == NULL) {
+        i_warning("cannot scan a read-only db");
+        return GREYDB_ERR;
+    }
+
+    memset(&skey, 0, sizeof(skey));
+    memset(&pkey, 0, sizeof(pkey));
+    memset(&pdata, 0, sizeof(pdata));
+
+    /*
+     * Delete the expired entries, which are first in expiry order.
+     * Deleting through the secondary cursor also removes the entry from
+     * the primary and the other secondary.
+     */
+    if ((ret = bh->expiry->cursor(bh->expiry, bh->txn, &cursor, 0)) != 0)
+        goto err;
+
+    while ((ret = cursor->pget(cursor, &skey, &pkey, &pdata, DB_NEXT)) == 0
+        && unpack_time(skey.data) <= *now) {
+        unpack_key(&key, &pkey);
+        unpack_val(&val, &pdata);
+        if ((ret = cursor->del(cursor, 0)) != 0)
+            goto err;
+
+        i_debug("deleting expired %sentry %s",
+            (key.type == DB_KEY_IP
+                    ? (val.data.gd.pcount >= 0 ? "white " : "greytrap ")
+                    : "grey "),
+            (key.type == DB_KEY_IP ? key.data.s : key.data.gt.ip));
+    }
+    if (ret != 0 && ret != DB_NOTFOUND)
+        goto err;
+    cursor->close(cursor);
+    cursor = NULL;
 
-    itr = DB_get_itr(handle, DB_ENTRIES);
-    while (DB_itr_next(itr, &key, &val) == GREYDB_FOUND) {
-        if (val.type != DB_VAL_GREY)
+    /*
+     * Whitelist the grey tuples which are due to pass, walking them in
+     * pass order, unless their address is trapped. The new white entries
+     * are collected with the others below.
+     */
+    if ((ret = bh->state->cursor(bh->state, bh->txn, &cursor, 0)) != 0)
+        goto err;
+
+    start[0] = STATE_GREY;
+    pack_time(start + 1, 0);
+    skey.data = start;
+    skey.size = sizeof(start);
+
+    for (ret = cursor->pget(cursor, &skey, &pkey, &pdata, DB_SET_RANGE);
+         ret == 0;
+         ret = cursor->pget(cursor, &skey, &pkey, &pdata, DB_NEXT)) {
+        sk = skey.data;
+        if (sk[0] != STATE_GREY || unpack_time(sk + 1) > *now)
+            break;
+
+        unpack_key(&key, &pkey);
+        unpack_val(&val, &pdata);
+
+        /* Check for a trapped address in the state index. */
+        len = strlen(key.data.gt.ip);
+        if (len >= sizeof(trap) - 1)
+            continue;
+        trap[0] = STATE_TRAP;
+        memcpy(trap + 1, key.data.gt.ip, len);
+
+        memset(&tkey, 0, sizeof(tkey));
+        memset(&tdata, 0, sizeof(tdata));
+        tkey.data = trap;
+        tkey.size = 1 + len;
+        tdata.flags = DB_DBT_PARTIAL;
+        ret = bh->state->get(bh->state, bh->txn, &tkey, &tdata, 0);
+
+        if (ret == 0) {
+            /* Ignore trapped entries. */
             continue;
+        } else if (ret != DB_NOTFOUND) {
+            goto err;
+        }
+
+        /* Re-add entry, keyed only by IP address. */
+        memset(&wkey, 0, sizeof(wkey));
+        wkey.type = DB_KEY_IP;
+        wkey.data.s = key.data.gt.ip;
 
+        memset(&wval, 0, sizeof(wval));
+        wval.type = DB_VAL_GREY;
         gd = val.data.gd;
-        if (gd.expire <= *now && gd.pcount > -2) {
-            /*
-             * This non-spamtrap/non-domain entry has expired.
-             */
-            if (DB_itr_del_curr(itr) != GREYDB_OK) {
-                ret = GREYDB_ERR;
-                goto cleanup;
-            } else {
-                i_debug("deleting expired %sentry %s",
-                    (key.type == DB_KEY_IP
-                            ? (gd.pcount >= 0 ? "white " : "greytrap ")
-                            : "grey "),
-                    (key.type == DB_KEY_IP
-                            ? key.data.s
-                            : key.data.gt.ip));
-            }
-            continue;
-        } else if (gd.pcount == -1 && key.type == DB_KEY_IP) {
-            /*
-             * This is a greytrap hit.
-             */
+        gd.expire = *now + *white_exp;
+        wval.data.gd = gd;
+
+        i_debug("whitelisting %s", key.data.gt.ip);
+        if (DB_put(handle, &wkey, &wval) != GREYDB_OK
+            || (ret = cursor->del(cursor, 0)) != 0) {
+            goto err;
+        }
+    }
+    if (ret != 0 && ret != DB_NOTFOUND)
+        goto err;
+
+    /*
+     * Collect the trapped & white addresses, which are grouped by state
+     * in the index.
+     */
+    start[0] = STATE_TRAP;
+    skey.data = start;
+    skey.size = 1;
+
+    for (ret = cursor->pget(cursor, &skey, &pkey, &pdata, DB_SET_RANGE);
+         ret == 0;
+         ret = cursor->pget(cursor, &skey, &pkey, &pdata, DB_NEXT)) {
+        sk = skey.data;
+        if (sk[0] != STATE_TRAP && sk[0] != STATE_WHITE)
+            break;
+
+        unpack_key(&key, &pkey);
+        unpack_val(&val, &pdata);
+
+        if (sk[0] == STATE_TRAP) {
             List_insert_after(traplist, strdup(key.data.s));
-        } else if (gd.pcount >= 0 && gd.pass <= *now) {
-            /*
-             * If not already trapped, add the address to the whitelist
-             * and add an address-keyed entry to the database.
-             */
-
-            if (key.type == DB_KEY_TUPLE) {
-                gt = key.data.gt;
-                switch (DB_addr_state(handle, gt.ip)) {
-                case 1:
-                    /* Ignore trapped entries. */
-                    continue;
-
-                case -1:
-                    ret = GREYDB_ERR;
-                    goto cleanup;
-                }
-
-                list = (IP_check_addr(key.data.s) == AF_INET6
-                        ? whitelist_ipv6
-                        : whitelist);
-                List_insert_after(list, strdup(key.data.s));
-
-                /* Re-add entry, keyed only by IP address. */
-                memset(&wkey, 0, sizeof(wkey));
-                wkey.type = DB_KEY_IP;
-                wkey.data.s = gt.ip;
-
-                memset(&wval, 0, sizeof(wval));
-                wval.type = DB_VAL_GREY;
-                gd.expire = *now + *white_exp;
-                wval.data.gd = gd;
-
-                if (!(DB_put(handle, &wkey, &wval) == GREYDB_OK
-                        && DB_itr_del_curr(itr) == GREYDB_OK)) {
-                    ret = GREYDB_ERR;
-                    goto cleanup;
-                }
-
-                i_debug("whitelisting %s", gt.ip);
-            } else if (key.type == DB_KEY_IP) {
-                /*
-                 * This must be a whitelist entry.
-                 */
-                list = (IP_check_addr(key.data.s) == AF_INET6
-                        ? whitelist_ipv6
-                        : whitelist);
-                List_insert_after(list, strdup(key.data.s));
-            }
+        } else if (val.data.gd.pass <= *now) {
+            list = (IP_check_addr(key.data.s) == AF_INET6
+                    ? whitelist_ipv6
+                    : whitelist);
+            List_insert_after(list, strdup(key.data.s));
         }
     }
+    if (ret != 0 && ret != DB_NOTFOUND)
+        goto err;
 
-cleanup:
-    DB_close_itr(&itr);
-    return ret;
+    res = GREYDB_OK;
+
+err:
+    if (res != GREYDB_OK && ret != 0)
+        i_warning("db scan failed: %s", db_strerror(ret));
+    if (cursor != NULL)
+        cursor->close(cursor);
+    return res;
 }
 
 static void
@@ -783,3 +909,165 @@ check_partial_dom(DB_handle_T handle, const char* part)
 
     return (match ? GREYDB_FOUND : GREYDB_NOT_FOUND);
 }
+
+/*
+ * Open a secondary index of the entries, named after the main database.
+ */
+static int
+open_index(DB_handle_T handle, DB** index, const char* prefix,
+    int (*callback)(DB*, const DBT*, const DBT*, DBT*))
+{
+    struct bdb_handle* bh = handle->dbh;
+    char *db_name, *index_name = NULL;
+    int ret, page_size;
+
+    db_name = Config_get_str(handle->config, "db_name", "database",
+        DEFAULT_DB);
+    page_size = Config_get_int(handle->config, "page_size", "database", 0);
+
+    if (asprintf(&index_name, "%s-%s", prefix, db_name) == -1) {
+        i_warning("asprintf: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((ret = db_create(index, bh->env, 0)) != 0
+        || (ret = (*index)->set_flags(*index, DB_DUP | DB_DUPSORT)) != 0
+        || (page_size > 0
+               && (ret = (*index)->set_pagesize(*index, page_size)) != 0)
+        || (ret = (*index)->open(*index, NULL, index_name, NULL, DB_BTREE,
+                DB_CREATE | DB_AUTO_COMMIT, 0600))
+            != 0
+        || (ret = bh->db->associate(bh->db, NULL, *index, callback,
+                DB_CREATE))
+            != 0) {
+        i_warning("db index open (%s) failed: %s", index_name,
+            db_strerror(ret));
+        free(index_name);
+        return -1;
+    }
+    free(index_name);
+
+    return 0;
+}
+
+/*
+ * Extract the big-endian expiry time of an entry, so that the index
+ * orders the entries by expiry.
+ */
+static int
+expiry_key(DB* index, const DBT* pkey, const DBT* pdata, DBT* skey)
+{
+    struct DB_val val;
+    unsigned char* buf;
+
+    unpack_val(&val, (DBT*)pdata);
+    if (val.type != DB_VAL_GREY || val.data.gd.pcount < -1)
+        return DB_DONOTINDEX;
+
+    if ((buf = malloc(TIME_LEN)) == NULL)
+        return ENOMEM;
+    pack_time(buf, val.data.gd.expire);
+
+    memset(skey, 0, sizeof(*skey));
+    skey->data = buf;
+    skey->size = TIME_LEN;
+    skey->flags = DB_DBT_APPMALLOC;
+
+    return 0;
+}
+
+/*
+ * Extract the state of an entry, followed by the address for white &
+ * trapped addresses, or by the pass time for grey tuples.
+ */
+static int
+state_key(DB* index, const DBT* pkey, const DBT* pdata, DBT* skey)
+{
+    struct DB_key key;
+    struct DB_val val;
+    unsigned char* buf;
+    size_t len;
+
+    unpack_key(&key, (DBT*)pkey);
+    unpack_val(&val, (DBT*)pdata);
+    if (val.type != DB_VAL_GREY)
+        return DB_DONOTINDEX;
+
+    if (key.type == DB_KEY_IP && val.data.gd.pcount >= -1) {
+        len = strlen(key.data.s);
+        if ((buf = malloc(1 + len)) == NULL)
+            return ENOMEM;
+        buf[0] = (val.data.gd.pcount == -1 ? STATE_TRAP : STATE_WHITE);
+        memcpy(buf + 1, key.data.s, len);
+        len++;
+    } else if (key.type == DB_KEY_TUPLE && val.data.gd.pcount >= 0) {
+        len = 1 + TIME_LEN;
+        if ((buf = malloc(len)) == NULL)
+            return ENOMEM;
+        buf[0] = STATE_GREY;
+        pack_time(buf + 1, val.data.gd.pass);
+    } else {
+        return DB_DONOTINDEX;
+    }
+
+    memset(skey, 0, sizeof(*skey));
+    skey->data = buf;
+    skey->size = len;
+    skey->flags = DB_DBT_APPMALLOC;
+
+    return 0;
+}
+
+static void
+pack_time(unsigned char* buf, time_t t)
+{
+    unsigned long long u = (t < 0 ? 0 : t);
+    int i;
+
+    for (i = TIME_LEN - 1; i >= 0; i--, u >>= 8)
+        buf[i] = u & 0xff;
+}
+
+static time_t
+unpack_time(const unsigned char* buf)
+{
+    unsigned long long u = 0;
+    int i;
+
+    for (i = 0; i < TIME_LEN; i++)
+        u = (u << 8) | buf[i];
+
+    return (time_t)u;
+}
+
+/*
+ * Make a batch of puts, or deletes if there are no values, within a
+ * single transaction rather than committing each write on its own.
+ */
+static int
+write_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    struct bdb_handle* bh = handle->dbh;
+    int i, own_txn = 0, ret = GREYDB_OK;
+
+    if (bh->txn == NULL) {
+        Mod_db_start_txn(handle);
+        own_txn = 1;
+    }
+
+    for (i = 0; i < n && ret != GREYDB_ERR; i++) {
+        ret = (vals ? Mod_db_put(handle, &keys[i], &vals[i])
+                    : Mod_db_del(handle, &keys[i]));
+    }
+    ret = (ret == GREYDB_ERR ? GREYDB_ERR : GREYDB_OK);
+
+    if (own_txn) {
+        if (ret == GREYDB_OK)
+            Mod_db_commit_txn(handle);
+        else
+            Mod_db_rollback_txn(handle);
+    }
+
+    return ret;
+}
@@ -26,6 +26,7 @@
 #include <string.h>
 
 #include "../src/firewall.h"
+#include "../src/ip.h"
 #include "../src/list.h"
 
 int Mod_fw_open(FW_handle_T handle)
@@ -45,6 +46,16 @@ int Mod_fw_replace(FW_handle_T handle, const char* set_name, List_T cidrs, short
     return List_size(cidrs);
 }
 
+int Mod_fw_add(FW_handle_T handle, const char* set_name, List_T cidrs, short af)
+{
+    return List_size(cidrs);
+}
+
+int Mod_fw_del(FW_handle_T handle, const char* set_name, List_T cidrs, short af)
+{
+    return List_size(cidrs);
+}
+
 void Mod_fw_start_log_capture(FW_handle_T handle)
 {
     /* noop */
@@ -56,7 +67,7 @@ void Mod_fw_end_log_capture(FW_handle_T handle)
 }
 
 List_T
-Mod_fw_capture_log(FW_handle_T handle)
+Mod_fw_capture_log(FW_handle_T handle, int timeout)
 {
     return NULL;
 }
@@ -65,8 +76,7 @@ int Mod_fw_lookup_orig_dst(FW_handle_T handle, struct sockaddr* src,
     struct sockaddr* proxy, struct sockaddr* orig_dst)
 {
     /* Default to the proxy address. */
-    memset(orig_dst, 0, sizeof(*orig_dst));
-    memcpy(orig_dst, proxy, sizeof(*orig_dst));
+    memcpy(orig_dst, proxy, IP_SOCKADDR_LEN(proxy));
 
     return 0;
 }
@@ -0,0 +1,1098 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   lmdb.c
+ * @brief  LMDB DB driver.
+ * @author Mikey Austin
+ * @date   2015
+ *
+ * Each key type is kept in its own sub-database, keyed by its NUL
+ * terminated strings so that keys read from the memory map may be
+ * returned without copying. Tuples are keyed by address first, keeping
+ * the tuples for an address together. Readers never block the single
+ * writer, nor each other.
+ */
+
+#include <config.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lmdb.h>
+#include <openssl/sha.h>
+
+#include "../src/failures.h"
+#include "../src/greydb.h"
+#include "../src/ip.h"
+#include "../src/list.h"
+
+#define DEFAULT_PATH "/var/db/greyd"
+#define DEFAULT_DB "greyd.lmdb"
+#define DEFAULT_MAP_SIZE 1024 /* In megabytes. */
+
+/* Large enough for the longest packed tuple. */
+#define KEY_MAX (INET6_ADDRSTRLEN + 1 + 3 * (GREY_MAX_MAIL + 1))
+
+/*
+ * The sub-databases, one per key type.
+ */
+enum lmdb_dbi {
+    LMDB_IPS = 0,
+    LMDB_TUPLES,
+    LMDB_SPAMTRAPS,
+    LMDB_DOMAINS,
+    LMDB_NUM_DBIS
+};
+
+static const char* lmdb_names[LMDB_NUM_DBIS] = {
+    "ips", "tuples", "spamtraps", "domains"
+};
+
+static const short lmdb_types[LMDB_NUM_DBIS] = {
+    DB_KEY_IP, DB_KEY_TUPLE, DB_KEY_MAIL, DB_KEY_DOM
+};
+
+/**
+ * The internal driver handle.
+ */
+struct lmdb_handle {
+    MDB_env* env;
+    MDB_dbi dbi[LMDB_NUM_DBIS];
+    MDB_txn* txn; /**< The explicit write transaction, if any. */
+    MDB_txn* rtxn; /**< Reusable read transaction for single reads. */
+    int max_key; /**< Longer keys are truncated and hashed. */
+};
+
+/**
+ * A packed key, with its untruncated form for keys which exceed the
+ * maximum LMDB key size.
+ */
+struct lmdb_key {
+    MDB_dbi dbi;
+    MDB_val key;
+    size_t len; /**< Full packed length. */
+    char buf[KEY_MAX];
+    char hashed[KEY_MAX]; /**< Truncated prefix and hash of a long key. */
+};
+
+struct lmdb_itr {
+    MDB_txn* txn;
+    int own_txn; /**< The iterator has its own read transaction. */
+    MDB_cursor* cursor;
+    enum lmdb_dbi dbis[LMDB_NUM_DBIS + 1];
+    enum lmdb_dbi* curr;
+    struct DB_key key; /**< Current key, for updates outside a txn. */
+    char buf[KEY_MAX]; /**< Copy of the current key in a write txn. */
+    struct lmdb_key* after; /**< Key to resume after, if any. */
+};
+
+static int pack_key(struct lmdb_handle*, struct DB_key*, struct lmdb_key*);
+static void pack_val(struct lmdb_key*, struct DB_val*, MDB_val*, char*);
+static int unpack(enum lmdb_dbi, MDB_val*, MDB_val*, struct DB_key*,
+    struct DB_val*, char*);
+static int key_matches(struct lmdb_key*, MDB_val*);
+static int get(DB_handle_T, MDB_txn*, struct DB_key*, struct DB_val*);
+static int write_many(DB_handle_T, struct DB_key*, struct DB_val*, int);
+static int write_txn(struct lmdb_handle*, MDB_txn**);
+static int end_write_txn(DB_handle_T, MDB_txn*, int);
+static int read_txn(struct lmdb_handle*, MDB_txn**);
+static void end_read_txn(struct lmdb_handle*, MDB_txn*);
+static int check_partial_dom(DB_handle_T, const char*);
+static int scan(DB_handle_T, time_t*, time_t*, List_T, List_T, List_T,
+    List_T, time_t*);
+
+extern void
+Mod_db_init(DB_handle_T handle)
+{
+    struct lmdb_handle* lh;
+    char* path;
+
+    path = Config_get_str(handle->config, "path", "database", DEFAULT_PATH);
+    if (mkdir(path, 0700) == -1) {
+        if (errno != EEXIST)
+            i_critical("lmdb db path: %s", strerror(errno));
+    } else {
+        /*
+         * As the directory has just been created, ensure the correct
+         * ownership.
+         */
+        if (handle->pw
+            && (chown(path, handle->pw->pw_uid, handle->pw->pw_gid) == -1)) {
+            i_critical("chown %s failed: %s", path, strerror(errno));
+        }
+    }
+
+    if ((lh = calloc(1, sizeof(*lh))) == NULL)
+        i_critical("calloc: %s", strerror(errno));
+    handle->dbh = lh;
+}
+
+extern void
+Mod_db_open(DB_handle_T handle, int flags)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    MDB_txn* txn;
+    char *db_name, *path, *db_path = NULL;
+    int ret, i, map_size;
+
+    if (lh->env != NULL)
+        return;
+
+    path = Config_get_str(handle->config, "path", "database", DEFAULT_PATH);
+    db_name = Config_get_str(handle->config, "db_name", "database",
+        DEFAULT_DB);
+    map_size = Config_get_int(handle->config, "map_size", "database",
+        DEFAULT_MAP_SIZE);
+
+    if (asprintf(&db_path, "%s/%s", path, db_name) <= 0) {
+        i_warning("could not create db path");
+        goto cleanup;
+    }
+
+    /*
+     * The environment is a single file plus its lock file. Read-only
+     * transactions are not tied to threads, so that an iterator's
+     * snapshot may be held whilst writing.
+     */
+    if ((ret = mdb_env_create(&lh->env)) != 0
+        || (ret = mdb_env_set_maxdbs(lh->env, LMDB_NUM_DBIS)) != 0
+        || (ret = mdb_env_set_mapsize(lh->env, (size_t)map_size << 20)) != 0
+        || (ret = mdb_env_open(lh->env, db_path,
+                MDB_NOSUBDIR | MDB_NOTLS
+                    | (flags & GREYDB_RO ? MDB_RDONLY : 0),
+                0600))
+            != 0) {
+        i_warning("could not open %s: %s", db_path, mdb_strerror(ret));
+        goto cleanup;
+    }
+
+    /* Release the reader slots of any crashed processes. */
+    mdb_reader_check(lh->env, NULL);
+
+    ret = mdb_txn_begin(lh->env, NULL, (flags & GREYDB_RO ? MDB_RDONLY : 0),
+        &txn);
+    if (ret != 0) {
+        i_warning("db txn start failed: %s", mdb_strerror(ret));
+        goto cleanup;
+    }
+
+    for (i = 0; i < LMDB_NUM_DBIS; i++) {
+        ret = mdb_dbi_open(txn, lmdb_names[i],
+            (flags & GREYDB_RO ? 0 : MDB_CREATE), &lh->dbi[i]);
+        if (ret != 0) {
+            i_warning("db open (%s) failed: %s", lmdb_names[i],
+                mdb_strerror(ret));
+            mdb_txn_abort(txn);
+            goto cleanup;
+        }
+    }
+
+    if ((ret = mdb_txn_commit(txn)) != 0) {
+        i_warning("db txn commit failed: %s", mdb_strerror(ret));
+        goto cleanup;
+    }
+
+    lh->max_key = mdb_env_get_maxkeysize(lh->env);
+    free(db_path);
+    return;
+
+cleanup:
+    if (lh->env)
+        mdb_env_close(lh->env);
+    exit(1);
+}
+
+extern int
+Mod_db_start_txn(DB_handle_T handle)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    int ret;
+
+    if (lh->txn != NULL) {
+        /* Already in a transaction. */
+        return -1;
+    }
+
+    /* This waits on any other process's write transaction. */
+    if ((ret = mdb_txn_begin(lh->env, NULL, 0, &lh->txn)) != 0) {
+        i_warning("db txn start failed: %s", mdb_strerror(ret));
+        lh->txn = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+extern int
+Mod_db_commit_txn(DB_handle_T handle)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    int ret;
+
+    if (lh->txn == NULL) {
+        i_warning("cannot commit, not in transaction");
+        return -1;
+    }
+
+    /* The transaction is freed even if the commit fails. */
+    ret = mdb_txn_commit(lh->txn);
+    lh->txn = NULL;
+    if (ret != 0) {
+        i_warning("db txn commit failed: %s", mdb_strerror(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+extern int
+Mod_db_rollback_txn(DB_handle_T handle)
+{
+    struct lmdb_handle* lh = handle->dbh;
+
+    if (lh->txn == NULL)
+        return -1;
+
+    mdb_txn_abort(lh->txn);
+    lh->txn = NULL;
+
+    return 0;
+}
+
+extern void
+Mod_db_close(DB_handle_T handle)
+{
+    struct lmdb_handle* lh;
+
+    if ((lh = handle->dbh) != NULL) {
+        if (lh->txn)
+            mdb_txn_abort(lh->txn);
+        if (lh->rtxn)
+            mdb_txn_abort(lh->rtxn);
+        if (lh->env)
+            mdb_env_close(lh->env);
+        free(lh);
+        handle->dbh = NULL;
+    }
+}
+
+extern int
+Mod_db_put(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    struct lmdb_key lk;
+    MDB_txn* txn;
+    MDB_val data;
+    char buf[sizeof(struct Grey_data) + KEY_MAX];
+    int ret;
+
+    if (pack_key(lh, key, &lk) == -1)
+        return GREYDB_ERR;
+    pack_val(&lk, val, &data, buf);
+
+    if ((ret = write_txn(lh, &txn)) == 0)
+        ret = mdb_put(txn, lk.dbi, &lk.key, &data, 0);
+
+    switch (ret) {
+    case 0:
+        return end_write_txn(handle, txn, 1);
+
+    case MDB_MAP_FULL:
+        i_error("Error putting record: %s, increase map_size",
+            mdb_strerror(ret));
+        break;
+
+    default:
+        i_error("Error putting record: %s", mdb_strerror(ret));
+    }
+
+    end_write_txn(handle, txn, 0);
+    return GREYDB_ERR;
+}
+
+extern int
+Mod_db_get(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    MDB_txn* txn;
+    int ret, res;
+
+    if (key->type == DB_KEY_DOM_PART)
+        return check_partial_dom(handle, key->data.s);
+
+    if ((ret = read_txn(lh, &txn)) != 0) {
+        i_error("Error retrieving record: %s", mdb_strerror(ret));
+        return GREYDB_ERR;
+    }
+
+    res = get(handle, txn, key, val);
+    end_read_txn(lh, txn);
+
+    return res;
+}
+
+extern int
+Mod_db_del(DB_handle_T handle, struct DB_key* key)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    struct lmdb_key lk;
+    MDB_txn* txn;
+    int ret;
+
+    if (pack_key(lh, key, &lk) == -1)
+        return GREYDB_ERR;
+
+    if ((ret = write_txn(lh, &txn)) == 0)
+        ret = mdb_del(txn, lk.dbi, &lk.key, NULL);
+
+    switch (ret) {
+    case 0:
+        return end_write_txn(handle, txn, 1);
+
+    case MDB_NOTFOUND:
+        end_write_txn(handle, txn, 1);
+        return GREYDB_NOT_FOUND;
+
+    default:
+        i_error("Error deleting record: %s", mdb_strerror(ret));
+    }
+
+    end_write_txn(handle, txn, 0);
+    return GREYDB_ERR;
+}
+
+extern int
+Mod_db_get_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int* found, int n)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    MDB_txn* txn;
+    int i, ret;
+
+    /* All of the lookups are made from the one snapshot. */
+    if ((ret = read_txn(lh, &txn)) != 0) {
+        i_error("Error retrieving record: %s", mdb_strerror(ret));
+        return GREYDB_ERR;
+    }
+
+    for (i = 0, ret = GREYDB_OK; i < n && ret == GREYDB_OK; i++) {
+        found[i] = (keys[i].type == DB_KEY_DOM_PART
+                ? check_partial_dom(handle, keys[i].data.s)
+                : get(handle, txn, &keys[i], &vals[i]));
+        if (found[i] != GREYDB_FOUND && found[i] != GREYDB_NOT_FOUND)
+            ret = GREYDB_ERR;
+    }
+    end_read_txn(lh, txn);
+
+    return ret;
+}
+
+extern int
+Mod_db_put_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    return write_many(handle, keys, vals, n);
+}
+
+extern int
+Mod_db_del_many(DB_handle_T handle, struct DB_key* keys, int n)
+{
+    return write_many(handle, keys, NULL, n);
+}
+
+extern void
+Mod_db_get_itr(DB_itr_T itr, int types)
+{
+    struct lmdb_handle* lh = itr->handle->dbh;
+    struct lmdb_itr* li;
+    enum lmdb_dbi* next;
+    int ret;
+
+    if ((li = calloc(1, sizeof(*li))) == NULL)
+        i_critical("calloc: %s", strerror(errno));
+
+    next = li->dbis;
+    if (types & DB_ENTRIES) {
+        *next++ = LMDB_IPS;
+        *next++ = LMDB_TUPLES;
+    }
+    if (types & DB_SPAMTRAPS)
+        *next++ = LMDB_SPAMTRAPS;
+    if (types & DB_DOMAINS)
+        *next++ = LMDB_DOMAINS;
+    *next = LMDB_NUM_DBIS;
+    li->curr = li->dbis;
+
+    /*
+     * Outside of a transaction, the iterator reads from its own
+     * snapshot, and its keys point directly into the map.
+     */
+    if ((li->txn = lh->txn) == NULL) {
+        ret = mdb_txn_begin(lh->env, NULL, MDB_RDONLY, &li->txn);
+        if (ret != 0)
+            i_critical("Could not create cursor (%s)", mdb_strerror(ret));
+        li->own_txn = 1;
+    }
+
+    itr->dbi = li;
+}
+
+extern void
+Mod_db_get_itr_after(DB_itr_T itr, struct DB_key* after)
+{
+    struct lmdb_itr* li;
+
+    Mod_db_get_itr(itr, DB_ENTRIES);
+    li = itr->dbi;
+
+    if (after == NULL
+        || (after->type != DB_KEY_IP && after->type != DB_KEY_TUPLE)) {
+        return;
+    }
+
+    if ((li->after = malloc(sizeof(*li->after))) == NULL)
+        i_critical("malloc: %s", strerror(errno));
+
+    if (pack_key(itr->handle->dbh, after, li->after) == -1)
+        i_critical("Could not resume iteration");
+
+    /* The tuples follow all of the addresses. */
+    if (after->type == DB_KEY_TUPLE)
+        li->curr++;
+}
+
+extern void
+Mod_db_itr_close(DB_itr_T itr)
+{
+    struct lmdb_itr* li = itr->dbi;
+
+    if (li) {
+        free(li->after);
+        if (li->cursor)
+            mdb_cursor_close(li->cursor);
+        if (li->own_txn)
+            mdb_txn_abort(li->txn);
+        free(li);
+        itr->dbi = NULL;
+    }
+}
+
+extern int
+Mod_db_itr_next(DB_itr_T itr, struct DB_key* key, struct DB_val* val)
+{
+    struct lmdb_handle* lh = itr->handle->dbh;
+    struct lmdb_itr* li = itr->dbi;
+    MDB_val k, v;
+    int ret;
+
+    while (*li->curr != LMDB_NUM_DBIS) {
+        if (li->cursor == NULL) {
+            ret = mdb_cursor_open(li->txn, lh->dbi[*li->curr], &li->cursor);
+            if (ret != 0) {
+                i_error("Could not create cursor (%s)", mdb_strerror(ret));
+                return GREYDB_ERR;
+            }
+
+            if (li->after == NULL) {
+                ret = mdb_cursor_get(li->cursor, &k, &v, MDB_FIRST);
+            } else {
+                /* Position the cursor past the key to resume after. */
+                k = li->after->key;
+                ret = mdb_cursor_get(li->cursor, &k, &v, MDB_SET_RANGE);
+                if (ret == 0 && k.mv_size == li->after->key.mv_size
+                    && !memcmp(k.mv_data, li->after->key.mv_data,
+                           k.mv_size)) {
+                    ret = mdb_cursor_get(li->cursor, &k, &v, MDB_NEXT);
+                }
+                free(li->after);
+                li->after = NULL;
+            }
+        } else {
+            ret = mdb_cursor_get(li->cursor, &k, &v, MDB_NEXT);
+        }
+
+        switch (ret) {
+        case 0:
+            /*
+             * Pages modified in a write transaction may move, so the key
+             * is copied rather than pointing into the map.
+             */
+            if (unpack(*li->curr, &k, &v, key, val,
+                    (li->own_txn ? NULL : li->buf))
+                == -1) {
+                continue;
+            }
+            li->key = *key;
+            itr->current++;
+            return GREYDB_FOUND;
+
+        case MDB_NOTFOUND:
+            mdb_cursor_close(li->cursor);
+            li->cursor = NULL;
+            li->curr++;
+            break;
+
+        default:
+            i_error("Error retrieving next record: %s", mdb_strerror(ret));
+            return GREYDB_ERR;
+        }
+    }
+
+    return GREYDB_NOT_FOUND;
+}
+
+extern int
+Mod_db_itr_replace_curr(DB_itr_T itr, struct DB_val* val)
+{
+    struct lmdb_itr* li = itr->dbi;
+    struct lmdb_key lk;
+    MDB_val k, v, data;
+    char buf[sizeof(struct Grey_data) + KEY_MAX];
+    int ret;
+
+    if (li->cursor == NULL)
+        return GREYDB_ERR;
+
+    /* An iterator's snapshot is read-only. */
+    if (li->own_txn)
+        return DB_put(itr->handle, &li->key, val);
+
+    if (pack_key(itr->handle->dbh, &li->key, &lk) == -1)
+        return GREYDB_ERR;
+    pack_val(&lk, val, &data, buf);
+
+    if ((ret = mdb_cursor_get(li->cursor, &k, &v, MDB_GET_CURRENT)) != 0
+        || (ret = mdb_cursor_put(li->cursor, &k, &data, MDB_CURRENT)) != 0) {
+        i_error("Error replacing record: %s", mdb_strerror(ret));
+        return GREYDB_ERR;
+    }
+
+    return GREYDB_OK;
+}
+
+extern int
+Mod_db_itr_del_curr(DB_itr_T itr)
+{
+    struct lmdb_itr* li = itr->dbi;
+    int ret;
+
+    if (li->cursor == NULL)
+        return GREYDB_ERR;
+
+    if (li->own_txn)
+        return DB_del(itr->handle, &li->key);
+
+    /* The cursor's next move returns the record after this one. */
+    if ((ret = mdb_cursor_del(li->cursor, 0)) != 0) {
+        i_error("Error deleting current record: %s", mdb_strerror(ret));
+        return GREYDB_ERR;
+    }
+
+    return GREYDB_OK;
+}
+
+extern int
+Mod_scan_db(DB_handle_T handle, time_t* now, List_T whitelist,
+    List_T whitelist_ipv6, List_T traplist, time_t* white_exp)
+{
+    return scan(handle, now, NULL, whitelist, whitelist_ipv6, traplist, NULL,
+        white_exp);
+}
+
+extern int
+Mod_scan_db_changes(DB_handle_T handle, time_t* now, time_t* since,
+    List_T whitelist, List_T whitelist_ipv6, List_T traplist, List_T removed,
+    time_t* white_exp)
+{
+    return scan(handle, now, since, whitelist, whitelist_ipv6, traplist,
+        removed, white_exp);
+}
+
+/*
+ * Delete expired entries and whitelist the grey tuples due to pass,
+ * unless their address is trapped, then populate the lists. For an
+ * incremental scan, only the addresses which are new since *since*, or
+ * which were whitelisted by this scan, are added to the lists, and the
+ * expired addresses are added to the removed list.
+ */
+static int
+scan(DB_handle_T handle, time_t* now, time_t* since, List_T whitelist,
+    List_T whitelist_ipv6, List_T traplist, List_T removed,
+    time_t* white_exp)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    MDB_txn* txn;
+    MDB_cursor* cursor = NULL;
+    MDB_val k, v, wk, wv;
+    struct DB_key key;
+    struct DB_val val;
+    struct Grey_data gd;
+    char ip[INET6_ADDRSTRLEN + 1];
+    List_T list;
+    int ret;
+
+    if ((ret = write_txn(lh, &txn)) != 0)
+        goto err;
+
+    /*
+     * Expire the grey tuples, and whitelist those which are due to
+     * pass. The trap status of each address is a lookup in the IP
+     * sub-database, within the same transaction.
+     */
+    if ((ret = mdb_cursor_open(txn, lh->dbi[LMDB_TUPLES], &cursor)) != 0)
+        goto err;
+
+    for (ret = mdb_cursor_get(cursor, &k, &v, MDB_FIRST); ret == 0;
+         ret = mdb_cursor_get(cursor, &k, &v, MDB_NEXT)) {
+        if (unpack(LMDB_TUPLES, &k, &v, &key, &val, NULL) == -1)
+            continue;
+        gd = val.data.gd;
+
+        if (gd.expire <= *now) {
+            i_debug("deleting expired grey entry %s", key.data.gt.ip);
+            if ((ret = mdb_cursor_del(cursor, 0)) != 0)
+                goto err;
+            continue;
+        }
+
+        if (gd.pcount < 0 || gd.pass > *now)
+            continue;
+
+        /* Copy the address out before the tuple is deleted. */
+        strncpy(ip, key.data.gt.ip, sizeof(ip) - 1);
+        ip[sizeof(ip) - 1] = '\0';
+        wk.mv_data = ip;
+        wk.mv_size = strlen(ip) + 1;
+
+        ret = mdb_get(txn, lh->dbi[LMDB_IPS], &wk, &wv);
+        if (ret == 0) {
+            memcpy(&val.data.gd, wv.mv_data, sizeof(struct Grey_data));
+            if (val.data.gd.pcount == -1) {
+                /* Ignore trapped entries. */
+                continue;
+            }
+        } else if (ret != MDB_NOTFOUND) {
+            goto err;
+        }
+
+        /* Re-add entry, keyed only by IP address. */
+        gd.expire = *now + *white_exp;
+        wv.mv_data = &gd;
+        wv.mv_size = sizeof(gd);
+
+        i_debug("whitelisting %s", ip);
+        if ((ret = mdb_put(txn, lh->dbi[LMDB_IPS], &wk, &wv, 0)) != 0
+            || (ret = mdb_cursor_del(cursor, 0)) != 0) {
+            goto err;
+        }
+    }
+    if (ret != MDB_NOTFOUND)
+        goto err;
+    mdb_cursor_close(cursor);
+
+    /*
+     * Expire the white & trapped addresses, and add the rest to the
+     * lists, including those whitelisted above.
+     */
+    if ((ret = mdb_cursor_open(txn, lh->dbi[LMDB_IPS], &cursor)) != 0) {
+        cursor = NULL;
+        goto err;
+    }
+
+    for (ret = mdb_cursor_get(cursor, &k, &v, MDB_FIRST); ret == 0;
+         ret = mdb_cursor_get(cursor, &k, &v, MDB_NEXT)) {
+        if (unpack(LMDB_IPS, &k, &v, &key, &val, NULL) == -1)
+            continue;
+        gd = val.data.gd;
+
+        if (gd.expire <= *now) {
+            i_debug("deleting expired %sentry %s",
+                (gd.pcount >= 0 ? "white " : "greytrap "), key.data.s);
+            if (removed != NULL)
+                List_insert_after(removed, strdup(key.data.s));
+            if ((ret = mdb_cursor_del(cursor, 0)) != 0)
+                goto err;
+        } else if (since != NULL) {
+            if (gd.first < *since && gd.expire != *now + *white_exp)
+                continue;
+
+            if (gd.pcount < 0) {
+                List_insert_after(traplist, strdup(key.data.s));
+            } else {
+                list = (IP_check_addr(key.data.s) == AF_INET6
+                        ? whitelist_ipv6
+                        : whitelist);
+                List_insert_after(list, strdup(key.data.s));
+            }
+        } else if (gd.pcount == -1) {
+            List_insert_after(traplist, strdup(key.data.s));
+        } else if (gd.pcount >= 0 && gd.pass <= *now) {
+            list = (IP_check_addr(key.data.s) == AF_INET6
+                    ? whitelist_ipv6
+                    : whitelist);
+            List_insert_after(list, strdup(key.data.s));
+        }
+    }
+    if (ret != MDB_NOTFOUND)
+        goto err;
+    mdb_cursor_close(cursor);
+
+    return end_write_txn(handle, txn, 1);
+
+err:
+    i_warning("db scan failed: %s", mdb_strerror(ret));
+    if (cursor != NULL)
+        mdb_cursor_close(cursor);
+    if (txn != NULL)
+        end_write_txn(handle, txn, 0);
+    return GREYDB_ERR;
+}
+
+/*
+ * Pack the key's strings, including their terminators, into the key
+ * buffer. Keys exceeding the maximum LMDB key size are truncated, with
+ * the end of the prefix replaced by a SHA-1 hash of the whole key so
+ * that keys sharing a long prefix remain distinct. They are also stored
+ * in full with the value.
+ */
+static int
+pack_key(struct lmdb_handle* lh, struct DB_key* key, struct lmdb_key* lk)
+{
+    struct Grey_tuple* gt;
+    char* buf = lk->buf;
+    int n;
+
+    switch (key->type) {
+    case DB_KEY_IP:
+        lk->dbi = lh->dbi[LMDB_IPS];
+        n = snprintf(buf, KEY_MAX, "%s", key->data.s);
+        break;
+
+    case DB_KEY_MAIL:
+        lk->dbi = lh->dbi[LMDB_SPAMTRAPS];
+        n = snprintf(buf, KEY_MAX, "%s", key->data.s);
+        break;
+
+    case DB_KEY_DOM:
+        lk->dbi = lh->dbi[LMDB_DOMAINS];
+        n = snprintf(buf, KEY_MAX, "%s", key->data.s);
+        break;
+
+    case DB_KEY_TUPLE:
+        lk->dbi = lh->dbi[LMDB_TUPLES];
+        gt = &key->data.gt;
+        n = snprintf(buf, KEY_MAX, "%s%c%s%c%s%c%s", gt->ip, '\0', gt->helo,
+            '\0', gt->from, '\0', gt->to);
+        break;
+
+    default:
+        i_warning("unknown key type %d", key->type);
+        return -1;
+    }
+
+    if (n < 0 || n >= KEY_MAX) {
+        i_warning("key too long");
+        return -1;
+    }
+
+    lk->len = n + 1;
+    lk->key.mv_data = buf;
+    lk->key.mv_size = lk->len;
+
+    if (lk->len > (size_t)lh->max_key) {
+        n = lh->max_key - SHA_DIGEST_LENGTH;
+        memcpy(lk->hashed, buf, n);
+        SHA1((unsigned char*)buf, lk->len, (unsigned char*)lk->hashed + n);
+        lk->key.mv_data = lk->hashed;
+        lk->key.mv_size = lh->max_key;
+    }
+
+    return 0;
+}
+
+/*
+ * Pack the grey data, followed by the full key if it was truncated.
+ */
+static void
+pack_val(struct lmdb_key* lk, struct DB_val* val, MDB_val* data, char* buf)
+{
+    memcpy(buf, &val->data.gd, sizeof(struct Grey_data));
+    data->mv_size = sizeof(struct Grey_data);
+    if (lk->key.mv_size < lk->len) {
+        memcpy(buf + data->mv_size, lk->buf, lk->len);
+        data->mv_size += lk->len;
+    }
+    data->mv_data = buf;
+}
+
+/*
+ * Unpack a record, pointing the key's strings at the map unless a copy
+ * buffer is supplied.
+ */
+static int
+unpack(enum lmdb_dbi which, MDB_val* k, MDB_val* v, struct DB_key* key,
+    struct DB_val* val, char* copy)
+{
+    struct Grey_tuple* gt;
+    char* buf = k->mv_data;
+    size_t len = k->mv_size;
+
+    if (v->mv_size < sizeof(struct Grey_data)) {
+        i_warning("invalid %s record", lmdb_names[which]);
+        return -1;
+    }
+
+    /* The full key of a truncated record is stored with its value. */
+    if (v->mv_size > sizeof(struct Grey_data)) {
+        buf = (char*)v->mv_data + sizeof(struct Grey_data);
+        len = v->mv_size - sizeof(struct Grey_data);
+    }
+
+    if (len == 0 || len > KEY_MAX || buf[len - 1] != '\0') {
+        i_warning("invalid %s record", lmdb_names[which]);
+        return -1;
+    }
+
+    if (copy != NULL) {
+        memcpy(copy, buf, len);
+        buf = copy;
+    }
+
+    memset(key, 0, sizeof(*key));
+    key->type = lmdb_types[which];
+    if (key->type == DB_KEY_TUPLE) {
+        gt = &key->data.gt;
+        gt->ip = buf;
+        gt->helo = gt->ip + strlen(gt->ip) + 1;
+        gt->from = gt->helo + strlen(gt->helo) + 1;
+        gt->to = gt->from + strlen(gt->from) + 1;
+        if (gt->to >= buf + len) {
+            i_warning("invalid %s record", lmdb_names[which]);
+            return -1;
+        }
+    } else {
+        key->data.s = buf;
+    }
+
+    memset(val, 0, sizeof(*val));
+    val->type = DB_VAL_GREY;
+    memcpy(&val->data.gd, v->mv_data, sizeof(struct Grey_data));
+
+    return 0;
+}
+
+/*
+ * Check the full key stored with the value of a truncated key, rather
+ * than rely on its hash alone.
+ */
+static int
+key_matches(struct lmdb_key* lk, MDB_val* data)
+{
+    if (lk->key.mv_size == lk->len)
+        return 1;
+
+    return (data->mv_size == sizeof(struct Grey_data) + lk->len
+        && !memcmp((char*)data->mv_data + sizeof(struct Grey_data), lk->buf,
+            lk->len));
+}
+
+/*
+ * Look up a single key within the supplied transaction.
+ */
+static int
+get(DB_handle_T handle, MDB_txn* txn, struct DB_key* key, struct DB_val* val)
+{
+    struct lmdb_key lk;
+    MDB_val data;
+    int ret;
+
+    if (pack_key(handle->dbh, key, &lk) == -1)
+        return GREYDB_ERR;
+
+    switch ((ret = mdb_get(txn, lk.dbi, &lk.key, &data))) {
+    case 0:
+        if (!key_matches(&lk, &data))
+            return GREYDB_NOT_FOUND;
+
+        /* The value may not be aligned in the map. */
+        memset(val, 0, sizeof(*val));
+        val->type = DB_VAL_GREY;
+        memcpy(&val->data.gd, data.mv_data, sizeof(struct Grey_data));
+        return GREYDB_FOUND;
+
+    case MDB_NOTFOUND:
+        return GREYDB_NOT_FOUND;
+
+    default:
+        i_error("Error retrieving record: %s", mdb_strerror(ret));
+    }
+
+    return GREYDB_ERR;
+}
+
+/*
+ * Make a batch of puts, or deletes if there are no values, in a single
+ * write transaction so that the batch is synced to disk once.
+ */
+static int
+write_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    struct lmdb_key lk;
+    MDB_txn* txn;
+    MDB_val data;
+    char buf[sizeof(struct Grey_data) + KEY_MAX];
+    int i, ret;
+
+    if ((ret = write_txn(lh, &txn)) != 0) {
+        i_error("Error writing records: %s", mdb_strerror(ret));
+        return GREYDB_ERR;
+    }
+
+    for (i = 0; i < n && ret == 0; i++) {
+        if (pack_key(lh, &keys[i], &lk) == -1)
+            return end_write_txn(handle, txn, 0);
+
+        if (vals) {
+            pack_val(&lk, &vals[i], &data, buf);
+            ret = mdb_put(txn, lk.dbi, &lk.key, &data, 0);
+        } else if ((ret = mdb_del(txn, lk.dbi, &lk.key, NULL))
+            == MDB_NOTFOUND) {
+            ret = 0;
+        }
+    }
+
+    if (ret != 0) {
+        i_error("Error writing records: %s%s", mdb_strerror(ret),
+            (ret == MDB_MAP_FULL ? ", increase map_size" : ""));
+    }
+
+    return end_write_txn(handle, txn, ret == 0);
+}
+
+/*
+ * Return the explicit write transaction, or begin one for a single
+ * write outside of a transaction.
+ */
+static int
+write_txn(struct lmdb_handle* lh, MDB_txn** txn)
+{
+    int ret;
+
+    if ((*txn = lh->txn) != NULL)
+        return 0;
+
+    if ((ret = mdb_txn_begin(lh->env, NULL, 0, txn)) != 0)
+        *txn = NULL;
+
+    return ret;
+}
+
+/*
+ * Commit a single write. On error, the transaction is aborted, rolling
+ * back an explicit transaction as the other drivers do.
+ */
+static int
+end_write_txn(DB_handle_T handle, MDB_txn* txn, int ok)
+{
+    struct lmdb_handle* lh = handle->dbh;
+    int ret;
+
+    if (txn == NULL)
+        return GREYDB_ERR;
+
+    if (txn == lh->txn) {
+        if (!ok)
+            DB_rollback_txn(handle);
+        return (ok ? GREYDB_OK : GREYDB_ERR);
+    }
+
+    if (!ok) {
+        mdb_txn_abort(txn);
+        return GREYDB_ERR;
+    }
+
+    if ((ret = mdb_txn_commit(txn)) != 0) {
+        i_warning("db txn commit failed: %s", mdb_strerror(ret));
+        return GREYDB_ERR;
+    }
+
+    return GREYDB_OK;
+}
+
+/*
+ * Reads within an explicit transaction see its writes. Otherwise, the
+ * handle's read transaction is renewed, which is cheaper than beginning
+ * a new one.
+ */
+static int
+read_txn(struct lmdb_handle* lh, MDB_txn** txn)
+{
+    int ret;
+
+    if ((*txn = lh->txn) != NULL)
+        return 0;
+
+    if (lh->rtxn != NULL) {
+        ret = mdb_txn_renew(lh->rtxn);
+    } else {
+        ret = mdb_txn_begin(lh->env, NULL, MDB_RDONLY, &lh->rtxn);
+        if (ret != 0)
+            lh->rtxn = NULL;
+    }
+    *txn = lh->rtxn;
+
+    return ret;
+}
+
+static void
+end_read_txn(struct lmdb_handle* lh, MDB_txn* txn)
+{
+    /* Release the snapshot so the writer may reuse its pages. */
+    if (txn != NULL && txn != lh->txn)
+        mdb_txn_reset(txn);
+}
+
+static int
+check_partial_dom(DB_handle_T handle, const char* part)
+{
+    DB_itr_T itr;
+    struct DB_key key;
+    struct DB_val val;
+    int part_len = strlen(part), match = 0, from_pos;
+    char* domain;
+
+    itr = DB_get_itr(handle, DB_DOMAINS);
+    while (!match && DB_itr_next(itr, &key, &val) == GREYDB_FOUND) {
+        domain = key.data.s;
+        from_pos = part_len - strlen(domain);
+
+        if ((from_pos >= 0)
+            && (strcasecmp(part + from_pos, domain) == 0)) {
+            match = 1;
+        }
+    }
+    DB_close_itr(&itr);
+
+    return (match ? GREYDB_FOUND : GREYDB_NOT_FOUND);
+}
@@ -42,6 +42,127 @@
 #define DEFAULT_HOST "localhost"
 #define DEFAULT_PORT 3306
 #define DEFAULT_DB "greyd"
+#define DEFAULT_BATCH 1
+
+/*
+ * The rows in each batched statement, and the columns per inserted row.
+ * The entry writes are also sent in the smaller batch sizes, so that a
+ * partial batch isn't padded.
+ */
+#define BATCH_ROWS 64
+#define BATCH_ROWS_MID 16
+#define BATCH_ROWS_SMALL 4
+#define ENTRY_COLS 10
+#define MAX_PARAMS (BATCH_ROWS * ENTRY_COLS)
+
+#define ENTRY_INSERT                                                    \
+    "INSERT INTO entries "                                              \
+    "(`ip`, `helo`, `from`, `to`, "                                     \
+    " `first`, `pass`, `expire`, `bcount`, `pcount`, `greyd_host`) "    \
+    "VALUES "
+#define ENTRY_ROW "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"
+#define ENTRY_UPDATE                                                    \
+    " ON DUPLICATE KEY UPDATE "                                         \
+    "`first` = VALUES(`first`), `pass` = VALUES(`pass`), "              \
+    "`expire` = VALUES(`expire`), `bcount` = VALUES(`bcount`), "        \
+    "`pcount` = VALUES(`pcount`), `greyd_host` = VALUES(`greyd_host`)"
+#define ENTRY_SELECT                                                    \
+    "SELECT %d, `first`, `pass`, `expire`, `bcount`, `pcount` "         \
+    "FROM entries "                                                     \
+    "WHERE `ip` = ? AND `helo` = ? AND `from` = ? AND `to` = ?"
+#define ENTRY_DELETE                                                    \
+    "DELETE FROM entries WHERE (`ip`, `helo`, `from`, `to`) IN ("
+#define KEY_ROW "(?, ?, ?, ?)"
+
+/*
+ * The statements prepared on demand for each connection. The batched
+ * entry statements are built when first needed.
+ */
+enum my_stmt {
+    MY_PUT_MAIL,
+    MY_PUT_DOM,
+    MY_PUT_ENTRY,
+    MY_PUT_BATCH,
+    MY_GET_MAIL,
+    MY_GET_DOM,
+    MY_GET_IP,
+    MY_GET_TUPLE,
+    MY_GET_DOM_PART,
+    MY_DEL_MAIL,
+    MY_DEL_DOM,
+    MY_DEL_IP,
+    MY_DEL_TUPLE,
+    MY_SCAN_DELETE,
+    MY_SCAN_PROMOTE,
+    MY_GET_BATCH,
+    MY_DEL_BATCH,
+    MY_PUT_BATCH_MID,
+    MY_PUT_BATCH_SMALL,
+    MY_NUM_STMTS
+};
+
+static const char* my_sql[MY_NUM_STMTS] = {
+    "INSERT IGNORE INTO spamtraps(address) VALUES (?)",
+    "INSERT IGNORE INTO domains(domain) VALUES (?)",
+    ENTRY_INSERT ENTRY_ROW ENTRY_UPDATE,
+    NULL,
+    "SELECT 0, 0, 0, 0, -2 "
+    "FROM spamtraps WHERE `address` = ? "
+    "LIMIT 1",
+    "SELECT 0, 0, 0, 0, -3 "
+    "FROM domains WHERE `domain` = ? "
+    "LIMIT 1",
+    "SELECT `first`, `pass`, `expire`, `bcount`, `pcount` "
+    "FROM entries "
+    "WHERE `ip` = ? AND `helo` = '' AND `from` = '' AND `to` = '' "
+    "LIMIT 1",
+    "SELECT `first`, `pass`, `expire`, `bcount`, `pcount` "
+    "FROM entries "
+    "WHERE `ip` = ? AND `helo` = ? AND `from` = ? AND `to` = ? "
+    "LIMIT 1",
+    "SELECT 0, 0, 0, 0, -3 "
+    "FROM domains WHERE ? LIKE CONCAT('%', domain) "
+    "LIMIT 1",
+    "DELETE FROM spamtraps WHERE `address` = ?",
+    "DELETE FROM domains WHERE `domain` = ?",
+    "DELETE FROM entries WHERE `ip` = ? "
+    "AND `helo` = '' AND `from` = '' AND `to` = ''",
+    "DELETE FROM entries WHERE `ip` = ? "
+    "AND `helo` = ? AND `from` = ? AND `to` = ?",
+    "DELETE FROM entries WHERE `expire` <= ? AND `greyd_host` = ?",
+    "UPDATE IGNORE entries e LEFT JOIN entries g "
+    "ON g.`ip` = e.`ip` AND g.`to` = '' AND g.`from` = '' "
+    "SET e.`helo` = '', e.`from` = '', e.`to` = '', e.`expire` = ? "
+    "WHERE e.`from` <> '' AND e.`to` <> '' AND e.`pcount` >= 0 "
+    "AND g.`ip` IS NULL AND e.`pass` <= ? "
+    "AND e.`greyd_host` = ?",
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+/*
+ * The parameters bound to a statement, with storage for the integer
+ * values and string lengths that the binds point to.
+ */
+struct my_params {
+    int n;
+    MYSQL_BIND bind[MAX_PARAMS];
+    unsigned long lengths[MAX_PARAMS];
+    long long ints[MAX_PARAMS];
+};
+
+/*
+ * An entry write held back to be sent in the next batched insert.
+ */
+struct my_entry {
+    char ip[INET6_ADDRSTRLEN + 1];
+    char helo[GREY_MAX_MAIL + 1];
+    char from[GREY_MAX_MAIL + 1];
+    char to[GREY_MAX_MAIL + 1];
+    struct Grey_data gd;
+};
 
 /**
  * The internal driver handle.
@@ -51,6 +172,11 @@ struct mysql_handle {
     char* greyd_host;
     int txn;
     int connected;
+    MYSQL_STMT* stmts[MY_NUM_STMTS]; /**< Cached prepared statements. */
+    struct my_params* params;
+    int batch; /**< Batch the entry writes made within a transaction. */
+    struct my_entry* batched; /**< Entry writes not yet sent. */
+    int nbatched;
 };
 
 struct mysql_itr {
@@ -58,33 +184,50 @@ struct mysql_itr {
     struct DB_key* curr;
 };
 
-static char* escape(MYSQL*, const char*);
 static void populate_key(MYSQL_ROW, struct DB_key*, int);
 static void populate_val(MYSQL_ROW, struct DB_val*, int);
+static MYSQL_STMT* get_stmt(struct mysql_handle*, enum my_stmt);
+static MYSQL_STMT* exec_stmt(struct mysql_handle*, enum my_stmt);
+static void param_str(struct my_params*, const char*);
+static void param_int(struct my_params*, long long);
+static void param_entry(struct mysql_handle*, const char*, const char*,
+    const char*, const char*, struct Grey_data*);
+static int key_params(struct mysql_handle*, struct DB_key*, enum my_stmt*,
+    enum my_stmt);
+static void param_key(struct my_params*, struct DB_key*);
+static char* batch_sql(enum my_stmt);
+static void batch_entry(struct mysql_handle*, struct DB_key*,
+    struct DB_val*);
+static int flush_batch(DB_handle_T);
+static int get_batch(struct mysql_handle*, struct DB_key*, struct DB_val*,
+    int*, int*, int);
+static int del_batch(struct mysql_handle*, struct DB_key*, int*, int);
 
 extern void
 Mod_db_init(DB_handle_T handle)
 {
     struct mysql_handle* dbh;
-    char *path, *hostname;
-    int ret, flags, uid_changed = 0, len;
+    char* hostname;
 
-    if ((dbh = malloc(sizeof(*dbh))) == NULL)
-        i_critical("malloc: %s", strerror(errno));
+    if ((dbh = calloc(1, sizeof(*dbh))) == NULL
+        || (dbh->params = calloc(1, sizeof(*dbh->params))) == NULL
+        || (dbh->batched = calloc(BATCH_ROWS, sizeof(*dbh->batched)))
+            == NULL) {
+        i_critical("calloc: %s", strerror(errno));
+    }
 
     handle->dbh = dbh;
     dbh->db = mysql_init(NULL);
     dbh->txn = 0;
     dbh->connected = 0;
+    dbh->nbatched = 0;
+    dbh->batch = Config_get_int(handle->config, "batch", "database",
+        DEFAULT_BATCH);
 
-    /* Escape and store the hostname in a static buffer. */
+    /* The hostname is only ever sent as a statement parameter. */
     hostname = Config_get_str(handle->config, "hostname", NULL, "");
-    if ((dbh->greyd_host = calloc(2 * (len = strlen(hostname)) + 1,
-             sizeof(char)))
-        == NULL) {
-        i_critical("malloc: %s", strerror(errno));
-    }
-    mysql_real_escape_string(dbh->db, dbh->greyd_host, hostname, len);
+    if ((dbh->greyd_host = strdup(hostname)) == NULL)
+        i_critical("strdup: %s", strerror(errno));
 }
 
 extern void
@@ -156,6 +299,9 @@ Mod_db_commit_txn(DB_handle_T handle)
         return -1;
     }
 
+    if (flush_batch(handle) != GREYDB_OK)
+        return -1;
+
     if (mysql_commit(dbh->db)) {
         i_warning("db txn commit failed: %s", mysql_error(dbh->db));
         goto cleanup;
@@ -179,6 +325,9 @@ Mod_db_rollback_txn(DB_handle_T handle)
         return -1;
     }
 
+    /* The batched writes are simply discarded. */
+    dbh->nbatched = 0;
+
     if (mysql_rollback(dbh->db)) {
         i_warning("db txn rollback failed: %s", mysql_error(dbh->db));
         goto cleanup;
@@ -196,11 +345,18 @@ extern void
 Mod_db_close(DB_handle_T handle)
 {
     struct mysql_handle* dbh;
+    int i;
 
     if ((dbh = handle->dbh) != NULL) {
         free(dbh->greyd_host);
+        for (i = 0; i < MY_NUM_STMTS; i++) {
+            if (dbh->stmts[i] != NULL)
+                mysql_stmt_close(dbh->stmts[i]);
+        }
         if (dbh->db)
             mysql_close(dbh->db);
+        free(dbh->params);
+        free(dbh->batched);
         free(dbh);
         handle->dbh = NULL;
     }
@@ -210,92 +366,45 @@ extern int
 Mod_db_put(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
 {
     struct mysql_handle* dbh = handle->dbh;
-    char *sql = NULL, *sql_tmpl = NULL;
     struct Grey_tuple* gt;
-    struct Grey_data* gd;
-    unsigned long len;
-    char* add_esc = NULL;
-    char* ip_esc = NULL;
-    char* helo_esc = NULL;
-    char* from_esc = NULL;
-    char* to_esc = NULL;
+    enum my_stmt which;
 
     switch (key->type) {
     case DB_KEY_MAIL:
-        sql_tmpl = "INSERT IGNORE INTO spamtraps(address) VALUES ('%s')";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
-
     case DB_KEY_DOM:
-        sql_tmpl = "INSERT IGNORE INTO domains(domain) VALUES ('%s')";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
+        key_params(dbh, key, &which, MY_PUT_MAIL);
+        if (exec_stmt(dbh, which) == NULL)
             goto err;
-        }
-        free(add_esc);
-        break;
+        return GREYDB_OK;
 
     case DB_KEY_IP:
-        sql_tmpl = "REPLACE INTO entries "
-                   "(`ip`, `helo`, `from`, `to`, "
-                   " `first`, `pass`, `expire`, `bcount`, `pcount`, `greyd_host`) "
-                   "VALUES "
-                   "('%s', '', '', '', %lld, %lld, %lld, %d, %d, '%s')";
-        add_esc = escape(dbh->db, key->data.s);
-
-        gd = &val->data.gd;
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc, gd->first, gd->pass, gd->expire, gd->bcount, gd->pcount, dbh->greyd_host) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
-
     case DB_KEY_TUPLE:
-        sql_tmpl = "REPLACE INTO entries "
-                   "(`ip`, `helo`, `from`, `to`, "
-                   " `first`, `pass`, `expire`, `bcount`, `pcount`, `greyd_host`) "
-                   "VALUES "
-                   "('%s', '%s', '%s', '%s', %lld, %lld, %lld, %d, %d, '%s')";
-        gt = &key->data.gt;
-        ip_esc = escape(dbh->db, gt->ip);
-        helo_esc = escape(dbh->db, gt->helo);
-        from_esc = escape(dbh->db, gt->from);
-        to_esc = escape(dbh->db, gt->to);
-
-        gd = &val->data.gd;
-        if (ip_esc && helo_esc && from_esc && to_esc
-            && asprintf(&sql, sql_tmpl, ip_esc, helo_esc, from_esc, to_esc,
-                   gd->first, gd->pass, gd->expire, gd->bcount,
-                   gd->pcount, dbh->greyd_host)
-                == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(ip_esc);
-        free(helo_esc);
-        free(from_esc);
-        free(to_esc);
         break;
 
     default:
         return GREYDB_ERR;
     }
 
-    if (mysql_real_query(dbh->db, sql, strlen(sql)) != 0) {
-        i_warning("put mysql error: %s", mysql_error(dbh->db));
-        free(sql);
-        goto err;
+    if (!dbh->batch || !dbh->txn) {
+        dbh->params->n = 0;
+        if (key->type == DB_KEY_IP) {
+            param_entry(dbh, key->data.s, "", "", "", &val->data.gd);
+        } else {
+            gt = &key->data.gt;
+            param_entry(dbh, gt->ip, gt->helo, gt->from, gt->to,
+                &val->data.gd);
+        }
+
+        if (exec_stmt(dbh, MY_PUT_ENTRY) == NULL)
+            goto err;
+        return GREYDB_OK;
     }
-    free(sql);
+
+    /* Hold the write back until the batch is full or must be flushed. */
+    batch_entry(dbh, key, val);
+    if (dbh->nbatched == BATCH_ROWS && flush_batch(handle) != GREYDB_OK)
+        return GREYDB_ERR;
+
     return GREYDB_OK;
 
 err:
@@ -307,203 +416,191 @@ extern int
 Mod_db_get(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
 {
     struct mysql_handle* dbh = handle->dbh;
-    char *sql = NULL, *sql_tmpl = NULL;
-    struct Grey_tuple* gt;
-    unsigned long len;
-    int res = GREYDB_NOT_FOUND;
-    char* add_esc = NULL;
-    char* ip_esc = NULL;
-    char* helo_esc = NULL;
-    char* from_esc = NULL;
-    char* to_esc = NULL;
+    MYSQL_STMT* stmt;
+    MYSQL_BIND result[5];
+    long long cols[5];
+    enum my_stmt which;
+    int i, res = GREYDB_NOT_FOUND;
 
-    switch (key->type) {
-    case DB_KEY_DOM_PART:
-        sql_tmpl = "SELECT 0, 0, 0, 0, -3 "
-                   "FROM domains WHERE '%s' LIKE CONCAT('%', domain)";
-        add_esc = escape(dbh->db, key->data.s);
+    /*
+     * The lookup must see any batched writes. These are flushed first,
+     * as the flush binds its own parameters.
+     */
+    if (flush_batch(handle) != GREYDB_OK)
+        return GREYDB_ERR;
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
+    if (key->type == DB_KEY_DOM_PART) {
+        which = MY_GET_DOM_PART;
+        dbh->params->n = 0;
+        param_str(dbh->params, key->data.s);
+    } else if (key_params(dbh, key, &which, MY_GET_MAIL) != GREYDB_OK) {
+        return GREYDB_ERR;
+    }
 
-    case DB_KEY_DOM:
-        sql_tmpl = "SELECT 0, 0, 0, 0, -3 "
-                   "FROM domains WHERE `domain`='%s' "
-                   "LIMIT 1";
-        add_esc = escape(dbh->db, key->data.s);
+    if ((stmt = exec_stmt(dbh, which)) == NULL)
+        return GREYDB_ERR;
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
+    memset(result, 0, sizeof(result));
+    for (i = 0; i < 5; i++) {
+        result[i].buffer_type = MYSQL_TYPE_LONGLONG;
+        result[i].buffer = &cols[i];
+    }
 
-    case DB_KEY_MAIL:
-        sql_tmpl = "SELECT 0, 0, 0, 0, -2 "
-                   "FROM spamtraps WHERE `address`='%s' "
-                   "LIMIT 1";
-        add_esc = escape(dbh->db, key->data.s);
+    if (mysql_stmt_bind_result(stmt, result) != 0) {
+        i_warning("get mysql error: %s", mysql_stmt_error(stmt));
+        res = GREYDB_ERR;
+    } else if (mysql_stmt_fetch(stmt) == 0) {
+        res = GREYDB_FOUND;
+        memset(val, 0, sizeof(*val));
+        val->type = DB_VAL_GREY;
+        val->data.gd.first = cols[0];
+        val->data.gd.pass = cols[1];
+        val->data.gd.expire = cols[2];
+        val->data.gd.bcount = cols[3];
+        val->data.gd.pcount = cols[4];
+    }
+    mysql_stmt_free_result(stmt);
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
+    return res;
+}
 
-    case DB_KEY_IP:
-        sql_tmpl = "SELECT `first`, `pass`, `expire`, `bcount`, `pcount` "
-                   "FROM entries "
-                   "WHERE `ip`='%s' AND `helo`='' AND `from`='' AND `to`='' "
-                   "LIMIT 1";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
+extern int
+Mod_db_del(DB_handle_T handle, struct DB_key* key)
+{
+    struct mysql_handle* dbh = handle->dbh;
+    enum my_stmt which;
 
-    case DB_KEY_TUPLE:
-        sql_tmpl = "SELECT `first`, `pass`, `expire`, `bcount`, `pcount` "
-                   "FROM entries "
-                   "WHERE `ip`='%s' AND `helo`='%s' AND `from`='%s' AND `to`='%s' "
-                   "LIMIT 1";
-        gt = &key->data.gt;
-        ip_esc = escape(dbh->db, gt->ip);
-        helo_esc = escape(dbh->db, gt->helo);
-        from_esc = escape(dbh->db, gt->from);
-        to_esc = escape(dbh->db, gt->to);
-
-        if (ip_esc && helo_esc && from_esc && to_esc
-            && asprintf(&sql, sql_tmpl, ip_esc, helo_esc, from_esc,
-                   to_esc)
-                == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(ip_esc);
-        free(helo_esc);
-        free(from_esc);
-        free(to_esc);
-        break;
+    /* Flush the batched writes before binding the key. */
+    if (flush_batch(handle) != GREYDB_OK)
+        return GREYDB_ERR;
 
-    default:
+    if (key_params(dbh, key, &which, MY_DEL_MAIL) != GREYDB_OK)
+        return GREYDB_ERR;
+
+    if (exec_stmt(dbh, which) == NULL) {
+        DB_rollback_txn(handle);
         return GREYDB_ERR;
     }
 
-    MYSQL_RES* result = NULL;
-    MYSQL_ROW row;
-    MYSQL_FIELD* field;
-    unsigned int expected_fields = 5;
+    return GREYDB_OK;
+}
 
-    if (mysql_real_query(dbh->db, sql, strlen(sql)) != 0) {
-        i_warning("get mysql error: %s", mysql_error(dbh->db));
-        goto err;
+extern int
+Mod_db_get_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int* found, int n)
+{
+    struct mysql_handle* dbh = handle->dbh;
+    int i, idx[BATCH_ROWS], nidx = 0;
+
+    /* The lookups must see any batched writes. */
+    if (flush_batch(handle) != GREYDB_OK)
+        return GREYDB_ERR;
+
+    /*
+     * The entries are looked up BATCH_ROWS at a time, whereas the
+     * spamtraps & domains are looked up individually.
+     */
+    for (i = 0; i < n; i++) {
+        switch (keys[i].type) {
+        case DB_KEY_IP:
+        case DB_KEY_TUPLE:
+            idx[nidx++] = i;
+            if (nidx == BATCH_ROWS) {
+                if (get_batch(dbh, keys, vals, found, idx, nidx)
+                    != GREYDB_OK) {
+                    return GREYDB_ERR;
+                }
+                nidx = 0;
+            }
+            break;
+
+        default:
+            found[i] = Mod_db_get(handle, &keys[i], &vals[i]);
+            if (found[i] != GREYDB_FOUND && found[i] != GREYDB_NOT_FOUND)
+                return GREYDB_ERR;
+            break;
+        }
     }
 
-    if ((result = mysql_store_result(dbh->db)) != NULL
-        && mysql_num_fields(result) == expected_fields
-        && mysql_num_rows(result) == 1) {
-        res = GREYDB_FOUND;
-        row = mysql_fetch_row(result);
-        populate_val(row, val, 0);
+    if (nidx == 1) {
+        found[idx[0]] = Mod_db_get(handle, &keys[idx[0]], &vals[idx[0]]);
+        if (found[idx[0]] != GREYDB_FOUND
+            && found[idx[0]] != GREYDB_NOT_FOUND) {
+            return GREYDB_ERR;
+        }
+    } else if (nidx > 1
+        && get_batch(dbh, keys, vals, found, idx, nidx) != GREYDB_OK) {
+        return GREYDB_ERR;
     }
 
-err:
-    if (sql != NULL)
-        free(sql);
-    if (result != NULL)
-        mysql_free_result(result);
-    return res;
+    return GREYDB_OK;
 }
 
 extern int
-Mod_db_del(DB_handle_T handle, struct DB_key* key)
+Mod_db_put_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
 {
     struct mysql_handle* dbh = handle->dbh;
-    char *sql = NULL, *sql_tmpl = NULL;
-    struct Grey_tuple* gt;
-    unsigned long len;
-    char* add_esc = NULL;
-    char* ip_esc = NULL;
-    char* helo_esc = NULL;
-    char* from_esc = NULL;
-    char* to_esc = NULL;
-
-    switch (key->type) {
-    case DB_KEY_MAIL:
-        sql_tmpl = "DELETE FROM spamtraps WHERE `address`='%s'";
-        add_esc = escape(dbh->db, key->data.s);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        switch (keys[i].type) {
+        case DB_KEY_IP:
+        case DB_KEY_TUPLE:
+            batch_entry(dbh, &keys[i], &vals[i]);
+            if (dbh->nbatched == BATCH_ROWS
+                && flush_batch(handle) != GREYDB_OK) {
+                return GREYDB_ERR;
+            }
+            break;
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
+        default:
+            if (Mod_db_put(handle, &keys[i], &vals[i]) != GREYDB_OK)
+                return GREYDB_ERR;
+            break;
         }
-        free(add_esc);
-        break;
+    }
 
-    case DB_KEY_DOM:
-        sql_tmpl = "DELETE FROM domains WHERE `domain`='%s'";
-        add_esc = escape(dbh->db, key->data.s);
+    /* Unless batching a transaction's writes, send the rest now. */
+    if ((!dbh->batch || !dbh->txn) && flush_batch(handle) != GREYDB_OK)
+        return GREYDB_ERR;
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
+    return GREYDB_OK;
+}
 
-    case DB_KEY_IP:
-        sql_tmpl = "DELETE FROM entries WHERE `ip`='%s' "
-                   "AND `helo`='' AND `from`='' AND `to`=''";
-        add_esc = escape(dbh->db, key->data.s);
+extern int
+Mod_db_del_many(DB_handle_T handle, struct DB_key* keys, int n)
+{
+    struct mysql_handle* dbh = handle->dbh;
+    int i, idx[BATCH_ROWS], nidx = 0;
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
+    if (flush_batch(handle) != GREYDB_OK)
+        return GREYDB_ERR;
 
-    case DB_KEY_TUPLE:
-        sql_tmpl = "DELETE FROM entries WHERE `ip`='%s' "
-                   "AND `helo`='%s' AND `from`='%s' AND `to`='%s' ";
-        gt = &key->data.gt;
-        ip_esc = escape(dbh->db, gt->ip);
-        helo_esc = escape(dbh->db, gt->helo);
-        from_esc = escape(dbh->db, gt->from);
-        to_esc = escape(dbh->db, gt->to);
-
-        if (ip_esc && helo_esc && from_esc && to_esc
-            && asprintf(&sql, sql_tmpl, ip_esc, helo_esc, from_esc,
-                   to_esc)
-                == -1) {
-            i_warning("mysql asprintf error");
-            goto err;
-        }
-        free(ip_esc);
-        free(helo_esc);
-        free(from_esc);
-        free(to_esc);
-        break;
+    for (i = 0; i < n; i++) {
+        switch (keys[i].type) {
+        case DB_KEY_IP:
+        case DB_KEY_TUPLE:
+            idx[nidx++] = i;
+            if (nidx == BATCH_ROWS) {
+                if (del_batch(dbh, keys, idx, nidx) != GREYDB_OK)
+                    goto err;
+                nidx = 0;
+            }
+            break;
 
-    default:
-        return GREYDB_ERR;
+        default:
+            if (Mod_db_del(handle, &keys[i]) != GREYDB_OK)
+                return GREYDB_ERR;
+            break;
+        }
     }
 
-    if (mysql_real_query(dbh->db, sql, strlen(sql)) != 0) {
-        i_warning("del mysql error: %s", mysql_error(dbh->db));
-        free(sql);
+    if (nidx == 1)
+        return Mod_db_del(handle, &keys[idx[0]]);
+    else if (nidx > 1 && del_batch(dbh, keys, idx, nidx) != GREYDB_OK)
         goto err;
-    }
-    free(sql);
+
     return GREYDB_OK;
 
 err:
@@ -526,6 +623,10 @@ Mod_db_get_itr(DB_itr_T itr, int types)
     dbi->curr = NULL;
     itr->dbi = dbi;
 
+    /* A failed flush has already rolled back the transaction. */
+    if (flush_batch(itr->handle) != GREYDB_OK)
+        exit(1);
+
     sql_tmpl = "SELECT `ip`, `helo`, `from`, `to`, "
                "`first`, `pass`, `expire`, `bcount`, `pcount` FROM entries "
                "WHERE %d "
@@ -617,102 +718,61 @@ Mod_scan_db(DB_handle_T handle, time_t* now, List_T whitelist,
     List_T whitelist_ipv6, List_T traplist, time_t* white_exp)
 {
     struct mysql_handle* dbh = handle->dbh;
-    char *sql, *sql_tmpl;
-    int ret = GREYDB_OK;
-
-    /*
-     * Delete expired entries and whitelist appropriate grey entries,
-     * by un-setting the tuple fields (to, from, helo), but only if there
-     * is not already a conflicting entry with the same IP address
-     * (ie an existing trap entry).
-     */
-    sql_tmpl = "DELETE FROM entries WHERE expire <= UNIX_TIMESTAMP() "
-               "AND `greyd_host`='%s'";
+    MYSQL_RES* result = NULL;
+    MYSQL_ROW row;
+    char* sql;
 
-    if (asprintf(&sql, sql_tmpl, dbh->greyd_host) == -1) {
-        i_warning("mysql asprintf error");
-        goto err;
-    }
+    if (flush_batch(handle) != GREYDB_OK)
+        return GREYDB_ERR;
 
-    if (mysql_real_query(dbh->db, sql, strlen(sql)) != 0) {
-        i_warning("delete mysql expired entries: %s", mysql_error(dbh->db));
-        goto err;
-    }
-    free(sql);
-    sql = NULL;
+    /* Delete expired entries. */
+    dbh->params->n = 0;
+    param_int(dbh->params, *now);
+    param_str(dbh->params, dbh->greyd_host);
+    if (exec_stmt(dbh, MY_SCAN_DELETE) == NULL)
+        return GREYDB_ERR;
 
-    sql_tmpl = "UPDATE IGNORE entries e LEFT JOIN entries g "
-               "ON g.`ip`=e.`ip` AND g.`to`='' AND g.`from`='' "
-               "SET e.`helo` = '', e.`from` = '', e.`to` = '', e.`expire` = %lld "
-               "WHERE e.`from` <> '' AND e.`to` <> '' AND e.`pcount` >= 0 "
-               "AND g.`ip` IS NULL AND e.`pass` <= UNIX_TIMESTAMP() "
-               "AND e.`greyd_host`='%s'";
+    /*
+     * Whitelist appropriate grey entries, by un-setting the tuple fields
+     * (to, from, helo), but only if there is not already a conflicting
+     * entry with the same IP address (ie an existing trap entry).
+     */
+    dbh->params->n = 0;
+    param_int(dbh->params, *now + *white_exp);
+    param_int(dbh->params, *now);
+    param_str(dbh->params, dbh->greyd_host);
+    if (exec_stmt(dbh, MY_SCAN_PROMOTE) == NULL)
+        return GREYDB_ERR;
 
-    if (asprintf(&sql, sql_tmpl, *now + *white_exp, dbh->greyd_host) == -1) {
-        i_warning("mysql asprintf error");
-        goto err;
-    }
+    /*
+     * Add greytrap & whitelist entries, streaming the rows from the
+     * server rather than buffering the whole result.
+     */
+    sql = "SELECT `ip`, `pcount` FROM entries "
+          "WHERE `to` = '' AND `from` = ''";
 
-    if (mysql_real_query(dbh->db, sql, strlen(sql)) != 0) {
-        i_warning("update mysql entries: %s", mysql_error(dbh->db));
-        goto err;
-    }
-    free(sql);
-    sql = NULL;
-
-    /* Add greytrap & whitelist entries. */
-    sql = "SELECT `ip`, NULL, NULL FROM entries             \
-        WHERE `to`='' AND `from`='' AND `ip` NOT LIKE '%:%' \
-            AND `pcount` >= 0                               \
-        UNION                                               \
-        SELECT NULL, `ip`, NULL FROM entries                \
-        WHERE `to`='' AND `from`='' AND `ip` LIKE '%:%'     \
-            AND `pcount` >= 0                               \
-        UNION                                               \
-        SELECT NULL, NULL, `ip` FROM entries                \
-        WHERE `to`='' AND `from`='' AND `pcount` < 0";
-
-    if (mysql_real_query(dbh->db, sql, strlen(sql)) != 0) {
+    if (mysql_real_query(dbh->db, sql, strlen(sql)) != 0
+        || (result = mysql_use_result(dbh->db)) == NULL) {
         i_warning("mysql fetch grey/white entries: %s", mysql_error(dbh->db));
-        goto err;
+        return GREYDB_ERR;
     }
 
-    MYSQL_RES* result = mysql_store_result(dbh->db);
-    MYSQL_ROW row;
-
-    if (result && mysql_num_rows(result) > 0) {
-        while ((row = mysql_fetch_row(result))) {
-            if (row[0] != NULL) {
-                List_insert_after(
-                    whitelist, strdup((const char*)row[0]));
-            } else if (row[1] != NULL) {
-                List_insert_after(
-                    whitelist_ipv6, strdup((const char*)row[1]));
-            } else if (row[2] != NULL) {
-                List_insert_after(
-                    traplist, strdup((const char*)row[2]));
-            }
-        }
+    while ((row = mysql_fetch_row(result))) {
+        if (atoi(row[1]) < 0)
+            List_insert_after(traplist, strdup(row[0]));
+        else if (strchr(row[0], ':') != NULL)
+            List_insert_after(whitelist_ipv6, strdup(row[0]));
+        else
+            List_insert_after(whitelist, strdup(row[0]));
     }
+    mysql_free_result(result);
 
-err:
-    if (result)
-        mysql_free_result(result);
-    return ret;
-}
-
-static char* escape(MYSQL* db, const char* str)
-{
-    char* esc;
-    size_t len = strlen(str);
-
-    if ((esc = calloc(2 * len + 1, sizeof(char))) == NULL) {
-        i_warning("calloc: %s", strerror(errno));
-        return NULL;
+    if (mysql_errno(dbh->db) != 0) {
+        i_warning("mysql fetch grey/white entries: %s", mysql_error(dbh->db));
+        return GREYDB_ERR;
     }
-    mysql_real_escape_string(db, esc, str, len);
 
-    return esc;
+    return GREYDB_OK;
 }
 
 static void
@@ -780,3 +840,384 @@ populate_val(MYSQL_ROW row, struct DB_val* val, int from)
     gd->bcount = atoi(row[from + 3]);
     gd->pcount = atoi(row[from + 4]);
 }
+
+/*
+ * Fetch the cached statement, preparing it on first use.
+ */
+static MYSQL_STMT*
+get_stmt(struct mysql_handle* dbh, enum my_stmt which)
+{
+    MYSQL_STMT* stmt;
+    char* sql = NULL;
+    const char* tmpl;
+
+    if ((stmt = dbh->stmts[which]) != NULL)
+        return stmt;
+
+    if ((tmpl = my_sql[which]) == NULL) {
+        if ((sql = batch_sql(which)) == NULL)
+            return NULL;
+        tmpl = sql;
+    }
+
+    if ((stmt = mysql_stmt_init(dbh->db)) == NULL
+        || mysql_stmt_prepare(stmt, tmpl, strlen(tmpl)) != 0) {
+        i_warning("mysql prepare: %s",
+            stmt ? mysql_stmt_error(stmt) : mysql_error(dbh->db));
+        if (stmt)
+            mysql_stmt_close(stmt);
+        stmt = NULL;
+    }
+    free(sql);
+
+    return (dbh->stmts[which] = stmt);
+}
+
+/*
+ * Execute the statement with the currently bound parameters.
+ */
+static MYSQL_STMT*
+exec_stmt(struct mysql_handle* dbh, enum my_stmt which)
+{
+    MYSQL_STMT* stmt;
+
+    if ((stmt = get_stmt(dbh, which)) == NULL)
+        return NULL;
+
+    if (mysql_stmt_bind_param(stmt, dbh->params->bind) != 0
+        || mysql_stmt_execute(stmt) != 0) {
+        i_warning("mysql error: %s", mysql_stmt_error(stmt));
+        return NULL;
+    }
+
+    return stmt;
+}
+
+static void
+param_str(struct my_params* params, const char* str)
+{
+    MYSQL_BIND* bind = &params->bind[params->n];
+
+    memset(bind, 0, sizeof(*bind));
+    params->lengths[params->n] = strlen(str);
+    bind->buffer_type = MYSQL_TYPE_STRING;
+    bind->buffer = (void*)str;
+    bind->buffer_length = params->lengths[params->n];
+    bind->length = &params->lengths[params->n];
+    params->n++;
+}
+
+static void
+param_int(struct my_params* params, long long val)
+{
+    MYSQL_BIND* bind = &params->bind[params->n];
+
+    memset(bind, 0, sizeof(*bind));
+    params->ints[params->n] = val;
+    bind->buffer_type = MYSQL_TYPE_LONGLONG;
+    bind->buffer = &params->ints[params->n];
+    params->n++;
+}
+
+/*
+ * Append the parameters for one row of an entry insert.
+ */
+static void
+param_entry(struct mysql_handle* dbh, const char* ip, const char* helo,
+    const char* from, const char* to, struct Grey_data* gd)
+{
+    struct my_params* params = dbh->params;
+
+    param_str(params, ip);
+    param_str(params, helo);
+    param_str(params, from);
+    param_str(params, to);
+    param_int(params, gd->first);
+    param_int(params, gd->pass);
+    param_int(params, gd->expire);
+    param_int(params, gd->bcount);
+    param_int(params, gd->pcount);
+    param_str(params, dbh->greyd_host);
+}
+
+/*
+ * Bind the key parameters, and select the key type's statement from the
+ * group starting at the supplied mail statement.
+ */
+static int
+key_params(struct mysql_handle* dbh, struct DB_key* key,
+    enum my_stmt* which, enum my_stmt group)
+{
+    struct my_params* params = dbh->params;
+    struct Grey_tuple* gt;
+    int offset;
+
+    params->n = 0;
+
+    switch (key->type) {
+    case DB_KEY_MAIL:
+    case DB_KEY_DOM:
+    case DB_KEY_IP:
+        offset = (key->type == DB_KEY_MAIL ? 0
+                                            : (key->type == DB_KEY_DOM ? 1 : 2));
+        param_str(params, key->data.s);
+        break;
+
+    case DB_KEY_TUPLE:
+        offset = 3;
+        gt = &key->data.gt;
+        param_str(params, gt->ip);
+        param_str(params, gt->helo);
+        param_str(params, gt->from);
+        param_str(params, gt->to);
+        break;
+
+    default:
+        return GREYDB_ERR;
+    }
+
+    *which = group + offset;
+
+    return GREYDB_OK;
+}
+
+/*
+ * Append the parameters for an entry key, where an ip address has an
+ * empty helo, from & to.
+ */
+static void
+param_key(struct my_params* params, struct DB_key* key)
+{
+    struct Grey_tuple* gt;
+
+    if (key->type == DB_KEY_IP) {
+        param_str(params, key->data.s);
+        param_str(params, "");
+        param_str(params, "");
+        param_str(params, "");
+    } else {
+        gt = &key->data.gt;
+        param_str(params, gt->ip);
+        param_str(params, gt->helo);
+        param_str(params, gt->from);
+        param_str(params, gt->to);
+    }
+}
+
+/*
+ * Build a batched entry statement over BATCH_ROWS keys, or fewer for the
+ * smaller entry writes. Each row of the batched lookup is tagged with the
+ * position of its key.
+ */
+static char*
+batch_sql(enum my_stmt which)
+{
+    char *sql, *p;
+    size_t len;
+    int i, rows = BATCH_ROWS;
+
+    switch (which) {
+    case MY_PUT_BATCH:
+    case MY_PUT_BATCH_MID:
+    case MY_PUT_BATCH_SMALL:
+        if (which == MY_PUT_BATCH_MID)
+            rows = BATCH_ROWS_MID;
+        else if (which == MY_PUT_BATCH_SMALL)
+            rows = BATCH_ROWS_SMALL;
+        len = sizeof(ENTRY_INSERT ENTRY_UPDATE)
+            + rows * sizeof(", " ENTRY_ROW);
+        break;
+
+    case MY_GET_BATCH:
+        len = BATCH_ROWS * (sizeof(" UNION ALL " ENTRY_SELECT) + 8);
+        break;
+
+    case MY_DEL_BATCH:
+        len = sizeof(ENTRY_DELETE ")") + BATCH_ROWS * sizeof(", " KEY_ROW);
+        break;
+
+    default:
+        return NULL;
+    }
+
+    if ((sql = malloc(len)) == NULL) {
+        i_warning("malloc: %s", strerror(errno));
+        return NULL;
+    }
+
+    switch (which) {
+    case MY_PUT_BATCH:
+    case MY_PUT_BATCH_MID:
+    case MY_PUT_BATCH_SMALL:
+        p = stpcpy(sql, ENTRY_INSERT);
+        for (i = 0; i < rows; i++)
+            p = stpcpy(p, i == 0 ? ENTRY_ROW : ", " ENTRY_ROW);
+        stpcpy(p, ENTRY_UPDATE);
+        break;
+
+    case MY_GET_BATCH:
+        for (p = sql, i = 0; i < BATCH_ROWS; i++)
+            p += sprintf(p, "%s" ENTRY_SELECT, (i == 0 ? "" : " UNION ALL "),
+                i);
+        break;
+
+    default:
+        p = stpcpy(sql, ENTRY_DELETE);
+        for (i = 0; i < BATCH_ROWS; i++)
+            p = stpcpy(p, i == 0 ? KEY_ROW : ", " KEY_ROW);
+        stpcpy(p, ")");
+        break;
+    }
+
+    return sql;
+}
+
+/*
+ * Copy an entry write into the batch.
+ */
+static void
+batch_entry(struct mysql_handle* dbh, struct DB_key* key,
+    struct DB_val* val)
+{
+    struct my_entry* entry = &dbh->batched[dbh->nbatched++];
+    struct Grey_tuple* gt;
+
+    if (key->type == DB_KEY_IP) {
+        sstrncpy(entry->ip, key->data.s, sizeof(entry->ip));
+        entry->helo[0] = entry->from[0] = entry->to[0] = '\0';
+    } else {
+        gt = &key->data.gt;
+        sstrncpy(entry->ip, gt->ip, sizeof(entry->ip));
+        sstrncpy(entry->helo, gt->helo, sizeof(entry->helo));
+        sstrncpy(entry->from, gt->from, sizeof(entry->from));
+        sstrncpy(entry->to, gt->to, sizeof(entry->to));
+    }
+    entry->gd = val->data.gd;
+}
+
+/*
+ * Send the batched entry writes, using the largest batched insert that
+ * the remaining writes fill, and single inserts for the last few. On
+ * failure, any open transaction is rolled back.
+ */
+static int
+flush_batch(DB_handle_T handle)
+{
+    struct mysql_handle* dbh = handle->dbh;
+    struct my_entry* entry;
+    enum my_stmt which;
+    int i, j, rows, left;
+
+    for (i = 0; i < dbh->nbatched; i += rows) {
+        left = dbh->nbatched - i;
+        if (left >= BATCH_ROWS) {
+            rows = BATCH_ROWS;
+            which = MY_PUT_BATCH;
+        } else if (left >= BATCH_ROWS_MID) {
+            rows = BATCH_ROWS_MID;
+            which = MY_PUT_BATCH_MID;
+        } else if (left >= BATCH_ROWS_SMALL) {
+            rows = BATCH_ROWS_SMALL;
+            which = MY_PUT_BATCH_SMALL;
+        } else {
+            rows = 1;
+            which = MY_PUT_ENTRY;
+        }
+
+        dbh->params->n = 0;
+        for (j = i; j < i + rows; j++) {
+            entry = &dbh->batched[j];
+            param_entry(dbh, entry->ip, entry->helo, entry->from, entry->to,
+                &entry->gd);
+        }
+
+        if (exec_stmt(dbh, which) == NULL) {
+            dbh->nbatched = 0;
+            if (dbh->txn)
+                DB_rollback_txn(handle);
+            return GREYDB_ERR;
+        }
+    }
+    dbh->nbatched = 0;
+
+    return GREYDB_OK;
+}
+
+/*
+ * Look up the entries for the keys at the supplied positions in a single
+ * statement, repeating the last key to fill the batch. The rows for the
+ * repeated keys are tagged beyond the positions and are skipped.
+ */
+static int
+get_batch(struct mysql_handle* dbh, struct DB_key* keys,
+    struct DB_val* vals, int* found, int* idx, int n)
+{
+    MYSQL_STMT* stmt;
+    MYSQL_BIND result[6];
+    long long cols[6];
+    struct Grey_data* gd;
+    int i, ret, res = GREYDB_OK;
+
+    dbh->params->n = 0;
+    for (i = 0; i < BATCH_ROWS; i++) {
+        param_key(dbh->params, &keys[idx[i < n ? i : n - 1]]);
+        if (i < n)
+            found[idx[i]] = GREYDB_NOT_FOUND;
+    }
+
+    if ((stmt = exec_stmt(dbh, MY_GET_BATCH)) == NULL)
+        return GREYDB_ERR;
+
+    memset(result, 0, sizeof(result));
+    for (i = 0; i < 6; i++) {
+        result[i].buffer_type = MYSQL_TYPE_LONGLONG;
+        result[i].buffer = &cols[i];
+    }
+
+    if (mysql_stmt_bind_result(stmt, result) != 0) {
+        i_warning("get mysql error: %s", mysql_stmt_error(stmt));
+        res = GREYDB_ERR;
+        goto cleanup;
+    }
+
+    while ((ret = mysql_stmt_fetch(stmt)) == 0) {
+        if (cols[0] < 0 || cols[0] >= n)
+            continue;
+
+        i = idx[cols[0]];
+        found[i] = GREYDB_FOUND;
+        memset(&vals[i], 0, sizeof(vals[i]));
+        vals[i].type = DB_VAL_GREY;
+        gd = &vals[i].data.gd;
+        gd->first = cols[1];
+        gd->pass = cols[2];
+        gd->expire = cols[3];
+        gd->bcount = cols[4];
+        gd->pcount = cols[5];
+    }
+
+    if (ret != MYSQL_NO_DATA) {
+        i_warning("get mysql error: %s", mysql_stmt_error(stmt));
+        res = GREYDB_ERR;
+    }
+
+cleanup:
+    mysql_stmt_free_result(stmt);
+    return res;
+}
+
+/*
+ * Delete the entries for the keys at the supplied positions in a single
+ * statement, repeating the last key to fill the batch.
+ */
+static int
+del_batch(struct mysql_handle* dbh, struct DB_key* keys, int* idx, int n)
+{
+    int i;
+
+    dbh->params->n = 0;
+    for (i = 0; i < BATCH_ROWS; i++)
+        param_key(dbh->params, &keys[idx[i < n ? i : n - 1]]);
+
+    return (exec_stmt(dbh, MY_DEL_BATCH) == NULL ? GREYDB_ERR : GREYDB_OK);
+}
@@ -0,0 +1,528 @@
+/*
+ * Copyright (C) 2014, 2015  Mikey Austin <mikey@greyd.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file   nf_common.c
+ * @brief  Functionality shared by the GNU/Linux firewall drivers.
+ * @author Mikey Austin
+ * @date   2014
+ */
+
+#include <linux/types.h>
+#include <sys/capability.h>
+#include <sys/prctl.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <asm/types.h>
+#include <libmnl/libmnl.h>
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+#include <libnetfilter_log/libipulog.h>
+#include <libnetfilter_log/libnetfilter_log.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+#include "../src/config_section.h"
+#include "../src/constants.h"
+#include "../src/failures.h"
+#include "../src/firewall.h"
+#include "../src/ip.h"
+#include "../src/list.h"
+
+#include "nf_common.h"
+
+#define NFLOG_BUF 65536 /* Kernel batch size, and receive buffer size. */
+#define NFLOG_TIMEOUT 100 /* In hundredths of a second. */
+#define NFLOG_QTHRESH 64 /* Packets batched per message by the kernel. */
+#define NFLOG_RCVBUF (4 * 1024 * 1024)
+#define NFLOG_COPY_RANGE 64 /* Only the IP header is needed. */
+#define NFLOG_DIR_IN 1
+#define NFLOG_DIR_OUT 0
+#define NFLOG_ADDRS_INIT 256
+#define NFLOG_ADDRS_MAX 65536 /* Addresses returned per capture. */
+#define NFLOG_REPORT_INTERVAL 60 /* In seconds. */
+#define LOG_CAP_TIMEOUT 10000 /* In milliseconds. */
+
+struct cb_data_arg {
+    struct sockaddr* proxy;
+    struct sockaddr* orig_dst;
+};
+
+/**
+ * This is the libnetfilter_conntrack data callback, called for the
+ * conntrack object matching the requested reply tuple.
+ */
+static int conntrack_callback(const struct nlmsghdr*, void*);
+
+/**
+ * nflog management functions.
+ */
+static void setup_nflog_handle(struct nflog_handle**, short, int);
+static void setup_nflog_group(struct nflog_handle*, struct nflog_g_handle**, int,
+    int);
+static void report_overruns(struct NF_log_handle*, int);
+static int log_callback(struct nflog_g_handle*, struct nfgenmsg*,
+    struct nflog_data*, void*);
+
+int NF_keep_caps(FW_handle_T handle)
+{
+    cap_value_t cap_values[] = { CAP_NET_ADMIN };
+    cap_t caps;
+
+    if (Config_get_int(handle->config, "drop_privs", NULL, 1)) {
+        /*
+         * Try to keep capabilities so that the netlink sockets can
+         * be used after privileges are dropped.
+         */
+        caps = cap_get_proc();
+        cap_set_flag(caps, CAP_PERMITTED, 1, cap_values, CAP_SET);
+        cap_set_proc(caps);
+        cap_free(caps);
+
+        if (prctl(PR_SET_KEEPCAPS, 1, 0, 0, 0) == -1) {
+            i_warning("prctl");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void NF_clear_caps(FW_handle_T handle)
+{
+    cap_t caps;
+
+    if (Config_get_int(handle->config, "drop_privs", NULL, 1)) {
+        /* Clear all capabilities upon closing the firewall handle. */
+        caps = cap_get_proc();
+        cap_clear(caps);
+        cap_set_proc(caps);
+        if (prctl(PR_SET_KEEPCAPS, 0, 0, 0, 0) == -1)
+            i_warning("prctl");
+        cap_free(caps);
+    }
+}
+
+void NF_set_effective_caps(FW_handle_T handle)
+{
+    cap_value_t cap_values[] = { CAP_NET_ADMIN };
+    cap_t caps;
+
+    if (!Config_get_int(handle->config, "drop_privs", NULL, 1))
+        return;
+
+    /* Set the effective capabilities. */
+    caps = cap_get_proc();
+    cap_clear(caps);
+    if (cap_set_flag(caps, CAP_PERMITTED, 1, cap_values, CAP_SET) == -1)
+        i_warning("cap_set_flag");
+    if (cap_set_flag(caps, CAP_EFFECTIVE, 1, cap_values, CAP_SET) == -1)
+        i_warning("cap_set_flag");
+    cap_set_proc(caps);
+    cap_free(caps);
+}
+
+int NF_lookup_orig_dst(FW_handle_T handle, struct mnl_socket* nl,
+    struct sockaddr* src, struct sockaddr* proxy, struct sockaddr* orig_dst)
+{
+    struct cb_data_arg data;
+    struct nlmsghdr* nlh;
+    struct nfgenmsg* nfh;
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    unsigned int seq, portid;
+    struct nf_conntrack* ct;
+    sa_family_t af;
+    int ret;
+
+    NF_set_effective_caps(handle);
+
+    if (nl == NULL)
+        return 0;
+
+    data.proxy = proxy;
+    data.orig_dst = orig_dst;
+
+    /* Default to the proxy address. */
+    memcpy(data.orig_dst, proxy, IP_SOCKADDR_LEN(proxy));
+
+    af = src->sa_family;
+    portid = mnl_socket_get_portid(nl);
+
+    /* Discard any replies left over from a previous request. */
+    while (recv(mnl_socket_get_fd(nl), buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+
+    /*
+     * Rather than dumping the whole connection table, get the single
+     * connection by its reply tuple. The reply to a redirected
+     * connection is from the proxy address to the source address.
+     */
+    memset(buf, 0, sizeof(buf));
+    nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    nlh->nlmsg_seq = seq = time(NULL);
+
+    nfh = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfh->nfgen_family = af;
+    nfh->version = NFNETLINK_V0;
+    nfh->res_id = 0;
+
+    ct = nfct_new();
+    if (ct == NULL) {
+        i_warning("nfct_new");
+        return 0;
+    }
+
+    nfct_set_attr_u8(ct, ATTR_REPL_L3PROTO, af);
+    nfct_set_attr_u8(ct, ATTR_REPL_L4PROTO, IPPROTO_TCP);
+    if (af == AF_INET) {
+        nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC,
+            ((struct sockaddr_in*)proxy)->sin_addr.s_addr);
+        nfct_set_attr_u32(ct, ATTR_REPL_IPV4_DST,
+            ((struct sockaddr_in*)src)->sin_addr.s_addr);
+        nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC,
+            ((struct sockaddr_in*)proxy)->sin_port);
+        nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST,
+            ((struct sockaddr_in*)src)->sin_port);
+    } else if (af == AF_INET6) {
+        nfct_set_attr(ct, ATTR_REPL_IPV6_SRC,
+            &((struct sockaddr_in6*)proxy)->sin6_addr);
+        nfct_set_attr(ct, ATTR_REPL_IPV6_DST,
+            &((struct sockaddr_in6*)src)->sin6_addr);
+        nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC,
+            ((struct sockaddr_in6*)proxy)->sin6_port);
+        nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST,
+            ((struct sockaddr_in6*)src)->sin6_port);
+    }
+
+    nfct_nlmsg_build(nlh, ct);
+    nfct_destroy(ct);
+
+    ret = mnl_socket_sendto(nl, nlh, nlh->nlmsg_len);
+    if (ret == -1) {
+        i_warning("mnl_socket_sendto");
+        return 0;
+    }
+
+    /* The connection (if found) is followed by the acknowledgement. */
+    ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
+    while (ret > 0) {
+        ret = mnl_cb_run(buf, ret, seq, portid, conntrack_callback, &data);
+        if (ret <= MNL_CB_STOP)
+            break;
+        ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
+    }
+
+    /* An unknown connection is not an error, the proxy address is used. */
+    if (ret == -1 && errno != ENOENT)
+        i_warning("conntrack lookup: %s", strerror(errno));
+
+    return 0;
+}
+
+struct NF_log_handle*
+NF_start_log_capture(FW_handle_T handle)
+{
+    struct NF_log_handle* lh;
+    int group_in, group_out, qthresh, rcvbuf;
+
+    group_in = Config_get_int(handle->config, "inbound_group", "firewall", NFLOG_GROUP_IN);
+    group_out = Config_get_int(handle->config, "outbound_group", "firewall", NFLOG_GROUP_OUT);
+    qthresh = Config_get_int(handle->config, "log_qthreshold", "firewall", NFLOG_QTHRESH);
+    rcvbuf = Config_get_int(handle->config, "log_rcvbuf", "firewall", NFLOG_RCVBUF);
+
+    if (Config_get_int(handle->config, "track_outbound", "firewall", TRACK_OUTBOUND)
+        && (group_in == group_out)) {
+        i_critical("inbound and outbound NFLOG groups must not be the same");
+    }
+
+    if ((lh = malloc(sizeof(*lh))) == NULL)
+        i_critical("malloc");
+
+    /*
+     * Binding a group to this AF_INET handle also picks up AF_INET6 packets destined
+     * to the same group, so we don't need a separate handle for IPv6.
+     */
+    memset(lh, 0, sizeof(*lh));
+    setup_nflog_handle(&lh->handle, AF_INET, rcvbuf);
+    setup_nflog_group(lh->handle, &lh->group_in, group_in, qthresh);
+    nflog_callback_register(lh->group_in, log_callback, lh);
+
+    if (Config_get_int(handle->config, "track_outbound", "firewall", TRACK_OUTBOUND)) {
+        setup_nflog_group(lh->handle, &lh->group_out, group_out, qthresh);
+        nflog_callback_register(lh->group_out, log_callback, lh);
+    } else {
+        lh->group_out = NULL;
+    }
+
+    /* The strings are owned by the handle, not the list. */
+    lh->entries = List_create(NULL);
+    lh->size = NFLOG_ADDRS_INIT;
+    if ((lh->buf = malloc(NFLOG_BUF)) == NULL
+        || (lh->addrs = calloc(lh->size, sizeof(*lh->addrs))) == NULL
+        || (lh->strs = calloc(lh->size, sizeof(*lh->strs))) == NULL) {
+        i_critical("malloc");
+    }
+    lh->reported = time(NULL);
+
+    return lh;
+}
+
+void NF_end_log_capture(struct NF_log_handle* lh)
+{
+    if (lh) {
+        if (lh->group_in != NULL)
+            nflog_unbind_group(lh->group_in);
+        if (lh->group_out != NULL)
+            nflog_unbind_group(lh->group_out);
+        nflog_close(lh->handle);
+        report_overruns(lh, 1);
+        List_destroy(&lh->entries);
+        free(lh->buf);
+        free(lh->addrs);
+        free(lh->strs);
+        free(lh);
+    }
+}
+
+List_T
+NF_capture_log(FW_handle_T handle, struct NF_log_handle* lh, int timeout)
+{
+    struct pollfd fd;
+    const void* addr;
+    int size, i;
+
+    NF_set_effective_caps(handle);
+
+    memset(&fd, 0, sizeof(fd));
+    fd.fd = nflog_fd(lh->handle);
+    fd.events = POLLIN;
+
+    /* Use poll to effect a timeout. */
+    if (timeout == -1 || timeout > LOG_CAP_TIMEOUT)
+        timeout = LOG_CAP_TIMEOUT;
+
+    if (poll(&fd, 1, timeout) == -1) {
+        if (errno != EINTR)
+            i_critical("poll: %s", strerror(errno));
+        return NULL;
+    }
+
+    List_remove_all(lh->entries);
+    lh->naddrs = 0;
+
+    /*
+     * Drain everything pending, so that the socket does not overrun
+     * whilst the caller is busy with the database.
+     */
+    while ((fd.revents & POLLIN) && lh->naddrs < NFLOG_ADDRS_MAX) {
+        if ((size = recv(fd.fd, lh->buf, NFLOG_BUF, MSG_DONTWAIT)) == -1) {
+            if (errno == ENOBUFS) {
+                /* Messages were dropped, but the socket is still usable. */
+                lh->overruns++;
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+
+            i_critical("recv: %s", strerror(errno));
+        }
+        nflog_handle_packet(lh->handle, lh->buf, size);
+    }
+
+    report_overruns(lh, 0);
+
+    for (i = 0; i < lh->naddrs; i++) {
+        addr = (lh->addrs[i].af == AF_INET
+                ? (const void*)&lh->addrs[i].addr.v4
+                : (const void*)&lh->addrs[i].addr.v6);
+        inet_ntop(lh->addrs[i].af, addr, lh->strs[i], INET6_ADDRSTRLEN);
+        i_debug("packet received: direction = %s, addr = %s",
+            (lh->addrs[i].direction == NFLOG_DIR_IN ? "in" : "out"),
+            lh->strs[i]);
+        List_insert_after(lh->entries, lh->strs[i]);
+    }
+
+    return lh->entries;
+}
+
+static int
+conntrack_callback(const struct nlmsghdr* nlh, void* arg)
+{
+    struct cb_data_arg* data = (struct cb_data_arg*)arg;
+    struct nf_conntrack* ct;
+    const void* addr;
+    sa_family_t af;
+
+    ct = nfct_new();
+    if (ct == NULL)
+        return MNL_CB_OK;
+
+    nfct_nlmsg_parse(nlh, ct);
+
+    af = data->proxy->sa_family;
+    if (af == AF_INET && nfct_attr_is_set(ct, ATTR_IPV4_DST) > 0) {
+        memset(data->orig_dst, 0, sizeof(struct sockaddr_in));
+        data->orig_dst->sa_family = af;
+        ((struct sockaddr_in*)data->orig_dst)->sin_port = ((struct sockaddr_in*)data->proxy)->sin_port;
+        ((struct sockaddr_in*)data->orig_dst)->sin_addr.s_addr = nfct_get_attr_u32(ct, ATTR_IPV4_DST);
+    } else if (af == AF_INET6 && (addr = nfct_get_attr(ct, ATTR_IPV6_DST)) != NULL) {
+        memset(data->orig_dst, 0, sizeof(struct sockaddr_in6));
+        data->orig_dst->sa_family = af;
+        ((struct sockaddr_in6*)data->orig_dst)->sin6_port = ((struct sockaddr_in6*)data->proxy)->sin6_port;
+        memcpy(&((struct sockaddr_in6*)data->orig_dst)->sin6_addr, addr,
+            sizeof(struct in6_addr));
+    }
+
+    nfct_destroy(ct);
+
+    return MNL_CB_OK;
+}
+
+static void
+setup_nflog_handle(struct nflog_handle** handle, short af, int rcvbuf)
+{
+    int fd;
+
+    if ((*handle = nflog_open()) == NULL)
+        i_critical("nflog_open");
+
+    if (nflog_bind_pf(*handle, af) < 0)
+        i_critical("nflog_bind_pf");
+
+    /*
+     * Bursts are absorbed by the socket receive buffer. Forcing the size
+     * past the rmem_max limit requires CAP_NET_ADMIN, which we hold.
+     */
+    fd = nflog_fd(*handle);
+    if (rcvbuf > 0
+        && setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1
+        && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) {
+        i_warning("could not set NFLOG receive buffer size: %s",
+            strerror(errno));
+    }
+}
+
+static void
+setup_nflog_group(struct nflog_handle* handle, struct nflog_g_handle** group,
+    int group_num, int qthresh)
+{
+    if ((*group = nflog_bind_group(handle, group_num)) == NULL)
+        i_critical("nflog_bind_group");
+
+    if (nflog_set_mode(*group, NFULNL_COPY_PACKET, NFLOG_COPY_RANGE) < 0)
+        i_critical("nflog_set_mode");
+
+    if (nflog_set_nlbufsiz(*group, NFLOG_BUF) < 0)
+        i_critical("nflog_set_nlbufsize");
+
+    /* Have the kernel batch packets into fewer messages. */
+    if (qthresh > 1 && nflog_set_qthresh(*group, qthresh) < 0)
+        i_critical("nflog_set_qthresh");
+
+    if (nflog_set_timeout(*group, NFLOG_TIMEOUT) < 0)
+        i_critical("nflog_set_timeout");
+}
+
+/*
+ * Report any receive buffer overruns since the last report, at most once
+ * per interval unless forced.
+ */
+static void
+report_overruns(struct NF_log_handle* lh, int force)
+{
+    time_t now = time(NULL);
+
+    if (lh->overruns == lh->overruns_reported
+        || (!force && now - lh->reported < NFLOG_REPORT_INTERVAL)) {
+        return;
+    }
+
+    i_warning("NFLOG receive buffer overrun %lu times (%lu in total), "
+              "logged packets were lost",
+        lh->overruns - lh->overruns_reported, lh->overruns);
+    lh->overruns_reported = lh->overruns;
+    lh->reported = now;
+}
+
+static int
+log_callback(struct nflog_g_handle* group, struct nfgenmsg* msg,
+    struct nflog_data* data, void* arg)
+{
+    struct NF_log_handle* lh = arg;
+    struct NF_log_addr* entry;
+    char* payload;
+    int payload_len = nflog_get_payload(data, &payload);
+    short direction;
+
+    direction = (group == lh->group_in ? NFLOG_DIR_IN : NFLOG_DIR_OUT);
+
+    if (lh->naddrs == lh->size) {
+        lh->size *= 2;
+        if ((lh->addrs = realloc(lh->addrs, lh->size * sizeof(*lh->addrs))) == NULL
+            || (lh->strs = realloc(lh->strs, lh->size * sizeof(*lh->strs))) == NULL) {
+            i_critical("realloc");
+        }
+    }
+    entry = lh->addrs + lh->naddrs;
+    entry->direction = direction;
+
+    /* Copy the relevant address out of the payload, as is. */
+    switch (msg->nfgen_family) {
+    case AF_INET:
+        if (payload_len <= 0 || payload_len < sizeof(struct iphdr)) {
+            i_warning("invalid IPv4 payload length of %d", payload_len);
+            return 0;
+        }
+        entry->af = AF_INET;
+        memcpy(&entry->addr.v4, (direction == NFLOG_DIR_IN
+                                        ? &((struct iphdr*)payload)->saddr
+                                        : &((struct iphdr*)payload)->daddr),
+            sizeof(struct in_addr));
+        break;
+
+    case AF_INET6:
+        if (payload_len <= 0 || payload_len < sizeof(struct ip6_hdr)) {
+            i_warning("invalid IPv6 payload length of %d", payload_len);
+            return 0;
+        }
+        entry->af = AF_INET6;
+        memcpy(&entry->addr.v6, (direction == NFLOG_DIR_IN
+                                        ? &((struct ip6_hdr*)payload)->ip6_src
+                                        : &((struct ip6_hdr*)payload)->ip6_dst),
+            sizeof(struct in6_addr));
+        break;
+
+    default:
+        return 0;
+    }
+    lh->naddrs++;
+
+    return 0;
+}
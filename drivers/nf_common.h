@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2014, 2015  Mikey Austin <mikey@greyd.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file   nf_common.h
+ * @brief  Functionality shared by the GNU/Linux firewall drivers.
+ * @author Mikey Austin
+ * @date   2014
+ *
+ * Both the ipset based netfilter driver and the nftables driver rely
+ * on conntrack for the DNAT original destination lookups and on NFLOG
+ * groups for capturing firewall packets. The common code lives here.
+ */
+
+#ifndef NF_COMMON_DEFINED
+#define NF_COMMON_DEFINED
+
+#include <sys/socket.h>
+
+#include <libmnl/libmnl.h>
+#include <libnetfilter_log/libnetfilter_log.h>
+
+#include "../src/firewall.h"
+#include "../src/ip.h"
+#include "../src/list.h"
+
+#include <time.h>
+
+#define NFLOG_GROUP_IN 155
+#define NFLOG_GROUP_OUT 255
+
+/**
+ * A captured address, kept in binary form until the capture is returned.
+ */
+struct NF_log_addr {
+    sa_family_t af;
+    short direction;
+    struct IP_addr addr;
+};
+
+/**
+ * State for an in-progress NFLOG capture. The address and string arrays
+ * are reused by each capture, and grow as needed.
+ */
+struct NF_log_handle {
+    struct nflog_handle* handle;
+    struct nflog_g_handle* group_in;
+    struct nflog_g_handle* group_out;
+    List_T entries;
+    char* buf;
+    struct NF_log_addr* addrs;
+    char (*strs)[INET6_ADDRSTRLEN];
+    int naddrs;
+    int size;
+    unsigned long overruns; /**< Receive buffer overruns (ENOBUFS). */
+    unsigned long overruns_reported;
+    time_t reported;
+};
+
+/**
+ * Keep CAP_NET_ADMIN in the permitted set across the dropping of
+ * privileges, if privileges are to be dropped.
+ *
+ * @return 0 on success, -1 on error.
+ */
+extern int NF_keep_caps(FW_handle_T handle);
+
+/**
+ * Clear all capabilities, if privileges were dropped.
+ */
+extern void NF_clear_caps(FW_handle_T handle);
+
+/**
+ * Raise CAP_NET_ADMIN into the effective set, if privileges were dropped.
+ */
+extern void NF_set_effective_caps(FW_handle_T handle);
+
+/**
+ * Lookup the original destination of a DNAT'd connection via conntrack
+ * on the supplied NETLINK_NETFILTER socket. The proxy address is used
+ * if no matching connection is found.
+ */
+extern int NF_lookup_orig_dst(FW_handle_T handle, struct mnl_socket* nl,
+    struct sockaddr* src, struct sockaddr* proxy, struct sockaddr* orig_dst);
+
+/**
+ * Bind to the configured inbound (and optionally outbound) NFLOG groups.
+ */
+extern struct NF_log_handle* NF_start_log_capture(FW_handle_T handle);
+
+/**
+ * Unbind the NFLOG groups and cleanup.
+ */
+extern void NF_end_log_capture(struct NF_log_handle* lh);
+
+/**
+ * Wait for logged packets, for up to timeout milliseconds (capped at the
+ * default capture timeout, which is also used if -1), then drain all
+ * pending messages and return the list of addresses captured. The list
+ * and its strings belong to the capture handle, and are only valid until
+ * the next call.
+ */
+extern List_T NF_capture_log(FW_handle_T handle, struct NF_log_handle* lh,
+    int timeout);
+
+#endif
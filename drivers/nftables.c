@@ -0,0 +1,534 @@
+/*
+ * Copyright (C) 2014, 2015  Mikey Austin <mikey@greyd.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file   nftables.c
+ * @brief  Pluggable GNU/Linux nftables firewall interface.
+ * @author Mikey Austin
+ * @date   2015
+ *
+ * This firewall driver manages the greyd sets as nftables interval
+ * sets via libnftnl. Each replace, add or delete is sent as a single
+ * netlink batch, which the kernel commits as one atomic transaction.
+ * The conntrack lookups and NFLOG capturing (for "log group" rules)
+ * are shared with the netfilter driver in nf_common.c.
+ */
+
+#include <linux/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/set.h>
+#include <libnftnl/table.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+
+#include "../src/config_section.h"
+#include "../src/constants.h"
+#include "../src/failures.h"
+#include "../src/firewall.h"
+#include "../src/ip.h"
+#include "../src/list.h"
+#include "../src/utils.h"
+
+#include "nf_common.h"
+
+#define NFT_TABLE "greyd"
+#define NFT_TYPE_IPADDR 7 /* The nft ipv4_addr data type. */
+#define NFT_TYPE_IP6ADDR 8 /* The nft ipv6_addr data type. */
+#define NFT_ELEMS_PER_MSG 1024
+#define NFT_ELEM_MAX_LEN 64 /* Upper bound on an encoded element. */
+#define NFT_MSG_MAX_LEN 512 /* Upper bound on a message less elements. */
+#define NFT_BATCH_INIT_SIZE (MNL_SOCKET_BUFFER_SIZE * 4)
+
+#define NFT_OP_REPLACE 0
+#define NFT_OP_ADD 1
+#define NFT_OP_DEL 2
+
+struct fw_handle {
+    struct mnl_socket* nl;
+    struct NF_log_handle* log;
+};
+
+/**
+ * A growable buffer of netlink messages sent as a single transaction.
+ */
+struct nft_batch {
+    char* buf;
+    size_t size;
+    size_t len;
+    u_int32_t seq;
+};
+
+static int transaction(FW_handle_T, const char*, List_T, short, int);
+static int put_elems(struct nft_batch*, const char*, const char*, List_T,
+    short, int);
+static struct nftnl_set* set_alloc(const char*, const char*, short);
+static int cidr_to_interval(const char*, short, u_int8_t*, u_int8_t*, int*);
+
+/**
+ * Netlink batch management functions.
+ */
+static void batch_init(struct nft_batch*);
+static void* batch_reserve(struct nft_batch*, size_t);
+static struct nlmsghdr* batch_put(struct nft_batch*, u_int16_t, u_int16_t,
+    size_t);
+static void batch_advance(struct nft_batch*, struct nlmsghdr*);
+static int batch_commit(struct mnl_socket*, struct nft_batch*);
+
+int Mod_fw_open(FW_handle_T handle)
+{
+    struct fw_handle* fwh;
+
+    if ((fwh = malloc(sizeof(*fwh))) == NULL)
+        i_critical("malloc");
+    handle->fwh = fwh;
+
+    /* Log handle initialized when needed. */
+    fwh->log = NULL;
+
+    fwh->nl = mnl_socket_open(NETLINK_NETFILTER);
+    if (fwh->nl == NULL) {
+        i_warning("mnl_socket_open");
+        goto err;
+    } else {
+        if (mnl_socket_bind(fwh->nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+            i_warning("mnl_socket_bind");
+            goto err;
+        }
+    }
+
+    if (NF_keep_caps(handle) == -1)
+        goto err;
+
+    return 0;
+
+err:
+    return -1;
+}
+
+void Mod_fw_close(FW_handle_T handle)
+{
+    struct fw_handle* fwh = handle->fwh;
+
+    if (fwh) {
+        if (fwh->nl != NULL)
+            mnl_socket_close(fwh->nl);
+        free(fwh);
+        handle->fwh = NULL;
+    }
+
+    NF_clear_caps(handle);
+}
+
+int Mod_fw_lookup_orig_dst(FW_handle_T handle, struct sockaddr* src,
+    struct sockaddr* proxy, struct sockaddr* orig_dst)
+{
+    return NF_lookup_orig_dst(handle, ((struct fw_handle*)handle->fwh)->nl,
+        src, proxy, orig_dst);
+}
+
+void Mod_fw_start_log_capture(FW_handle_T handle)
+{
+    struct fw_handle* fwh = handle->fwh;
+
+    fwh->log = NF_start_log_capture(handle);
+}
+
+void Mod_fw_end_log_capture(FW_handle_T handle)
+{
+    struct fw_handle* fwh = handle->fwh;
+
+    NF_end_log_capture(fwh->log);
+    fwh->log = NULL;
+}
+
+List_T
+Mod_fw_capture_log(FW_handle_T handle, int timeout)
+{
+    struct fw_handle* fwh = handle->fwh;
+
+    return NF_capture_log(handle, fwh->log, timeout);
+}
+
+int Mod_fw_replace(FW_handle_T handle, const char* set_name, List_T cidrs, short af)
+{
+    return transaction(handle, set_name, cidrs, af, NFT_OP_REPLACE);
+}
+
+int Mod_fw_add(FW_handle_T handle, const char* set_name, List_T cidrs, short af)
+{
+    return transaction(handle, set_name, cidrs, af, NFT_OP_ADD);
+}
+
+int Mod_fw_del(FW_handle_T handle, const char* set_name, List_T cidrs, short af)
+{
+    struct List_entry* entry;
+    List_T single;
+    char* cidr;
+    int ret, ndeleted = 0;
+
+    if ((ret = transaction(handle, set_name, cidrs, af, NFT_OP_DEL)) != -1
+        || errno != ENOENT)
+        return ret;
+
+    /*
+     * Deleting an absent element aborts the whole transaction. As
+     * with ipset, this is not an error, so retry one element at a time.
+     */
+    single = List_create(NULL);
+    LIST_EACH(cidrs, entry)
+    {
+        if ((cidr = List_entry_value(entry)) == NULL)
+            continue;
+
+        List_remove_all(single);
+        List_insert_after(single, cidr);
+        if ((ret = transaction(handle, set_name, single, af, NFT_OP_DEL)) > 0)
+            ndeleted += ret;
+        else if (ret == -1 && errno != ENOENT)
+            break;
+    }
+    List_destroy(&single);
+
+    return (ret == -1 && errno != ENOENT ? -1 : ndeleted);
+}
+
+/*
+ * Build and commit a batch containing all of the messages needed to
+ * apply the operation. For a replace, the set is flushed and reloaded
+ * within the same transaction, so the packet path never sees it empty.
+ */
+static int
+transaction(FW_handle_T handle, const char* set_name, List_T cidrs, short af,
+    int op)
+{
+    struct mnl_socket* nl = ((struct fw_handle*)handle->fwh)->nl;
+    struct nft_batch batch;
+    struct nlmsghdr* nlh;
+    struct nftnl_table* table;
+    struct nftnl_set* set;
+    const char* table_name;
+    int nelems = 0;
+
+    NF_set_effective_caps(handle);
+
+    if (nl == NULL)
+        return -1;
+
+    if (op != NFT_OP_REPLACE && List_size(cidrs) == 0)
+        return 0;
+
+    table_name = Config_section_get_str(handle->section, "table", NFT_TABLE);
+
+    batch_init(&batch);
+    nlh = nftnl_batch_begin(batch_reserve(&batch, NFT_MSG_MAX_LEN),
+        batch.seq++);
+    batch_advance(&batch, nlh);
+
+    if (op != NFT_OP_DEL) {
+        /* Create the table and set if they don't already exist. */
+        if ((table = nftnl_table_alloc()) == NULL)
+            i_critical("nftnl_table_alloc");
+        nftnl_table_set_str(table, NFTNL_TABLE_NAME, table_name);
+        nlh = batch_put(&batch, NFT_MSG_NEWTABLE, NLM_F_CREATE,
+            NFT_MSG_MAX_LEN);
+        nftnl_table_nlmsg_build_payload(nlh, table);
+        batch_advance(&batch, nlh);
+        nftnl_table_free(table);
+
+        set = set_alloc(table_name, set_name, af);
+        nlh = batch_put(&batch, NFT_MSG_NEWSET, NLM_F_CREATE,
+            NFT_MSG_MAX_LEN);
+        nftnl_set_nlmsg_build_payload(nlh, set);
+        batch_advance(&batch, nlh);
+        nftnl_set_free(set);
+    }
+
+    if (op == NFT_OP_REPLACE) {
+        /* Deleting the elements of a set without specifying any flushes it. */
+        set = set_alloc(table_name, set_name, af);
+        nlh = batch_put(&batch, NFT_MSG_DELSETELEM, 0, NFT_MSG_MAX_LEN);
+        nftnl_set_elems_nlmsg_build_payload(nlh, set);
+        batch_advance(&batch, nlh);
+        nftnl_set_free(set);
+    }
+
+    if ((nelems = put_elems(&batch, table_name, set_name, cidrs, af,
+             (op == NFT_OP_DEL ? NFT_MSG_DELSETELEM : NFT_MSG_NEWSETELEM)))
+        == -1) {
+        free(batch.buf);
+        return -1;
+    }
+
+    nlh = nftnl_batch_end(batch_reserve(&batch, NFT_MSG_MAX_LEN),
+        batch.seq++);
+    batch_advance(&batch, nlh);
+
+    if (batch_commit(nl, &batch) == -1) {
+        if (errno != ENOENT || op != NFT_OP_DEL)
+            i_warning("nftables %s %s: %s",
+                (op == NFT_OP_DEL ? "delete" : "update"), set_name,
+                strerror(errno));
+        free(batch.buf);
+        return -1;
+    }
+
+    free(batch.buf);
+
+    return nelems;
+}
+
+/*
+ * Add element messages for each of the cidrs, in chunks to bound the
+ * size of the individual messages. Each cidr becomes an interval, which
+ * is a start element followed by an interval end element one past the
+ * last address in the range.
+ */
+static int
+put_elems(struct nft_batch* batch, const char* table_name,
+    const char* set_name, List_T cidrs, short af, int msg_type)
+{
+    struct List_entry* entry;
+    struct nlmsghdr* nlh;
+    struct nftnl_set* set = NULL;
+    struct nftnl_set_elem* elem;
+    u_int8_t start[sizeof(struct in6_addr)], end[sizeof(struct in6_addr)];
+    u_int32_t key_len = (af == AF_INET6 ? sizeof(struct in6_addr)
+                                        : sizeof(struct in_addr));
+    int has_end, nchunk = 0, nelems = 0;
+    char* cidr;
+
+    LIST_EACH(cidrs, entry)
+    {
+        if ((cidr = List_entry_value(entry)) == NULL)
+            continue;
+
+        if (cidr_to_interval(cidr, af, start, end, &has_end) == -1) {
+            i_warning("invalid cidr %s", cidr);
+            if (set)
+                nftnl_set_free(set);
+            return -1;
+        }
+
+        if (set == NULL)
+            set = set_alloc(table_name, set_name, af);
+
+        if ((elem = nftnl_set_elem_alloc()) == NULL)
+            i_critical("nftnl_set_elem_alloc");
+        nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, start, key_len);
+        nftnl_set_elem_add(set, elem);
+
+        if (has_end) {
+            if ((elem = nftnl_set_elem_alloc()) == NULL)
+                i_critical("nftnl_set_elem_alloc");
+            nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, end, key_len);
+            nftnl_set_elem_set_u32(elem, NFTNL_SET_ELEM_FLAGS,
+                NFT_SET_ELEM_INTERVAL_END);
+            nftnl_set_elem_add(set, elem);
+        }
+
+        nelems++;
+        if (++nchunk == NFT_ELEMS_PER_MSG) {
+            nlh = batch_put(batch, msg_type,
+                (msg_type == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0),
+                NFT_MSG_MAX_LEN + 2 * nchunk * NFT_ELEM_MAX_LEN);
+            nftnl_set_elems_nlmsg_build_payload(nlh, set);
+            batch_advance(batch, nlh);
+            nftnl_set_free(set);
+            set = NULL;
+            nchunk = 0;
+        }
+    }
+
+    if (set != NULL) {
+        nlh = batch_put(batch, msg_type,
+            (msg_type == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0),
+            NFT_MSG_MAX_LEN + 2 * nchunk * NFT_ELEM_MAX_LEN);
+        nftnl_set_elems_nlmsg_build_payload(nlh, set);
+        batch_advance(batch, nlh);
+        nftnl_set_free(set);
+    }
+
+    return nelems;
+}
+
+static struct nftnl_set*
+set_alloc(const char* table_name, const char* set_name, short af)
+{
+    struct nftnl_set* set;
+
+    if ((set = nftnl_set_alloc()) == NULL)
+        i_critical("nftnl_set_alloc");
+
+    nftnl_set_set_str(set, NFTNL_SET_TABLE, table_name);
+    nftnl_set_set_str(set, NFTNL_SET_NAME, set_name);
+    nftnl_set_set_u32(set, NFTNL_SET_FAMILY, NFPROTO_INET);
+    nftnl_set_set_u32(set, NFTNL_SET_FLAGS, NFT_SET_INTERVAL);
+    if (af == AF_INET6) {
+        nftnl_set_set_u32(set, NFTNL_SET_KEY_TYPE, NFT_TYPE_IP6ADDR);
+        nftnl_set_set_u32(set, NFTNL_SET_KEY_LEN, sizeof(struct in6_addr));
+    } else {
+        nftnl_set_set_u32(set, NFTNL_SET_KEY_TYPE, NFT_TYPE_IPADDR);
+        nftnl_set_set_u32(set, NFTNL_SET_KEY_LEN, sizeof(struct in_addr));
+    }
+
+    return set;
+}
+
+/*
+ * Convert an address or cidr into the network byte order start and
+ * (exclusive) end keys of an interval. There is no end key if the
+ * range extends to the last address.
+ */
+static int
+cidr_to_interval(const char* cidr, short af, u_int8_t* start, u_int8_t* end,
+    int* has_end)
+{
+    struct IP_addr n, m;
+    sa_family_t cidr_af;
+    char buf[INET6_ADDRSTRLEN + 5];
+    int i, len, host_bits;
+
+    host_bits = (af == AF_INET6 ? IP_MAX_MASKBITS : IP_MAX_MASKBITS_V4);
+    len = host_bits / 8;
+
+    if (strchr(cidr, '/') == NULL)
+        snprintf(buf, sizeof(buf), "%s/%d", cidr, host_bits);
+    else
+        sstrncpy(buf, cidr, sizeof(buf));
+
+    if (IP_str_to_addr_mask(buf, &n, &m, &cidr_af) == -1 || cidr_af != af)
+        return -1;
+
+    *has_end = 0;
+    for (i = len - 1; i >= 0; i--) {
+        start[i] = n.addr8[i];
+        end[i] = n.addr8[i] | ~m.addr8[i];
+    }
+
+    /* Increment the last address in the range, carrying as needed. */
+    for (i = len - 1; i >= 0; i--) {
+        if (++end[i] != 0) {
+            *has_end = 1;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void
+batch_init(struct nft_batch* batch)
+{
+    batch->size = NFT_BATCH_INIT_SIZE;
+    batch->len = 0;
+    batch->seq = time(NULL);
+    if ((batch->buf = malloc(batch->size)) == NULL)
+        i_critical("malloc");
+}
+
+/*
+ * Ensure there is room for a message of up to the specified length at
+ * the end of the batch, and return a pointer to it.
+ */
+static void*
+batch_reserve(struct nft_batch* batch, size_t len)
+{
+    size_t size = batch->size;
+
+    while (batch->len + len > size)
+        size *= 2;
+
+    if (size != batch->size) {
+        if ((batch->buf = realloc(batch->buf, size)) == NULL)
+            i_critical("realloc");
+        batch->size = size;
+    }
+
+    memset(batch->buf + batch->len, 0, len);
+
+    return batch->buf + batch->len;
+}
+
+static struct nlmsghdr*
+batch_put(struct nft_batch* batch, u_int16_t type, u_int16_t flags,
+    size_t len)
+{
+    return nftnl_nlmsg_build_hdr(batch_reserve(batch, len), type,
+        NFPROTO_INET, flags, batch->seq++);
+}
+
+static void
+batch_advance(struct nft_batch* batch, struct nlmsghdr* nlh)
+{
+    batch->len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/*
+ * Send the batch in a single write. The kernel processes the batch
+ * before the write returns, so any errors are already queued on the
+ * socket and may be read without blocking.
+ */
+static int
+batch_commit(struct mnl_socket* nl, struct nft_batch* batch)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    int fd, sndbuf, ret, err = 0;
+    socklen_t optlen = sizeof(sndbuf);
+    unsigned int portid;
+
+    fd = mnl_socket_get_fd(nl);
+    portid = mnl_socket_get_portid(nl);
+
+    /* Large batches exceed the default netlink socket send buffer. */
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) == 0
+        && (size_t)sndbuf < batch->len) {
+        sndbuf = batch->len;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf,
+                sizeof(sndbuf))
+            == -1)
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    }
+
+    if (mnl_socket_sendto(nl, batch->buf, batch->len) == -1)
+        return -1;
+
+    while ((ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (mnl_cb_run(buf, ret, 0, portid, NULL, NULL) == -1 && err == 0)
+            err = errno;
+    }
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
@@ -266,7 +266,7 @@ void Mod_fw_end_log_capture(FW_handle_T handle)
 }
 
 List_T
-Mod_fw_capture_log(FW_handle_T handle)
+Mod_fw_capture_log(FW_handle_T handle, int timeout)
 {
     struct fw_handle* fwh = handle->fwh;
     pcap_handler ph = packet_received;
@@ -29,6 +29,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -43,6 +44,140 @@
 #define DEFAULT_HOST "localhost"
 #define DEFAULT_PORT "5432"
 #define DEFAULT_DB "greyd"
+#define DEFAULT_PIPELINE 1
+
+/* Bound the statements in flight, so neither end blocks on a full socket. */
+#define PIPELINE_MAX 256
+#define MAX_PARAMS 10
+
+/* Parameter type OIDs, from the server's pg_type catalog. */
+#define PG_INT8OID 20
+#define PG_INT4OID 23
+
+/*
+ * The statements prepared on each connection. The put, get & del groups
+ * each list the mail, domain, ip & tuple statements in that order.
+ */
+enum pg_stmt {
+    PG_PUT_MAIL,
+    PG_PUT_DOM,
+    PG_PUT_IP,
+    PG_PUT_TUPLE,
+    PG_GET_MAIL,
+    PG_GET_DOM,
+    PG_GET_IP,
+    PG_GET_TUPLE,
+    PG_DEL_MAIL,
+    PG_DEL_DOM,
+    PG_DEL_IP,
+    PG_DEL_TUPLE,
+    PG_GET_DOM_PART,
+    PG_SCAN_DELETE,
+    PG_SCAN_PROMOTE,
+    PG_SCAN_LISTS,
+    PG_NUM_STMTS
+};
+
+/*
+ * The parameter types are given as one character per parameter: "s" for
+ * a string sent as text, "8" for a binary bigint and "4" for a binary
+ * integer.
+ */
+static const struct pg_stmt_def {
+    const char* name;
+    const char* types;
+    const char* sql;
+} pg_stmts[PG_NUM_STMTS] = {
+    { "put_mail", "s",
+        "INSERT INTO spamtraps(\"address\") VALUES ($1) "
+        "ON CONFLICT (\"address\") DO NOTHING" },
+    { "put_dom", "s",
+        "INSERT INTO domains(\"domain\") VALUES ($1) "
+        "ON CONFLICT (\"domain\") DO NOTHING" },
+    { "put_ip", "s88844s",
+        "INSERT INTO entries("
+        "\"ip\", \"helo\", \"from\", \"to\", \"first\", "
+        "\"pass\", \"expire\", \"bcount\", \"pcount\", \"greyd_host\") "
+        "VALUES ($1, '', '', '', $2, $3, $4, $5, $6, $7) "
+        "ON CONFLICT (\"ip\", \"helo\", \"from\", \"to\") "
+        "DO UPDATE SET "
+        "\"first\" = EXCLUDED.\"first\", "
+        "\"pass\" = EXCLUDED.\"pass\", "
+        "\"expire\" = EXCLUDED.\"expire\", "
+        "\"bcount\" = EXCLUDED.\"bcount\", "
+        "\"pcount\" = EXCLUDED.\"pcount\", "
+        "\"greyd_host\" = EXCLUDED.\"greyd_host\"" },
+    { "put_tuple", "ssss88844s",
+        "INSERT INTO entries("
+        "\"ip\", \"helo\", \"from\", \"to\", \"first\", "
+        "\"pass\", \"expire\", \"bcount\", \"pcount\", \"greyd_host\") "
+        "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10) "
+        "ON CONFLICT (\"ip\", \"helo\", \"from\", \"to\") "
+        "DO UPDATE SET "
+        "\"first\" = EXCLUDED.\"first\", "
+        "\"pass\" = EXCLUDED.\"pass\", "
+        "\"expire\" = EXCLUDED.\"expire\", "
+        "\"bcount\" = EXCLUDED.\"bcount\", "
+        "\"pcount\" = EXCLUDED.\"pcount\", "
+        "\"greyd_host\" = EXCLUDED.\"greyd_host\"" },
+    { "get_mail", "s",
+        "SELECT 0::bigint, 0::bigint, 0::bigint, 0, -2 "
+        "FROM spamtraps WHERE \"address\" = $1 "
+        "LIMIT 1" },
+    { "get_dom", "s",
+        "SELECT 0::bigint, 0::bigint, 0::bigint, 0, -3 "
+        "FROM domains WHERE \"domain\" = $1 "
+        "LIMIT 1" },
+    { "get_ip", "s",
+        "SELECT \"first\", \"pass\", \"expire\", \"bcount\", \"pcount\" "
+        "FROM entries "
+        "WHERE \"ip\" = $1 AND \"helo\" = '' AND \"from\" = '' "
+        "AND \"to\" = '' "
+        "LIMIT 1" },
+    { "get_tuple", "ssss",
+        "SELECT \"first\", \"pass\", \"expire\", \"bcount\", \"pcount\" "
+        "FROM entries "
+        "WHERE \"ip\" = $1 AND \"helo\" = $2 AND \"from\" = $3 "
+        "AND \"to\" = $4 "
+        "LIMIT 1" },
+    { "del_mail", "s",
+        "DELETE FROM spamtraps WHERE \"address\" = $1" },
+    { "del_dom", "s",
+        "DELETE FROM domains WHERE \"domain\" = $1" },
+    { "del_ip", "s",
+        "DELETE FROM entries WHERE \"ip\" = $1 "
+        "AND \"helo\" = '' AND \"from\" = '' AND \"to\" = ''" },
+    { "del_tuple", "ssss",
+        "DELETE FROM entries WHERE \"ip\" = $1 "
+        "AND \"helo\" = $2 AND \"from\" = $3 AND \"to\" = $4" },
+    { "get_dom_part", "s",
+        "SELECT 0::bigint, 0::bigint, 0::bigint, 0, -3 "
+        "FROM domains WHERE $1 LIKE ('%' || \"domain\") "
+        "LIMIT 1" },
+    { "scan_delete", "8s",
+        "DELETE FROM entries "
+        "WHERE \"expire\" <= $1 AND \"greyd_host\" = $2" },
+    { "scan_promote", "88s",
+        "WITH passed AS ("
+        "    DELETE FROM entries "
+        "    WHERE \"from\" <> '' AND \"to\" <> '' AND \"pcount\" >= 0 "
+        "    AND \"pass\" <= $1 AND \"greyd_host\" = $3 "
+        "    AND NOT EXISTS ("
+        "        SELECT 1 FROM entries g WHERE g.\"ip\" = entries.\"ip\" "
+        "        AND g.\"from\" = '' AND g.\"to\" = ''"
+        "    ) "
+        "    RETURNING \"ip\", \"first\", \"pass\", \"bcount\", \"pcount\""
+        ") "
+        "INSERT INTO entries("
+        "\"ip\", \"helo\", \"from\", \"to\", \"first\", "
+        "\"pass\", \"expire\", \"bcount\", \"pcount\", \"greyd_host\") "
+        "SELECT DISTINCT ON (\"ip\") \"ip\", '', '', '', \"first\", "
+        "\"pass\", $2, \"bcount\", \"pcount\", $3 FROM passed "
+        "ON CONFLICT (\"ip\", \"helo\", \"from\", \"to\") DO NOTHING" },
+    { "scan_lists", "",
+        "SELECT \"ip\", \"pcount\" FROM entries "
+        "WHERE \"from\" = '' AND \"to\" = ''" }
+};
 
 /**
  * The internal driver handle.
@@ -52,6 +187,20 @@ struct postgresql_handle {
     char* greyd_host;
     int txn;
     int connected;
+    int pipeline; /**< Pipeline writes made within a transaction. */
+    int pending; /**< Pipelined statements awaiting their results. */
+};
+
+/*
+ * The parameters for a prepared statement. The binary values are
+ * stored in network byte order alongside the pointers to them.
+ */
+struct pg_params {
+    int n;
+    const char* values[MAX_PARAMS];
+    int lengths[MAX_PARAMS];
+    int formats[MAX_PARAMS];
+    unsigned char bin[MAX_PARAMS][8];
 };
 
 struct postgresql_itr {
@@ -59,16 +208,27 @@ struct postgresql_itr {
     struct DB_key* curr;
 };
 
-static char* escape(PGconn*, const char*);
 static void populate_key(PGresult*, struct DB_key*, int, int);
 static void populate_val(PGresult*, struct DB_val*, int, int);
+static void populate_val_bin(PGresult*, struct DB_val*);
+static int prepare_stmts(struct postgresql_handle*);
+static void param_str(struct pg_params*, const char*);
+static void param_int8(struct pg_params*, long long);
+static void param_int4(struct pg_params*, int);
+static int key_params(struct DB_key*, struct pg_params*, enum pg_stmt*,
+    enum pg_stmt);
+static int get_params(struct DB_key*, struct pg_params*, enum pg_stmt*);
+static PGresult* exec_stmt(struct postgresql_handle*, enum pg_stmt,
+    struct pg_params*, int);
+static int write_stmt(DB_handle_T, enum pg_stmt, struct pg_params*);
+static int drain_pipeline(struct postgresql_handle*);
+static int write_many(DB_handle_T, struct DB_key*, struct DB_val*, int);
 
 extern void
 Mod_db_init(DB_handle_T handle)
 {
     struct postgresql_handle* dbh;
-    char *path, *hostname;
-    int ret, flags, uid_changed = 0, len;
+    char* hostname;
 
     if ((dbh = malloc(sizeof(*dbh))) == NULL)
         i_critical("malloc: %s", strerror(errno));
@@ -77,15 +237,14 @@ Mod_db_init(DB_handle_T handle)
     dbh->db = NULL;
     dbh->txn = 0;
     dbh->connected = 0;
+    dbh->pending = 0;
+    dbh->pipeline = Config_get_int(handle->config, "pipeline", "database",
+        DEFAULT_PIPELINE);
 
-    /* Escape and store the hostname in a static buffer. */
+    /* The hostname is only ever sent as a statement parameter. */
     hostname = Config_get_str(handle->config, "hostname", NULL, "");
-    if ((dbh->greyd_host = calloc(2 * (len = strlen(hostname)) + 1,
-             sizeof(char)))
-        == NULL) {
-        i_critical("malloc: %s", strerror(errno));
-    }
-    PQescapeString(dbh->greyd_host, hostname, len);
+    if ((dbh->greyd_host = strdup(hostname)) == NULL)
+        i_critical("strdup: %s", strerror(errno));
 }
 
 extern void
@@ -112,10 +271,14 @@ Mod_db_open(DB_handle_T handle, int flags)
 
     dbh->db = PQconnectdbParams(db_keywords, db_values, expand_dbname);
     if (PQstatus(dbh->db) != CONNECTION_OK) {
-        i_warning("could not connect to postgresql %s:%d: %s", host, port,
+        i_warning("could not connect to postgresql %s:%s: %s", host, port,
             PQerrorMessage(dbh->db));
         goto cleanup;
     }
+
+    if (prepare_stmts(dbh) == -1)
+        goto cleanup;
+
     dbh->connected = 1;
     return;
 
@@ -160,6 +323,11 @@ Mod_db_commit_txn(DB_handle_T handle)
         return -1;
     }
 
+    if (drain_pipeline(dbh) != GREYDB_OK) {
+        DB_rollback_txn(handle);
+        return -1;
+    }
+
     PGresult* result = PQexec(dbh->db, "END");
     if (PQresultStatus(result) != PGRES_COMMAND_OK) {
         i_warning("db txn commit failed: %s", PQerrorMessage(dbh->db));
@@ -187,6 +355,9 @@ Mod_db_rollback_txn(DB_handle_T handle)
         return -1;
     }
 
+    /* Any pipelined errors are moot, as the writes are discarded. */
+    drain_pipeline(dbh);
+
     PGresult* result = PQexec(dbh->db, "ROLLBACK");
     if (PQresultStatus(result) != PGRES_COMMAND_OK) {
         i_warning("db txn rollback failed: %s", PQerrorMessage(dbh->db));
@@ -211,8 +382,10 @@ Mod_db_close(DB_handle_T handle)
 
     if ((dbh = handle->dbh) != NULL) {
         free(dbh->greyd_host);
-        if (dbh->db)
+        if (dbh->db) {
+            drain_pipeline(dbh);
             PQfinish(dbh->db);
+        }
         free(dbh);
         handle->dbh = NULL;
     }
@@ -222,330 +395,171 @@ extern int
 Mod_db_put(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
 {
     struct postgresql_handle* dbh = handle->dbh;
-    char *sql = NULL, *sql_tmpl = NULL;
-    struct Grey_tuple* gt;
+    struct pg_params params;
     struct Grey_data* gd;
-    unsigned long len;
-    char* add_esc = NULL;
-    char* ip_esc = NULL;
-    char* helo_esc = NULL;
-    char* from_esc = NULL;
-    char* to_esc = NULL;
-
-    switch (key->type) {
-    case DB_KEY_MAIL:
-        sql_tmpl = "INSERT INTO spamtraps(\"address\") VALUES ('%s') "
-                   "ON CONFLICT (\"address\") DO NOTHING";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
+    enum pg_stmt which;
 
-    case DB_KEY_DOM:
-        sql_tmpl = "INSERT INTO domains(\"domain\") VALUES ('%s') "
-                   "ON CONFLICT (\"domain\") DO NOTHING";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
-
-    case DB_KEY_IP:
-        sql_tmpl = "INSERT INTO entries("
-                   "\"ip\", \"helo\", \"from\", \"to\", \"first\", "
-                   "\"pass\", \"expire\", \"bcount\", \"pcount\", \"greyd_host\") "
-                   "VALUES "
-                   "('%s', '', '', '', %lld, %lld, %lld, %d, %d, '%s') "
-                   "ON CONFLICT (\"ip\", \"helo\", \"from\", \"to\") "
-                   "DO UPDATE SET "
-                   "\"first\" = EXCLUDED.\"first\", "
-                   "\"pass\" = EXCLUDED.\"pass\", "
-                   "\"expire\" = EXCLUDED.\"expire\", "
-                   "\"bcount\" = EXCLUDED.\"bcount\", "
-                   "\"pcount\" = EXCLUDED.\"pcount\", "
-                   "\"greyd_host\" = EXCLUDED.\"greyd_host\"";
-        add_esc = escape(dbh->db, key->data.s);
-
-        gd = &val->data.gd;
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc, gd->first, gd->pass, gd->expire, gd->bcount, gd->pcount, dbh->greyd_host) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
-
-    case DB_KEY_TUPLE:
-        sql_tmpl = "INSERT INTO entries("
-                   "\"ip\", \"helo\", \"from\", \"to\", \"first\", "
-                   "\"pass\", \"expire\", \"bcount\", \"pcount\", \"greyd_host\") "
-                   "VALUES "
-                   "('%s', '%s', '%s', '%s', %lld, %lld, %lld, %d, %d, '%s') "
-                   "ON CONFLICT (\"ip\", \"helo\", \"from\", \"to\") "
-                   "DO UPDATE SET "
-                   "\"first\" = EXCLUDED.\"first\", "
-                   "\"pass\" = EXCLUDED.\"pass\", "
-                   "\"expire\" = EXCLUDED.\"expire\", "
-                   "\"bcount\" = EXCLUDED.\"bcount\", "
-                   "\"pcount\" = EXCLUDED.\"pcount\", "
-                   "\"greyd_host\" = EXCLUDED.\"greyd_host\"";
-        gt = &key->data.gt;
-        ip_esc = escape(dbh->db, gt->ip);
-        helo_esc = escape(dbh->db, gt->helo);
-        from_esc = escape(dbh->db, gt->from);
-        to_esc = escape(dbh->db, gt->to);
+    if (key_params(key, &params, &which, PG_PUT_MAIL) != GREYDB_OK)
+        return GREYDB_ERR;
 
+    if (key->type == DB_KEY_IP || key->type == DB_KEY_TUPLE) {
         gd = &val->data.gd;
-        if (ip_esc && helo_esc && from_esc && to_esc
-            && asprintf(&sql, sql_tmpl, ip_esc, helo_esc, from_esc, to_esc,
-                   gd->first, gd->pass, gd->expire, gd->bcount,
-                   gd->pcount, dbh->greyd_host)
-                == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(ip_esc);
-        free(helo_esc);
-        free(from_esc);
-        free(to_esc);
-        break;
-
-    default:
-        return GREYDB_ERR;
+        param_int8(&params, gd->first);
+        param_int8(&params, gd->pass);
+        param_int8(&params, gd->expire);
+        param_int4(&params, gd->bcount);
+        param_int4(&params, gd->pcount);
+        param_str(&params, dbh->greyd_host);
     }
 
-    PGresult* result = PQexec(dbh->db, sql);
-    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
-        i_warning("put postgesql error: %s", PQerrorMessage(dbh->db));
-        free(sql);
-        PQclear(result);
-        goto err;
-    }
-    free(sql);
-    PQclear(result);
-    return GREYDB_OK;
-
-err:
-    DB_rollback_txn(handle);
-    return GREYDB_ERR;
+    return write_stmt(handle, which, &params);
 }
 
 extern int
 Mod_db_get(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
 {
     struct postgresql_handle* dbh = handle->dbh;
-    char *sql = NULL, *sql_tmpl = NULL;
-    struct Grey_tuple* gt;
-    unsigned long len;
+    PGresult* result = NULL;
+    struct pg_params params;
+    enum pg_stmt which;
     int res = GREYDB_NOT_FOUND;
-    char* add_esc = NULL;
-    char* ip_esc = NULL;
-    char* helo_esc = NULL;
-    char* from_esc = NULL;
-    char* to_esc = NULL;
-
-    switch (key->type) {
-    case DB_KEY_DOM_PART:
-        sql_tmpl = "SELECT 0, 0, 0, 0, -3 "
-                   "FROM domains WHERE '%s' LIKE ('%' || domain)";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
-
-    case DB_KEY_DOM:
-        sql_tmpl = "SELECT 0, 0, 0, 0, -3 "
-                   "FROM domains WHERE \"domain\"='%s' "
-                   "LIMIT 1";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
-
-    case DB_KEY_MAIL:
-        sql_tmpl = "SELECT 0, 0, 0, 0, -2 "
-                   "FROM spamtraps WHERE \"address\"='%s' "
-                   "LIMIT 1";
-        add_esc = escape(dbh->db, key->data.s);
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
-
-    case DB_KEY_IP:
-        sql_tmpl = "SELECT \"first\", \"pass\", \"expire\", \"bcount\", "
-                   "\"pcount\" "
-                   "FROM entries "
-                   "WHERE \"ip\"='%s' AND \"helo\"='' AND \"from\"='' AND \"to\"='' "
-                   "LIMIT 1";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
-
-    case DB_KEY_TUPLE:
-        sql_tmpl = "SELECT \"first\", \"pass\", \"expire\", \"bcount\", "
-                   "\"pcount\" "
-                   "FROM entries "
-                   "WHERE \"ip\"='%s' AND \"helo\"='%s' AND \"from\"='%s' "
-                   "AND \"to\"='%s' "
-                   "LIMIT 1";
-        gt = &key->data.gt;
-        ip_esc = escape(dbh->db, gt->ip);
-        helo_esc = escape(dbh->db, gt->helo);
-        from_esc = escape(dbh->db, gt->from);
-        to_esc = escape(dbh->db, gt->to);
-
-        if (ip_esc && helo_esc && from_esc && to_esc
-            && asprintf(&sql, sql_tmpl, ip_esc, helo_esc, from_esc,
-                   to_esc)
-                == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(ip_esc);
-        free(helo_esc);
-        free(from_esc);
-        free(to_esc);
-        break;
-
-    default:
+    if (get_params(key, &params, &which) != GREYDB_OK)
         return GREYDB_ERR;
-    }
 
-    PGresult* result = NULL;
-    unsigned int expected_fields = 5;
+    /* The lookup must see any writes still in the pipeline. */
+    if (drain_pipeline(dbh) != GREYDB_OK)
+        return GREYDB_ERR;
 
-    result = PQexec(dbh->db, sql);
+    result = exec_stmt(dbh, which, &params, 1);
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
         i_warning("get postgresql error: %s", PQerrorMessage(dbh->db));
+        res = GREYDB_ERR;
         goto err;
     }
 
-    if (PQnfields(result) == expected_fields
-        && PQntuples(result) == 1) {
+    if (PQnfields(result) == 5 && PQntuples(result) == 1) {
         res = GREYDB_FOUND;
-        populate_val(result, val, 0, 0);
+        populate_val_bin(result, val);
     }
 
 err:
-    if (sql != NULL)
-        free(sql);
-    if (result != NULL)
-        PQclear(result);
+    PQclear(result);
     return res;
 }
 
 extern int
 Mod_db_del(DB_handle_T handle, struct DB_key* key)
 {
+    struct pg_params params;
+    enum pg_stmt which;
+
+    if (key_params(key, &params, &which, PG_DEL_MAIL) != GREYDB_OK)
+        return GREYDB_ERR;
+
+    return write_stmt(handle, which, &params);
+}
+
+extern int
+Mod_db_get_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int* found, int n)
+{
+#ifdef LIBPQ_HAS_PIPELINING
     struct postgresql_handle* dbh = handle->dbh;
-    char *sql = NULL, *sql_tmpl = NULL;
-    struct Grey_tuple* gt;
-    unsigned long len;
-    char* add_esc = NULL;
-    char* ip_esc = NULL;
-    char* helo_esc = NULL;
-    char* from_esc = NULL;
-    char* to_esc = NULL;
+    PGresult* result;
+    struct pg_params params;
+    enum pg_stmt which;
+    int i, j, sent, ret = GREYDB_OK;
 
-    switch (key->type) {
-    case DB_KEY_MAIL:
-        sql_tmpl = "DELETE FROM spamtraps WHERE \"address\"='%s'";
-        add_esc = escape(dbh->db, key->data.s);
+    /* The lookups must see any writes still in the pipeline. */
+    if (drain_pipeline(dbh) != GREYDB_OK)
+        return GREYDB_ERR;
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
-        }
-        free(add_esc);
-        break;
+    if (!PQenterPipelineMode(dbh->db)) {
+        i_warning("postgresql pipeline: %s", PQerrorMessage(dbh->db));
+        return GREYDB_ERR;
+    }
 
-    case DB_KEY_DOM:
-        sql_tmpl = "DELETE FROM domains WHERE \"domain\"='%s'";
-        add_esc = escape(dbh->db, key->data.s);
+    /*
+     * Send the lookups in runs of at most PIPELINE_MAX, so that the
+     * results of a whole run are received after a single round trip.
+     */
+    for (i = 0; i < n && ret == GREYDB_OK; i += sent) {
+        for (sent = 0; sent < PIPELINE_MAX && i + sent < n; sent++) {
+            if (get_params(&keys[i + sent], &params, &which) != GREYDB_OK) {
+                ret = GREYDB_ERR;
+                break;
+            }
 
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
+            if (!PQsendQueryPrepared(dbh->db, pg_stmts[which].name,
+                    params.n, params.values, params.lengths, params.formats,
+                    1)) {
+                i_warning("get postgresql error: %s",
+                    PQerrorMessage(dbh->db));
+                ret = GREYDB_ERR;
+                break;
+            }
         }
-        free(add_esc);
-        break;
 
-    case DB_KEY_IP:
-        sql_tmpl = "DELETE FROM entries WHERE \"ip\"='%s' "
-                   "AND \"helo\"='' AND \"from\"='' AND \"to\"=''";
-        add_esc = escape(dbh->db, key->data.s);
-
-        if (add_esc && asprintf(&sql, sql_tmpl, add_esc) == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
+        if (!PQpipelineSync(dbh->db)) {
+            i_warning("postgresql pipeline sync: %s",
+                PQerrorMessage(dbh->db));
+            ret = GREYDB_ERR;
         }
-        free(add_esc);
-        break;
 
-    case DB_KEY_TUPLE:
-        sql_tmpl = "DELETE FROM entries WHERE \"ip\"='%s' "
-                   "AND \"helo\"='%s' AND \"from\"='%s' AND \"to\"='%s' ";
-        gt = &key->data.gt;
-        ip_esc = escape(dbh->db, gt->ip);
-        helo_esc = escape(dbh->db, gt->helo);
-        from_esc = escape(dbh->db, gt->from);
-        to_esc = escape(dbh->db, gt->to);
-
-        if (ip_esc && helo_esc && from_esc && to_esc
-            && asprintf(&sql, sql_tmpl, ip_esc, helo_esc, from_esc,
-                   to_esc)
-                == -1) {
-            i_warning("postgresql asprintf error");
-            goto err;
+        for (j = i; j < i + sent; j++) {
+            found[j] = GREYDB_NOT_FOUND;
+            while ((result = PQgetResult(dbh->db)) != NULL) {
+                if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+                    if (ret == GREYDB_OK) {
+                        i_warning("get postgresql error: %s",
+                            PQresultErrorMessage(result));
+                    }
+                    ret = GREYDB_ERR;
+                } else if (PQnfields(result) == 5
+                    && PQntuples(result) == 1) {
+                    found[j] = GREYDB_FOUND;
+                    populate_val_bin(result, &vals[j]);
+                }
+                PQclear(result);
+            }
         }
-        free(ip_esc);
-        free(helo_esc);
-        free(from_esc);
-        free(to_esc);
-        break;
 
-    default:
-        return GREYDB_ERR;
+        /* Consume the sync point. */
+        if ((result = PQgetResult(dbh->db)) != NULL)
+            PQclear(result);
     }
 
-    PGresult* result = PQexec(dbh->db, sql);
+    if (!PQexitPipelineMode(dbh->db)) {
+        i_warning("postgresql pipeline: %s", PQerrorMessage(dbh->db));
+        ret = GREYDB_ERR;
+    }
 
-    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
-        i_warning("del postgresql error: %s", PQerrorMessage(dbh->db));
-        free(sql);
-        PQclear(result);
-        goto err;
+    return ret;
+#else
+    int i;
+
+    for (i = 0; i < n; i++) {
+        found[i] = Mod_db_get(handle, &keys[i], &vals[i]);
+        if (found[i] != GREYDB_FOUND && found[i] != GREYDB_NOT_FOUND)
+            return GREYDB_ERR;
     }
-    free(sql);
-    PQclear(result);
+
     return GREYDB_OK;
+#endif
+}
 
-err:
-    DB_rollback_txn(handle);
-    return GREYDB_ERR;
+extern int
+Mod_db_put_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    return write_many(handle, keys, vals, n);
+}
+
+extern int
+Mod_db_del_many(DB_handle_T handle, struct DB_key* keys, int n)
+{
+    return write_many(handle, keys, NULL, n);
 }
 
 extern void
@@ -564,6 +578,9 @@ Mod_db_get_itr(DB_itr_T itr, int types)
     dbi->curr = NULL;
     itr->dbi = dbi;
 
+    if (drain_pipeline(dbh) != GREYDB_OK)
+        goto err;
+
     entries = (types & DB_ENTRIES) != 0 ? "TRUE" : "FALSE";
     spamtraps = (types & DB_SPAMTRAPS) != 0 ? "TRUE" : "FALSE";
     domains = (types & DB_DOMAINS) != 0 ? "TRUE" : "FALSE";
@@ -660,118 +677,86 @@ Mod_scan_db(DB_handle_T handle, time_t* now, List_T whitelist,
 {
     struct postgresql_handle* dbh = handle->dbh;
     PGresult* result = NULL;
-    char *sql, *sql_tmpl;
-    int ret = GREYDB_OK;
-    unsigned int size;
+    struct pg_params params;
+    const char* ip;
+    int ret = GREYDB_ERR;
 
-    /*
-     * Delete expired entries and whitelist appropriate grey entries,
-     * by un-setting the tuple fields (to, from, helo), but only if there
-     * is not already a conflicting entry with the same IP address
-     * (ie an existing trap entry).
-     */
-    sql_tmpl = "DELETE FROM entries "
-               "WHERE \"expire\" <= EXTRACT(EPOCH FROM now()) "
-               "AND \"greyd_host\"='%s'";
-
-    if (asprintf(&sql, sql_tmpl, dbh->greyd_host) == -1) {
-        i_warning("postgresql asprintf error");
-        goto err;
-    }
+    if (drain_pipeline(dbh) != GREYDB_OK)
+        return GREYDB_ERR;
 
-    result = PQexec(dbh->db, sql);
+    /* Delete expired entries. */
+    params.n = 0;
+    param_int8(&params, *now);
+    param_str(&params, dbh->greyd_host);
+    result = exec_stmt(dbh, PG_SCAN_DELETE, &params, 0);
     if (PQresultStatus(result) != PGRES_COMMAND_OK) {
         i_warning("delete postgresql expired entries: %s",
             PQerrorMessage(dbh->db));
         goto err;
     }
     PQclear(result);
-    free(sql);
-    sql = NULL;
-
-    sql_tmpl = "UPDATE entries "
-               "SET \"helo\" = '', \"from\" = '', \"to\" = '', \"expire\" = %lld "
-               "FROM entries e LEFT JOIN entries g "
-               "ON g.\"ip\" = e.\"ip\" AND g.\"to\" = '' AND g.\"from\" = '' "
-               "WHERE e.\"ip\" = entries.\"ip\" AND e.\"helo\" = entries.\"helo\" "
-               "AND e.\"from\" = entries.\"from\" AND e.\"to\" = entries.\"to\" "
-               "AND e.\"from\" <> '' AND e.\"to\" <> '' AND e.\"pcount\" >= 0 "
-               "AND e.\"pass\" <= EXTRACT(EPOCH FROM now()) AND e.\"greyd_host\"='%s' "
-               "AND g.\"ip\" IS NULL";
-
-    if (asprintf(&sql, sql_tmpl, *now + *white_exp, dbh->greyd_host) == -1) {
-        i_warning("postgresql asprintf error");
-        goto err;
-    }
 
-    result = PQexec(dbh->db, sql);
+    /*
+     * Whitelist the passed grey entries, by replacing each with an entry
+     * with empty tuple fields (to, from, helo), but only if there is not
+     * already a conflicting entry with the same IP address (ie an
+     * existing trap entry). Several passed tuples from the same address
+     * yield one white entry.
+     */
+    params.n = 0;
+    param_int8(&params, *now);
+    param_int8(&params, *now + *white_exp);
+    param_str(&params, dbh->greyd_host);
+    result = exec_stmt(dbh, PG_SCAN_PROMOTE, &params, 0);
     if (PQresultStatus(result) != PGRES_COMMAND_OK) {
         i_warning("update postgresql entries: %s", PQerrorMessage(dbh->db));
         goto err;
     }
     PQclear(result);
-    free(sql);
-    sql = NULL;
-
-    /* Add greytrap & whitelist entries. */
-    sql = "SELECT \"ip\", NULL, NULL FROM entries "
-          "WHERE \"to\"='' AND \"from\"='' AND \"ip\" NOT LIKE '%:%' "
-          "AND \"pcount\" >= 0 "
-          "UNION "
-          "SELECT NULL, \"ip\", NULL FROM entries "
-          "WHERE \"to\"='' AND \"from\"='' AND \"ip\" LIKE '%:%' "
-          "AND \"pcount\" >= 0 "
-          "UNION "
-          "SELECT NULL, NULL, \"ip\" FROM entries "
-          "WHERE \"to\"='' AND \"from\"='' AND \"pcount\" < 0 ";
-
-    result = PQexec(dbh->db, sql);
-    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+    result = NULL;
+
+    /*
+     * Add greytrap & whitelist entries, fetching the rows one at a time
+     * rather than buffering the whole result.
+     */
+    if (!PQsendQueryPrepared(dbh->db, pg_stmts[PG_SCAN_LISTS].name, 0, NULL,
+            NULL, NULL, 0)
+        || !PQsetSingleRowMode(dbh->db)) {
         i_warning("postgresql fetch grey/white entries: %s",
             PQerrorMessage(dbh->db));
         goto err;
     }
 
-    size = PQntuples(result);
-    if (size > 0) {
-        for (int tuple = 0; tuple < size; tuple++) {
-            if (!PQgetisnull(result, tuple, 0)) {
-                List_insert_after(whitelist,
-                    strdup((const char*)
-                            PQgetvalue(result, tuple, 0)));
-            } else if (!PQgetisnull(result, tuple, 1)) {
-                List_insert_after(whitelist_ipv6,
-                    strdup((const char*)
-                            PQgetvalue(result, tuple, 1)));
-            } else if (!PQgetisnull(result, tuple, 2)) {
-                List_insert_after(traplist,
-                    strdup((const char*)
-                            PQgetvalue(result, tuple, 2)));
-            }
+    ret = GREYDB_OK;
+    while ((result = PQgetResult(dbh->db)) != NULL) {
+        switch (PQresultStatus(result)) {
+        case PGRES_SINGLE_TUPLE:
+            ip = PQgetvalue(result, 0, 0);
+            if (atoi(PQgetvalue(result, 0, 1)) < 0)
+                List_insert_after(traplist, strdup(ip));
+            else if (strchr(ip, ':') != NULL)
+                List_insert_after(whitelist_ipv6, strdup(ip));
+            else
+                List_insert_after(whitelist, strdup(ip));
+            break;
+
+        case PGRES_TUPLES_OK:
+            break;
+
+        default:
+            i_warning("postgresql fetch grey/white entries: %s",
+                PQresultErrorMessage(result));
+            ret = GREYDB_ERR;
+            break;
         }
+        PQclear(result);
     }
 
 err:
-    if (result)
-        PQclear(result);
+    PQclear(result);
     return ret;
 }
 
-static char* escape(PGconn* db, const char* str)
-{
-    char* esc;
-    size_t len = strlen(str);
-    int* err;
-
-    if ((esc = calloc(2 * len + 1, sizeof(char))) == NULL) {
-        i_warning("calloc: %s", strerror(errno));
-        return NULL;
-    }
-    PQescapeStringConn(db, esc, str, len, err);
-
-    return esc;
-}
-
 static void
 populate_key(PGresult* result, struct DB_key* key, int from, int tuple)
 {
@@ -843,3 +828,307 @@ populate_val(PGresult* result, struct DB_val* val, int from, int tuple)
     gd->bcount = atoi(PQgetvalue(result, tuple, from + 3));
     gd->pcount = atoi(PQgetvalue(result, tuple, from + 4));
 }
+
+/*
+ * Populate a value from the binary result of a get statement.
+ */
+static void
+populate_val_bin(PGresult* result, struct DB_val* val)
+{
+    struct Grey_data* gd;
+    const unsigned char* v;
+    uint64_t u;
+    int64_t n[5];
+    int i, j, len;
+
+    /* The first three columns are bigints, the last two integers. */
+    for (i = 0; i < 5; i++) {
+        v = (const unsigned char*)PQgetvalue(result, 0, i);
+        len = PQgetlength(result, 0, i);
+        for (u = 0, j = 0; j < len; j++)
+            u = (u << 8) | v[j];
+        n[i] = (len == 8 ? (int64_t)u : (int32_t)u);
+    }
+
+    memset(val, 0, sizeof(*val));
+    val->type = DB_VAL_GREY;
+    gd = &val->data.gd;
+    gd->first = n[0];
+    gd->pass = n[1];
+    gd->expire = n[2];
+    gd->bcount = n[3];
+    gd->pcount = n[4];
+}
+
+/*
+ * Prepare all of the statements on a new connection, so that none need
+ * preparing once the connection is in pipeline mode.
+ */
+static int
+prepare_stmts(struct postgresql_handle* dbh)
+{
+    const struct pg_stmt_def* def;
+    PGresult* result;
+    Oid types[MAX_PARAMS];
+    int i, n;
+
+    for (i = 0; i < PG_NUM_STMTS; i++) {
+        def = &pg_stmts[i];
+        for (n = 0; def->types[n] != '\0'; n++) {
+            types[n] = (def->types[n] == '8'
+                    ? PG_INT8OID
+                    : (def->types[n] == '4' ? PG_INT4OID : 0));
+        }
+
+        result = PQprepare(dbh->db, def->name, def->sql, n, types);
+        if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+            i_warning("prepare %s: %s", def->name, PQerrorMessage(dbh->db));
+            PQclear(result);
+            return -1;
+        }
+        PQclear(result);
+    }
+
+    return 0;
+}
+
+static void
+param_str(struct pg_params* params, const char* str)
+{
+    params->values[params->n] = str;
+    params->lengths[params->n] = 0;
+    params->formats[params->n] = 0;
+    params->n++;
+}
+
+static void
+param_int8(struct pg_params* params, long long val)
+{
+    unsigned char* bin = params->bin[params->n];
+    uint64_t u = val;
+    int i;
+
+    for (i = 7; i >= 0; i--, u >>= 8)
+        bin[i] = u & 0xff;
+
+    params->values[params->n] = (const char*)bin;
+    params->lengths[params->n] = 8;
+    params->formats[params->n] = 1;
+    params->n++;
+}
+
+static void
+param_int4(struct pg_params* params, int val)
+{
+    unsigned char* bin = params->bin[params->n];
+    uint32_t u = val;
+    int i;
+
+    for (i = 3; i >= 0; i--, u >>= 8)
+        bin[i] = u & 0xff;
+
+    params->values[params->n] = (const char*)bin;
+    params->lengths[params->n] = 4;
+    params->formats[params->n] = 1;
+    params->n++;
+}
+
+/*
+ * Set the key parameters, and select the key type's statement from the
+ * group starting at the supplied mail statement.
+ */
+static int
+key_params(struct DB_key* key, struct pg_params* params,
+    enum pg_stmt* which, enum pg_stmt group)
+{
+    struct Grey_tuple* gt;
+
+    params->n = 0;
+
+    switch (key->type) {
+    case DB_KEY_MAIL:
+        *which = group;
+        param_str(params, key->data.s);
+        break;
+
+    case DB_KEY_DOM:
+        *which = group + 1;
+        param_str(params, key->data.s);
+        break;
+
+    case DB_KEY_IP:
+        *which = group + 2;
+        param_str(params, key->data.s);
+        break;
+
+    case DB_KEY_TUPLE:
+        *which = group + 3;
+        gt = &key->data.gt;
+        param_str(params, gt->ip);
+        param_str(params, gt->helo);
+        param_str(params, gt->from);
+        param_str(params, gt->to);
+        break;
+
+    default:
+        return GREYDB_ERR;
+    }
+
+    return GREYDB_OK;
+}
+
+/*
+ * Set the parameters and select the statement for a lookup, which may
+ * also be of a partial domain.
+ */
+static int
+get_params(struct DB_key* key, struct pg_params* params,
+    enum pg_stmt* which)
+{
+    if (key->type == DB_KEY_DOM_PART) {
+        *which = PG_GET_DOM_PART;
+        params->n = 0;
+        param_str(params, key->data.s);
+        return GREYDB_OK;
+    }
+
+    return key_params(key, params, which, PG_GET_MAIL);
+}
+
+static PGresult*
+exec_stmt(struct postgresql_handle* dbh, enum pg_stmt which,
+    struct pg_params* params, int binary)
+{
+    return PQexecPrepared(dbh->db, pg_stmts[which].name, params->n,
+        params->values, params->lengths, params->formats, binary);
+}
+
+/*
+ * Run a put or delete statement. Within a transaction the statement is
+ * pipelined if possible, in which case any error is reported when the
+ * pipeline is next drained.
+ */
+static int
+write_stmt(DB_handle_T handle, enum pg_stmt which, struct pg_params* params)
+{
+    struct postgresql_handle* dbh = handle->dbh;
+    PGresult* result;
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if (dbh->pipeline && dbh->txn) {
+        if (PQpipelineStatus(dbh->db) == PQ_PIPELINE_OFF
+            && !PQenterPipelineMode(dbh->db)) {
+            i_warning("postgresql pipeline: %s", PQerrorMessage(dbh->db));
+            goto err;
+        }
+
+        if (!PQsendQueryPrepared(dbh->db, pg_stmts[which].name, params->n,
+                params->values, params->lengths, params->formats, 0)) {
+            i_warning("write postgresql error: %s", PQerrorMessage(dbh->db));
+            goto err;
+        }
+
+        if (++dbh->pending >= PIPELINE_MAX
+            && drain_pipeline(dbh) != GREYDB_OK) {
+            goto err;
+        }
+
+        return GREYDB_OK;
+    }
+#endif
+
+    result = exec_stmt(dbh, which, params, 0);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        i_warning("write postgresql error: %s", PQerrorMessage(dbh->db));
+        PQclear(result);
+        goto err;
+    }
+    PQclear(result);
+
+    return GREYDB_OK;
+
+err:
+    DB_rollback_txn(handle);
+    return GREYDB_ERR;
+}
+
+/*
+ * Collect the results of any pipelined statements and leave pipeline
+ * mode, so that the connection may again be used synchronously.
+ */
+static int
+drain_pipeline(struct postgresql_handle* dbh)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+    PGresult* result;
+    int ret = GREYDB_OK;
+
+    if (PQpipelineStatus(dbh->db) == PQ_PIPELINE_OFF)
+        return GREYDB_OK;
+
+    if (dbh->pending > 0) {
+        if (!PQpipelineSync(dbh->db)) {
+            i_warning("postgresql pipeline sync: %s",
+                PQerrorMessage(dbh->db));
+            ret = GREYDB_ERR;
+        }
+
+        for (; dbh->pending > 0; dbh->pending--) {
+            while ((result = PQgetResult(dbh->db)) != NULL) {
+                if (PQresultStatus(result) != PGRES_COMMAND_OK
+                    && ret == GREYDB_OK) {
+                    i_warning("write postgresql error: %s",
+                        PQresultErrorMessage(result));
+                    ret = GREYDB_ERR;
+                }
+                PQclear(result);
+            }
+        }
+
+        /* Consume the sync point. */
+        if ((result = PQgetResult(dbh->db)) != NULL)
+            PQclear(result);
+    }
+
+    if (!PQexitPipelineMode(dbh->db)) {
+        i_warning("postgresql pipeline: %s", PQerrorMessage(dbh->db));
+        ret = GREYDB_ERR;
+    }
+
+    return ret;
+#else
+    return GREYDB_OK;
+#endif
+}
+
+/*
+ * Make a batch of puts, or deletes if there are no values. Outside of a
+ * transaction, one is started for the batch so that its statements are
+ * pipelined and committed together.
+ */
+static int
+write_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    struct postgresql_handle* dbh = handle->dbh;
+    int i, own_txn = 0, ret = GREYDB_OK;
+
+    if (!dbh->txn) {
+        Mod_db_start_txn(handle);
+        own_txn = 1;
+    }
+
+    for (i = 0; i < n && ret == GREYDB_OK; i++) {
+        ret = (vals ? Mod_db_put(handle, &keys[i], &vals[i])
+                    : Mod_db_del(handle, &keys[i]));
+    }
+
+    if (own_txn && dbh->txn) {
+        if (ret == GREYDB_OK && Mod_db_commit_txn(handle) != 0)
+            ret = GREYDB_ERR;
+        else if (ret != GREYDB_OK)
+            Mod_db_rollback_txn(handle);
+    }
+
+    return ret;
+}
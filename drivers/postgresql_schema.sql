@@ -34,4 +34,26 @@ CREATE TABLE IF NOT EXISTS entries(
 --
 -- Index the greyd_host column (B-tree).
 --
-CREATE INDEX greyd_host_index ON entries("greyd_host");
+CREATE INDEX IF NOT EXISTS greyd_host_index ON entries("greyd_host");
+
+--
+-- Index the expiry times for each host, used to delete expired entries.
+--
+CREATE INDEX IF NOT EXISTS entries_expire_index
+  ON entries("greyd_host", "expire");
+
+--
+-- Partially index the pass times of the grey tuples which may be
+-- whitelisted, so that promotion does not visit the other entries.
+--
+CREATE INDEX IF NOT EXISTS entries_grey_pass_index
+  ON entries("greyd_host", "pass")
+  WHERE "from" <> '' AND "to" <> '' AND "pcount" >= 0;
+
+--
+-- Partially index the white & trapped addresses, which are fetched by
+-- each scan and looked up when promoting grey tuples.
+--
+CREATE INDEX IF NOT EXISTS entries_listed_index
+  ON entries("ip", "pcount")
+  WHERE "from" = '' AND "to" = '';
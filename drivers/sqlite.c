@@ -56,12 +56,89 @@
 #define MAX_RETRY 20
 #define RETRY_SECS 5
 
+/*
+ * The statements used for single entry access and for the scans, which
+ * are prepared once per handle and then reset and rebound for each call.
+ */
+enum s3_stmt {
+    S3_PUT_MAIL,
+    S3_PUT_DOM,
+    S3_PUT_IP,
+    S3_PUT_TUPLE,
+    S3_GET_DOM_PART,
+    S3_GET_MAIL,
+    S3_GET_DOM,
+    S3_GET_IP,
+    S3_GET_TUPLE,
+    S3_DEL_MAIL,
+    S3_DEL_DOM,
+    S3_DEL_IP,
+    S3_DEL_TUPLE,
+    S3_SCAN_EXPIRED,
+    S3_SCAN_DELETE,
+    S3_SCAN_PROMOTE,
+    S3_SCAN_LISTS,
+    S3_SCAN_CHANGES,
+    S3_NUM_STMTS
+};
+
+static const char* s3_sql[S3_NUM_STMTS] = {
+    "INSERT OR IGNORE INTO spamtraps(address) VALUES (?)",
+    "INSERT OR IGNORE INTO domains(domain) VALUES (?)",
+    "INSERT OR REPLACE INTO entries "
+    "(`ip`, `helo`, `from`, `to`, "
+    " `first`, `pass`, `expire`, `bcount`, `pcount`) "
+    "VALUES (?, '', '', '', ?, ?, ?, ?, ?)",
+    "INSERT OR REPLACE INTO entries "
+    "(`ip`, `helo`, `from`, `to`, "
+    " `first`, `pass`, `expire`, `bcount`, `pcount`) "
+    "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
+    "SELECT 0, 0, 0, 0, -3 FROM domains WHERE ? LIKE '%' || domain",
+    "SELECT 0, 0, 0, 0, -2 "
+    "FROM spamtraps WHERE `address`=? "
+    "LIMIT 1",
+    "SELECT 0, 0, 0, 0, -3 "
+    "FROM domains WHERE `domain`=? "
+    "LIMIT 1",
+    "SELECT `first`, `pass`, `expire`, `bcount`, `pcount`"
+    "FROM entries "
+    "WHERE `ip`=? AND `helo`='' AND `from`='' "
+    "AND `to`='' "
+    "LIMIT 1",
+    "SELECT `first`, `pass`, `expire`, `bcount`, `pcount`"
+    "FROM entries "
+    "WHERE `ip`=? AND `helo`=? AND `from`=? AND `to`=? "
+    "LIMIT 1",
+    "DELETE FROM spamtraps WHERE `address`=?",
+    "DELETE FROM domains WHERE `domain`=?",
+    "DELETE FROM entries WHERE `ip`=? "
+    "AND `helo`='' AND `from`='' AND `to`=''",
+    "DELETE FROM entries WHERE `ip`=? "
+    "AND `helo`=? AND `from`=? AND `to`=?",
+    "SELECT `ip` FROM entries "
+    "WHERE `expire` <= ? AND `to` = '' AND `from` = ''",
+    "DELETE FROM entries WHERE `expire` <= ?",
+    "UPDATE OR REPLACE entries "
+    "SET `helo` = '', `from` = '', `to` = '', `expire` = ? "
+    "WHERE `from` <> '' AND `to` <> '' AND `pcount` >= 0 AND `pass` <= ? "
+    "AND NOT EXISTS ( "
+    "    SELECT 1 FROM entries AS e "
+    "    WHERE e.`ip` = entries.`ip` AND e.`from` = '' AND e.`to` = '' "
+    ")",
+    "SELECT `ip`, `pcount` FROM entries "
+    "WHERE `to` = '' AND `from` = ''",
+    "SELECT `ip`, `pcount` FROM entries "
+    "WHERE (`first` >= ? OR `expire` = ?) "
+    "AND `to` = '' AND `from` = ''"
+};
+
 /**
  * The internal driver handle.
  */
 struct s3_handle {
     sqlite3* db;
     int txn;
+    sqlite3_stmt* stmts[S3_NUM_STMTS]; /**< Cached prepared statements. */
 };
 
 struct s3_itr {
@@ -71,6 +148,12 @@ struct s3_itr {
 
 static void populate_key(sqlite3_stmt*, struct DB_key*, int);
 static void populate_val(sqlite3_stmt*, struct DB_val*, int);
+static int expire_and_promote(DB_handle_T, time_t*, time_t*, List_T);
+static void add_list_entry(sqlite3_stmt*, List_T, List_T, List_T);
+static sqlite3_stmt* get_stmt(struct s3_handle*, enum s3_stmt);
+static void release_stmt(sqlite3_stmt*);
+static void set_pragmas(DB_handle_T);
+static int write_many(DB_handle_T, struct DB_key*, struct DB_val*, int);
 
 extern void
 Mod_db_init(DB_handle_T handle)
@@ -94,8 +177,8 @@ Mod_db_init(DB_handle_T handle)
         }
     }
 
-    if ((dbh = malloc(sizeof(*dbh))) == NULL)
-        i_critical("malloc: %s", strerror(errno));
+    if ((dbh = calloc(1, sizeof(*dbh))) == NULL)
+        i_critical("calloc: %s", strerror(errno));
     dbh->db = NULL;
     dbh->txn = 0;
     handle->dbh = dbh;
@@ -126,6 +209,8 @@ Mod_db_open(DB_handle_T handle, int flags)
         goto cleanup;
     }
 
+    set_pragmas(handle);
+
     /* Ensure that the schema is setup appropriately. */
     sql = "CREATE TABLE IF NOT EXISTS spamtraps(        \
                `address` VARCHAR(1024),                 \
@@ -146,7 +231,13 @@ Mod_db_open(DB_handle_T handle, int flags)
                `bcount` INTEGER,                        \
                `pcount` INTEGER,                        \
                PRIMARY KEY (`ip`, `helo`, `from`, `to`) \
-           );";
+           );                                           \
+           CREATE INDEX IF NOT EXISTS entries_expire    \
+               ON entries(`expire`);                    \
+           CREATE INDEX IF NOT EXISTS entries_pass      \
+               ON entries(`pass`);                      \
+           CREATE INDEX IF NOT EXISTS entries_first     \
+               ON entries(`first`);";
     ret = sqlite3_exec(dbh->db, sql, NULL, NULL, &err);
     if (ret != SQLITE_OK) {
         i_warning("db schema init failed: %s", err);
@@ -154,6 +245,26 @@ Mod_db_open(DB_handle_T handle, int flags)
         goto cleanup;
     }
 
+#if SQLITE_VERSION_NUMBER >= 3008000
+    /*
+     * Partial indexes over the grey tuples waiting to pass, and over the
+     * white & trapped addresses, so that the scan statements need not
+     * visit the rest of the table.
+     */
+    sql = "CREATE INDEX IF NOT EXISTS entries_grey_pass     \
+               ON entries(`pass`)                       \
+               WHERE `from` <> '' AND `to` <> '';       \
+           CREATE INDEX IF NOT EXISTS entries_ip_pcount \
+               ON entries(`ip`, `pcount`)               \
+               WHERE `from` = '' AND `to` = '';";
+    ret = sqlite3_exec(dbh->db, sql, NULL, NULL, &err);
+    if (ret != SQLITE_OK) {
+        i_warning("db scan index init failed: %s", err);
+        sqlite3_free(err);
+        goto cleanup;
+    }
+#endif
+
     free(db_path);
     return;
 
@@ -274,8 +385,14 @@ extern void
 Mod_db_close(DB_handle_T handle)
 {
     struct s3_handle* dbh;
+    int i;
 
     if ((dbh = handle->dbh) != NULL) {
+        for (i = 0; i < S3_NUM_STMTS; i++) {
+            if (dbh->stmts[i] != NULL)
+                sqlite3_finalize(dbh->stmts[i]);
+        }
+
         if (dbh->db) {
             if (sqlite3_close(dbh->db) != SQLITE_OK)
                 i_warning("sqlite3_close: %s", sqlite3_errmsg(dbh->db));
@@ -290,34 +407,17 @@ Mod_db_put(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
 {
     struct s3_handle* dbh = handle->dbh;
     sqlite3_stmt* stmt;
-    char* sql;
     struct Grey_tuple* gt;
     struct Grey_data* gd;
     int ret;
 
     switch (key->type) {
     case DB_KEY_MAIL:
-        sql = "INSERT OR IGNORE INTO spamtraps(address) VALUES (?)";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-
-        ret = sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_bind_text: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-        break;
-
     case DB_KEY_DOM:
-        sql = "INSERT OR IGNORE INTO domains(domain) VALUES (?)";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        stmt = get_stmt(dbh, (key->type == DB_KEY_MAIL ? S3_PUT_MAIL
+                                                       : S3_PUT_DOM));
+        if (stmt == NULL)
             goto err;
-        }
 
         ret = sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC);
         if (ret != SQLITE_OK) {
@@ -327,15 +427,8 @@ Mod_db_put(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
         break;
 
     case DB_KEY_IP:
-        sql = "INSERT OR REPLACE INTO entries "
-              "(`ip`, `helo`, `from`, `to`, "
-              " `first`, `pass`, `expire`, `bcount`, `pcount`) "
-              "VALUES (?, '', '', '', ?, ?, ?, ?, ?)";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        if ((stmt = get_stmt(dbh, S3_PUT_IP)) == NULL)
             goto err;
-        }
 
         gd = &val->data.gd;
         if (!(!sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC)
@@ -350,15 +443,8 @@ Mod_db_put(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
         break;
 
     case DB_KEY_TUPLE:
-        sql = "INSERT OR REPLACE INTO entries "
-              "(`ip`, `helo`, `from`, `to`, "
-              " `first`, `pass`, `expire`, `bcount`, `pcount`) "
-              "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        if ((stmt = get_stmt(dbh, S3_PUT_TUPLE)) == NULL)
             goto err;
-        }
 
         gt = &key->data.gt;
         gd = &val->data.gd;
@@ -381,16 +467,15 @@ Mod_db_put(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
     }
 
     ret = sqlite3_step(stmt);
+    release_stmt(stmt);
     if (ret != SQLITE_DONE) {
         i_warning("Mod_db_put: unexpected sqlite3_step result: %d", ret);
-        sqlite3_finalize(stmt);
         return GREYDB_ERR;
     }
-    sqlite3_finalize(stmt);
     return GREYDB_OK;
 
 err:
-    sqlite3_finalize(stmt);
+    release_stmt(stmt);
     DB_rollback_txn(handle);
     return GREYDB_ERR;
 }
@@ -400,52 +485,19 @@ Mod_db_get(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
 {
     struct s3_handle* dbh = handle->dbh;
     sqlite3_stmt* stmt;
-    char* sql;
     struct Grey_tuple* gt;
-    int ret, res;
+    int ret, res = GREYDB_ERR;
 
     switch (key->type) {
     case DB_KEY_DOM_PART:
-        sql = "SELECT 0, 0, 0, 0, -3 FROM domains WHERE ? LIKE '%' || domain";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-
-        ret = sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_bind_text: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-        break;
-
     case DB_KEY_MAIL:
-        sql = "SELECT 0, 0, 0, 0, -2 "
-              "FROM spamtraps WHERE `address`=? "
-              "LIMIT 1";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-
-        ret = sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_bind_text: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-        break;
-
     case DB_KEY_DOM:
-        sql = "SELECT 0, 0, 0, 0, -3 "
-              "FROM domains WHERE `domain`=? "
-              "LIMIT 1";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        stmt = get_stmt(dbh, (key->type == DB_KEY_DOM_PART
+                                     ? S3_GET_DOM_PART
+                                     : (key->type == DB_KEY_MAIL ? S3_GET_MAIL
+                                                                 : S3_GET_DOM)));
+        if (stmt == NULL)
             goto err;
-        }
 
         ret = sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC);
         if (ret != SQLITE_OK) {
@@ -455,16 +507,8 @@ Mod_db_get(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
         break;
 
     case DB_KEY_IP:
-        sql = "SELECT `first`, `pass`, `expire`, `bcount`, `pcount`"
-              "FROM entries "
-              "WHERE `ip`=? AND `helo`='' AND `from`='' "
-              "AND `to`='' "
-              "LIMIT 1";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        if ((stmt = get_stmt(dbh, S3_GET_IP)) == NULL)
             goto err;
-        }
 
         if (sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC)
             != SQLITE_OK) {
@@ -474,15 +518,8 @@ Mod_db_get(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
         break;
 
     case DB_KEY_TUPLE:
-        sql = "SELECT `first`, `pass`, `expire`, `bcount`, `pcount`"
-              "FROM entries "
-              "WHERE `ip`=? AND `helo`=? AND `from`=? AND `to`=? "
-              "LIMIT 1";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        if ((stmt = get_stmt(dbh, S3_GET_TUPLE)) == NULL)
             goto err;
-        }
 
         gt = &key->data.gt;
         if (!(!sqlite3_bind_text(stmt, 1, gt->ip, -1, SQLITE_STATIC)
@@ -518,7 +555,7 @@ Mod_db_get(DB_handle_T handle, struct DB_key* key, struct DB_val* val)
     }
 
 err:
-    sqlite3_finalize(stmt);
+    release_stmt(stmt);
     return res;
 }
 
@@ -528,48 +565,18 @@ Mod_db_del(DB_handle_T handle, struct DB_key* key)
     struct s3_handle* dbh = handle->dbh;
     struct Grey_tuple* gt;
     sqlite3_stmt* stmt;
-    char* sql;
     int ret;
 
     switch (key->type) {
     case DB_KEY_MAIL:
-        sql = "DELETE FROM spamtraps WHERE `address`=?";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-
-        ret = sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_bind_text: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-        break;
-
     case DB_KEY_DOM:
-        sql = "DELETE FROM domains WHERE `domain`=?";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-
-        ret = sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_bind_text: %s", sqlite3_errmsg(dbh->db));
-            goto err;
-        }
-        break;
-
     case DB_KEY_IP:
-        sql = "DELETE FROM entries WHERE `ip`=? "
-              "AND `helo`='' AND `from`='' AND `to`=''";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        stmt = get_stmt(dbh, (key->type == DB_KEY_MAIL
+                                     ? S3_DEL_MAIL
+                                     : (key->type == DB_KEY_DOM ? S3_DEL_DOM
+                                                                : S3_DEL_IP)));
+        if (stmt == NULL)
             goto err;
-        }
 
         ret = sqlite3_bind_text(stmt, 1, key->data.s, -1, SQLITE_STATIC);
         if (ret != SQLITE_OK) {
@@ -579,13 +586,8 @@ Mod_db_del(DB_handle_T handle, struct DB_key* key)
         break;
 
     case DB_KEY_TUPLE:
-        sql = "DELETE FROM entries WHERE `ip`=? "
-              "AND `helo`=? AND `from`=? AND `to`=?";
-        ret = sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL);
-        if (ret != SQLITE_OK) {
-            i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        if ((stmt = get_stmt(dbh, S3_DEL_TUPLE)) == NULL)
             goto err;
-        }
 
         gt = &key->data.gt;
         if (!(!sqlite3_bind_text(stmt, 1, gt->ip, -1, SQLITE_STATIC)
@@ -602,20 +604,66 @@ Mod_db_del(DB_handle_T handle, struct DB_key* key)
     }
 
     ret = sqlite3_step(stmt);
+    release_stmt(stmt);
     if (ret != SQLITE_DONE) {
         i_warning("Mod_db_del: unexpected sqlite3_step result: %d", ret);
-        sqlite3_finalize(stmt);
         return GREYDB_ERR;
     }
-    sqlite3_finalize(stmt);
     return GREYDB_OK;
 
 err:
-    sqlite3_finalize(stmt);
+    release_stmt(stmt);
     DB_rollback_txn(handle);
     return GREYDB_ERR;
 }
 
+extern int
+Mod_db_get_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int* found, int n)
+{
+    struct s3_handle* dbh = handle->dbh;
+    int i, own_txn = 0, ret = GREYDB_OK;
+
+    /*
+     * Outside of a transaction, read the batch from a single snapshot
+     * rather than locking the database for each statement.
+     */
+    if (!dbh->txn
+        && sqlite3_exec(dbh->db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK) {
+        own_txn = 1;
+    }
+
+    for (i = 0; i < n && ret == GREYDB_OK; i++) {
+        switch ((found[i] = Mod_db_get(handle, &keys[i], &vals[i]))) {
+        case GREYDB_FOUND:
+        case GREYDB_NOT_FOUND:
+            break;
+
+        default:
+            ret = GREYDB_ERR;
+            break;
+        }
+    }
+
+    if (own_txn)
+        sqlite3_exec(dbh->db, "COMMIT", NULL, NULL, NULL);
+
+    return ret;
+}
+
+extern int
+Mod_db_put_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    return write_many(handle, keys, vals, n);
+}
+
+extern int
+Mod_db_del_many(DB_handle_T handle, struct DB_key* keys, int n)
+{
+    return write_many(handle, keys, NULL, n);
+}
+
 extern void
 Mod_db_get_itr(DB_itr_T itr, int types)
 {
@@ -663,6 +711,74 @@ err:
     exit(1);
 }
 
+extern void
+Mod_db_get_itr_after(DB_itr_T itr, struct DB_key* after)
+{
+    struct s3_handle* dbh = itr->handle->dbh;
+    struct s3_itr* dbi = NULL;
+    const char* params[4] = { "", "", "", "" };
+    char* sql;
+    int ret, i;
+
+    if ((dbi = malloc(sizeof(*dbi))) == NULL) {
+        i_warning("malloc: %s", strerror(errno));
+        goto err;
+    }
+    dbi->stmt = NULL;
+    dbi->curr = NULL;
+    itr->dbi = dbi;
+
+    /*
+     * Entries are ordered by the primary key, so that the iteration can
+     * be resumed from the last key returned. The leading comparison on
+     * the ip allows the primary key index to be used.
+     */
+    if (after == NULL) {
+        sql = "SELECT `ip`, `helo`, `from`, `to`, "
+              "`first`, `pass`, `expire`, `bcount`, `pcount` FROM entries "
+              "ORDER BY `ip`, `helo`, `from`, `to`";
+    } else {
+        sql = "SELECT `ip`, `helo`, `from`, `to`, "
+              "`first`, `pass`, `expire`, `bcount`, `pcount` FROM entries "
+              "WHERE `ip` >= ?1 AND (`ip` > ?1 OR (`helo` > ?2 "
+              "OR (`helo` = ?2 AND (`from` > ?3 "
+              "OR (`from` = ?3 AND `to` > ?4))))) "
+              "ORDER BY `ip`, `helo`, `from`, `to`";
+
+        if (after->type == DB_KEY_TUPLE) {
+            params[0] = after->data.gt.ip;
+            params[1] = after->data.gt.helo;
+            params[2] = after->data.gt.from;
+            params[3] = after->data.gt.to;
+        } else {
+            params[0] = after->data.s;
+        }
+    }
+
+    ret = sqlite3_prepare_v2(dbh->db, sql, -1, &dbi->stmt, NULL);
+    if (ret != SQLITE_OK) {
+        i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        goto err;
+    }
+
+    if (after != NULL) {
+        for (i = 0; i < 4; i++) {
+            if (sqlite3_bind_text(dbi->stmt, i + 1, params[i], -1,
+                    SQLITE_TRANSIENT)
+                != SQLITE_OK) {
+                i_warning("sqlite3_bind_text: %s", sqlite3_errmsg(dbh->db));
+                goto err;
+            }
+        }
+    }
+    return;
+
+err:
+    DB_rollback_txn(itr->handle);
+    sqlite3_close(dbh->db);
+    exit(1);
+}
+
 extern void
 Mod_db_itr_close(DB_itr_T itr)
 {
@@ -735,19 +851,91 @@ Mod_scan_db(DB_handle_T handle, time_t* now, List_T whitelist,
     List_T whitelist_ipv6, List_T traplist, time_t* white_exp)
 {
     struct s3_handle* dbh = handle->dbh;
-    sqlite3_stmt* stmt;
-    char* sql;
-    int ret = GREYDB_OK;
+    sqlite3_stmt* stmt = NULL;
+    int ret;
+
+    if ((ret = expire_and_promote(handle, now, white_exp, NULL)) != GREYDB_OK)
+        goto cleanup;
+
+    /* Add greytrap & whitelist entries. */
+    if ((stmt = get_stmt(dbh, S3_SCAN_LISTS)) == NULL) {
+        ret = GREYDB_ERR;
+        goto cleanup;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        add_list_entry(stmt, whitelist, whitelist_ipv6, traplist);
+
+cleanup:
+    release_stmt(stmt);
+    return ret;
+}
+
+extern int
+Mod_scan_db_changes(DB_handle_T handle, time_t* now, time_t* since,
+    List_T whitelist, List_T whitelist_ipv6, List_T traplist, List_T removed,
+    time_t* white_exp)
+{
+    struct s3_handle* dbh = handle->dbh;
+    sqlite3_stmt* stmt = NULL;
+    int ret;
+
+    if ((ret = expire_and_promote(handle, now, white_exp, removed))
+        != GREYDB_OK)
+        goto cleanup;
 
     /*
-     * Delete expired entries and whitelist appropriate grey entries,
-     * by un-setting the tuple fields (to, from, helo), but only if there
-     * is not already a conflicting entry with the same IP address
-     * (ie an existing trap entry).
+     * Only fetch the IP entries which are new since the last scan, or
+     * which were whitelisted above. Both conditions are satisfied by
+     * the first & expire indexes.
      */
-    sql = "DELETE FROM entries WHERE expire <= ?";
+    if (!((stmt = get_stmt(dbh, S3_SCAN_CHANGES)) != NULL
+            && !sqlite3_bind_int64(stmt, 1, *since)
+            && !sqlite3_bind_int64(stmt, 2, *now + *white_exp))) {
+        i_warning("fetch changed entries: %s", sqlite3_errmsg(dbh->db));
+        ret = GREYDB_ERR;
+        goto cleanup;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        add_list_entry(stmt, whitelist, whitelist_ipv6, traplist);
+
+cleanup:
+    release_stmt(stmt);
+    return ret;
+}
+
+/*
+ * Delete expired entries and whitelist appropriate grey entries, by
+ * un-setting the tuple fields (to, from, helo), but only if there is not
+ * already a conflicting entry with the same IP address (ie an existing
+ * trap entry). If the removed list is supplied, it is populated with the
+ * expired white & trapped addresses.
+ */
+static int
+expire_and_promote(DB_handle_T handle, time_t* now, time_t* white_exp,
+    List_T removed)
+{
+    struct s3_handle* dbh = handle->dbh;
+    sqlite3_stmt* stmt = NULL;
+    int ret = GREYDB_OK;
+
+    if (removed != NULL) {
+        if (!((stmt = get_stmt(dbh, S3_SCAN_EXPIRED)) != NULL
+                && !sqlite3_bind_int64(stmt, 1, *now))) {
+            i_warning("fetch expired entries: %s", sqlite3_errmsg(dbh->db));
+            ret = GREYDB_ERR;
+            goto cleanup;
+        }
 
-    if (!(!sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL)
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            List_insert_after(removed,
+                strdup((const char*)sqlite3_column_text(stmt, 0)));
+        }
+        release_stmt(stmt);
+    }
+
+    if (!((stmt = get_stmt(dbh, S3_SCAN_DELETE)) != NULL
             && !sqlite3_bind_int64(stmt, 1, *now))) {
         i_warning("delete expired entries: %s", sqlite3_errmsg(dbh->db));
         ret = GREYDB_ERR;
@@ -759,69 +947,49 @@ Mod_scan_db(DB_handle_T handle, time_t* now, List_T whitelist,
         ret = GREYDB_ERR;
         goto cleanup;
     }
-    sqlite3_finalize(stmt);
+    release_stmt(stmt);
 
-    sql = "UPDATE OR REPLACE entries "
-          "SET `helo` = '', `from` = '', `to` = '', `expire` = ? "
-          "WHERE `from` <> '' AND `to` <> '' AND `pcount` >= 0 AND `pass` <= ? "
-          "AND `ip` NOT IN ( "
-          "    SELECT `ip` FROM entries WHERE `from` = '' AND `to` = '' "
-          ")";
-
-    if (!(!sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL)
+    /*
+     * The correlated lookup of an existing white or trap entry for the
+     * same address is satisfied by the primary key.
+     */
+    if (!((stmt = get_stmt(dbh, S3_SCAN_PROMOTE)) != NULL
             && !sqlite3_bind_int64(stmt, 1, *now + *white_exp)
             && !sqlite3_bind_int64(stmt, 2, *now))) {
-        i_warning("Mod_scan_db: update db entries: %s", sqlite3_errmsg(dbh->db));
+        i_warning("update db entries: %s", sqlite3_errmsg(dbh->db));
         ret = GREYDB_ERR;
         goto cleanup;
     }
 
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        i_warning("Mod_scan_db: unexpected sqlite3_step result: %s", sqlite3_errmsg(dbh->db));
-        ret = GREYDB_ERR;
-        goto cleanup;
-    }
-    sqlite3_finalize(stmt);
-
-    /* Add greytrap & whitelist entries. */
-    sql = "SELECT `ip`, NULL, NULL FROM entries             \
-        WHERE `to`='' AND `from`='' AND `ip` NOT LIKE '%:%' \
-            AND `pcount` >= 0                               \
-        UNION                                               \
-        SELECT NULL, `ip`, NULL FROM entries                \
-        WHERE `to`='' AND `from`='' AND `ip` LIKE '%:%'     \
-            AND `pcount` >= 0                               \
-        UNION                                               \
-        SELECT NULL, NULL, `ip` FROM entries                \
-        WHERE `to`='' AND `from`='' AND `pcount` < 0";
-
-    if (sqlite3_prepare(dbh->db, sql, strlen(sql) + 1, &stmt, NULL)) {
-        i_warning("fetch white/trap entries: %s", sqlite3_errmsg(dbh->db));
+        i_warning("update db entries: unexpected sqlite3_step result: %s",
+            sqlite3_errmsg(dbh->db));
         ret = GREYDB_ERR;
         goto cleanup;
     }
 
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
-            List_insert_after(
-                whitelist,
-                strdup((const char*)sqlite3_column_text(stmt, 0)));
-        } else if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
-            List_insert_after(
-                whitelist_ipv6,
-                strdup((const char*)sqlite3_column_text(stmt, 1)));
-        } else if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
-            List_insert_after(
-                traplist,
-                strdup((const char*)sqlite3_column_text(stmt, 2)));
-        }
-    }
-
 cleanup:
-    sqlite3_finalize(stmt);
+    release_stmt(stmt);
     return ret;
 }
 
+/*
+ * Add an (ip, pcount) row to the trap list or the appropriate whitelist.
+ */
+static void
+add_list_entry(sqlite3_stmt* stmt, List_T whitelist, List_T whitelist_ipv6,
+    List_T traplist)
+{
+    const char* ip = (const char*)sqlite3_column_text(stmt, 0);
+
+    if (sqlite3_column_int(stmt, 1) < 0)
+        List_insert_after(traplist, strdup(ip));
+    else if (strchr(ip, ':') != NULL)
+        List_insert_after(whitelist_ipv6, strdup(ip));
+    else
+        List_insert_after(whitelist, strdup(ip));
+}
+
 static void
 populate_key(sqlite3_stmt* stmt, struct DB_key* key, int from)
 {
@@ -893,3 +1061,113 @@ populate_val(sqlite3_stmt* stmt, struct DB_val* val, int from)
     gd->bcount = sqlite3_column_int(stmt, from + 3);
     gd->pcount = sqlite3_column_int(stmt, from + 4);
 }
+
+/*
+ * Fetch the cached statement, preparing it on first use.
+ */
+static sqlite3_stmt*
+get_stmt(struct s3_handle* dbh, enum s3_stmt which)
+{
+    if (dbh->stmts[which] == NULL
+        && sqlite3_prepare_v2(dbh->db, s3_sql[which], -1,
+               &dbh->stmts[which], NULL)
+            != SQLITE_OK) {
+        i_warning("sqlite3_prepare: %s", sqlite3_errmsg(dbh->db));
+        dbh->stmts[which] = NULL;
+    }
+
+    return dbh->stmts[which];
+}
+
+/*
+ * Reset a cached statement for its next use, dropping the bindings to
+ * the caller's strings.
+ */
+static void
+release_stmt(sqlite3_stmt* stmt)
+{
+    if (stmt != NULL) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+}
+
+/*
+ * Apply the configured tuning options to a newly opened database.
+ */
+static void
+set_pragmas(DB_handle_T handle)
+{
+    struct s3_handle* dbh = handle->dbh;
+    char *journal_mode, *synchronous, *sql, *err;
+    int mmap_size, cache_size, busy_timeout, i;
+    char* pragmas[4] = { NULL, NULL, NULL, NULL };
+
+    journal_mode = Config_get_str(handle->config, "journal_mode", "database",
+        NULL);
+    synchronous = Config_get_str(handle->config, "synchronous", "database",
+        NULL);
+    mmap_size = Config_get_int(handle->config, "mmap_size", "database", 0);
+    cache_size = Config_get_int(handle->config, "cache_size", "database", 0);
+    busy_timeout = Config_get_int(handle->config, "busy_timeout", "database",
+        0);
+
+    if (journal_mode)
+        asprintf(&pragmas[0], "PRAGMA journal_mode = %s", journal_mode);
+    if (synchronous)
+        asprintf(&pragmas[1], "PRAGMA synchronous = %s", synchronous);
+    if (mmap_size > 0)
+        asprintf(&pragmas[2], "PRAGMA mmap_size = %d", mmap_size);
+    if (cache_size != 0)
+        asprintf(&pragmas[3], "PRAGMA cache_size = %d", cache_size);
+
+    for (i = 0; i < 4; i++) {
+        if ((sql = pragmas[i]) == NULL)
+            continue;
+
+        if (sqlite3_exec(dbh->db, sql, NULL, NULL, &err) != SQLITE_OK) {
+            i_warning("%s failed: %s", sql, err);
+            sqlite3_free(err);
+        }
+        free(sql);
+    }
+
+    /*
+     * Let SQLite wait for locks held by the other processes, before
+     * falling back to retrying the transaction.
+     */
+    if (busy_timeout > 0)
+        sqlite3_busy_timeout(dbh->db, busy_timeout);
+}
+
+/*
+ * Make a batch of puts, or deletes if there are no values, committing
+ * them together if the caller is not already in a transaction.
+ */
+static int
+write_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    struct s3_handle* dbh = handle->dbh;
+    int i, own_txn = 0, ret = GREYDB_OK;
+
+    if (!dbh->txn) {
+        if (Mod_db_start_txn(handle) != SQLITE_OK)
+            return GREYDB_ERR;
+        own_txn = 1;
+    }
+
+    for (i = 0; i < n && ret == GREYDB_OK; i++) {
+        ret = (vals ? Mod_db_put(handle, &keys[i], &vals[i])
+                    : Mod_db_del(handle, &keys[i]));
+    }
+
+    if (own_txn) {
+        if (ret == GREYDB_OK && Mod_db_commit_txn(handle) != SQLITE_OK)
+            ret = GREYDB_ERR;
+        if (ret != GREYDB_OK)
+            Mod_db_rollback_txn(handle);
+    }
+
+    return ret;
+}
@@ -65,6 +65,7 @@ struct Blacklist_T {
     int type;
     struct Trie* trie;
     struct Blacklist_entry* entries;
+    unsigned long hits; /* Connections matched, as kept by greyd. */
 };
 
 /**
@@ -30,6 +30,7 @@
 #include <arpa/inet.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <poll.h>
 #include <stdbool.h>
@@ -38,6 +39,13 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_LINUX_NETFILTER_IPV4_H
+#include <linux/netfilter_ipv4.h>
+#ifndef IP6T_SO_ORIGINAL_DST
+#define IP6T_SO_ORIGINAL_DST 80
+#endif
+#endif
+
 #include "blacklist.h"
 #include "con.h"
 #include "config_parser.h"
@@ -47,6 +55,7 @@
 #include "hash.h"
 #include "ip.h"
 #include "list.h"
+#include "stats.h"
 #include "utils.h"
 
 #define DNAT_LOOKUP_TIMEOUT 1000 /* In ms. */
@@ -56,6 +65,11 @@
 #define PROXY_ERROR 2
 
 static int match(const char*, const char*);
+static int sockopt_orig_dst(struct Con*);
+static void send_grey(struct Con*, struct Greyd_state*);
+static void resume_nat(struct Con*, struct Greyd_state*, const char*);
+static void process_nat_reply(Config_T, void*);
+static double elapsed_ms(struct timespec*);
 static void get_helo(char*, size_t, char*);
 static void set_log(char*, size_t, char*);
 static void destroy_blacklist(void*);
@@ -126,14 +140,17 @@ Con_init(struct Con* con, int fd, struct sockaddr_storage* src,
                 /* Make a local copy for the connection (excluding the entries). */
                 con_blacklist = Blacklist_create(bl_name, blacklist->message, BL_STORAGE_TRIE);
                 List_insert_after(con->blacklists, con_blacklist);
+                blacklist->hits++;
             }
         }
         List_destroy(&bl_names);
     }
 
     state->clients++;
+    state->stats.accepts++;
     if (List_size(con->blacklists) > 0) {
         state->black_clients++;
+        state->stats.accepts_black++;
         con->lists = Con_summarize_lists(con);
 
         /* Abandon stuttering if there are to many blacklisted connections. */
@@ -166,6 +183,10 @@ Con_close(struct Con* con, struct Greyd_state* state)
     con->fd = -1;
     state->slow_until = 0;
 
+    if (con->nat_state == CON_NAT_WAIT)
+        state->nat_pending--;
+    con->nat_state = CON_NAT_NONE;
+
     time(&now);
     i_info("%s: disconnected after %lld seconds.%s%s",
         con->src_addr, (long long)(now - con->s),
@@ -338,6 +359,8 @@ Con_handle_write(struct Con* con, time_t* now, struct Greyd_state* state)
         default:
             con->out_p += nwritten;
             con->out_remaining -= nwritten;
+            if (within_max && con->stutter)
+                state->stats.stutter_bytes += nwritten;
             break;
         }
     }
@@ -515,21 +538,11 @@ Con_next_state(struct Con* con, time_t* now, struct Greyd_state* state)
 
                 if (greylist && List_size(con->blacklists) == 0) {
                     /*
-                     * Send this information to the greylister.
+                     * Send this information to the greylister, once the
+                     * original destination is known.
                      */
-                    Con_get_orig_dst(con, state);
-                    fprintf(state->grey_out,
-                        "type = %d\n"
-                        "dst_ip = \"%s\"\n"
-                        "ip = \"%s\"\n"
-                        "helo = \"%s\"\n"
-                        "from = \"%s\"\n"
-                        "to = \"%s\"\n"
-                        "%%\n",
-                        GREY_MSG_GREY, con->dst_addr,
-                        con->src_addr, con->helo,
-                        con->mail, con->rcpt);
-                    fflush(state->grey_out);
+                    if (Con_get_orig_dst(con, state) == 0)
+                        send_grey(con, state);
                 }
             } else {
                 i_debug("incomplete sender and/or recipient; "
@@ -809,19 +822,13 @@ error:
     }
 }
 
-extern void
+extern int
 Con_get_orig_dst(struct Con* con, struct Greyd_state* state)
 {
     struct sockaddr_storage ss_proxy;
     socklen_t proxy_len = sizeof(ss_proxy);
-    char proxy[INET6_ADDRSTRLEN], *dst;
-    Lexer_source_T source;
-    Lexer_T lexer;
-    Config_parser_T parser;
-    Config_T message;
-    struct pollfd fd;
+    char proxy[INET6_ADDRSTRLEN];
     unsigned short src_port, proxy_port;
-    int read_fd;
 
     if (state->proxy_protocol_enabled) {
         /*
@@ -829,18 +836,28 @@ Con_get_orig_dst(struct Con* con, struct Greyd_state* state)
          * address from the obtained proxy info line, so don't bother poking
          * into the NAT table here.
          */
-        return;
+        return 0;
     }
 
+    /* Subsequent recipients reuse the previous lookup. */
+    if (con->nat_state == CON_NAT_DONE)
+        return 0;
+
+    if (sockopt_orig_dst(con) == 0)
+        return 0;
+
+    if (state->fw_out == NULL)
+        return 0;
+
     if (getsockname(con->fd, (struct sockaddr*)&ss_proxy, &proxy_len) == -1)
-        return;
+        return 0;
 
     if (getnameinfo((struct sockaddr*)&ss_proxy,
             IP_SOCKADDR_LEN(((struct sockaddr*)&ss_proxy)),
             proxy, sizeof(proxy),
             NULL, 0, NI_NUMERICHOST)
         != 0) {
-        return;
+        return 0;
     }
 
     if (((struct sockaddr*)&con->src)->sa_family == AF_INET) {
@@ -851,49 +868,72 @@ Con_get_orig_dst(struct Con* con, struct Greyd_state* state)
         proxy_port = ((struct sockaddr_in6*)&ss_proxy)->sin6_port;
     }
 
+    /*
+     * The id is echoed in the reply, to find this connection again. Ids
+     * are positive, as an id of 0 is never echoed.
+     */
+    if (state->nat_id <= 0 || state->nat_id == INT_MAX)
+        state->nat_id = 1;
+    else
+        state->nat_id++;
+
     fprintf(state->fw_out,
         "type=\"nat\"\n"
+        "id=%d\n"
         "src=\"%s\"\n"
         "src_port=%u\n"
         "proxy=\"%s\"\n"
         "proxy_port=%u\n%%\n",
-        con->src_addr, src_port,
+        state->nat_id, con->src_addr, src_port,
         proxy, proxy_port);
     if (fflush(state->fw_out) == EOF)
-        return;
-
-    /* Fetch response from firewall thread. */
-    *con->dst_addr = '\0';
+        return 0;
 
     /*
-     * Duplicate the descriptor so that the pipe isn't closed
-     * upon destroying the lexer source.
+     * Park the connection's pending output until the reply arrives, so
+     * that other connections may progress in the meantime.
      */
-    if ((read_fd = dup(fileno(state->fw_in))) == -1)
-        i_critical("dup: %s", strerror(errno));
-
-    memset(&fd, 0, sizeof(fd));
-    fd.fd = read_fd;
-    fd.events = POLLIN;
-    if (poll(&fd, 1, DNAT_LOOKUP_TIMEOUT) == -1) {
-        i_warning("poll original dst: %s", strerror(errno));
-        return;
-    }
+    *con->dst_addr = '\0';
+    con->nat_state = CON_NAT_WAIT;
+    con->nat_id = state->nat_id;
+    clock_gettime(CLOCK_MONOTONIC, &con->nat_start);
+    con->nat_w = con->w;
+    con->w = 0;
+    state->nat_pending++;
+
+    return 1;
+}
 
-    if (fd.revents & POLLIN) {
-        source = Lexer_source_create_from_fd(fd.fd);
-        lexer = Config_lexer_create(source);
-        message = Config_create();
-        parser = Config_parser_create(lexer);
+struct nat_reply_ctx {
+    struct Greyd_state* state;
+    time_t* now;
+};
 
-        if (Config_parser_start(parser, message) == CONFIG_PARSER_OK) {
-            dst = Config_get_str(message, "dst", NULL, "");
-            sstrncpy(con->dst_addr, dst, sizeof(con->dst_addr));
-        }
+extern void
+Con_handle_nat_reply(struct Greyd_state* state, time_t* now)
+{
+    struct nat_reply_ctx ctx;
+
+    ctx.state = state;
+    ctx.now = now;
+    if (Greyd_read_messages(fileno(state->fw_in), &state->nat_buf,
+            process_nat_reply, &ctx)
+        == -1) {
+        i_debug("firewall nat pipe read error");
+    }
+}
 
-        Config_destroy(&message);
-        Config_parser_destroy(&parser);
+extern void
+Con_check_nat_timeout(struct Con* con, time_t* now, struct Greyd_state* state)
+{
+    if (con->nat_state != CON_NAT_WAIT
+        || elapsed_ms(&con->nat_start) < DNAT_LOOKUP_TIMEOUT) {
+        return;
     }
+
+    i_debug("%s: original destination lookup timed out", con->src_addr);
+    state->nat_timeouts++;
+    resume_nat(con, state, "");
 }
 
 extern void
@@ -937,6 +977,118 @@ Con_accept(int fd, struct sockaddr_storage* addr, struct Greyd_state* state)
     }
 }
 
+/*
+ * When greyd is itself the target of a REDIRECT rule, the original
+ * destination is available directly from the socket, avoiding the
+ * round trip to the firewall process.
+ */
+static int
+sockopt_orig_dst(struct Con* con)
+{
+#ifdef SO_ORIGINAL_DST
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    int ret;
+
+    memset(&ss, 0, sizeof(ss));
+    if (((struct sockaddr*)&con->src)->sa_family == AF_INET6)
+        ret = getsockopt(con->fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, &ss, &len);
+    else
+        ret = getsockopt(con->fd, SOL_IP, SO_ORIGINAL_DST, &ss, &len);
+
+    if (ret == 0
+        && getnameinfo((struct sockaddr*)&ss,
+               IP_SOCKADDR_LEN(((struct sockaddr*)&ss)),
+               con->dst_addr, sizeof(con->dst_addr),
+               NULL, 0, NI_NUMERICHOST)
+            == 0) {
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+static void
+send_grey(struct Con* con, struct Greyd_state* state)
+{
+    fprintf(state->grey_out,
+        "type = %d\n"
+        "dst_ip = \"%s\"\n"
+        "ip = \"%s\"\n"
+        "helo = \"%s\"\n"
+        "from = \"%s\"\n"
+        "to = \"%s\"\n"
+        "%%\n",
+        GREY_MSG_GREY, con->dst_addr,
+        con->src_addr, con->helo,
+        con->mail, con->rcpt);
+    fflush(state->grey_out);
+    state->stats.grey_messages++;
+}
+
+/*
+ * Complete a waiting connection's greylisting and restore its pending
+ * output.
+ */
+static void
+resume_nat(struct Con* con, struct Greyd_state* state, const char* dst)
+{
+    sstrncpy(con->dst_addr, dst, sizeof(con->dst_addr));
+    con->nat_state = CON_NAT_DONE;
+    state->nat_pending--;
+
+    send_grey(con, state);
+    con->w = con->nat_w;
+}
+
+static void
+process_nat_reply(Config_T message, void* arg)
+{
+    struct nat_reply_ctx* ctx = arg;
+    struct Greyd_state* state = ctx->state;
+    struct Con* con;
+    double latency;
+    char* dst;
+    int i, id;
+
+    id = Config_get_int(message, "id", NULL, 0);
+    dst = Config_get_str(message, "dst", NULL, "");
+
+    for (i = 0; i < state->max_cons; i++) {
+        con = &state->cons[i];
+        if (con->fd == -1 || con->nat_state != CON_NAT_WAIT
+            || con->nat_id != id) {
+            continue;
+        }
+
+        latency = elapsed_ms(&con->nat_start);
+        state->nat_lookups++;
+        state->nat_latency_total += latency;
+        if (latency > state->nat_latency_max)
+            state->nat_latency_max = latency;
+        Stats_observe(&state->stats.nat_latency, latency / 1000);
+
+        i_debug("%s: original destination %s in %.3f ms",
+            con->src_addr, (*dst ? dst : "unknown"), latency);
+        resume_nat(con, state, dst);
+        return;
+    }
+
+    /* The connection has since timed out or closed. */
+    i_debug("discarding original destination reply %d", id);
+}
+
+static double
+elapsed_ms(struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0
+        + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
 static int
 match(const char* a, const char* b)
 {
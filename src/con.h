@@ -62,6 +62,13 @@
 #define CON_STATE_REPLY 98
 #define CON_STATE_CLOSE 99
 
+/**
+ * Original destination lookup states.
+ */
+#define CON_NAT_NONE 0
+#define CON_NAT_WAIT 1
+#define CON_NAT_DONE 2
+
 /**
  * Main structure encapsulating the state of a single connection.
  */
@@ -105,6 +112,15 @@ struct Con {
     int stutter;
     int bad_cmd;
     int seen_cr;
+
+    /*
+     * While waiting on the firewall process for the original destination,
+     * the pending write is parked in nat_w.
+     */
+    int nat_state;
+    int nat_id;
+    struct timespec nat_start;
+    time_t nat_w;
 };
 
 /**
@@ -143,9 +159,27 @@ extern void Con_handle_write(struct Con* con, time_t* now,
 
 /**
  * Attempt to find and set the address the client originally
- * connected to.
+ * connected to. If the address is not immediately available, a lookup
+ * request is sent to the firewall process and the connection's output
+ * is suspended until the reply arrives.
+ *
+ * @return 0 if the lookup has completed.
+ * @return 1 if the connection is waiting for a reply.
  */
-extern void Con_get_orig_dst(struct Con* con, struct Greyd_state* state);
+extern int Con_get_orig_dst(struct Con* con, struct Greyd_state* state);
+
+/**
+ * Read the original destination replies from the firewall process, and
+ * resume the matching waiting connections.
+ */
+extern void Con_handle_nat_reply(struct Greyd_state* state, time_t* now);
+
+/**
+ * Resume a connection that has been waiting for longer than the lookup
+ * timeout, without an original destination.
+ */
+extern void Con_check_nat_timeout(struct Con* con, time_t* now,
+    struct Greyd_state* state);
 
 /**
  * Return a suitably sized string summarizing the lists containing,
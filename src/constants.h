@@ -42,6 +42,9 @@
 #define GREYD_BANNER "greyd IP-based SPAM blocker"
 #define NUM_BLACKLISTS 10
 #define TRACK_OUTBOUND 1
+#define GREYLOGD_REFRESH_WINDOW 60 /* In seconds. */
+#define GREYLOGD_REFRESH_MAX 65536 /* Addresses remembered. */
+#define GREYLOGD_STATS_INTERVAL 3600 /* In seconds. */
 #define SPF_ENABLED 1
 #define SPF_WHITELIST_PASS 0
 #define SPF_TRAP_SOFTFAIL 1
@@ -24,11 +24,30 @@
 #include "firewall.h"
 #include "config_section.h"
 #include "failures.h"
+#include "hash.h"
+#include "ip.h"
 #include "list.h"
 #include "mod.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#define FW_SETS_INIT_SIZE 4
+#define FW_SET_INIT_SIZE 1024
+
+/* Value stored against each network block in a tracked set. */
+#define FW_SET_MEMBER ((void*)1)
+
+static void destroy_set(struct Hash_entry*);
+static Hash_T track_set(FW_handle_T, const char*);
+static int replace_tracked(FW_handle_T, const char*, Hash_T, short);
+static struct FW_orig_dst* orig_dst_cache_get(FW_handle_T, struct sockaddr*,
+    struct sockaddr*, time_t);
+static void orig_dst_cache_put(FW_handle_T, struct sockaddr*,
+    struct sockaddr*, struct sockaddr*, time_t);
+static int sockaddr_equal(const struct sockaddr*, const struct sockaddr*);
+
 extern FW_handle_T
 FW_open(Config_T config)
 {
@@ -47,6 +66,13 @@ FW_open(Config_T config)
     handle->config = config;
     handle->section = section;
     handle->fwh = NULL;
+    handle->sets = NULL;
+    handle->orig_dst_lookups = 0;
+    if ((handle->orig_dst_cache = calloc(FW_ORIG_DST_CACHE_SIZE,
+             sizeof(*handle->orig_dst_cache)))
+        == NULL) {
+        i_critical("Could not create original destination cache");
+    }
 
     handle->driver = Mod_open(section, "firewall");
 
@@ -56,14 +82,25 @@ FW_open(Config_T config)
         Mod_get(handle->driver, "Mod_fw_close");
     handle->fw_replace = (int (*)(FW_handle_T, const char*, List_T, short))
         Mod_get(handle->driver, "Mod_fw_replace");
+    handle->fw_add = (int (*)(FW_handle_T, const char*, List_T, short))
+        Mod_get_optional(handle->driver, "Mod_fw_add");
+    handle->fw_del = (int (*)(FW_handle_T, const char*, List_T, short))
+        Mod_get_optional(handle->driver, "Mod_fw_del");
+
+    if (handle->fw_add == NULL || handle->fw_del == NULL) {
+        handle->fw_add = handle->fw_del = NULL;
+        handle->sets = Hash_create(FW_SETS_INIT_SIZE, destroy_set);
+    }
     handle->fw_lookup_orig_dst = (int (*)(FW_handle_T, struct sockaddr*, struct sockaddr*, struct sockaddr*))
         Mod_get(handle->driver, "Mod_fw_lookup_orig_dst");
     handle->fw_start_log_capture = (void (*)(FW_handle_T))Mod_get(handle->driver, "Mod_fw_start_log_capture");
     handle->fw_end_log_capture = (void (*)(FW_handle_T))Mod_get(handle->driver, "Mod_fw_end_log_capture");
-    handle->fw_capture_log = (List_T(*)(FW_handle_T))Mod_get(handle->driver, "Mod_fw_capture_log");
+    handle->fw_capture_log = (List_T(*)(FW_handle_T, int))Mod_get(handle->driver, "Mod_fw_capture_log");
 
     if (handle->fw_open(handle) == -1) {
         Mod_close(handle->driver);
+        Hash_destroy(&handle->sets);
+        free(handle->orig_dst_cache);
         free(handle);
         return NULL;
     }
@@ -78,6 +115,8 @@ FW_close(FW_handle_T* handle)
         return;
 
     (*handle)->fw_close(*handle);
+    Hash_destroy(&(*handle)->sets);
+    free((*handle)->orig_dst_cache);
     Mod_close((*handle)->driver);
     free(*handle);
     *handle = NULL;
@@ -86,14 +125,81 @@ FW_close(FW_handle_T* handle)
 extern int
 FW_replace(FW_handle_T handle, const char* set_name, List_T cidrs, short af)
 {
+    struct List_entry* entry;
+    Hash_T set;
+
+    if (handle->sets != NULL) {
+        set = track_set(handle, set_name);
+        Hash_reset(set);
+        LIST_EACH(cidrs, entry)
+        {
+            Hash_insert(set, List_entry_value(entry), FW_SET_MEMBER);
+        }
+    }
+
     return handle->fw_replace(handle, set_name, cidrs, af);
 }
 
+extern int
+FW_add(FW_handle_T handle, const char* set_name, List_T cidrs, short af)
+{
+    struct List_entry* entry;
+    Hash_T set;
+
+    if (handle->sets == NULL)
+        return handle->fw_add(handle, set_name, cidrs, af);
+
+    set = track_set(handle, set_name);
+    LIST_EACH(cidrs, entry)
+    {
+        Hash_insert(set, List_entry_value(entry), FW_SET_MEMBER);
+    }
+
+    return replace_tracked(handle, set_name, set, af);
+}
+
+extern int
+FW_del(FW_handle_T handle, const char* set_name, List_T cidrs, short af)
+{
+    struct List_entry* entry;
+    Hash_T set;
+
+    if (handle->sets == NULL)
+        return handle->fw_del(handle, set_name, cidrs, af);
+
+    set = track_set(handle, set_name);
+    LIST_EACH(cidrs, entry)
+    {
+        Hash_delete(set, List_entry_value(entry));
+    }
+
+    return replace_tracked(handle, set_name, set, af);
+}
+
 extern int
 FW_lookup_orig_dst(FW_handle_T handle, struct sockaddr* src,
     struct sockaddr* proxy, struct sockaddr* orig_dst)
 {
-    return handle->fw_lookup_orig_dst(handle, src, proxy, orig_dst);
+    struct FW_orig_dst* cached;
+    time_t now = time(NULL);
+
+    if ((cached = orig_dst_cache_get(handle, src, proxy, now)) != NULL) {
+        memcpy(orig_dst, &cached->orig_dst,
+            IP_SOCKADDR_LEN((struct sockaddr*)&cached->orig_dst));
+        return 0;
+    }
+
+    if (handle->fw_lookup_orig_dst(handle, src, proxy, orig_dst) == -1)
+        return -1;
+
+    /*
+     * Drivers fall back to the proxy address when no translation is
+     * found, which may be transient so is not cached.
+     */
+    if (!sockaddr_equal(orig_dst, proxy))
+        orig_dst_cache_put(handle, src, proxy, orig_dst, now);
+
+    return 0;
 }
 
 extern void
@@ -109,7 +215,124 @@ FW_end_log_capture(FW_handle_T handle)
 }
 
 extern List_T
-FW_capture_log(FW_handle_T handle)
+FW_capture_log(FW_handle_T handle, int timeout)
 {
-    return handle->fw_capture_log(handle);
+    return handle->fw_capture_log(handle, timeout);
+}
+
+static void
+destroy_set(struct Hash_entry* entry)
+{
+    if (entry && entry->v) {
+        Hash_destroy((Hash_T*)&entry->v);
+    }
+}
+
+static Hash_T
+track_set(FW_handle_T handle, const char* set_name)
+{
+    Hash_T set;
+
+    if ((set = Hash_get(handle->sets, set_name)) == NULL) {
+        set = Hash_create(FW_SET_INIT_SIZE, NULL);
+        Hash_insert(handle->sets, set_name, set);
+    }
+
+    return set;
+}
+
+static int
+replace_tracked(FW_handle_T handle, const char* set_name, Hash_T set,
+    short af)
+{
+    List_T cidrs;
+    int ret;
+
+    if ((cidrs = Hash_keys(set)) == NULL)
+        cidrs = List_create(NULL);
+
+    ret = handle->fw_replace(handle, set_name, cidrs, af);
+    List_destroy(&cidrs);
+
+    return ret;
+}
+
+static struct FW_orig_dst*
+orig_dst_cache_get(FW_handle_T handle, struct sockaddr* src,
+    struct sockaddr* proxy, time_t now)
+{
+    struct FW_orig_dst* entry;
+    int i;
+
+    for (i = 0; i < FW_ORIG_DST_CACHE_SIZE; i++) {
+        entry = handle->orig_dst_cache + i;
+        if (entry->expires > now
+            && sockaddr_equal((struct sockaddr*)&entry->src, src)
+            && sockaddr_equal((struct sockaddr*)&entry->proxy, proxy)) {
+            entry->used = ++handle->orig_dst_lookups;
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Replace an expired entry, otherwise the least recently used.
+ */
+static void
+orig_dst_cache_put(FW_handle_T handle, struct sockaddr* src,
+    struct sockaddr* proxy, struct sockaddr* orig_dst, time_t now)
+{
+    struct FW_orig_dst *entry, *victim = handle->orig_dst_cache;
+    int i;
+
+    for (i = 0; i < FW_ORIG_DST_CACHE_SIZE; i++) {
+        entry = handle->orig_dst_cache + i;
+        if (entry->expires <= now) {
+            victim = entry;
+            break;
+        }
+
+        if (entry->used < victim->used)
+            victim = entry;
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    memcpy(&victim->src, src, IP_SOCKADDR_LEN(src));
+    memcpy(&victim->proxy, proxy, IP_SOCKADDR_LEN(proxy));
+    memcpy(&victim->orig_dst, orig_dst, IP_SOCKADDR_LEN(orig_dst));
+    victim->expires = now + FW_ORIG_DST_CACHE_TTL;
+    victim->used = ++handle->orig_dst_lookups;
+}
+
+/*
+ * Compare the address and port of two socket addresses.
+ */
+static int
+sockaddr_equal(const struct sockaddr* a, const struct sockaddr* b)
+{
+    const struct sockaddr_in *a4, *b4;
+    const struct sockaddr_in6 *a6, *b6;
+
+    if (a->sa_family != b->sa_family)
+        return 0;
+
+    switch (a->sa_family) {
+    case AF_INET:
+        a4 = (const struct sockaddr_in*)a;
+        b4 = (const struct sockaddr_in*)b;
+        return (a4->sin_port == b4->sin_port
+            && a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+
+    case AF_INET6:
+        a6 = (const struct sockaddr_in6*)a;
+        b6 = (const struct sockaddr_in6*)b;
+        return (a6->sin6_port == b6->sin6_port
+            && memcmp(&a6->sin6_addr, &b6->sin6_addr,
+                   sizeof(a6->sin6_addr))
+                == 0);
+    }
+
+    return 0;
 }
@@ -25,11 +25,27 @@
 #define FIREWALL_DEFINED
 
 #include "greyd_config.h"
+#include "hash.h"
 #include "list.h"
 
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <time.h>
+
+#define FW_ORIG_DST_CACHE_SIZE 64
+#define FW_ORIG_DST_CACHE_TTL 30 /* In seconds. */
+
+/**
+ * A recent original destination lookup result.
+ */
+struct FW_orig_dst {
+    struct sockaddr_storage src;
+    struct sockaddr_storage proxy;
+    struct sockaddr_storage orig_dst;
+    time_t expires;
+    unsigned long used; /**< Lookup count when last used, for LRU eviction. */
+};
 
 typedef struct FW_handle_T* FW_handle_T;
 struct FW_handle_T {
@@ -37,13 +53,18 @@ struct FW_handle_T {
     void* driver; /**< Driver dependent handle reference. */
     Config_T config; /**< System configuration. */
     Config_section_T section; /**< Module configuration section. */
+    Hash_T sets; /**< Set contents, for drivers without fw_add/fw_del. */
+    struct FW_orig_dst* orig_dst_cache; /**< Recent original destinations. */
+    unsigned long orig_dst_lookups;
 
     int (*fw_open)(FW_handle_T);
     void (*fw_close)(FW_handle_T);
     int (*fw_replace)(FW_handle_T, const char*, List_T, short);
+    int (*fw_add)(FW_handle_T, const char*, List_T, short);
+    int (*fw_del)(FW_handle_T, const char*, List_T, short);
     void (*fw_start_log_capture)(FW_handle_T);
     void (*fw_end_log_capture)(FW_handle_T);
-    List_T (*fw_capture_log)(FW_handle_T);
+    List_T (*fw_capture_log)(FW_handle_T, int);
     int (*fw_lookup_orig_dst)(FW_handle_T, struct sockaddr*,
         struct sockaddr*, struct sockaddr*);
 };
@@ -64,6 +85,19 @@ extern void FW_close(FW_handle_T* handle);
  */
 extern int FW_replace(FW_handle_T handle, const char* set, List_T cidrs, short af);
 
+/**
+ * Add the supplied list of network blocks to the IP set/table. If the
+ * driver cannot add to a set, the whole set is replaced with the
+ * contents tracked since the last FW_replace.
+ */
+extern int FW_add(FW_handle_T handle, const char* set, List_T cidrs, short af);
+
+/**
+ * Remove the supplied list of network blocks from the IP set/table, as
+ * for FW_add.
+ */
+extern int FW_del(FW_handle_T handle, const char* set, List_T cidrs, short af);
+
 /**
  * Initialize the log capture machinery.
  */
@@ -76,14 +110,18 @@ extern void FW_end_log_capture(FW_handle_T handle);
 
 /**
  * Wait until a suitable log message arrives, then extract and return
- * the IP address (IPv4 or IPv6) as a NUL-terminated string.
+ * the IP address (IPv4 or IPv6) as a NUL-terminated string. The wait is
+ * limited to timeout milliseconds, or the driver's own timeout if -1.
+ * Drivers may wait for less than the timeout, but not for longer.
  */
-extern List_T FW_capture_log(FW_handle_T handle);
+extern List_T FW_capture_log(FW_handle_T handle, int timeout);
 
 /**
  * As connections are redirected to greyd by way of a DNAT, consult
  * the firewall connection tracking to lookup the original destination
- * (ie the destination address before the DNAT took place).
+ * (ie the destination address before the DNAT took place). The most
+ * recently found original destinations are cached for a short time, as
+ * a lookup is made for each recipient of a connection.
  */
 extern int FW_lookup_orig_dst(FW_handle_T handle, struct sockaddr* src,
     struct sockaddr* proxy, struct sockaddr* orig_dst);
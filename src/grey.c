@@ -23,12 +23,18 @@
 
 #include <config.h>
 
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -68,14 +74,47 @@
 #define GREY_WHITE_NAME "greyd-whitelist"
 #define GREY_WHITE_NAME_IPV6 "greyd-whitelist-ipv6"
 
+/* Value stored against each address in the white/trap sets. */
+#define GREY_SET_MEMBER ((void*)1)
+
+/* The white & trap entries looked up and written in one transaction. */
+#define GREY_NON_GREY_BATCH 64
+
+/*
+ * A white or trap entry update, either from greyd or received via sync.
+ */
+struct non_grey {
+    int spamtrap;
+    int delete;
+    char* ip;
+    char* source;
+    char* expires;
+    long expire;
+};
+
 static void destroy_address(void*);
 static void drop_grey_privs(Greylister_T, struct passwd*);
 static void shutdown_greyd(int);
+static void reap_greyd(int);
+static void start_snapshot_server(Greylister_T, struct passwd*);
+static void serve_snapshots(Greylister_T, Sync_engine_T, int);
+static void start_bootstrap(Greylister_T, struct passwd*);
 static int process_message(Greylister_T, Config_T);
+static void process_sync_batch(Greylister_T, List_T);
 static void process_grey(Greylister_T, struct Grey_tuple*, int, char*);
 static void process_non_grey(Greylister_T, int, char*, char*, char*, int, int);
+static int parse_non_grey(struct non_grey*, int, char*, char*, char*, int);
+static void update_non_grey(Greylister_T, struct non_grey*, int, int);
 static int trap_check(Greylister_T, char*);
-static void update_firewall(Greylister_T, int);
+static void update_firewall(Greylister_T, int, List_T, List_T);
+static void read_fw_status(Greylister_T);
+static void process_fw_status(Config_T, void*);
+static void report_stats(Greylister_T);
+static int write_fw_message(Greylister_T, const char*, const char*, int,
+    List_T);
+static int reconcile_set(Hash_T*, List_T, List_T, List_T);
+static int add_to_set(Hash_T, List_T, List_T);
+static int remove_from_set(Hash_T, List_T, List_T);
 #ifdef HAVE_SPF
 static int spf_lookup(Greylister_T, struct Grey_tuple*);
 #endif
@@ -94,10 +133,21 @@ Grey_setup(Config_T config)
     greylister->config = config;
     greylister->trap_out = NULL;
     greylister->grey_in = NULL;
+    greylister->fw_out = NULL;
+    greylister->fw_status_fd = -1;
+    memset(&greylister->fw_status_buf, 0, sizeof(greylister->fw_status_buf));
+    greylister->stats_out = NULL;
     greylister->grey_pid = -1;
     greylister->reader_pid = -1;
+    greylister->snapshot_pid = -1;
+    greylister->bootstrap_pid = -1;
+    greylister->bootstrapped = 0;
     greylister->startup = -1;
     greylister->syncer = NULL;
+    greylister->stats_reported = 0;
+    greylister->sync_packets_reported = 0;
+    greylister->sync_entries_reported = 0;
+    greylister->sync_suppressed_reported = 0;
     greylister->shutdown = 0;
 
     /*
@@ -130,9 +180,20 @@ Grey_setup(Config_T config)
     greylister->low_prio_mx = Config_get_str(
         config, "low_prio_mx", NULL, "grey");
 
+    greylister->full_scan_interval = Config_get_int(
+        config, "full_scan_interval", "grey", GREY_DB_FULL_SCAN_INTERVAL);
+
     greylister->traplist = List_create(destroy_address);
     greylister->whitelist = List_create(destroy_address);
     greylister->whitelist_ipv6 = List_create(destroy_address);
+    greylister->removed = List_create(destroy_address);
+    greylister->white_set = Hash_create(GREY_SET_INIT_SIZE, NULL);
+    greylister->white_set_ipv6 = Hash_create(GREY_SET_INIT_SIZE, NULL);
+    greylister->trap_set = Hash_create(GREY_SET_INIT_SIZE, NULL);
+    greylister->last_scan = -1;
+    greylister->last_full_scan = -1;
+    greylister->fw_resync = 1;
+    greylister->fw_resync_ipv6 = 1;
     greylister->domains = List_create(destroy_address);
 
     Grey_load_domains(greylister);
@@ -146,7 +207,7 @@ Grey_setup(Config_T config)
 
 extern void
 Grey_start(Greylister_T greylister, pid_t grey_pid, FILE* grey_in,
-    FILE* trap_out, FILE* fw_out)
+    FILE* trap_out, FILE* fw_out, int fw_status_fd, FILE* stats_out)
 {
     char *pidfile, *db_user;
     struct passwd* db_pw;
@@ -159,6 +220,12 @@ Grey_start(Greylister_T greylister, pid_t grey_pid, FILE* grey_in,
     greylister->grey_in = grey_in;
     greylister->trap_out = trap_out;
     greylister->fw_out = fw_out;
+    greylister->fw_status_fd = fw_status_fd;
+    greylister->stats_out = stats_out;
+
+    /* The firewall status is only checked for, never waited on. */
+    if (fcntl(fw_status_fd, F_SETFL, O_NONBLOCK) == -1)
+        i_warning("fcntl firewall status: %s", strerror(errno));
 
     /*
      * Set a global reference to the configured greylister state,
@@ -171,8 +238,9 @@ Grey_start(Greylister_T greylister, pid_t grey_pid, FILE* grey_in,
     sa.sa_handler = shutdown_greyd;
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGHUP, &sa, NULL);
-    sigaction(SIGCHLD, &sa, NULL);
     sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = reap_greyd;
+    sigaction(SIGCHLD, &sa, NULL);
 
     db_user = Config_get_str(greylister->config, "user", "grey",
         GREYD_DB_USER);
@@ -215,8 +283,10 @@ Grey_start(Greylister_T greylister, pid_t grey_pid, FILE* grey_in,
          */
         fclose(greylister->trap_out);
         fclose(greylister->fw_out);
+        close(greylister->fw_status_fd);
         greylister->trap_out = NULL;
         greylister->fw_out = NULL;
+        greylister->fw_status_fd = -1;
 
 #ifdef HAVE_SPF
         if (Config_get_int(greylister->config, "enable", "spf", SPF_ENABLED)) {
@@ -232,9 +302,13 @@ Grey_start(Greylister_T greylister, pid_t grey_pid, FILE* grey_in,
             i_critical("Greyd reader failed to start");
             exit(1);
         }
+        Log_flush();
         _exit(0);
     }
 
+    start_snapshot_server(greylister, db_pw);
+    start_bootstrap(greylister, db_pw);
+
     /*
      * In parent. This process has no access to the grey data being
      * sent from the main greyd process.
@@ -244,7 +318,9 @@ Grey_start(Greylister_T greylister, pid_t grey_pid, FILE* grey_in,
     }
 
     fclose(greylister->grey_in);
+    fclose(greylister->stats_out);
     greylister->grey_in = NULL;
+    greylister->stats_out = NULL;
 
     drop_grey_privs(greylister, db_pw);
 
@@ -270,7 +346,11 @@ Grey_finish(Greylister_T* greylister)
     List_destroy(&((*greylister)->whitelist));
     List_destroy(&((*greylister)->whitelist_ipv6));
     List_destroy(&((*greylister)->traplist));
+    List_destroy(&((*greylister)->removed));
     List_destroy(&((*greylister)->domains));
+    Hash_destroy(&((*greylister)->white_set));
+    Hash_destroy(&((*greylister)->white_set_ipv6));
+    Hash_destroy(&((*greylister)->trap_set));
 
     if ((*greylister)->trap_out != NULL)
         fclose((*greylister)->trap_out);
@@ -281,6 +361,16 @@ Grey_finish(Greylister_T* greylister)
     if ((*greylister)->fw_out != NULL)
         fclose((*greylister)->fw_out);
 
+    if ((*greylister)->fw_status_fd != -1)
+        close((*greylister)->fw_status_fd);
+    Greyd_free_messages(&((*greylister)->fw_status_buf));
+
+    if ((*greylister)->stats_out != NULL)
+        fclose((*greylister)->stats_out);
+
+    if ((*greylister)->syncer != NULL)
+        Sync_stop(&((*greylister)->syncer));
+
 #ifdef HAVE_SPF
     if ((*greylister)->spf_server != NULL)
         SPF_server_free((*greylister)->spf_server);
@@ -298,7 +388,8 @@ Grey_start_reader(Greylister_T greylister)
     Lexer_T lexer;
     Config_parser_T parser;
     Config_T message = NULL;
-    int ret, fd;
+    struct pollfd pfd;
+    int ret, fd, timeout, log_timeout;
 
     fd = fileno(greylister->grey_in);
     if (fd == -1) {
@@ -310,12 +401,47 @@ Grey_start_reader(Greylister_T greylister)
     lexer = Config_lexer_create(source);
     parser = Config_parser_create(lexer);
 
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
     for (;;) {
         if (greylister->shutdown) {
             i_debug("stopping grey reader");
             goto cleanup;
         }
 
+        timeout = (greylister->syncer
+                ? Sync_flush_timeout(greylister->syncer)
+                : -1);
+        log_timeout = Log_flush_timeout();
+        if (log_timeout != -1 && (timeout == -1 || log_timeout < timeout))
+            timeout = log_timeout;
+
+        if (timeout != -1) {
+            /*
+             * Wait for input no longer than the pending sync entries
+             * or log messages may be held. Input already buffered by
+             * the lexer is not seen by poll, and at worst waits for
+             * the flush interval.
+             */
+            if (timeout > 0 && poll(&pfd, 1, timeout) == -1
+                && errno != EINTR) {
+                i_debug("error polling grey_in: %s", strerror(errno));
+                goto cleanup;
+            }
+
+            if (greylister->syncer
+                && Sync_flush_timeout(greylister->syncer) == 0) {
+                Sync_flush(greylister->syncer);
+            }
+
+            if (Log_flush_timeout() == 0)
+                Log_flush();
+        }
+
+        report_stats(greylister);
+
         message = Config_create();
         ret = Config_parser_start(parser, message);
         switch (ret) {
@@ -356,9 +482,16 @@ Grey_start_scanner(Greylister_T greylister)
         if (greylister->shutdown)
             break;
 
+        if (greylister->bootstrapped) {
+            /* Pick up the entries applied from the snapshot. */
+            greylister->bootstrapped = 0;
+            greylister->last_full_scan = -1;
+        }
+
         if (Grey_scan_db(greylister) == -1)
             i_warning("db scan failed");
 
+        Log_flush();
         sleep(GREY_DB_SCAN_INTERVAL);
     }
 
@@ -369,6 +502,12 @@ Grey_start_scanner(Greylister_T greylister)
     if (Grey_greylister->reader_pid != -1)
         kill(Grey_greylister->reader_pid, SIGTERM);
 
+    if (Grey_greylister->snapshot_pid != -1)
+        kill(Grey_greylister->snapshot_pid, SIGTERM);
+
+    if (Grey_greylister->bootstrap_pid != -1)
+        kill(Grey_greylister->bootstrap_pid, SIGTERM);
+
     Grey_finish(&greylister);
 
     exit(0);
@@ -378,33 +517,103 @@ extern int
 Grey_scan_db(Greylister_T greylister)
 {
     DB_handle_T db = greylister->db_handle;
-    time_t now = time(NULL);
-    int ret = 0;
+    time_t now = time(NULL), since;
+    int ret = 0, full, trap_changed;
+    List_T trapped, white_added, white_removed, white6_added, white6_removed;
+
+    full = (greylister->last_full_scan == -1
+        || (now - greylister->last_full_scan)
+            >= greylister->full_scan_interval);
 
     DB_open(db, 0);
     DB_start_txn(db);
 
-    if (DB_scan(db, &now, greylister->whitelist, greylister->whitelist_ipv6,
-            greylister->traplist, &greylister->white_exp)
-        != GREYDB_OK) {
+    if (!full) {
+        /*
+         * Overlap with the previous scan interval, so that entries
+         * committed by the reader whilst the last scan was running
+         * are not missed. Re-adding an address to a set is harmless.
+         */
+        since = greylister->last_scan - GREY_DB_SCAN_INTERVAL;
+
+        switch (DB_scan_changes(db, &now, &since, greylister->whitelist,
+            greylister->whitelist_ipv6, greylister->traplist,
+            greylister->removed, &greylister->white_exp)) {
+        case GREYDB_OK:
+            break;
+
+        case GREYDB_NOT_FOUND:
+            /* The driver can only perform full scans. */
+            full = 1;
+            break;
+
+        default:
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+    if (full
+        && DB_scan(db, &now, greylister->whitelist,
+               greylister->whitelist_ipv6, greylister->traplist,
+               &greylister->white_exp)
+            != GREYDB_OK) {
         ret = -1;
         goto cleanup;
     }
     DB_commit_txn(db);
 
-    Greyd_send_config(greylister->trap_out,
-        greylister->traplist_name,
-        greylister->traplist_msg,
-        greylister->traplist);
+    white_added = List_create(destroy_address);
+    white_removed = List_create(destroy_address);
+    white6_added = List_create(destroy_address);
+    white6_removed = List_create(destroy_address);
+
+    if (full) {
+        reconcile_set(&greylister->white_set, greylister->whitelist,
+            white_added, white_removed);
+        reconcile_set(&greylister->white_set_ipv6, greylister->whitelist_ipv6,
+            white6_added, white6_removed);
+        trap_changed = reconcile_set(&greylister->trap_set,
+            greylister->traplist, NULL, NULL);
+        greylister->last_full_scan = now;
+    } else {
+        remove_from_set(greylister->white_set, greylister->removed,
+            white_removed);
+        add_to_set(greylister->white_set, greylister->whitelist, white_added);
+        remove_from_set(greylister->white_set_ipv6, greylister->removed,
+            white6_removed);
+        add_to_set(greylister->white_set_ipv6, greylister->whitelist_ipv6,
+            white6_added);
+        trap_changed = remove_from_set(greylister->trap_set,
+                           greylister->removed, NULL)
+            + add_to_set(greylister->trap_set, greylister->traplist, NULL);
+    }
+    greylister->last_scan = now;
+
+    if (trap_changed) {
+        trapped = Hash_keys(greylister->trap_set);
+        Greyd_send_config(greylister->trap_out,
+            greylister->traplist_name,
+            greylister->traplist_msg,
+            trapped);
+        List_destroy(&trapped);
+    }
 
-    update_firewall(greylister, AF_INET);
+    read_fw_status(greylister);
+    update_firewall(greylister, AF_INET, white_added, white_removed);
     if (Config_get_int(greylister->config, "enable_ipv6", NULL, IPV6_ENABLED))
-        update_firewall(greylister, AF_INET6);
+        update_firewall(greylister, AF_INET6, white6_added, white6_removed);
+
+    List_destroy(&white_added);
+    List_destroy(&white_removed);
+    List_destroy(&white6_added);
+    List_destroy(&white6_removed);
 
 cleanup:
     List_remove_all(greylister->whitelist);
     List_remove_all(greylister->whitelist_ipv6);
     List_remove_all(greylister->traplist);
+    List_remove_all(greylister->removed);
 
     if (ret < 0)
         DB_rollback_txn(db);
@@ -537,41 +746,255 @@ trap_check(Greylister_T greylister, char* to)
     }
 }
 
+/*
+ * Bring the firewall whitelist up to date. After startup, or if a
+ * previous update could not be sent or was reported as failed by the
+ * firewall process, the whole set is replaced. Otherwise only the added
+ * and removed addresses are sent.
+ */
 static void
-update_firewall(Greylister_T greylister, int af)
+update_firewall(Greylister_T greylister, int af, List_T added,
+    List_T removed)
 {
+    Hash_T set;
     List_T ips;
-    struct List_entry* entry;
-    char *ip, *name;
-    int first = 1;
+    char* name;
+    int* resync;
 
     if (af == AF_INET) {
         name = greylister->whitelist_name;
-        ips = greylister->whitelist;
+        set = greylister->white_set;
+        resync = &greylister->fw_resync;
     } else {
         name = greylister->whitelist_name_ipv6;
-        ips = greylister->whitelist_ipv6;
+        set = greylister->white_set_ipv6;
+        resync = &greylister->fw_resync_ipv6;
+    }
+
+    if (*resync) {
+        ips = Hash_keys(set);
+        *resync = (write_fw_message(greylister, "replace", name, af, ips)
+            != 0);
+        List_destroy(&ips);
+    } else if (write_fw_message(greylister, "delete", name, af, removed) == -1
+        || write_fw_message(greylister, "add", name, af, added) == -1) {
+        *resync = 1;
     }
+}
 
-    if (greylister->fw_out != NULL && List_size(ips) > 0) {
-        fprintf(greylister->fw_out,
-            "type=\"replace\"\n"
-            "name=\"%s\"\n"
-            "af=%u\n"
-            "ips=[",
-            name, af);
+/*
+ * Pick up the set updates which the firewall process reports as failed,
+ * so that the affected whitelist is replaced on the next update.
+ */
+static void
+read_fw_status(Greylister_T greylister)
+{
+    int n;
+
+    if (greylister->fw_status_fd == -1)
+        return;
+
+    while ((n = Greyd_read_messages(greylister->fw_status_fd,
+                &greylister->fw_status_buf, process_fw_status, greylister))
+        > 0)
+        ;
+
+    if (n == -1) {
+        close(greylister->fw_status_fd);
+        greylister->fw_status_fd = -1;
+    }
+}
+
+static void
+process_fw_status(Config_T message, void* arg)
+{
+    Greylister_T greylister = arg;
+
+    if (Config_get_int(message, "af", NULL, AF_INET) == AF_INET6)
+        greylister->fw_resync_ipv6 = 1;
+    else
+        greylister->fw_resync = 1;
+}
+
+/*
+ * Report the sync counters to the main greyd process, as the increase
+ * since the previous report. Reports are made at most once per interval,
+ * and only when a counter has changed.
+ */
+static void
+report_stats(Greylister_T greylister)
+{
+    Sync_engine_T syncer = greylister->syncer;
+    time_t now = time(NULL);
+
+    if (greylister->stats_out == NULL || syncer == NULL
+        || now - greylister->stats_reported < GREY_STATS_INTERVAL) {
+        return;
+    }
+    greylister->stats_reported = now;
 
-        LIST_EACH(ips, entry)
+    if (syncer->packets_sent == greylister->sync_packets_reported
+        && syncer->tlvs_sent == greylister->sync_entries_reported
+        && syncer->updates_suppressed
+            == greylister->sync_suppressed_reported) {
+        return;
+    }
+
+    fprintf(greylister->stats_out,
+        "sync_packets_sent=%lu\n"
+        "sync_entries_sent=%lu\n"
+        "sync_updates_suppressed=%lu\n%%\n",
+        syncer->packets_sent - greylister->sync_packets_reported,
+        syncer->tlvs_sent - greylister->sync_entries_reported,
+        syncer->updates_suppressed - greylister->sync_suppressed_reported);
+
+    if (fflush(greylister->stats_out) == EOF)
+        i_debug("report stats: fflush failed");
+
+    greylister->sync_packets_reported = syncer->packets_sent;
+    greylister->sync_entries_reported = syncer->tlvs_sent;
+    greylister->sync_suppressed_reported = syncer->updates_suppressed;
+}
+
+/*
+ * Send a message of the specified type to the firewall process.
+ *
+ * @return 0 if the message was sent
+ * @return 1 if there were no addresses to send
+ * @return -1 on error
+ */
+static int
+write_fw_message(Greylister_T greylister, const char* type, const char* name,
+    int af, List_T ips)
+{
+    struct List_entry* entry;
+    char* ip;
+    int first = 1;
+
+    if (greylister->fw_out == NULL)
+        return -1;
+
+    if (List_size(ips) == 0)
+        return 1;
+
+    fprintf(greylister->fw_out,
+        "type=\"%s\"\n"
+        "name=\"%s\"\n"
+        "af=%u\n"
+        "ips=[",
+        type, name, af);
+
+    LIST_EACH(ips, entry)
+    {
+        ip = List_entry_value(entry);
+        fprintf(greylister->fw_out, "%s\"%s\"", (first ? "" : ","), ip);
+        first = 0;
+    }
+    fprintf(greylister->fw_out, "]\n%%\n");
+
+    if (fflush(greylister->fw_out) == EOF) {
+        i_debug("update firewall: fflush failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Replace the set with the addresses in the list, returning the number
+ * of addresses which were added or removed. If supplied, the added and
+ * removed lists are populated with copies of the differing addresses.
+ */
+static int
+reconcile_set(Hash_T* set, List_T ips, List_T added, List_T removed)
+{
+    Hash_T current;
+    List_T keys;
+    struct List_entry* entry;
+    char* ip;
+    int changes = 0;
+
+    current = Hash_create(GREY_SET_INIT_SIZE, NULL);
+    LIST_EACH(ips, entry)
+    {
+        ip = List_entry_value(entry);
+        if (Hash_get(current, ip) == NULL) {
+            Hash_insert(current, ip, GREY_SET_MEMBER);
+            if (Hash_get(*set, ip) == NULL) {
+                if (added != NULL)
+                    List_insert_after(added, strdup(ip));
+                changes++;
+            }
+        }
+    }
+
+    if ((keys = Hash_keys(*set)) != NULL) {
+        LIST_EACH(keys, entry)
         {
             ip = List_entry_value(entry);
-            fprintf(greylister->fw_out, "%s\"%s\"", (first ? "" : ","), ip);
-            first = 0;
+            if (Hash_get(current, ip) == NULL) {
+                if (removed != NULL)
+                    List_insert_after(removed, strdup(ip));
+                changes++;
+            }
         }
-        fprintf(greylister->fw_out, "]\n%%\n");
+        List_destroy(&keys);
+    }
 
-        if (fflush(greylister->fw_out) == EOF)
-            i_debug("update firewall: fflush failed");
+    Hash_destroy(set);
+    *set = current;
+
+    return changes;
+}
+
+/*
+ * Add each address in the list to the set, returning the number of
+ * addresses which were not already present.
+ */
+static int
+add_to_set(Hash_T set, List_T ips, List_T added)
+{
+    struct List_entry* entry;
+    char* ip;
+    int changes = 0;
+
+    LIST_EACH(ips, entry)
+    {
+        ip = List_entry_value(entry);
+        if (Hash_get(set, ip) == NULL) {
+            Hash_insert(set, ip, GREY_SET_MEMBER);
+            if (added != NULL)
+                List_insert_after(added, strdup(ip));
+            changes++;
+        }
+    }
+
+    return changes;
+}
+
+/*
+ * Remove each address in the list from the set, returning the number of
+ * addresses which were present.
+ */
+static int
+remove_from_set(Hash_T set, List_T ips, List_T removed)
+{
+    struct List_entry* entry;
+    char* ip;
+    int changes = 0;
+
+    LIST_EACH(ips, entry)
+    {
+        ip = List_entry_value(entry);
+        if (Hash_get(set, ip) != NULL) {
+            Hash_delete(set, ip);
+            if (removed != NULL)
+                List_insert_after(removed, strdup(ip));
+            changes++;
+        }
     }
+
+    return changes;
 }
 
 static void
@@ -583,7 +1006,7 @@ process_grey(Greylister_T greylister, struct Grey_tuple* gt, int sync,
     struct DB_val val;
     struct Grey_data gd;
     time_t now, expire;
-    int spamtrap, spfres;
+    int spamtrap, spfres, changed = 1;
 
     now = time(NULL);
     DB_open(db, 0);
@@ -709,6 +1132,8 @@ process_grey(Greylister_T greylister, struct Grey_tuple* gt, int sync,
         gd.pcount = (spamtrap ? -1 : 0);
         if ((gd.first + greylister->pass_time) < now)
             gd.pass = now;
+        else
+            changed = 0; /* Peers need not see every block. */
         val.data.gd = gd;
 
         if (DB_put(db, &key, &val) == GREYDB_OK) {
@@ -734,7 +1159,7 @@ process_grey(Greylister_T greylister, struct Grey_tuple* gt, int sync,
         if (spamtrap) {
             Sync_trapped(greylister->syncer, gt->ip, now, now + expire, 0);
         } else {
-            Sync_update(greylister->syncer, gt, now);
+            Sync_update(greylister->syncer, gt, now, changed);
         }
     }
 
@@ -745,86 +1170,190 @@ rollback:
     DB_rollback_txn(db);
 }
 
+/*
+ * Process the entries received via sync in a single batched message. Each
+ * entry is a kind followed by four fields:
+ *   "grey", ip, helo, from, to
+ *   "white" or "trap", ip, source, expires, delete
+ */
+static void
+process_sync_batch(Greylister_T greylister, List_T entries)
+{
+    struct List_entry* entry;
+    struct Grey_tuple gt;
+    struct non_grey batch[GREY_NON_GREY_BATCH];
+    char* fields[GREY_MSG_SYNC_FIELDS];
+    int i = 0, j, n = 0;
+
+    if (entries == NULL)
+        return;
+
+    /*
+     * Consecutive white & trap entries are applied together. The batch
+     * is applied early to keep the entries in order when a grey entry
+     * or a repeated address is reached.
+     */
+    LIST_EACH(entries, entry)
+    {
+        if ((fields[i] = cv_str(List_entry_value(entry))) == NULL)
+            break;
+
+        if (++i < GREY_MSG_SYNC_FIELDS)
+            continue;
+        i = 0;
+
+        if (strcmp(fields[0], "grey") == 0) {
+            update_non_grey(greylister, batch, n, 0);
+            n = 0;
+
+            gt.ip = fields[1];
+            gt.helo = fields[2];
+            gt.from = fields[3];
+            gt.to = fields[4];
+            process_grey(greylister, &gt, 0, "");
+            continue;
+        }
+
+        for (j = 0; j < n && strcmp(batch[j].ip, fields[1]) != 0; j++)
+            ;
+
+        if (j < n || n == GREY_NON_GREY_BATCH) {
+            update_non_grey(greylister, batch, n, 0);
+            n = 0;
+        }
+
+        if (parse_non_grey(&batch[n], (strcmp(fields[0], "trap") == 0 ? 1 : 0),
+                fields[1], fields[2], fields[3],
+                (strcmp(fields[4], "1") == 0 ? 1 : 0))
+            == 0) {
+            n++;
+        }
+    }
+
+    update_non_grey(greylister, batch, n, 0);
+}
+
 static void
 process_non_grey(Greylister_T greylister, int spamtrap, char* ip, char* source,
     char* expires, int sync, int delete)
 {
-    DB_handle_T db = greylister->db_handle;
-    struct DB_key key;
-    struct DB_val val;
-    struct Grey_data gd;
-    time_t now;
+    struct non_grey entry;
+
+    if (parse_non_grey(&entry, spamtrap, ip, source, expires, delete) == 0)
+        update_non_grey(greylister, &entry, 1, sync);
+}
+
+static int
+parse_non_grey(struct non_grey* entry, int spamtrap, char* ip, char* source,
+    char* expires, int delete)
+{
     long expire;
     char* end;
 
-    now = time(NULL);
-
     /* Expiry times have to be in the future. */
     errno = 0;
     expire = strtol(expires, &end, 10);
     if (!delete &&(expire == 0 || expires[0] == '\0' || *end != '\0'
             || (errno == ERANGE && (expire == LONG_MAX || expire == LONG_MIN)))) {
         i_warning("could not parse expires %s", expires);
-        return;
+        return -1;
     }
 
-    key.type = DB_KEY_IP;
-    key.data.s = ip;
+    entry->spamtrap = spamtrap;
+    entry->delete = delete;
+    entry->ip = ip;
+    entry->source = source;
+    entry->expires = expires;
+    entry->expire = expire;
+
+    return 0;
+}
+
+/*
+ * Apply a batch of white & trap entry updates within one transaction,
+ * looking up the existing entries together and then writing them
+ * together. The addresses in a batch must be distinct.
+ */
+static void
+update_non_grey(Greylister_T greylister, struct non_grey* entries, int n,
+    int sync)
+{
+    DB_handle_T db = greylister->db_handle;
+    struct DB_key keys[GREY_NON_GREY_BATCH], dels[GREY_NON_GREY_BATCH];
+    struct DB_val vals[GREY_NON_GREY_BATCH];
+    struct Grey_data gd;
+    struct non_grey* entry;
+    time_t now;
+    int found[GREY_NON_GREY_BATCH], i, nputs = 0, ndels = 0;
+
+    if (n <= 0)
+        return;
+
+    now = time(NULL);
+    for (i = 0; i < n; i++) {
+        keys[i].type = DB_KEY_IP;
+        keys[i].data.s = entries[i].ip;
+    }
 
     DB_open(db, 0);
     DB_start_txn(db);
 
-    switch (DB_get(db, &key, &val)) {
-    case GREYDB_NOT_FOUND:
-        /*
-         * This is a new entry.
-         */
-        if (delete)
-            break;
-
-        memset(&gd, 0, sizeof(gd));
-        gd.first = now;
-        gd.pcount = (spamtrap ? -1 : 0);
-        gd.pass = (spamtrap ? expire : now);
-        gd.expire = expire;
-        val.type = DB_VAL_GREY;
-        val.data.gd = gd;
+    if (DB_get_many(db, keys, vals, found, n) != GREYDB_OK)
+        goto rollback;
 
-        if (DB_put(db, &key, &val) == GREYDB_OK && sync) {
-            i_debug("new %s from %s for %s, expires %s",
-                (spamtrap ? "TRAP" : "WHITE"), source, ip,
-                expires);
-        }
-        break;
+    for (i = 0; i < n; i++) {
+        entry = &entries[i];
 
-    case GREYDB_FOUND:
-        /*
-         * This is an existing entry.
-         */
-        if (delete) {
-            if (DB_del(db, &key) == GREYDB_OK && sync) {
-                i_debug("deleted %s", ip);
-            }
+        if (found[i] == GREYDB_NOT_FOUND) {
+            /*
+             * This is a new entry.
+             */
+            if (entry->delete)
+                continue;
+
+            memset(&gd, 0, sizeof(gd));
+            gd.first = now;
+            gd.pcount = (entry->spamtrap ? -1 : 0);
+            gd.pass = (entry->spamtrap ? entry->expire : now);
+            gd.expire = entry->expire;
+            vals[i].type = DB_VAL_GREY;
+            vals[i].data.gd = gd;
+        } else if (entry->delete) {
+            /*
+             * This is an existing entry to be deleted.
+             */
+            dels[ndels++] = keys[i];
+            continue;
+        } else if (entry->spamtrap) {
+            vals[i].data.gd.pcount = -1;
+            vals[i].data.gd.bcount++;
         } else {
-            if (spamtrap) {
-                val.data.gd.pcount = -1;
-                val.data.gd.bcount++;
-            } else {
-                val.data.gd.pcount++;
-            }
-
-            if (DB_put(db, &key, &val) == GREYDB_OK && sync) {
-                i_debug("updated %s", ip);
-            }
+            vals[i].data.gd.pcount++;
         }
-        break;
 
-    default:
+        keys[nputs] = keys[i];
+        vals[nputs++] = vals[i];
+    }
+
+    if (DB_put_many(db, keys, vals, nputs) != GREYDB_OK
+        || DB_del_many(db, dels, ndels) != GREYDB_OK) {
         goto rollback;
-        break;
     }
 
     DB_commit_txn(db);
+
+    for (i = 0; sync && i < n; i++) {
+        entry = &entries[i];
+
+        if (found[i] == GREYDB_NOT_FOUND && !entry->delete) {
+            i_debug("new %s from %s for %s, expires %s",
+                (entry->spamtrap ? "TRAP" : "WHITE"), entry->source,
+                entry->ip, entry->expires);
+        } else if (found[i] == GREYDB_FOUND) {
+            i_debug("%s %s", (entry->delete ? "deleted" : "updated"),
+                entry->ip);
+        }
+    }
     return;
 
 rollback:
@@ -869,6 +1398,11 @@ process_message(Greylister_T greylister, Config_T message)
                 ip, source, expires, sync, delete);
         break;
 
+    case GREY_MSG_SYNC:
+        process_sync_batch(greylister,
+            Config_get_list(message, "entries", NULL));
+        break;
+
     default:
         return -1;
     }
@@ -902,6 +1436,197 @@ shutdown_greyd(int sig)
     }
 }
 
+/*
+ * Any child exiting other than the bootstrap process is fatal.
+ */
+static void
+reap_greyd(int sig)
+{
+    int saved_errno = errno;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (Grey_greylister == NULL)
+            continue;
+
+        if (pid == Grey_greylister->bootstrap_pid) {
+            Grey_greylister->bootstrap_pid = -1;
+            Grey_greylister->bootstrapped = 1;
+            continue;
+        }
+
+        if (pid == Grey_greylister->reader_pid)
+            Grey_greylister->reader_pid = -1;
+        else if (pid == Grey_greylister->snapshot_pid)
+            Grey_greylister->snapshot_pid = -1;
+
+        Grey_greylister->shutdown = 1;
+    }
+
+    errno = saved_errno;
+}
+
+/*
+ * Fork a process to serve database snapshots to bootstrapping sync
+ * peers, if configured.
+ */
+static void
+start_snapshot_server(Greylister_T greylister, struct passwd* db_pw)
+{
+    Sync_engine_T syncer;
+    int fd;
+
+    if (!Config_get_int(greylister->config, "snapshot", "sync",
+            SYNC_SNAPSHOT_ENABLED)) {
+        return;
+    }
+
+    switch ((greylister->snapshot_pid = fork())) {
+    case -1:
+        i_critical("Could not fork snapshot server");
+        exit(1);
+
+    case 0:
+        Log_reinit(greylister->config);
+
+        fclose(greylister->grey_in);
+        fclose(greylister->trap_out);
+        fclose(greylister->fw_out);
+        close(greylister->fw_status_fd);
+        fclose(greylister->stats_out);
+        greylister->grey_in = NULL;
+        greylister->trap_out = NULL;
+        greylister->fw_out = NULL;
+        greylister->fw_status_fd = -1;
+        greylister->stats_out = NULL;
+
+        if ((syncer = Sync_init(greylister->config)) == NULL
+            || (fd = Sync_snapshot_listen(syncer)) == -1) {
+            i_warning("could not start snapshot server");
+            Log_flush();
+            _exit(1);
+        }
+
+        if ((greylister->db_handle = DB_init(greylister->config)) == NULL)
+            i_critical("Could not create db handle");
+
+        drop_grey_privs(greylister, db_pw);
+        serve_snapshots(greylister, syncer, fd);
+
+        close(fd);
+        Sync_stop(&syncer);
+        Grey_finish(&greylister);
+        Log_flush();
+        _exit(0);
+    }
+}
+
+/*
+ * Serve one snapshot request at a time, until shutdown.
+ */
+static void
+serve_snapshots(Greylister_T greylister, Sync_engine_T syncer, int listen_fd)
+{
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    socklen_t addr_len;
+    int fd;
+    long sent;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+
+    while (!greylister->shutdown) {
+        if (poll(&pfd, 1, -1) < 1)
+            continue;
+
+        addr_len = sizeof(addr);
+        if ((fd = accept(listen_fd, (struct sockaddr*)&addr, &addr_len))
+            == -1) {
+            continue;
+        }
+
+        if ((sent = Sync_snapshot_send(syncer, fd, greylister->db_handle))
+            != -1) {
+            i_info("sent snapshot of %ld entries to %s", sent,
+                inet_ntoa(addr.sin_addr));
+        }
+        close(fd);
+    }
+}
+
+/*
+ * Fork a process to pull a snapshot from the configured peer. The
+ * reader keeps applying incremental sync updates in the meantime.
+ */
+static void
+start_bootstrap(Greylister_T greylister, struct passwd* db_pw)
+{
+    Sync_engine_T syncer;
+    DB_handle_T db;
+    sigset_t set, oset;
+    char* peer;
+    long applied = -1;
+    int fd;
+
+    if ((peer = Config_get_str(greylister->config, "bootstrap", "sync",
+             NULL))
+        == NULL) {
+        return;
+    }
+
+    /* Don't let the bootstrap exit before its pid is known. */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &oset);
+
+    switch ((greylister->bootstrap_pid = fork())) {
+    case -1:
+        i_warning("Could not fork sync bootstrap");
+        break;
+
+    case 0:
+        sigprocmask(SIG_SETMASK, &oset, NULL);
+        Log_reinit(greylister->config);
+
+        fclose(greylister->grey_in);
+        fclose(greylister->trap_out);
+        fclose(greylister->fw_out);
+        close(greylister->fw_status_fd);
+        fclose(greylister->stats_out);
+
+        if ((syncer = Sync_init(greylister->config)) == NULL) {
+            i_warning("sync must be enabled to bootstrap from %s", peer);
+            Log_flush();
+            _exit(1);
+        }
+
+        if ((db = DB_init(greylister->config)) == NULL)
+            i_critical("Could not create db handle");
+
+        fd = Sync_snapshot_connect(syncer, peer);
+        drop_grey_privs(greylister, db_pw);
+
+        if (fd != -1) {
+            applied = Sync_snapshot_recv(syncer, fd, db);
+            close(fd);
+        }
+
+        if (applied == -1)
+            i_warning("sync bootstrap from %s failed", peer);
+        else
+            i_info("bootstrapped %ld entries from %s", applied, peer);
+
+        DB_close(&db);
+        Sync_stop(&syncer);
+        Log_flush();
+        _exit(applied == -1);
+    }
+
+    sigprocmask(SIG_SETMASK, &oset, NULL);
+}
+
 #ifdef HAVE_SPF
 /**
  * Perform SPF lookup against the MAIL FROM first, and followed by another
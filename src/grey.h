@@ -44,17 +44,24 @@
 #include <stdio.h>
 
 #include "firewall.h"
+#include "greyd.h"
 #include "greyd_config.h"
+#include "hash.h"
 #include "list.h"
 
 #define GREY_MAX_MAIL 1024
 #define GREY_MAX_KEY 45
 #define GREY_DB_SCAN_INTERVAL 60
 #define GREY_DB_TRAP_INTERVAL (60 * 10)
+#define GREY_DB_FULL_SCAN_INTERVAL (60 * 10)
+#define GREY_SET_INIT_SIZE 1024
+#define GREY_STATS_INTERVAL 10 /**< Seconds between statistics reports. */
 
 #define GREY_MSG_GREY 1
 #define GREY_MSG_TRAP 2
 #define GREY_MSG_WHITE 3
+#define GREY_MSG_SYNC 4 /**< A batch of entries received via sync. */
+#define GREY_MSG_SYNC_FIELDS 5 /**< List elements per batched entry. */
 
 /**< Pass after first retry seen after 25 minutes. */
 #define GREY_PASSTIME (60 * 25)
@@ -101,21 +108,42 @@ struct Greylister_T {
     List_T whitelist;
     List_T whitelist_ipv6;
     List_T traplist;
+    List_T removed;
     List_T domains;
+    Hash_T white_set; /**< Addresses last sent to the firewall. */
+    Hash_T white_set_ipv6;
+    Hash_T trap_set; /**< Addresses last sent to greyd. */
     FILE* trap_out;
     FILE* grey_in;
     FILE* fw_out;
+    int fw_status_fd; /**< Failed firewall updates reported back. */
+    struct Greyd_msg_buf fw_status_buf;
+    FILE* stats_out; /**< Statistics reported to the main greyd process. */
     pid_t grey_pid;
     pid_t reader_pid;
+    pid_t snapshot_pid; /**< Serves snapshots to bootstrapping peers. */
+    pid_t bootstrap_pid; /**< Pulls a snapshot from a peer at startup. */
+    int bootstrapped; /**< Set once the bootstrap snapshot is applied. */
     time_t startup;
     time_t grey_exp;
     time_t trap_exp;
     time_t white_exp;
     time_t pass_time;
+    time_t last_scan;
+    time_t last_full_scan;
+    time_t full_scan_interval;
+    int fw_resync; /**< Replace the whole firewall whitelist next scan. */
+    int fw_resync_ipv6;
 
     struct DB_handle_T* db_handle;
     struct Sync_engine_T* syncer;
 
+    /* The sync counters as of the last statistics report. */
+    time_t stats_reported;
+    unsigned long sync_packets_reported;
+    unsigned long sync_entries_reported;
+    unsigned long sync_suppressed_reported;
+
 #ifdef HAVE_SPF
     SPF_server_t* spf_server;
 #endif
@@ -131,7 +159,8 @@ extern Greylister_T Grey_setup(Config_T config);
  * Start the greylisting engine.
  */
 extern void Grey_start(Greylister_T greylister, pid_t grey_pid,
-    FILE* grey_in, FILE* trap_out, FILE* fw_out);
+    FILE* grey_in, FILE* trap_out, FILE* fw_out, int fw_status_fd,
+    FILE* stats_out);
 
 /**
  * Stop the greylisting engine and cleanup afterwards.
@@ -155,6 +184,13 @@ extern void Grey_start_scanner(Greylister_T greylister);
  * Scan the grey engine database looking to expire entries,
  * update firewall whitelists and send trapped IP addresses to
  * the main greyd process.
+ *
+ * Where the database driver supports it, only the entries which have
+ * changed since the last scan are visited, and the white/trap sets are
+ * maintained incrementally. A full scan is performed on the first run
+ * and then every full_scan_interval seconds to reconcile the sets.
+ * Only the whitelist additions and removals are sent to the firewall,
+ * except on startup or after a failed update, when the set is replaced.
  */
 extern int Grey_scan_db(Greylister_T greylister);
 
@@ -22,11 +22,15 @@
  */
 
 #include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -36,15 +40,22 @@
 #include "constants.h"
 #include "failures.h"
 #include "firewall.h"
+#include "grey.h"
 #include "greyd.h"
 #include "greyd_config.h"
 #include "hash.h"
 #include "ip.h"
 #include "list.h"
+#include "log.h"
+#include "stats.h"
+#include "sync.h"
 #include "utils.h"
 
 #define MSG_TYPE_NAT "nat"
 #define MSG_TYPE_REPLACE "replace"
+#define MSG_TYPE_ADD "add"
+#define MSG_TYPE_DELETE "delete"
+#define MSG_TYPE_RESYNC "resync"
 
 #define CMP(a, b) strncmp((a), (b), sizeof((b)))
 
@@ -80,12 +91,15 @@ Greyd_process_config(int fd, struct Greyd_state* state)
     Lexer_source_T source;
     Lexer_T lexer;
     Config_parser_T parser;
-    Blacklist_T blacklist;
+    Blacklist_T blacklist, existing;
     char *bl_name, *bl_msg, *addr;
     List_T ips;
     struct List_entry* entry;
+    struct timespec start;
     int read_fd;
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     /*
      * Duplicate the descriptor so that the incoming fd isn't closed
      * upon destroying the lexer source.
@@ -112,12 +126,147 @@ Greyd_process_config(int fd, struct Greyd_state* state)
                 if ((addr = cv_str(value)) != NULL)
                     Blacklist_add(blacklist, addr);
             }
+
+            /* Keep the hit count across reloads of the same list. */
+            if ((existing = Hash_get(state->blacklists, bl_name)) != NULL)
+                blacklist->hits = existing->hits;
             Hash_insert(state->blacklists, bl_name, blacklist);
         }
     }
 
     Config_destroy(&message);
     Config_parser_destroy(&parser);
+
+    Stats_observe(&state->stats.reload_time, Stats_elapsed(&start));
+}
+
+extern void
+Greyd_write_stats(FILE* out, struct Greyd_state* state)
+{
+    struct Greyd_stats* stats = &state->stats;
+    struct List_entry* entry;
+    Blacklist_T blacklist;
+    List_T bl_names;
+    const char* help;
+    char* bl_name;
+
+    Stats_write_counter(out, "greyd_accepts_total",
+        "Connections accepted.", NULL, NULL, stats->accepts);
+    Stats_write_counter(out, "greyd_accepts_blacklisted_total",
+        "Connections accepted from blacklisted addresses.", NULL, NULL,
+        stats->accepts_black);
+    Stats_write_gauge(out, "greyd_connections",
+        "Connections currently open.", state->clients);
+    Stats_write_gauge(out, "greyd_connections_blacklisted",
+        "Blacklisted connections currently open.", state->black_clients);
+    Stats_write_gauge(out, "greyd_connections_max",
+        "Maximum number of connections.", state->max_cons);
+
+    help = "Connections matching each blacklist.";
+    if ((bl_names = Hash_keys(state->blacklists)) != NULL) {
+        LIST_EACH(bl_names, entry)
+        {
+            bl_name = List_entry_value(entry);
+            if ((blacklist = Hash_get(state->blacklists, bl_name)) == NULL)
+                continue;
+
+            Stats_write_counter(out, "greyd_blacklist_hits_total", help,
+                "blacklist", bl_name, blacklist->hits);
+            help = NULL;
+        }
+        List_destroy(&bl_names);
+    }
+
+    Stats_write_counter(out, "greyd_stutter_bytes_total",
+        "Bytes written to connections a byte at a time.", NULL, NULL,
+        stats->stutter_bytes);
+    Stats_write_counter(out, "greyd_grey_messages_total",
+        "Messages sent to the greylister.", NULL, NULL,
+        stats->grey_messages);
+    Stats_write_counter(out, "greyd_nat_lookups_total",
+        "Original destination lookups answered.", NULL, NULL,
+        state->nat_lookups);
+    Stats_write_counter(out, "greyd_nat_timeouts_total",
+        "Original destination lookups timed out.", NULL, NULL,
+        state->nat_timeouts);
+    Stats_write_histogram(out, "greyd_nat_lookup_seconds",
+        "Original destination lookup latency.", &stats->nat_latency);
+    Stats_write_histogram(out, "greyd_config_reload_seconds",
+        "Time taken to load a blacklist configuration.",
+        &stats->reload_time);
+    Stats_write_histogram(out, "greyd_event_loop_seconds",
+        "Time taken to handle each event loop iteration.",
+        &stats->loop_time);
+    Stats_write_counter(out, "greyd_sync_packets_sent_total",
+        "Sync packets sent by the greylister.", NULL, NULL,
+        stats->sync_packets_sent);
+    Stats_write_counter(out, "greyd_sync_entries_sent_total",
+        "Sync entries sent by the greylister.", NULL, NULL,
+        stats->sync_entries_sent);
+    Stats_write_counter(out, "greyd_sync_updates_suppressed_total",
+        "Repeated grey updates not sent to sync peers.", NULL, NULL,
+        stats->sync_updates_suppressed);
+    Stats_write_counter(out, "greyd_sync_packets_received_total",
+        "Sync packets received.", NULL, NULL,
+        (state->syncer ? state->syncer->packets_recv : 0));
+    Stats_write_counter(out, "greyd_sync_entries_received_total",
+        "Sync entries received.", NULL, NULL,
+        (state->syncer ? state->syncer->tlvs_recv : 0));
+    Stats_write_counter(out, "greyd_log_dropped_total",
+        "Log messages dropped by a full log buffer.", NULL, NULL,
+        Log_dropped());
+}
+
+extern void
+Greyd_process_grey_stats(Config_T message, void* arg)
+{
+    struct Greyd_stats* stats = &((struct Greyd_state*)arg)->stats;
+
+    stats->sync_packets_sent += Config_get_int(message,
+        "sync_packets_sent", NULL, 0);
+    stats->sync_entries_sent += Config_get_int(message,
+        "sync_entries_sent", NULL, 0);
+    stats->sync_updates_suppressed += Config_get_int(message,
+        "sync_updates_suppressed", NULL, 0);
+}
+
+extern void
+Greyd_serve_stats(int stats_sock, struct Greyd_state* state)
+{
+    FILE* out;
+    char* buf = NULL;
+    size_t len = 0;
+    ssize_t nwritten;
+    int fd, flags;
+
+    if ((fd = accept(stats_sock, NULL, NULL)) == -1) {
+        if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+            i_warning("stats accept: %s", strerror(errno));
+        return;
+    }
+
+    if ((flags = fcntl(fd, F_GETFL)) == -1
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        i_warning("stats fcntl: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    if ((out = open_memstream(&buf, &len)) == NULL) {
+        i_warning("stats open_memstream: %s", strerror(errno));
+        goto cleanup;
+    }
+    Greyd_write_stats(out, state);
+    fclose(out);
+
+    if ((nwritten = write(fd, buf, len)) == -1)
+        i_debug("stats write: %s", strerror(errno));
+    else if ((size_t)nwritten < len)
+        i_debug("stats truncated to %ld of %lu bytes", (long)nwritten,
+            (unsigned long)len);
+
+cleanup:
+    free(buf);
+    close(fd);
 }
 
 extern void
@@ -152,6 +301,88 @@ Greyd_send_config(FILE* out, char* bl_name, char* bl_msg, List_T ips)
     }
 }
 
+extern int
+Greyd_read_messages(int fd, struct Greyd_msg_buf* mb,
+    void (*process)(Config_T, void*), void* arg)
+{
+    Lexer_source_T source;
+    Config_parser_T parser;
+    Config_T message;
+    char *end, *buf;
+    size_t consumed, msg_len, size;
+    ssize_t n;
+    int processed = 0;
+
+    if (mb->len + 1 >= mb->size) {
+        size = (mb->size == 0 ? GREYD_MSG_BUF_SIZE : mb->size * 2);
+        if (size > GREYD_MSG_BUF_MAX) {
+            i_warning("message too large, discarding %zu bytes", mb->len);
+            mb->len = 0;
+        } else if ((buf = realloc(mb->buf, size)) == NULL) {
+            i_warning("realloc: %s", strerror(errno));
+            return -1;
+        } else {
+            mb->buf = buf;
+            mb->size = size;
+        }
+    }
+
+    n = read(fd, mb->buf + mb->len, mb->size - 1 - mb->len);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    else if (n <= 0)
+        return -1;
+
+    mb->len += n;
+    mb->buf[mb->len] = '\0';
+
+    /*
+     * Each message is terminated by a line containing only a "%", so
+     * split the buffer and parse each complete message separately. Any
+     * trailing partial message is kept for the next read.
+     */
+    consumed = 0;
+    for (;;) {
+        if (strncmp(mb->buf + consumed, "%\n", 2) == 0)
+            end = mb->buf + consumed;
+        else if ((end = strstr(mb->buf + consumed, "\n%\n")) != NULL)
+            end++;
+        else
+            break;
+
+        msg_len = (end + 2) - (mb->buf + consumed);
+        source = Lexer_source_create_from_str(mb->buf + consumed, msg_len);
+        parser = Config_parser_create(Config_lexer_create(source));
+        message = Config_create();
+
+        if (Config_parser_start(parser, message) == CONFIG_PARSER_OK) {
+            process(message, arg);
+            processed++;
+        } else {
+            i_warning("message parse error");
+        }
+
+        Config_destroy(&message);
+        Config_parser_destroy(&parser);
+        consumed += msg_len;
+    }
+
+    if (consumed > 0) {
+        mb->len -= consumed;
+        memmove(mb->buf, mb->buf + consumed, mb->len);
+    }
+
+    return processed;
+}
+
+extern void
+Greyd_free_messages(struct Greyd_msg_buf* mb)
+{
+    free(mb->buf);
+    mb->buf = NULL;
+    mb->size = mb->len = 0;
+}
+
 extern void
 Greyd_process_fw_message(Config_T message, FW_handle_T fw_handle, FILE* out)
 {
@@ -164,24 +395,30 @@ Greyd_process_fw_message(Config_T message, FW_handle_T fw_handle, FILE* out)
     char *addr, *name;
     List_T whitelist, ips;
     short af;
+    int id, ret = 0;
 
     if ((type = Config_get_str(message, "type", NULL, NULL)) == NULL)
         return;
 
     if (CMP(type, MSG_TYPE_NAT) == 0) {
         /*
-         * Perform a DNAT lookup and return the original destination.
+         * Perform a DNAT lookup and return the original destination. A
+         * reply is always sent, so that the waiting connection may be
+         * resumed promptly.
          */
+        if (out == NULL)
+            return;
+
+        memset(dst, 0, sizeof(dst));
         src = Config_get_str(message, "src", NULL, "");
         proxy = Config_get_str(message, "proxy", NULL, "");
         src_port = Config_get_int(message, "src_port", NULL, 0);
         proxy_port = Config_get_int(message, "proxy_port", NULL, 0);
         if (src_port == 0 || proxy_port == 0) {
             i_debug("nat lookup: expecting non-zero src & proxy ports");
-            return;
+            goto nat_reply;
         }
 
-        memset(dst, 0, sizeof(dst));
         memset(&ss_src, 0, sizeof(ss_src));
         memset(&ss_proxy, 0, sizeof(ss_proxy));
         memset(&ss_dst, 0, sizeof(ss_dst));
@@ -194,14 +431,14 @@ Greyd_process_fw_message(Config_T message, FW_handle_T fw_handle, FILE* out)
 
         if (getaddrinfo(src, NULL, &hints, &res) != 0) {
             i_debug("getaddrinfo: %s", strerror(errno));
-            return;
+            goto nat_reply;
         }
         memcpy(&ss_src, res->ai_addr, res->ai_addrlen);
         free(res);
 
         if (getaddrinfo(proxy, NULL, &hints, &res) != 0) {
             i_debug("getaddrinfo: %s", strerror(errno));
-            return;
+            goto nat_reply;
         }
         memcpy(&ss_proxy, res->ai_addr, res->ai_addrlen);
         free(res);
@@ -219,7 +456,7 @@ Greyd_process_fw_message(Config_T message, FW_handle_T fw_handle, FILE* out)
                 (struct sockaddr*)&ss_proxy,
                 (struct sockaddr*)&ss_dst)
             == -1) {
-            return;
+            goto nat_reply;
         }
 
         if (getnameinfo((struct sockaddr*)&ss_dst,
@@ -230,13 +467,20 @@ Greyd_process_fw_message(Config_T message, FW_handle_T fw_handle, FILE* out)
             dst[0] = '\0';
         }
 
+    nat_reply:
+        /* Echo the request id, so the reply may be matched. */
+        if ((id = Config_get_int(message, "id", NULL, 0)) > 0)
+            fprintf(out, "id=%d\n", id);
         fprintf(out, "dst=\"%s\"\n%%\n", dst);
         if (fflush(out) == EOF)
             i_debug("dnat lookup: fflush failed");
-    } else if (CMP(type, MSG_TYPE_REPLACE) == 0) {
+    } else if (CMP(type, MSG_TYPE_REPLACE) == 0
+        || CMP(type, MSG_TYPE_ADD) == 0
+        || CMP(type, MSG_TYPE_DELETE) == 0) {
         /*
          * Retrieve list of ip addresses to send to the
-         * firewall.
+         * firewall. The whole set is replaced, or the addresses
+         * are added to or removed from the existing set.
          */
         name = Config_get_str(message, "name", NULL, "");
         af = Config_get_int(message, "af", NULL, AF_INET);
@@ -253,27 +497,64 @@ Greyd_process_fw_message(Config_T message, FW_handle_T fw_handle, FILE* out)
                 }
             }
 
-            if (List_size(whitelist) > 0)
-                FW_replace(fw_handle, name, whitelist, af);
+            if (List_size(whitelist) > 0) {
+                if (CMP(type, MSG_TYPE_ADD) == 0)
+                    ret = FW_add(fw_handle, name, whitelist, af);
+                else if (CMP(type, MSG_TYPE_DELETE) == 0)
+                    ret = FW_del(fw_handle, name, whitelist, af);
+                else
+                    ret = FW_replace(fw_handle, name, whitelist, af);
+            }
 
             List_destroy(&whitelist);
         }
+
+        /*
+         * Report a failed update, so that the sender replaces the whole
+         * set rather than sending further changes to a set it can no
+         * longer be sure of.
+         */
+        if (ret == -1 && out != NULL) {
+            i_warning("failed to %s set %s, requesting resync", type, name);
+            fprintf(out, "type=\"%s\"\nname=\"%s\"\naf=%d\n%%\n",
+                MSG_TYPE_RESYNC, name, af);
+            if (fflush(out) == EOF)
+                i_debug("set update: fflush failed");
+        }
     }
 }
 
-extern int
-Greyd_start_fw_child(struct Greyd_state* state, int in_fd, int nat_in_fd, int out_fd)
-{
-    Config_T config = state->config;
+struct fw_message_ctx {
     FW_handle_T fw_handle;
     FILE* out;
-    Lexer_source_T source, nat_source;
-    Lexer_T lexer, nat_lexer;
-    Config_parser_T parser;
-    Config_T message;
+};
+
+static void
+process_nat_message(Config_T message, void* arg)
+{
+    struct fw_message_ctx* ctx = arg;
+
+    Greyd_process_fw_message(message, ctx->fw_handle, ctx->out);
+}
+
+static void
+process_set_message(Config_T message, void* arg)
+{
+    struct fw_message_ctx* ctx = arg;
+
+    Greyd_process_fw_message(message, ctx->fw_handle, ctx->out);
+}
+
+/*
+ * Each firewall worker obtains its own firewall handle before dropping
+ * privileges, so that the workers never contend over a handle.
+ */
+static FW_handle_T
+open_fw_worker(Config_T config)
+{
+    FW_handle_T fw_handle;
     struct passwd* main_pw;
     char *main_user, *chroot_dir = NULL;
-    int ret, i;
 
     /* Setup the firewall handle before dropping privileges. */
     if ((fw_handle = FW_open(config)) == NULL)
@@ -298,61 +579,166 @@ Greyd_start_fw_child(struct Greyd_state* state, int in_fd, int nat_in_fd, int ou
         i_critical("failed to drop privileges: %s", strerror(errno));
     }
 
-    if ((out = fdopen(out_fd, "w")) == NULL)
+    return fw_handle;
+}
+
+/*
+ * Serve the latency sensitive original destination lookups from the
+ * main process.
+ */
+static void
+run_nat_worker(struct Greyd_state* state, int nat_in_fd, int out_fd)
+{
+    Config_T config = state->config;
+    FW_handle_T fw_handle;
+    struct Greyd_msg_buf nat_buf;
+    struct fw_message_ctx ctx;
+    struct pollfd fd;
+    int timeout;
+
+    fw_handle = open_fw_worker(config);
+
+    if ((ctx.out = fdopen(out_fd, "w")) == NULL)
         i_critical("fdopen: %s", strerror(errno));
+    ctx.fw_handle = fw_handle;
 
-    struct pollfd fds[2];
-    memset(&fds, 0, 2 * sizeof(*fds));
-    fds[0].fd = in_fd;
-    fds[0].events = POLLIN;
-    fds[1].fd = nat_in_fd;
-    fds[1].events = POLLIN;
+    /*
+     * The lookup requests are read into a buffer rather than via a
+     * buffered lexer, as several requests may be in flight at once.
+     */
+    memset(&nat_buf, 0, sizeof(nat_buf));
 
-    nat_source = Lexer_source_create_from_fd(nat_in_fd);
-    nat_lexer = Config_lexer_create(nat_source);
+    memset(&fd, 0, sizeof(fd));
+    fd.fd = nat_in_fd;
+    fd.events = POLLIN;
 
-    source = Lexer_source_create_from_fd(in_fd);
-    lexer = Config_lexer_create(source);
-    parser = Config_parser_create(lexer);
+    while (!state->shutdown) {
+        timeout = Log_flush_timeout();
+        if (timeout == -1 || timeout > POLL_TIMEOUT)
+            timeout = POLL_TIMEOUT;
 
-    for (;;) {
-        if (state->shutdown) {
-            i_info("stopping firewall process");
-            goto cleanup;
+        if (poll(&fd, 1, timeout) == -1) {
+            if (errno != EINTR)
+                i_warning("firewall nat process, poll error: %s",
+                    strerror(errno));
+            continue;
         }
 
-        if ((poll(fds, 2, POLL_TIMEOUT) == -1) && errno != EINTR) {
-            i_warning("firewall process, poll error: %s", strerror(errno));
-        } else {
-            for (i = 0; i < 2; i++) {
-                if (fds[i].revents & POLLIN) {
-                    Config_parser_set_lexer(
-                        parser, (i == 0 ? lexer : nat_lexer));
-                    message = Config_create();
-                    ret = Config_parser_start(parser, message);
-                    switch (ret) {
-                    case CONFIG_PARSER_OK:
-                        Greyd_process_fw_message(message, fw_handle, out);
-                        break;
-
-                    case CONFIG_PARSER_ERR:
-                        i_warning("firewall process: parse error");
-                        break;
-                    }
-
-                    Config_destroy(&message);
-                }
+        if (Log_flush_timeout() == 0)
+            Log_flush();
+
+        if (fd.revents & POLLIN) {
+            if (Greyd_read_messages(nat_in_fd, &nat_buf,
+                    process_nat_message, &ctx)
+                == -1) {
+                break;
             }
+        } else if (fd.revents & (POLLERR | POLLHUP)) {
+            break;
         }
     }
 
-cleanup:
-    Lexer_destroy(&lexer);
-    Lexer_destroy(&nat_lexer);
-    Config_parser_set_lexer(parser, NULL);
-    Config_parser_destroy(&parser);
+    i_info("stopping firewall nat process");
+    Greyd_free_messages(&nat_buf);
+    fclose(ctx.out);
     FW_close(&fw_handle);
     Config_destroy(&config);
+}
+
+/*
+ * Serve the bulk firewall set updates from the greylister, which may
+ * take some time for large sets.
+ */
+static void
+run_set_worker(struct Greyd_state* state, int in_fd, int status_fd)
+{
+    Config_T config = state->config;
+    FW_handle_T fw_handle;
+    struct Greyd_msg_buf set_buf;
+    struct fw_message_ctx ctx;
+    struct pollfd fd;
+    int timeout;
+
+    fw_handle = open_fw_worker(config);
+
+    /* Failed updates are reported back to the greylister. */
+    if ((ctx.out = fdopen(status_fd, "w")) == NULL)
+        i_critical("fdopen: %s", strerror(errno));
+    ctx.fw_handle = fw_handle;
+
+    /*
+     * As with the lookups, the updates are read straight from the
+     * descriptor, so that every complete message is processed before
+     * polling again rather than left in a stdio buffer.
+     */
+    memset(&set_buf, 0, sizeof(set_buf));
+
+    memset(&fd, 0, sizeof(fd));
+    fd.fd = in_fd;
+    fd.events = POLLIN;
+
+    while (!state->shutdown) {
+        timeout = Log_flush_timeout();
+        if (timeout == -1 || timeout > POLL_TIMEOUT)
+            timeout = POLL_TIMEOUT;
+
+        if (poll(&fd, 1, timeout) == -1) {
+            if (errno != EINTR)
+                i_warning("firewall process, poll error: %s",
+                    strerror(errno));
+            continue;
+        }
+
+        if (Log_flush_timeout() == 0)
+            Log_flush();
+
+        if (fd.revents & POLLIN) {
+            if (Greyd_read_messages(in_fd, &set_buf, process_set_message,
+                    &ctx)
+                == -1) {
+                break;
+            }
+        } else if (fd.revents & (POLLERR | POLLHUP)) {
+            break;
+        }
+    }
+
+    i_info("stopping firewall process");
+    Greyd_free_messages(&set_buf);
+    fclose(ctx.out);
+    FW_close(&fw_handle);
+    Config_destroy(&config);
+}
+
+extern int
+Greyd_start_fw_child(struct Greyd_state* state, int in_fd, int status_fd,
+    int nat_in_fd, int out_fd)
+{
+    pid_t nat_pid;
+
+    /*
+     * Split the lookups and the set updates into separate processes,
+     * each with its own firewall handle, so that a long running replace
+     * never delays a lookup.
+     */
+    switch ((nat_pid = fork())) {
+    case -1:
+        i_critical("fork firewall nat process: %s", strerror(errno));
+        exit(1);
+
+    case 0:
+        close(in_fd);
+        close(status_fd);
+        run_nat_worker(state, nat_in_fd, out_fd);
+        return 0;
+    }
+
+    close(nat_in_fd);
+    close(out_fd);
+    run_set_worker(state, in_fd, status_fd);
+
+    kill(nat_pid, SIGTERM);
+    waitpid(nat_pid, NULL, 0);
 
     return 0;
 }
@@ -31,6 +31,42 @@
 #include "firewall.h"
 #include "hash.h"
 #include "blacklist.h"
+#include "stats.h"
+
+#define GREYD_MSG_BUF_SIZE 8192
+#define GREYD_MSG_BUF_MAX (64 * 1024 * 1024)
+
+/**
+ * Buffer for messages read from a pipe, which may hold a partial message
+ * or several complete messages at once. The buffer is allocated on the
+ * first read and grows to hold large messages, such as whole firewall
+ * sets, so it must be zeroed before use.
+ */
+struct Greyd_msg_buf {
+    char* buf;
+    size_t size;
+    size_t len;
+};
+
+/**
+ * The counters of the main greyd event loop. These are updated in place
+ * on the hot path, and only formatted when the statistics are read.
+ */
+struct Greyd_stats {
+    unsigned long accepts;
+    unsigned long accepts_black;
+    unsigned long stutter_bytes;
+    unsigned long grey_messages;
+
+    /* Sync counters reported by the greylister. */
+    unsigned long sync_packets_sent;
+    unsigned long sync_entries_sent;
+    unsigned long sync_updates_suppressed;
+
+    struct Stats_histogram nat_latency;
+    struct Stats_histogram reload_time;
+    struct Stats_histogram loop_time;
+};
 
 /**
  * Structure to encapsulate the state of the main
@@ -54,8 +90,21 @@ struct Greyd_state {
     FILE* fw_out;
     FILE* fw_in;
 
+    /* Original destination lookups in flight to the firewall process. */
+    struct Greyd_msg_buf nat_buf;
+    int nat_id;
+    int nat_pending;
+    unsigned long nat_lookups;
+    unsigned long nat_timeouts;
+    double nat_latency_total; /* In milliseconds. */
+    double nat_latency_max; /* In milliseconds. */
+
     Hash_T blacklists;
 
+    struct Sync_engine_T* syncer; /* Receives sync messages, may be NULL. */
+    struct Greyd_msg_buf grey_stats_buf;
+    struct Greyd_stats stats;
+
     bool proxy_protocol_enabled;
     /* We use a blacklist structure to contain the permitted ranges for fast lookups. */
     Blacklist_T proxy_protocol_permitted_proxies;
@@ -78,13 +127,57 @@ extern void Greyd_process_config(int fd, struct Greyd_state* state);
 extern void Greyd_send_config(FILE* out, char* bl_name, char* bl_msg, List_T ips);
 
 /**
- * Process a request for the firewall process.
+ * Write the statistics of the main greyd process in the Prometheus text
+ * exposition format.
+ */
+extern void Greyd_write_stats(FILE* out, struct Greyd_state* state);
+
+/**
+ * Add the counters reported by the greylister to the statistics. The
+ * greylister sends the increase since its previous report, as the
+ * counters may exceed an int. The state is passed as arg, for use with
+ * Greyd_read_messages.
+ */
+extern void Greyd_process_grey_stats(Config_T message, void* arg);
+
+/**
+ * Accept a connection on the statistics socket, write out the current
+ * statistics and close it. The statistics are written in a single
+ * non-blocking write, so a slow reader may not stall the event loop.
+ */
+extern void Greyd_serve_stats(int stats_sock, struct Greyd_state* state);
+
+/**
+ * Read the messages available on the file descriptor into the buffer,
+ * and call the supplied function for each complete message. This should
+ * only be called when the descriptor is readable, as it reads at most
+ * once.
+ *
+ * @return The number of messages processed.
+ * @return -1 on end of file or error.
+ */
+extern int Greyd_read_messages(int fd, struct Greyd_msg_buf* mb,
+    void (*process)(Config_T, void*), void* arg);
+
+/**
+ * Free the storage of a message buffer.
+ */
+extern void Greyd_free_messages(struct Greyd_msg_buf* mb);
+
+/**
+ * Process a request for the firewall process. Lookup replies, and
+ * reports of set updates which failed, are written to out, which may be
+ * NULL if neither are expected.
  */
 extern void Greyd_process_fw_message(Config_T message, FW_handle_T fw_handle, FILE* out);
 
 /**
- * Start the firewall management process.
+ * Start the firewall management process. The original destination
+ * lookups and the firewall set updates are served by separate processes,
+ * so that set updates do not delay lookups. Set updates which fail are
+ * reported on status_fd.
  */
-extern int Greyd_start_fw_child(struct Greyd_state* state, int in_fd, int nat_in_fd, int out_fd);
+extern int Greyd_start_fw_child(struct Greyd_state* state, int in_fd,
+    int status_fd, int nat_in_fd, int out_fd);
 
 #endif
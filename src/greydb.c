@@ -75,8 +75,18 @@ DB_init(Config_T config)
         Mod_get(handle->driver, "Mod_db_get");
     handle->db_del = (int (*)(DB_handle_T, struct DB_key*))
         Mod_get(handle->driver, "Mod_db_del");
+    handle->db_get_many = (int (*)(DB_handle_T, struct DB_key*,
+        struct DB_val*, int*, int))
+        Mod_get_optional(handle->driver, "Mod_db_get_many");
+    handle->db_put_many = (int (*)(DB_handle_T, struct DB_key*,
+        struct DB_val*, int))
+        Mod_get_optional(handle->driver, "Mod_db_put_many");
+    handle->db_del_many = (int (*)(DB_handle_T, struct DB_key*, int))
+        Mod_get_optional(handle->driver, "Mod_db_del_many");
     handle->db_get_itr = (void (*)(DB_itr_T, int))
         Mod_get(handle->driver, "Mod_db_get_itr");
+    handle->db_get_itr_after = (void (*)(DB_itr_T, struct DB_key*))
+        Mod_get_optional(handle->driver, "Mod_db_get_itr_after");
     handle->db_itr_next = (int (*)(DB_itr_T, struct DB_key*, struct DB_val*))
         Mod_get(handle->driver, "Mod_db_itr_next");
     handle->db_itr_replace_curr = (int (*)(DB_itr_T, struct DB_val*))
@@ -88,6 +98,9 @@ DB_init(Config_T config)
     handle->db_scan = (int (*)(DB_handle_T, time_t*, List_T, List_T,
         List_T, time_t*))
         Mod_get(handle->driver, "Mod_scan_db");
+    handle->db_scan_changes = (int (*)(DB_handle_T, time_t*, time_t*, List_T,
+        List_T, List_T, List_T, time_t*))
+        Mod_get_optional(handle->driver, "Mod_scan_db_changes");
 
     /* Initialize the database driver. */
     handle->db_init(handle);
@@ -150,6 +163,71 @@ DB_del(DB_handle_T handle, struct DB_key* key)
     return handle->db_del(handle, key);
 }
 
+extern int
+DB_get_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int* found, int n)
+{
+    int i;
+
+    if (n <= 0)
+        return GREYDB_OK;
+
+    if (handle->db_get_many != NULL)
+        return handle->db_get_many(handle, keys, vals, found, n);
+
+    for (i = 0; i < n; i++) {
+        switch ((found[i] = handle->db_get(handle, &keys[i], &vals[i]))) {
+        case GREYDB_FOUND:
+        case GREYDB_NOT_FOUND:
+            break;
+
+        default:
+            return GREYDB_ERR;
+        }
+    }
+
+    return GREYDB_OK;
+}
+
+extern int
+DB_put_many(DB_handle_T handle, struct DB_key* keys, struct DB_val* vals,
+    int n)
+{
+    int i;
+
+    if (n <= 0)
+        return GREYDB_OK;
+
+    if (handle->db_put_many != NULL)
+        return handle->db_put_many(handle, keys, vals, n);
+
+    for (i = 0; i < n; i++) {
+        if (handle->db_put(handle, &keys[i], &vals[i]) != GREYDB_OK)
+            return GREYDB_ERR;
+    }
+
+    return GREYDB_OK;
+}
+
+extern int
+DB_del_many(DB_handle_T handle, struct DB_key* keys, int n)
+{
+    int i;
+
+    if (n <= 0)
+        return GREYDB_OK;
+
+    if (handle->db_del_many != NULL)
+        return handle->db_del_many(handle, keys, n);
+
+    for (i = 0; i < n; i++) {
+        if (handle->db_del(handle, &keys[i]) == GREYDB_ERR)
+            return GREYDB_ERR;
+    }
+
+    return GREYDB_OK;
+}
+
 extern DB_itr_T
 DB_get_itr(DB_handle_T handle, int types)
 {
@@ -169,6 +247,27 @@ DB_get_itr(DB_handle_T handle, int types)
     return itr;
 }
 
+extern DB_itr_T
+DB_get_itr_after(DB_handle_T handle, struct DB_key* after)
+{
+    DB_itr_T itr;
+
+    if (handle->db_get_itr_after == NULL)
+        return NULL;
+
+    if ((itr = malloc(sizeof(*itr))) == NULL) {
+        i_critical("Could not create iterator");
+    }
+
+    itr->handle = handle;
+    itr->current = -1;
+    itr->size = 0;
+
+    handle->db_get_itr_after(itr, after);
+
+    return itr;
+}
+
 extern int
 DB_itr_next(DB_itr_T itr, struct DB_key* key, struct DB_val* val)
 {
@@ -207,6 +306,18 @@ DB_scan(DB_handle_T handle, time_t* now, List_T whitelist,
         white_exp);
 }
 
+extern int
+DB_scan_changes(DB_handle_T handle, time_t* now, time_t* since,
+    List_T whitelist, List_T whitelist_ipv6, List_T traplist, List_T removed,
+    time_t* white_exp)
+{
+    if (handle->db_scan_changes == NULL)
+        return GREYDB_NOT_FOUND;
+
+    return handle->db_scan_changes(handle, now, since, whitelist,
+        whitelist_ipv6, traplist, removed, white_exp);
+}
+
 extern int
 DB_addr_state(DB_handle_T handle, char* addr)
 {
@@ -91,13 +91,22 @@ struct DB_handle_T {
     int (*db_put)(DB_handle_T handle, struct DB_key* key, struct DB_val* val);
     int (*db_get)(DB_handle_T handle, struct DB_key* key, struct DB_val* val);
     int (*db_del)(DB_handle_T handle, struct DB_key* key);
+    int (*db_get_many)(DB_handle_T handle, struct DB_key* keys,
+        struct DB_val* vals, int* found, int n);
+    int (*db_put_many)(DB_handle_T handle, struct DB_key* keys,
+        struct DB_val* vals, int n);
+    int (*db_del_many)(DB_handle_T handle, struct DB_key* keys, int n);
     void (*db_get_itr)(DB_itr_T itr, int types);
+    void (*db_get_itr_after)(DB_itr_T itr, struct DB_key* after);
     int (*db_itr_next)(DB_itr_T itr, struct DB_key* key, struct DB_val* val);
     int (*db_itr_replace_curr)(DB_itr_T itr, struct DB_val* val);
     int (*db_itr_del_curr)(DB_itr_T itr);
     void (*db_itr_close)(DB_itr_T itr);
     int (*db_scan)(DB_handle_T handle, time_t* now, List_T whitelist,
         List_T whitelist_ipv6, List_T traplist, time_t* white_exp);
+    int (*db_scan_changes)(DB_handle_T handle, time_t* now, time_t* since,
+        List_T whitelist, List_T whitelist_ipv6, List_T traplist,
+        List_T removed, time_t* white_exp);
 };
 
 struct DB_itr_T {
@@ -153,12 +162,60 @@ extern int DB_get(DB_handle_T handle, struct DB_key* key, struct DB_val* val);
  */
 extern int DB_del(DB_handle_T handle, struct DB_key* key);
 
+/**
+ * Look up each of the *n* keys, storing GREYDB_FOUND or GREYDB_NOT_FOUND
+ * in the corresponding element of *found*, and the value in that of
+ * *vals* when found. The keys may be of any type.
+ *
+ * This entry point is optional for drivers; the keys are otherwise
+ * looked up one at a time.
+ *
+ * @return GREYDB_OK if all of the lookups were made
+ * @return GREYDB_ERR on error
+ */
+extern int DB_get_many(DB_handle_T handle, struct DB_key* keys,
+    struct DB_val* vals, int* found, int n);
+
+/**
+ * Insert the *n* key/value pairs. Outside of a transaction, the drivers
+ * may write the pairs as a single transaction.
+ *
+ * This entry point is optional for drivers; the pairs are otherwise
+ * inserted one at a time.
+ *
+ * @return GREYDB_OK on success
+ * @return GREYDB_ERR on error
+ */
+extern int DB_put_many(DB_handle_T handle, struct DB_key* keys,
+    struct DB_val* vals, int n);
+
+/**
+ * Remove the records specified by the *n* keys. Keys which are not in
+ * the database are ignored.
+ *
+ * This entry point is optional for drivers; the records are otherwise
+ * removed one at a time.
+ *
+ * @return GREYDB_OK on success
+ * @return GREYDB_ERR on error
+ */
+extern int DB_del_many(DB_handle_T handle, struct DB_key* keys, int n);
+
 /**
  * Return an iterator for all database entries specified by the flag
  * *types*. If there are no entries, NULL is returned.
  */
 extern DB_itr_T DB_get_itr(DB_handle_T handle, int types);
 
+/**
+ * Return an iterator for the address and tuple entries in key order,
+ * starting after the key *after*, or from the first entry if it is
+ * NULL. As the iterator reads its own snapshot, a long iteration may be
+ * resumed a part at a time without holding a transaction open. If the
+ * driver cannot resume iterations, NULL is returned.
+ */
+extern DB_itr_T DB_get_itr_after(DB_handle_T handle, struct DB_key* after);
+
 /**
  * Return the next key/value pair from the iterator.
  */
@@ -191,6 +248,24 @@ extern int DB_scan(DB_handle_T handle, time_t* now, List_T whitelist,
     List_T whitelist_ipv6, List_T traplist,
     time_t* white_exp);
 
+/**
+ * Perform an incremental scan, only visiting entries whose expiry or
+ * pass deadlines have arrived. Expired entries are deleted and passed
+ * tuples are whitelisted as with DB_scan, however the lists are only
+ * populated with:
+ *   - IP addresses which were whitelisted or trapped since *since*
+ *   - IP addresses which were expired from the database (*removed*)
+ *
+ * This entry point is optional for drivers.
+ *
+ * @return GREYDB_OK on success
+ * @return GREYDB_NOT_FOUND if the driver has no incremental scan
+ * @return GREYDB_ERR on error
+ */
+extern int DB_scan_changes(DB_handle_T handle, time_t* now, time_t* since,
+    List_T whitelist, List_T whitelist_ipv6, List_T traplist, List_T removed,
+    time_t* white_exp);
+
 /**
  * Check the state of the supplied address via the opened
  * database handle.
@@ -39,8 +39,8 @@
 static struct Hash_entry* Hash_find_entry(Hash_T hash, const char* key);
 
 /**
- * Resize the list of entries if the number of entries equals the configured
- * size.
+ * Grow the array of entries to the new size, re-hashing each existing
+ * entry into its new slot.
  */
 static void Hash_resize(Hash_T hash, int new_size);
 
@@ -54,6 +54,11 @@ static unsigned int Hash_lookup(const char* key);
  */
 static void Hash_create_entries(Hash_T hash);
 
+/**
+ * Call the configured destructor on an entry in use and free its key.
+ */
+static void Hash_destroy_entry(Hash_T hash, struct Hash_entry* entry);
+
 extern Hash_T
 Hash_create(int size, void (*destroy)(struct Hash_entry* entry))
 {
@@ -82,9 +87,9 @@ Hash_destroy(Hash_T* hash)
         return;
     }
 
-    if ((*hash)->destroy && (*hash)->num_entries > 0) {
+    if ((*hash)->entries && (*hash)->num_entries > 0) {
         for (i = 0; i < (*hash)->size; i++) {
-            (*hash)->destroy(((*hash)->entries + i));
+            Hash_destroy_entry(*hash, ((*hash)->entries + i));
         }
     }
 
@@ -107,8 +112,7 @@ Hash_reset(Hash_T hash)
         return;
 
     for (i = 0; i < hash->size; i++) {
-        hash->destroy((hash->entries + i));
-        hash->entries[i].v = NULL;
+        Hash_destroy_entry(hash, (hash->entries + i));
     }
 
     /* Reset the number of entries counter. */
@@ -122,21 +126,22 @@ Hash_insert(Hash_T hash, const char* key, void* value)
 
     if (hash->entries == NULL) {
         Hash_create_entries(hash);
-    } else if (hash->num_entries >= hash->size) {
+    } else if ((hash->num_entries + 1) * 100 > hash->size * HASH_MAX_LOAD) {
         Hash_resize(hash, (2 * hash->size));
     }
 
     entry = Hash_find_entry(hash, key);
     if (entry->v != NULL) {
         /* An entry exists, clear contents before overwriting. */
-        hash->destroy(entry);
+        if (hash->destroy)
+            hash->destroy(entry);
     } else {
         /* As nothing was over written, increment the number of entries. */
+        if ((entry->k = strdup(key)) == NULL)
+            i_critical("strdup: %s", strerror(errno));
         hash->num_entries++;
     }
 
-    /* Setup the new entry. */
-    sstrncpy(entry->k, key, MAX_KEY_LEN + 1);
     entry->v = value;
 }
 
@@ -154,17 +159,38 @@ extern void* Hash_get(Hash_T hash, const char* key)
 extern void
 Hash_delete(Hash_T hash, const char* key)
 {
-    struct Hash_entry* entry;
+    struct Hash_entry *entry, *curr;
+    unsigned int i, j, home;
 
     if (hash->entries == NULL)
         return;
 
     entry = Hash_find_entry(hash, key);
-    if (entry->v != NULL) {
-        hash->destroy(entry);
-        *(entry->k) = '\0';
-        entry->v = NULL;
-        hash->num_entries--;
+    if (entry->v == NULL)
+        return;
+
+    Hash_destroy_entry(hash, entry);
+    hash->num_entries--;
+
+    /*
+     * Shift any following entries in the same probe sequence back into
+     * the hole, so that lookups never stop short at an emptied slot.
+     */
+    i = j = entry - hash->entries;
+    for (;;) {
+        j = ((j + 1) % hash->size);
+        curr = hash->entries + j;
+        if (curr->v == NULL)
+            break;
+
+        home = Hash_lookup(curr->k) % hash->size;
+        if ((j > i && (home <= i || home > j))
+            || (j < i && (home <= i && home > j))) {
+            hash->entries[i] = *curr;
+            curr->k = NULL;
+            curr->v = NULL;
+            i = j;
+        }
     }
 }
 
@@ -196,7 +222,7 @@ static struct Hash_entry* Hash_find_entry(Hash_T hash, const char* key)
     i = j = (Hash_lookup(key) % hash->size);
     do {
         curr = hash->entries + i;
-        if ((strcmp(key, curr->k) == 0) || (curr->v == NULL))
+        if ((curr->v == NULL) || (strcmp(key, curr->k) == 0))
             break;
 
         i = ((i + 1) % hash->size);
@@ -230,14 +256,15 @@ Hash_resize(Hash_T hash, int new_size)
         i_critical("Could not resize hash entries of size %d to %d",
             hash->size, new_size);
 
-    /* Re-initialize the hash entries. */
     hash->size = new_size;
-    hash->num_entries = 0;
 
-    /* For each non-NULL entry, re-hash into the new entries array. */
+    /*
+     * For each non-NULL entry, re-hash into the new entries array. The
+     * keys are moved across rather than copied.
+     */
     for (i = 0; i < old_size; i++) {
         if (old_entries[i].v != NULL) {
-            Hash_insert(hash, old_entries[i].k, old_entries[i].v);
+            *Hash_find_entry(hash, old_entries[i].k) = old_entries[i];
         }
     }
 
@@ -258,6 +285,19 @@ Hash_create_entries(Hash_T hash)
         i_critical("Could not allocate hash entries of size %d", hash->size);
 }
 
+static void
+Hash_destroy_entry(Hash_T hash, struct Hash_entry* entry)
+{
+    if (entry->v == NULL)
+        return;
+
+    if (hash->destroy)
+        hash->destroy(entry);
+    free(entry->k);
+    entry->k = NULL;
+    entry->v = NULL;
+}
+
 /*
  * Use the djb2 string hash function.
  */
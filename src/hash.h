@@ -30,13 +30,17 @@
 
 #include "list.h"
 
-#define MAX_KEY_LEN 255
+/**
+ * The table is grown once it becomes this full (as a percentage), to
+ * keep the linear probe sequences short.
+ */
+#define HASH_MAX_LOAD 75
 
 /**
  * A struct to contain a hash entry's key and value pair.
  */
 struct Hash_entry {
-    char k[MAX_KEY_LEN + 1]; /**< Hash entry key */
+    char* k; /**< Hash entry key */
     void* v; /**< Hash entry value */
 };
 
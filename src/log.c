@@ -23,20 +23,59 @@
 
 #include "constants.h"
 #include "greyd_config.h"
+#include "log.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+/*
+ * A buffered message. The formatted line is held in the text buffer, with
+ * the message itself starting at msg for the benefit of syslog.
+ */
+struct Log_record {
+    int severity;
+    int msg;
+    int len;
+};
+
+/*
+ * The per-process buffer used for asynchronous logging. It is only ever
+ * appended to and drained completely, so records never wrap. A child
+ * inherits its parent's unwritten messages across a fork, which it
+ * discards rather than writing twice.
+ */
+struct Log_buffer {
+    char* text;
+    int size;
+    int used;
+    struct Log_record* records;
+    int max_records;
+    int nrecords;
+    pid_t pid;
+    int flush_interval;
+    struct timespec first;
+    unsigned long dropped;
+    unsigned long dropped_total;
+};
+
 static short Log_debug = 0;
 static short Log_syslog = 0;
 static const char* Log_ident = NULL;
 static FILE* log_file = NULL;
 static struct flock lock;
+static struct Log_buffer* Log_buf = NULL;
+
+static void setup_async(Config_T config);
+static int buffer_write(int severity, const char* msg, va_list args);
+static void write_buffer(FILE* f);
 
 extern void Log_reinit(Config_T config)
 {
@@ -49,6 +88,8 @@ extern void Log_reinit(Config_T config)
 
     char* path = NULL;
     if ((path = Config_get_str(config, "log_to_file", NULL, NULL)) != NULL) {
+        /* Write out anything buffered for the old file first. */
+        Log_flush();
         log_file = fopen(path, "a");
     }
 }
@@ -64,6 +105,9 @@ Log_setup(Config_T config, const char* prog_name)
         openlog(Log_ident, LOG_PID | LOG_NDELAY, LOG_DAEMON);
     }
 
+    if (Log_buf == NULL && Config_get_int(config, "log_async", NULL, 0))
+        setup_async(config);
+
     Log_reinit(config);
 }
 
@@ -94,6 +138,9 @@ Log_write(int severity, const char* msg, va_list args)
     va_list syslog_args, file_args;
 
     if (Log_debug || (!Log_debug && severity < LOG_DEBUG)) {
+        if (Log_buf != NULL && buffer_write(severity, msg, args) == 0)
+            return;
+
         if (Log_syslog) {
             va_copy(syslog_args, args);
             vsyslog(severity, msg, syslog_args);
@@ -108,3 +155,199 @@ Log_write(int severity, const char* msg, va_list args)
         write_to(stderr, msg, args);
     }
 }
+
+extern void
+Log_flush(void)
+{
+    struct Log_record* rec;
+    char dropped[128];
+    int i, len;
+
+    if (Log_buf == NULL || Log_buf->pid != getpid())
+        return;
+
+    if (Log_buf->dropped > 0) {
+        len = snprintf(dropped, sizeof(dropped),
+            "%s[%d]: dropped %lu log messages\n", Log_ident, getpid(),
+            Log_buf->dropped);
+        if (Log_syslog)
+            syslog(LOG_WARNING, "dropped %lu log messages", Log_buf->dropped);
+        if (log_file != NULL)
+            write(fileno(log_file), dropped, len);
+        write(fileno(stderr), dropped, len);
+        Log_buf->dropped = 0;
+    }
+
+    if (Log_buf->nrecords == 0)
+        return;
+
+    if (Log_syslog) {
+        for (i = 0; i < Log_buf->nrecords; i++) {
+            rec = Log_buf->records + i;
+            syslog(rec->severity, "%.*s", rec->len, Log_buf->text + rec->msg);
+        }
+    }
+
+    if (log_file != NULL)
+        write_buffer(log_file);
+    write_buffer(stderr);
+
+    Log_buf->used = 0;
+    Log_buf->nrecords = 0;
+}
+
+extern int
+Log_flush_timeout(void)
+{
+    struct timespec now;
+    long elapsed;
+
+    if (Log_buf == NULL || (Log_buf->nrecords == 0 && Log_buf->dropped == 0))
+        return -1;
+
+    /* Don't wait for the interval once the buffer is half full. */
+    if (Log_buf->used * 2 >= Log_buf->size
+        || Log_buf->nrecords * 2 >= Log_buf->max_records) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - Log_buf->first.tv_sec) * 1000
+        + (now.tv_nsec - Log_buf->first.tv_nsec) / 1000000;
+
+    return (elapsed >= Log_buf->flush_interval
+            ? 0
+            : Log_buf->flush_interval - elapsed);
+}
+
+extern unsigned long
+Log_dropped(void)
+{
+    return (Log_buf ? Log_buf->dropped_total : 0);
+}
+
+static void
+setup_async(Config_T config)
+{
+    struct Log_buffer* buf;
+    int size;
+
+    size = Config_get_int(config, "log_buffer_size", NULL, LOG_ASYNC_BUFFER);
+    if (size <= 0 || (buf = calloc(1, sizeof(*buf))) == NULL)
+        return;
+
+    buf->size = size;
+    buf->max_records = size / LOG_ASYNC_RECORD_MIN + 1;
+    buf->pid = getpid();
+    buf->flush_interval = Config_get_int(config, "log_flush_interval", NULL,
+        LOG_ASYNC_FLUSH_INTERVAL);
+
+    if ((buf->text = malloc(buf->size)) == NULL
+        || (buf->records = calloc(buf->max_records, sizeof(*buf->records)))
+            == NULL) {
+        free(buf->text);
+        free(buf);
+        return;
+    }
+
+    Log_buf = buf;
+
+    /* Every buffered message must be written out on exit. */
+    atexit(Log_flush);
+}
+
+/*
+ * Format the message into the buffer. Returns -1 if the message should
+ * be written directly instead, otherwise 0, including when dropped.
+ */
+static int
+buffer_write(int severity, const char* msg, va_list args)
+{
+    struct Log_buffer* buf = Log_buf;
+    struct Log_record* rec;
+    va_list msg_args;
+    pid_t pid = getpid();
+    int prefix, len, avail;
+
+    if (buf->pid != pid) {
+        /* Forget the messages inherited from the parent. */
+        buf->used = buf->nrecords = 0;
+        buf->dropped = 0;
+        buf->pid = pid;
+    }
+
+    /* Errors bypass the buffer, so that they are seen straight away. */
+    if (severity <= LOG_ERR) {
+        Log_flush();
+        return -1;
+    }
+
+    avail = buf->size - buf->used;
+    if (buf->nrecords == buf->max_records || avail <= 0)
+        goto drop;
+
+    prefix = snprintf(buf->text + buf->used, avail, "%s[%d]: ", Log_ident,
+        pid);
+    if (prefix < 0 || prefix >= avail)
+        goto drop;
+
+    va_copy(msg_args, args);
+    len = vsnprintf(buf->text + buf->used + prefix, avail - prefix, msg,
+        msg_args);
+    va_end(msg_args);
+
+    /* Leave room for the newline. */
+    if (len < 0 || prefix + len + 1 >= avail)
+        goto drop;
+
+    if (buf->nrecords == 0 && buf->dropped == 0)
+        clock_gettime(CLOCK_MONOTONIC, &buf->first);
+
+    rec = buf->records + buf->nrecords++;
+    rec->severity = severity;
+    rec->msg = buf->used + prefix;
+    rec->len = len;
+
+    buf->text[buf->used + prefix + len] = '\n';
+    buf->used += prefix + len + 1;
+
+    return 0;
+
+drop:
+    if (buf->nrecords == 0 && buf->dropped == 0)
+        clock_gettime(CLOCK_MONOTONIC, &buf->first);
+    buf->dropped++;
+    buf->dropped_total++;
+
+    return 0;
+}
+
+/*
+ * Write the whole buffer under a single lock.
+ */
+static void
+write_buffer(FILE* f)
+{
+    ssize_t n;
+    int off = 0;
+
+    lock.l_type = F_WRLCK;
+    if (fcntl(fileno(f), F_SETLKW, &lock) == -1 && errno != EINVAL
+        && errno != EBADF) {
+        return;
+    }
+
+    fflush(f);
+    while (off < Log_buf->used) {
+        if ((n = write(fileno(f), Log_buf->text + off, Log_buf->used - off))
+            == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        off += n;
+    }
+
+    lock.l_type = F_UNLCK;
+    fcntl(fileno(f), F_SETLK, &lock);
+}
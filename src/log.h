@@ -25,6 +25,10 @@
 
 #include <stdarg.h>
 
+#define LOG_ASYNC_BUFFER 65536 /* In bytes. */
+#define LOG_ASYNC_FLUSH_INTERVAL 200 /* In milliseconds. */
+#define LOG_ASYNC_RECORD_MIN 32 /* Average record size assumed. */
+
 /**
  * Setup the logging framework.
  */
@@ -36,6 +40,27 @@ extern void Log_setup(Config_T config, const char* prog_name);
 extern void Log_reinit(Config_T config);
 
 /**
- * Write a message to the logging system.
+ * Write a message to the logging system. When asynchronous logging is
+ * enabled, the message is formatted into the process's log buffer and
+ * only written out by Log_flush. If the buffer is full, the message is
+ * dropped and counted.
  */
 extern void Log_write(int severity, const char* msg, va_list args);
+
+/**
+ * Write out all buffered messages in one batch, preceded by a count of
+ * any messages dropped since the last flush. This is called on exit,
+ * and is a no-op when asynchronous logging is disabled.
+ */
+extern void Log_flush(void);
+
+/**
+ * Return the number of milliseconds until the buffered messages are due
+ * to be flushed, 0 if they are due now, or -1 if nothing is buffered.
+ */
+extern int Log_flush_timeout(void);
+
+/**
+ * Return the total number of messages dropped by this process.
+ */
+extern unsigned long Log_dropped(void);
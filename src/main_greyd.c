@@ -24,7 +24,9 @@
 #include <config.h>
 
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include "con.h"
 #include "config_parser.h"
@@ -37,6 +39,7 @@
 #include "ip.h"
 #include "lexer_source.h"
 #include "log.h"
+#include "stats.h"
 #include "sync.h"
 #include "utils.h"
 #include <ctype.h>
@@ -62,6 +65,9 @@ static void usage(void);
 static int max_files(void);
 static void destroy_blacklist(struct Hash_entry* entry);
 static void shutdown_greyd(int sig);
+static int open_stats_socket(const char* path, struct passwd* pw);
+static void close_stats_socket(int sock, const char* path,
+    const char* chroot_dir);
 
 struct Greyd_state* Greyd_state = NULL;
 
@@ -118,6 +124,60 @@ destroy_blacklist(struct Hash_entry* entry)
     }
 }
 
+/*
+ * Bind the statistics socket before chrooting, readable by the main
+ * user's group.
+ */
+static int
+open_stats_socket(const char* path, struct passwd* pw)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sstrncpy(addr.sun_path, path, sizeof(addr.sun_path))
+        >= sizeof(addr.sun_path)) {
+        i_critical("stats socket path too long: %s", path);
+    }
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        i_critical("stats socket: %s", strerror(errno));
+
+    /* Remove a socket left behind by a previous instance. */
+    if (unlink(path) == -1 && errno != ENOENT)
+        i_critical("could not unlink %s: %s", path, strerror(errno));
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        i_critical("bind %s: %s", path, strerror(errno));
+
+    if (chmod(path, 0660) == -1 || chown(path, pw->pw_uid, pw->pw_gid) == -1)
+        i_warning("could not set permissions on %s: %s", path,
+            strerror(errno));
+
+    return sock;
+}
+
+static void
+close_stats_socket(int sock, const char* path, const char* chroot_dir)
+{
+    const char* chroot_path = path;
+
+    close(sock);
+
+    /* The socket may only be removed if it is within the chroot. */
+    if (chroot_dir != NULL) {
+        if (strncmp(path, chroot_dir, strlen(chroot_dir)) != 0
+            || path[strlen(chroot_dir)] != '/') {
+            return;
+        }
+        chroot_path = path + strlen(chroot_dir);
+    }
+
+    if (unlink(chroot_path) != 0)
+        i_warning("could not unlink %s: %s", chroot_path, strerror(errno));
+}
+
 int main(int argc, char** argv)
 {
     struct Greyd_state state;
@@ -125,10 +185,12 @@ int main(int argc, char** argv)
     Greylister_T greylister;
     Config_T config, opts;
     char *config_file = DEFAULT_CONFIG, hostname[MAX_HOST_NAME];
-    char *bind_addr, *bind_addr6, *pidfile;
+    char *bind_addr, *bind_addr6, *pidfile, *stats_path;
     int option, i, main_sock, main_sock6 = -1, cfg_sock, sock_val = 1;
+    int stats_sock = -1;
     int grey_pipe[2], trap_pipe[2], trap_fd = -1, cfg_fd = -1;
-    int fw_pipe[2], nat_pipe[2], grey_fw_pipe[2];
+    int grey_stats_pipe[2], grey_stats_fd = -1;
+    int fw_pipe[2], nat_pipe[2], grey_fw_pipe[2], fw_status_pipe[2];
     u_short port, cfg_port;
     unsigned long long grey_time, white_time, pass_time;
     struct rlimit limit;
@@ -138,12 +200,13 @@ int main(int argc, char** argv)
     List_T hosts;
     char* main_user;
     pid_t grey_pid;
-    FILE *grey_in, *trap_out, *grey_fw;
+    FILE *grey_in, *trap_out, *grey_fw, *grey_stats;
     char* chroot_dir = NULL;
     time_t now;
     int prev_max_fd = 0, sync_recv = 0, sync_send = 0;
     struct pollfd* fds = NULL;
     struct sigaction sa;
+    struct timespec loop_start;
 
     opts = Config_create();
     if (gethostname(hostname, sizeof(hostname)) == -1) {
@@ -439,6 +502,10 @@ int main(int argc, char** argv)
     if ((main_pw = getpwnam(main_user)) == NULL)
         errx(1, "no such user %s", main_user);
 
+    stats_path = Config_get_str(state.config, "stats_socket", NULL, NULL);
+    if (stats_path != NULL)
+        stats_sock = open_stats_socket(stats_path, main_pw);
+
     pidfile = Config_get_str(state.config, "greyd_pidfile", NULL,
         GREYD_PIDFILE);
     switch (write_pidfile(main_pw, pidfile)) {
@@ -460,6 +527,9 @@ int main(int argc, char** argv)
         if (pipe(grey_fw_pipe) == -1)
             i_critical("grey firewall pipe: %s", strerror(errno));
 
+        if (pipe(fw_status_pipe) == -1)
+            i_critical("firewall status pipe: %s", strerror(errno));
+
         /* Fork the firewall process. */
         state.fw_pid = fork();
         switch (state.fw_pid) {
@@ -479,8 +549,9 @@ int main(int argc, char** argv)
 
             close(nat_pipe[0]);
             close(fw_pipe[1]);
-            return Greyd_start_fw_child(
-                &state, grey_fw_pipe[0], fw_pipe[0], nat_pipe[1]);
+            close(fw_status_pipe[0]);
+            return Greyd_start_fw_child(&state, grey_fw_pipe[0],
+                fw_status_pipe[1], fw_pipe[0], nat_pipe[1]);
         }
 
         /* In parent. */
@@ -491,6 +562,7 @@ int main(int argc, char** argv)
         if ((state.fw_in = fdopen(nat_pipe[0], "r")) == NULL)
             i_critical("fdopen: %s", strerror(errno));
         close(nat_pipe[1]);
+        close(fw_status_pipe[1]);
 
         /* Ensure that the the grey connections outweigh the blacklisted. */
         state.max_black = (state.max_black >= state.max_cons
@@ -507,6 +579,9 @@ int main(int argc, char** argv)
         if (pipe(trap_pipe) == -1)
             i_critical("trap pipe: %s", strerror(errno));
 
+        if (pipe(grey_stats_pipe) == -1)
+            i_critical("grey stats pipe: %s", strerror(errno));
+
         grey_pid = fork();
         switch (grey_pid) {
         case -1:
@@ -524,7 +599,10 @@ int main(int argc, char** argv)
 
             trap_fd = trap_pipe[0];
             close(trap_pipe[1]);
+            grey_stats_fd = grey_stats_pipe[0];
+            close(grey_stats_pipe[1]);
             close(grey_fw_pipe[1]);
+            close(fw_status_pipe[0]);
 
             goto jail;
         }
@@ -543,7 +621,12 @@ int main(int argc, char** argv)
             i_critical("fdopen: %s", strerror(errno));
         close(grey_fw_pipe[0]);
 
-        Grey_start(greylister, grey_pid, grey_in, trap_out, grey_fw);
+        if ((grey_stats = fdopen(grey_stats_pipe[1], "w")) == NULL)
+            i_critical("fdopen: %s", strerror(errno));
+        close(grey_stats_pipe[0]);
+
+        Grey_start(greylister, grey_pid, grey_in, trap_out, grey_fw,
+            fw_status_pipe[0], grey_stats);
 
         /* Not reached. */
     }
@@ -566,6 +649,7 @@ jail:
         sync_send = 0;
         sync_recv = 0;
     }
+    state.syncer = syncer;
 
     memset(&sa, 0, sizeof(sa));
     sigfillset(&sa.sa_mask);
@@ -601,6 +685,9 @@ jail:
         i_warning("listening for incoming IPv6 connections");
     }
 
+    if (stats_sock != -1 && listen(stats_sock, GREYD_BACKLOG) == -1)
+        i_critical("listen: %s", strerror(errno));
+
     state.slow_until = 0;
     state.clients = state.black_clients = 0;
     state.blacklists = Hash_create(NUM_BLACKLISTS, destroy_blacklist);
@@ -614,7 +701,7 @@ jail:
 
     /* Main event loop. */
     for (;;) {
-        int max_fd, writers, timeout;
+        int max_fd, writers, timeout, log_timeout;
         struct Con* con;
         int accept_fd;
         socklen_t main_addr_len, main_addr6_len;
@@ -628,6 +715,10 @@ jail:
         if (main_sock6 > 0)
             max_fd = MAX(max_fd, main_sock6);
         max_fd = MAX(max_fd, trap_fd);
+        max_fd = MAX(max_fd, grey_stats_fd);
+        if (state.fw_in != NULL)
+            max_fd = MAX(max_fd, fileno(state.fw_in));
+        max_fd = MAX(max_fd, stats_sock);
 
         time(&now);
         for (i = 0; i < state.max_cons; i++) {
@@ -659,6 +750,9 @@ jail:
         for (i = 0; i < state.max_cons; i++) {
             con = &state.cons[i];
 
+            if (con->fd != -1 && con->nat_state == CON_NAT_WAIT)
+                Con_check_nat_timeout(con, &now, &state);
+
             if (con->fd != -1 && con->r) {
                 if (con->r + MAX_TIME <= now) {
                     Con_close(con, &state);
@@ -706,22 +800,44 @@ jail:
             fds[trap_fd % max_fd].events = POLLIN;
         }
 
+        if (grey_stats_fd > 0) {
+            fds[grey_stats_fd % max_fd].fd = grey_stats_fd;
+            fds[grey_stats_fd % max_fd].events = POLLIN;
+        }
+
         if (sync_recv && syncer && syncer->sync_fd > 0) {
             fds[syncer->sync_fd % max_fd].fd = syncer->sync_fd;
             fds[syncer->sync_fd % max_fd].events = POLLIN;
         }
 
+        /* Original destination replies from the firewall process. */
+        if (state.fw_in != NULL) {
+            fds[fileno(state.fw_in) % max_fd].fd = fileno(state.fw_in);
+            fds[fileno(state.fw_in) % max_fd].events = POLLIN;
+        }
+
+        if (stats_sock != -1) {
+            fds[stats_sock % max_fd].fd = stats_sock;
+            fds[stats_sock % max_fd].events = POLLIN;
+        }
+
         /*
          * If we are not listening, ensure we wake up at least once
-         * a second to progress the stuttered writers.
+         * a second to progress the stuttered writers and to expire
+         * any outstanding original destination lookups.
          */
-        if (writers == 0 && state.slow_until == 0) {
+        if (writers == 0 && state.slow_until == 0 && state.nat_pending == 0) {
             /* Just sleep until a connection arrives. */
             timeout = -1;
         } else {
             timeout = POLL_TIMEOUT;
         }
 
+        /* Wake up in time to write out any buffered log messages. */
+        log_timeout = Log_flush_timeout();
+        if (log_timeout != -1 && (timeout == -1 || log_timeout < timeout))
+            timeout = log_timeout;
+
         if (poll(fds, max_fd + 1, timeout) == -1) {
             if (errno != EINTR) {
                 i_warning("poll: %s", strerror(errno));
@@ -730,10 +846,25 @@ jail:
             continue;
         }
 
+        clock_gettime(CLOCK_MONOTONIC, &loop_start);
+
+        if (Log_flush_timeout() == 0)
+            Log_flush();
+
         /* Check if we can stop throttling connections. */
         if (state.slow_until && state.slow_until <= now)
             state.slow_until = 0;
 
+        /* Resume the connections waiting on the firewall process. */
+        if (state.fw_in != NULL) {
+            if (fds[fileno(state.fw_in) % max_fd].revents & POLLIN) {
+                Con_handle_nat_reply(&state, &now);
+            } else if (fds[fileno(state.fw_in) % max_fd].revents & (POLLERR | POLLHUP)) {
+                i_warning("firewall nat pipe poll error");
+                goto shutdown;
+            }
+        }
+
         /* Handle any accepted clients in progress. */
         for (i = 0; i < state.max_cons; i++) {
             con = &state.cons[i];
@@ -826,6 +957,16 @@ jail:
             }
         }
 
+        /* Statistics reported by the greylister. */
+        if (grey_stats_fd > 0
+            && (fds[grey_stats_fd % max_fd].revents & (POLLIN | POLLERR | POLLHUP))
+            && Greyd_read_messages(grey_stats_fd, &state.grey_stats_buf,
+                   Greyd_process_grey_stats, &state)
+                == -1) {
+            close(grey_stats_fd);
+            grey_stats_fd = -1;
+        }
+
         /* Finally process any sync messages. */
         if (sync_recv && syncer) {
             if (fds[syncer->sync_fd % max_fd].revents & POLLIN) {
@@ -835,11 +976,26 @@ jail:
                 goto shutdown;
             }
         }
+
+        if (stats_sock != -1 && fds[stats_sock % max_fd].revents & POLLIN)
+            Greyd_serve_stats(stats_sock, &state);
+
+        Stats_observe(&state.stats.loop_time, Stats_elapsed(&loop_start));
     }
 
 shutdown:
     i_debug("stopping main process");
 
+    if (state.nat_lookups > 0 || state.nat_timeouts > 0) {
+        i_info("original destination lookups: %lu, timeouts: %lu, "
+               "latency avg %.3f ms, max %.3f ms",
+            state.nat_lookups, state.nat_timeouts,
+            (state.nat_lookups > 0
+                    ? state.nat_latency_total / state.nat_lookups
+                    : 0.0),
+            state.nat_latency_max);
+    }
+
     for (i = 0; i < state.max_cons; i++) {
         if (state.cons[i].fd != -1)
             Con_close(&state.cons[i], &state);
@@ -848,6 +1004,7 @@ shutdown:
             List_destroy(&state.cons[i].blacklists);
     }
 
+    state.syncer = NULL;
     if (syncer)
         Sync_stop(&syncer);
 
@@ -855,9 +1012,13 @@ shutdown:
         kill(state.fw_pid, SIGTERM);
 
     close_pidfile(pidfile, chroot_dir);
+    if (stats_sock != -1)
+        close_stats_socket(stats_sock, stats_path, chroot_dir);
     free(fds);
     free(state.cons);
     fclose(state.grey_out);
+    Greyd_free_messages(&state.nat_buf);
+    Greyd_free_messages(&state.grey_stats_buf);
     Hash_destroy(&state.blacklists);
     Config_destroy(&state.config);
 
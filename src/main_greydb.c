@@ -23,6 +23,7 @@
 
 #include <ctype.h>
 #include <err.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,55 +50,128 @@
 #define ACTION_LIST 0
 #define ACTION_DEL 1
 #define ACTION_ADD 2
+#define ACTION_IMPORT 3
+
+#define LIST_GREY 0x01
+#define LIST_WHITE 0x02
+#define LIST_TRAPPED 0x04
+#define LIST_SPAMTRAP 0x08
+#define LIST_DOMAIN 0x10
+#define LIST_ALL 0x1f
+
+#define BULK_BATCH 10000 /* Records imported per transaction. */
+#define BULK_BUFSIZE (1 << 20)
+#define RECORD_FIELDS 10
 
 extern char* optarg;
 extern int optind, opterr, optopt;
 
 static void usage(void);
-static int db_list(DB_handle_T);
-static int db_update(DB_handle_T, char*, int, int, Sync_engine_T,
+static int list_types(char*);
+static int db_list(DB_handle_T, FILE*, int, time_t);
+static int db_update(DB_handle_T, char**, int, int, int, Sync_engine_T,
     int, int);
+static int db_import(DB_handle_T, FILE*, Sync_engine_T);
+static int import_batch(DB_handle_T, struct DB_key*, struct DB_val*, int,
+    Sync_engine_T, time_t);
+static int parse_record(char*, char*, struct DB_key*, struct DB_val*,
+    time_t);
+static int parse_time(const char*, time_t*);
+static int parse_count(const char*, int*);
 
 static void
 usage(void)
 {
     fprintf(stderr, "usage: %s [-f config] [[-DTt] -a keys] "
-                    "[[-DTt] -d keys] \n",
+                    "[[-DTt] -d keys] [-i file] [-o file] [-F types] "
+                    "[-e time]\n",
         PROG_NAME);
     exit(1);
 }
 
+/*
+ * Parse a comma separated list of entry type names into a mask of
+ * LIST_* flags, returning -1 on an unknown name.
+ */
 static int
-db_list(DB_handle_T db)
+list_types(char* names)
+{
+    char* name;
+    int types = 0;
+
+    while ((name = strsep(&names, ",")) != NULL) {
+        if (strcasecmp(name, "grey") == 0)
+            types |= LIST_GREY;
+        else if (strcasecmp(name, "white") == 0)
+            types |= LIST_WHITE;
+        else if (strcasecmp(name, "trapped") == 0)
+            types |= LIST_TRAPPED;
+        else if (strcasecmp(name, "spamtrap") == 0)
+            types |= LIST_SPAMTRAP;
+        else if (strcasecmp(name, "domain") == 0)
+            types |= LIST_DOMAIN;
+        else
+            return -1;
+    }
+
+    return types;
+}
+
+/*
+ * List the entries of the given types to the output stream. Entries
+ * which expire before the given time are skipped, although SPAMTRAP and
+ * DOMAIN entries never expire.
+ */
+static int
+db_list(DB_handle_T db, FILE* out, int types, time_t expiry)
 {
     DB_itr_T itr;
     struct DB_key key;
     struct DB_val val;
     struct Grey_tuple gt;
     struct Grey_data gd;
+    int itr_types = 0;
+
+    /* Only ask the driver for the entries which will be listed. */
+    if (types & (LIST_GREY | LIST_WHITE | LIST_TRAPPED))
+        itr_types |= DB_ENTRIES;
+    if (types & LIST_SPAMTRAP)
+        itr_types |= DB_SPAMTRAPS;
+    if (types & LIST_DOMAIN)
+        itr_types |= DB_DOMAINS;
 
-    itr = DB_get_itr(db, DB_ENTRIES | DB_SPAMTRAPS | DB_DOMAINS);
+    itr = DB_get_itr(db, itr_types);
     while (DB_itr_next(itr, &key, &val) != GREYDB_NOT_FOUND) {
         gd = val.data.gd;
 
+        if ((key.type == DB_KEY_TUPLE || key.type == DB_KEY_IP)
+            && gd.expire < expiry) {
+            continue;
+        }
+
         switch (key.type) {
         case DB_KEY_TUPLE:
             /*
              * This is a greylist entry.
              */
+            if (!(types & LIST_GREY))
+                break;
+
             gt = key.data.gt;
-            printf("GREY|%s|%s|%s|%s|%lld|%lld|%lld|%d|%d\n",
+            fprintf(out, "GREY|%s|%s|%s|%s|%lld|%lld|%lld|%d|%d\n",
                 gt.ip, gt.helo, gt.from, gt.to, (long long)gd.first,
                 (long long)gd.pass, (long long)gd.expire,
                 gd.bcount, gd.pcount);
             break;
 
         case DB_KEY_MAIL:
-            printf("SPAMTRAP|%s\n", key.data.s);
+            if (types & LIST_SPAMTRAP)
+                fprintf(out, "SPAMTRAP|%s\n", key.data.s);
             break;
 
         case DB_KEY_DOM:
-            printf("DOMAIN|%s\n", key.data.s);
+            if (types & LIST_DOMAIN)
+                fprintf(out, "DOMAIN|%s\n", key.data.s);
             break;
 
         case DB_KEY_IP:
@@ -107,15 +181,17 @@ db_list(DB_handle_T db)
             switch (gd.pcount) {
             case -1:
                 /* Spamtrap hit, with expiry time. */
-                printf("TRAPPED|%s|%lld\n", key.data.s,
-                    (long long)gd.expire);
+                if (types & LIST_TRAPPED)
+                    fprintf(out, "TRAPPED|%s|%lld\n", key.data.s,
+                        (long long)gd.expire);
                 break;
 
             default:
                 /* Must be a whitelist entry. */
-                printf("WHITE|%s|||%lld|%lld|%lld|%d|%d\n", key.data.s,
-                    (long long)gd.first, (long long)gd.pass,
-                    (long long)gd.expire, gd.bcount, gd.pcount);
+                if (types & LIST_WHITE)
+                    fprintf(out, "WHITE|%s|||%lld|%lld|%lld|%d|%d\n",
+                        key.data.s, (long long)gd.first, (long long)gd.pass,
+                        (long long)gd.expire, gd.bcount, gd.pcount);
                 break;
             }
             break;
@@ -123,183 +199,433 @@ db_list(DB_handle_T db)
     }
     DB_close_itr(&itr);
 
+    if (fflush(out) == EOF || ferror(out)) {
+        warn("write");
+        return 1;
+    }
+
     return 0;
 }
 
+/*
+ * Add or delete the addresses of the given type, looking up and writing
+ * the entries as a batch within a single transaction.
+ */
 static int
-db_update(DB_handle_T db, char* ip, int action, int type,
+db_update(DB_handle_T db, char** ips, int nips, int action, int type,
     Sync_engine_T syncer, int white_expiry, int trap_expiry)
 {
-    struct DB_key key;
-    struct DB_val val;
-    struct Grey_data gd;
-    char addr[GREY_MAX_MAIL];
+    struct DB_key* keys;
+    struct DB_val* vals;
+    struct Grey_data* gd;
+    char(*addrs)[GREY_MAX_MAIL];
+    char* ip;
     time_t now;
-    int ret, i;
+    int *found, i, n = 0, m = 0, failed = 0;
 
-    memset(&gd, 0, sizeof(gd));
-    memset(&addr, 0, GREY_MAX_MAIL);
+    if ((keys = calloc(nips, sizeof(*keys))) == NULL
+        || (vals = calloc(nips, sizeof(*vals))) == NULL
+        || (found = calloc(nips, sizeof(*found))) == NULL
+        || (addrs = calloc(nips, sizeof(*addrs))) == NULL) {
+        err(1, "calloc");
+    }
     now = time(NULL);
 
-    switch (type) {
-    case TYPE_TRAPHIT:
-    case TYPE_WHITE:
-        /*
-         * We are expecting a numeric IP address.
-         */
-        if (IP_check_addr(ip) == -1) {
-            warnx("Invalid IP address %s", ip);
-            return 1;
-        }
-        key.type = DB_KEY_IP;
-        break;
+    for (i = 0; i < nips; i++) {
+        ip = ips[i];
+
+        switch (type) {
+        case TYPE_TRAPHIT:
+        case TYPE_WHITE:
+            /*
+             * We are expecting a numeric IP address.
+             */
+            if (IP_check_addr(ip) == -1) {
+                warnx("Invalid IP address %s", ip);
+                failed++;
+                continue;
+            }
+            keys[n].type = DB_KEY_IP;
+            break;
+
+        case TYPE_SPAMTRAP:
+            keys[n].type = DB_KEY_MAIL;
+            normalize_email_addr(ip, addrs[n], GREY_MAX_MAIL);
+            ip = addrs[n];
+            if (strchr(ip, '@') == NULL) {
+                warnx("Not an email address: %s", ip);
+                failed++;
+                continue;
+            }
+            break;
 
-    case TYPE_SPAMTRAP:
-        key.type = DB_KEY_MAIL;
-        normalize_email_addr(ip, addr, GREY_MAX_MAIL);
-        ip = addr;
-        if (strchr(ip, '@') == NULL) {
-            warnx("Not an email address: %s", ip);
-            return 1;
+        case TYPE_DOMAIN:
+            keys[n].type = DB_KEY_DOM;
+            normalize_email_addr(ip, addrs[n], GREY_MAX_MAIL);
+            ip = addrs[n];
+            break;
+
+        default:
+            warnx("Unknown type %d", type);
+            failed++;
+            continue;
         }
-        break;
 
-    case TYPE_DOMAIN:
-        key.type = DB_KEY_DOM;
-        normalize_email_addr(ip, addr, GREY_MAX_MAIL);
-        ip = addr;
-        break;
+        keys[n++].data.s = ip;
     }
 
+    if (n == 0)
+        goto cleanup;
+
     DB_start_txn(db);
 
-    key.data.s = ip;
+    if (DB_get_many(db, keys, vals, found, n) != GREYDB_OK) {
+        warnx("Lookup failed");
+        goto rollback;
+    }
+
     if (action == ACTION_DEL) {
-        ret = DB_del(db, &key);
-        switch (ret) {
-        case GREYDB_NOT_FOUND:
-            warnx("No entry for %s", ip);
-            goto rollback;
+        /* Only the entries which exist are deleted. */
+        for (i = 0; i < n; i++) {
+            if (found[i] == GREYDB_NOT_FOUND) {
+                warnx("No entry for %s", keys[i].data.s);
+                failed++;
+            } else {
+                keys[m++] = keys[i];
+            }
+        }
 
-        case GREYDB_ERR:
+        if (DB_del_many(db, keys, m) != GREYDB_OK) {
             warnx("Deletion failed");
             goto rollback;
         }
+        memset(vals, 0, n * sizeof(*vals));
     } else {
-        /*
-         * Add a new entry.
-         */
-        ret = DB_get(db, &key, &val);
-        switch (ret) {
-        case GREYDB_FOUND:
-            /*
-             * Update the existing entry in the database.
-             */
-            gd = val.data.gd;
-            gd.pcount++;
+        for (i = 0, m = n; i < n; i++) {
+            gd = &vals[i].data.gd;
+
+            if (found[i] == GREYDB_FOUND) {
+                /*
+                 * Update the existing entry in the database.
+                 */
+                gd->pcount++;
+                switch (type) {
+                case TYPE_WHITE:
+                    gd->pass = now;
+                    gd->expire = now + white_expiry;
+                    break;
+
+                case TYPE_TRAPHIT:
+                    gd->expire = now + trap_expiry;
+                    gd->pcount = -1;
+                    break;
+
+                case TYPE_SPAMTRAP:
+                    gd->expire = 0;
+                    gd->pcount = -2;
+                    break;
+
+                case TYPE_DOMAIN:
+                    gd->expire = 0;
+                    gd->pcount = -3;
+                    break;
+                }
+            } else {
+                /*
+                 * Create a fresh entry and insert into the database.
+                 */
+                memset(gd, 0, sizeof(*gd));
+                gd->first = now;
+                gd->bcount = 1;
+
+                switch (type) {
+                case TYPE_WHITE:
+                    gd->pass = now;
+                    gd->expire = now + white_expiry;
+                    break;
+
+                case TYPE_TRAPHIT:
+                    gd->expire = now + trap_expiry;
+                    gd->pcount = -1;
+                    break;
+
+                case TYPE_SPAMTRAP:
+                case TYPE_DOMAIN:
+                    gd->expire = 0;
+                    gd->pcount = -2;
+                    break;
+                }
+            }
+            vals[i].type = DB_VAL_GREY;
+        }
+
+        if (DB_put_many(db, keys, vals, n) != GREYDB_OK) {
+            warnx("Put failed");
+            goto rollback;
+        }
+    }
+
+    DB_commit_txn(db);
+
+    if (syncer) {
+        for (i = 0; i < m; i++) {
             switch (type) {
             case TYPE_WHITE:
-                gd.pass = now;
-                gd.expire = now + white_expiry;
+                Sync_white(syncer, keys[i].data.s, now,
+                    vals[i].data.gd.expire, (action == ACTION_DEL ? 1 : 0));
                 break;
 
             case TYPE_TRAPHIT:
-                gd.expire = now + trap_expiry;
-                gd.pcount = -1;
+                Sync_trapped(syncer, keys[i].data.s, now,
+                    vals[i].data.gd.expire, (action == ACTION_DEL ? 1 : 0));
                 break;
+            }
+        }
+    }
 
-            case TYPE_SPAMTRAP:
-                gd.expire = 0;
-                gd.pcount = -2;
-                break;
+    goto cleanup;
 
-            case TYPE_DOMAIN:
-                gd.expire = 0;
-                gd.pcount = -3;
-                break;
+rollback:
+    DB_rollback_txn(db);
+    failed = nips;
 
-            default:
-                warnx("unknown type %d", type);
-                goto rollback;
-            }
+cleanup:
+    free(keys);
+    free(vals);
+    free(found);
+    free(addrs);
 
-            val.type = DB_VAL_GREY;
-            val.data.gd = gd;
-            if ((ret = DB_put(db, &key, &val)) != GREYDB_OK) {
-                warnx("Put failed");
-                goto rollback;
-            }
-            break;
+    return failed;
+}
 
-        case GREYDB_NOT_FOUND:
-            /*
-             * Create a fresh entry and insert into the database.
-             */
-            gd.first = now;
-            gd.bcount = 1;
+/*
+ * Read records in the listing format from the input stream and write
+ * them in batches, each within a single transaction. Existing entries are
+ * replaced. The number of records which could not be imported is
+ * returned.
+ */
+static int
+db_import(DB_handle_T db, FILE* in, Sync_engine_T syncer)
+{
+    struct DB_key* keys;
+    struct DB_val* vals;
+    char(*addrs)[GREY_MAX_MAIL];
+    char **lines, *buf = NULL;
+    size_t len = 0;
+    long lineno = 0;
+    time_t now = time(NULL);
+    int i, n = 0, failed = 0;
+
+    if ((keys = calloc(BULK_BATCH, sizeof(*keys))) == NULL
+        || (vals = calloc(BULK_BATCH, sizeof(*vals))) == NULL
+        || (lines = calloc(BULK_BATCH, sizeof(*lines))) == NULL
+        || (addrs = calloc(BULK_BATCH, sizeof(*addrs))) == NULL) {
+        err(1, "calloc");
+    }
 
-            switch (type) {
-            case TYPE_WHITE:
-                gd.pass = now;
-                gd.expire = now + white_expiry;
-                break;
+    while (getline(&buf, &len, in) != -1) {
+        lineno++;
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (buf[0] == '\0' || buf[0] == '#')
+            continue;
+
+        /* The keys point into the line, so it must outlive the batch. */
+        if ((lines[n] = strdup(buf)) == NULL)
+            err(1, "strdup");
+
+        if (parse_record(lines[n], addrs[n], &keys[n], &vals[n], now) == -1) {
+            warnx("Invalid record on line %ld: %s", lineno, buf);
+            free(lines[n]);
+            failed++;
+            continue;
+        }
 
-            case TYPE_TRAPHIT:
-                gd.expire = now + trap_expiry;
-                gd.pcount = -1;
-                break;
+        if (++n == BULK_BATCH) {
+            failed += import_batch(db, keys, vals, n, syncer, now);
+            for (i = 0; i < n; i++)
+                free(lines[i]);
+            n = 0;
+        }
+    }
 
-            case TYPE_SPAMTRAP:
-            case TYPE_DOMAIN:
-                gd.expire = 0;
-                gd.pcount = -2;
-                break;
+    if (ferror(in)) {
+        warn("read");
+        failed++;
+    }
 
-            default:
-                warnx("Unknown type %d", type);
-                goto rollback;
-            }
+    if (n > 0) {
+        failed += import_batch(db, keys, vals, n, syncer, now);
+        for (i = 0; i < n; i++)
+            free(lines[i]);
+    }
 
-            val.type = DB_VAL_GREY;
-            val.data.gd = gd;
-            if ((ret = DB_put(db, &key, &val)) != GREYDB_OK) {
-                warnx("Put failed");
-                goto rollback;
-            }
-            break;
+    free(buf);
+    free(keys);
+    free(vals);
+    free(lines);
+    free(addrs);
 
-        default:
-        case GREYDB_ERR:
-            goto rollback;
-        }
-    }
+    return failed;
+}
 
+/*
+ * Write a batch of imported records, then queue sync messages for any
+ * WHITE and TRAPPED entries once committed.
+ */
+static int
+import_batch(DB_handle_T db, struct DB_key* keys, struct DB_val* vals,
+    int n, Sync_engine_T syncer, time_t now)
+{
+    struct Grey_data* gd;
+    int i;
+
+    DB_start_txn(db);
+    if (DB_put_many(db, keys, vals, n) != GREYDB_OK) {
+        warnx("Put failed");
+        DB_rollback_txn(db);
+        return n;
+    }
     DB_commit_txn(db);
 
     if (syncer) {
-        switch (type) {
-        case TYPE_WHITE:
-            Sync_white(syncer, ip, now, gd.expire, (action == ACTION_DEL ? 1 : 0));
-            break;
+        for (i = 0; i < n; i++) {
+            if (keys[i].type != DB_KEY_IP)
+                continue;
+
+            gd = &vals[i].data.gd;
+            if (gd->pcount == -1)
+                Sync_trapped(syncer, keys[i].data.s, now, gd->expire, 0);
+            else
+                Sync_white(syncer, keys[i].data.s, now, gd->expire, 0);
+        }
+    }
 
-        case TYPE_TRAPHIT:
-            Sync_trapped(syncer, ip, now, gd.expire, (action == ACTION_DEL ? 1 : 0));
-            break;
+    return 0;
+}
+
+/*
+ * Parse a single record in the listing format into a key and value.
+ * The key's strings point into the line, or the address buffer for
+ * normalized SPAMTRAP and DOMAIN entries.
+ */
+static int
+parse_record(char* line, char* addr, struct DB_key* key, struct DB_val* val,
+    time_t now)
+{
+    struct Grey_data* gd = &val->data.gd;
+    char *fields[RECORD_FIELDS], **counts, *p = line;
+    int n = 0;
+
+    while (n < RECORD_FIELDS && (fields[n] = strsep(&p, "|")) != NULL)
+        n++;
+
+    /* Too many fields. */
+    if (p != NULL)
+        return -1;
+
+    memset(key, 0, sizeof(*key));
+    memset(val, 0, sizeof(*val));
+    val->type = DB_VAL_GREY;
+
+    if ((strcmp(fields[0], "GREY") == 0 && n == RECORD_FIELDS)
+        || (strcmp(fields[0], "WHITE") == 0 && n == RECORD_FIELDS - 1)) {
+        if (IP_check_addr(fields[1]) == -1)
+            return -1;
+
+        /* The times and counters are the last five fields. */
+        counts = fields + n - 5;
+        if (parse_time(counts[0], &gd->first) == -1
+            || parse_time(counts[1], &gd->pass) == -1
+            || parse_time(counts[2], &gd->expire) == -1
+            || parse_count(counts[3], &gd->bcount) == -1
+            || parse_count(counts[4], &gd->pcount) == -1) {
+            return -1;
+        }
+
+        if (n == RECORD_FIELDS) {
+            key->type = DB_KEY_TUPLE;
+            key->data.gt.ip = fields[1];
+            key->data.gt.helo = fields[2];
+            key->data.gt.from = fields[3];
+            key->data.gt.to = fields[4];
+        } else {
+            key->type = DB_KEY_IP;
+            key->data.s = fields[1];
         }
+    } else if (strcmp(fields[0], "TRAPPED") == 0 && n == 3) {
+        if (IP_check_addr(fields[1]) == -1
+            || parse_time(fields[2], &gd->expire) == -1) {
+            return -1;
+        }
+
+        key->type = DB_KEY_IP;
+        key->data.s = fields[1];
+        gd->first = now;
+        gd->bcount = 1;
+        gd->pcount = -1;
+    } else if (strcmp(fields[0], "SPAMTRAP") == 0 && n == 2) {
+        normalize_email_addr(fields[1], addr, GREY_MAX_MAIL);
+        if (strchr(addr, '@') == NULL)
+            return -1;
+
+        key->type = DB_KEY_MAIL;
+        key->data.s = addr;
+        gd->first = now;
+        gd->bcount = 1;
+        gd->pcount = -2;
+    } else if (strcmp(fields[0], "DOMAIN") == 0 && n == 2) {
+        normalize_email_addr(fields[1], addr, GREY_MAX_MAIL);
+        if (addr[0] == '\0')
+            return -1;
+
+        key->type = DB_KEY_DOM;
+        key->data.s = addr;
+        gd->first = now;
+        gd->bcount = 1;
+        gd->pcount = -3;
+    } else {
+        return -1;
     }
 
     return 0;
+}
 
-rollback:
-    DB_rollback_txn(db);
+static int
+parse_time(const char* str, time_t* out)
+{
+    char* end;
+    long long num;
+
+    num = strtoll(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || num < 0)
+        return -1;
+    *out = (time_t)num;
+
+    return 0;
+}
+
+static int
+parse_count(const char* str, int* out)
+{
+    char* end;
+    long num;
 
-    return 1;
+    num = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || num < INT_MIN || num > INT_MAX)
+        return -1;
+    *out = (int)num;
+
+    return 0;
 }
 
 int main(int argc, char** argv)
 {
     int option, type = TYPE_WHITE, action = ACTION_LIST, i, ret = 0, c = 0;
-    char* config_file = DEFAULT_CONFIG;
+    int types = 0, failed;
+    char *config_file = DEFAULT_CONFIG, *import_file = NULL;
+    char *export_file = NULL, *end;
+    time_t expiry = 0;
+    FILE* stream = NULL;
     Config_T config, opts;
     DB_handle_T db;
     Sync_engine_T syncer = NULL;
@@ -308,7 +634,7 @@ int main(int argc, char** argv)
     int white_expiry, trap_expiry;
 
     opts = Config_create();
-    while ((option = getopt(argc, argv, "adtTDf:Y:")) != -1) {
+    while ((option = getopt(argc, argv, "adtTDf:Y:i:o:F:e:")) != -1) {
         switch (option) {
         case 'a':
             action = ACTION_ADD;
@@ -339,6 +665,27 @@ int main(int argc, char** argv)
             sync_send++;
             break;
 
+        case 'i':
+            action = ACTION_IMPORT;
+            import_file = optarg;
+            break;
+
+        case 'o':
+            export_file = optarg;
+            break;
+
+        case 'F':
+            if ((i = list_types(optarg)) == -1)
+                usage();
+            types |= i;
+            break;
+
+        case 'e':
+            expiry = strtoll(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0')
+                usage();
+            break;
+
         default:
             usage();
             break;
@@ -349,6 +696,31 @@ int main(int argc, char** argv)
         usage();
     }
 
+    /* The listing options only apply to listing. */
+    if (action != ACTION_LIST && (export_file || types || expiry)) {
+        usage();
+    }
+
+    if (action == ACTION_IMPORT && type != TYPE_WHITE) {
+        usage();
+    }
+
+    if (action == ACTION_LIST) {
+        if (export_file == NULL || strcmp(export_file, "-") == 0) {
+            stream = stdout;
+        } else if ((stream = fopen(export_file, "w")) == NULL) {
+            err(1, "%s", export_file);
+        }
+        setvbuf(stream, NULL, _IOFBF, BULK_BUFSIZE);
+    } else if (action == ACTION_IMPORT) {
+        if (strcmp(import_file, "-") == 0) {
+            stream = stdin;
+        } else if ((stream = fopen(import_file, "r")) == NULL) {
+            err(1, "%s", import_file);
+        }
+        setvbuf(stream, NULL, _IOFBF, BULK_BUFSIZE);
+    }
+
     config = Config_create();
     Config_load_file(config, config_file);
     Config_merge(config, opts);
@@ -364,15 +736,17 @@ int main(int argc, char** argv)
 
     switch (action) {
     case ACTION_LIST:
-        ret = db_list(db);
+        ret = db_list(db, stream, (types ? types : LIST_ALL), expiry);
         break;
 
     case ACTION_ADD:
     case ACTION_DEL:
+    case ACTION_IMPORT:
         /* Ensure that the sync bind address is not set. */
         Config_delete(config, "bind_address", "sync");
 
-        if (sync_send == 0
+        /* Imports are only synced to explicitly specified targets. */
+        if (sync_send == 0 && action != ACTION_IMPORT
             && (hosts = Config_get_list(config, "hosts", "sync"))) {
             sync_send += List_size(hosts);
         }
@@ -387,21 +761,30 @@ int main(int argc, char** argv)
             sync_send = 0;
         }
 
+        if (action == ACTION_IMPORT) {
+            if ((failed = db_import(db, stream, syncer)) > 0)
+                warnx("%d records could not be imported", failed);
+            ret = (failed != 0);
+            break;
+        }
+
         white_expiry = Config_get_int(config, "white_expiry", "grey",
             GREY_WHITEEXP);
         trap_expiry = Config_get_int(config, "trap_expiry", "grey",
             GREY_TRAPEXP);
 
+        /* Skip any empty arguments. */
         for (i = optind; i < argc; i++) {
-            if (argv[i][0] != '\0') {
-                c++;
-                ret += db_update(db, argv[i], action, type, syncer,
-                    white_expiry, trap_expiry);
-            }
+            if (argv[i][0] != '\0')
+                argv[optind + c++] = argv[i];
         }
 
         if (c == 0) {
             warnx("No addresses specified");
+        } else {
+            ret = (db_update(db, argv + optind, c, action, type, syncer,
+                       white_expiry, trap_expiry)
+                != 0);
         }
         break;
 
@@ -414,5 +797,8 @@ int main(int argc, char** argv)
     if (sync_send)
         Sync_stop(&syncer);
 
+    if (stream && stream != stdin && stream != stdout && fclose(stream) == EOF)
+        ret = 1;
+
     return ret;
 }
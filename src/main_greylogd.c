@@ -42,6 +42,7 @@
 #include "firewall.h"
 #include "greyd_config.h"
 #include "greydb.h"
+#include "hash.h"
 #include "log.h"
 #include "sync.h"
 #include "utils.h"
@@ -53,6 +54,31 @@ extern int optind, opterr, optopt;
 
 static volatile sig_atomic_t Greylogd_shutdown = 0;
 
+/*
+ * The whitelisting state kept between captures.
+ */
+struct whitelister {
+    DB_handle_T db;
+    Sync_engine_T syncer;
+    Hash_T recent; /* Addresses refreshed within the window. */
+    int white_expiry;
+    int window;
+    unsigned long updated;
+    unsigned long skipped;
+};
+
+/*
+ * A recently refreshed address, along with the passes seen since, which
+ * are added to the pass count at the next refresh.
+ */
+struct refresh {
+    time_t refreshed;
+    int pending;
+};
+
+static int whitelist_entries(struct whitelister*, List_T);
+static void destroy_refresh(struct Hash_entry*);
+
 void usage(void)
 {
     fprintf(stderr,
@@ -73,17 +99,16 @@ int main(int argc, char** argv)
     Config_T config, opts;
     char *config_file = DEFAULT_CONFIG, *db_user, *pidfile;
     struct passwd* db_pw;
-    int option, white_expiry, sync_send = 0;
+    int option, white_expiry, sync_send = 0, timeout, sync_timeout;
+    struct whitelister wl;
+    time_t stats_logged;
     FW_handle_T fw_handle;
     List_T entries, hosts;
-    struct List_entry* entry;
     DB_handle_T db_handle;
-    struct DB_key key;
-    struct DB_val val;
-    time_t now;
     Sync_engine_T syncer = NULL;
     struct sigaction act;
 
+    memset(&wl, 0, sizeof(wl));
     opts = Config_create();
     while ((option = getopt(argc, argv, "DIW:Y:f:P:")) != -1) {
         switch (option) {
@@ -199,52 +224,48 @@ int main(int argc, char** argv)
     white_expiry = Config_get_int(config, "white_expiry", "grey", GREY_WHITEEXP);
     DB_open(db_handle, 0);
 
+    wl.db = db_handle;
+    wl.syncer = (sync_send ? syncer : NULL);
+    wl.white_expiry = white_expiry;
+    wl.window = Config_get_int(config, "refresh_window", "grey",
+        GREYLOGD_REFRESH_WINDOW);
+    wl.recent = Hash_create(GREY_SET_INIT_SIZE, destroy_refresh);
+    stats_logged = time(NULL);
+
     while (!Greylogd_shutdown) {
-        if ((entries = FW_capture_log(fw_handle)) != NULL
-            && List_size(entries) > 0) {
-            now = time(NULL);
-            LIST_EACH(entries, entry)
-            {
-                key.data.s = List_entry_value(entry);
-                key.type = DB_KEY_IP;
-
-                DB_start_txn(db_handle);
-                switch (DB_get(db_handle, &key, &val)) {
-                case GREYDB_NOT_FOUND:
-                    /* Create new entry. */
-                    memset(&val.data.gd, 0, sizeof(val.data.gd));
-                    val.type = DB_VAL_GREY;
-                    val.data.gd.first = now;
-                    val.data.gd.pass = now;
-                    /* Fallthrough. */
-
-                case GREYDB_FOUND:
-                    /* Update existing entry. */
-                    val.data.gd.pcount++;
-                    val.data.gd.expire = now + white_expiry;
-                    if (DB_put(db_handle, &key, &val) != GREYDB_OK) {
-                        i_warning("error putting %s", key.data.s);
-                        DB_rollback_txn(db_handle);
-                        goto shutdown;
-                    } else {
-                        i_info("whitelisting %s", key.data.s);
-                        if (sync_send)
-                            Sync_white(syncer, key.data.s, now, now + white_expiry, 0);
-                    }
-                    break;
-
-                default:
-                    i_warning("error querying database for %s", key.data.s);
-                    DB_rollback_txn(db_handle);
-                    goto shutdown;
-                }
-
-                DB_commit_txn(db_handle);
-            }
+        /* Wake up in time to flush buffered log messages and sync entries. */
+        timeout = Log_flush_timeout();
+        if (sync_send && (sync_timeout = Sync_flush_timeout(syncer)) != -1
+            && (timeout == -1 || sync_timeout < timeout)) {
+            timeout = sync_timeout;
+        }
+
+        if ((entries = FW_capture_log(fw_handle, timeout)) != NULL
+            && List_size(entries) > 0
+            && whitelist_entries(&wl, entries) == -1) {
+            goto shutdown;
+        }
+
+        /* Send any sync entries left pending by a quiet period. */
+        if (sync_send && Sync_flush_timeout(syncer) == 0)
+            Sync_flush(syncer);
+
+        if (Log_flush_timeout() == 0)
+            Log_flush();
+
+        if (time(NULL) - stats_logged >= GREYLOGD_STATS_INTERVAL) {
+            i_info("updated %lu addresses, skipped %lu recently refreshed",
+                wl.updated, wl.skipped);
+            stats_logged = time(NULL);
         }
     }
 
 shutdown:
+    if (wl.recent) {
+        i_info("updated %lu addresses, skipped %lu recently refreshed",
+            wl.updated, wl.skipped);
+        Hash_destroy(&wl.recent);
+    }
     i_info("exiting");
     FW_end_log_capture(fw_handle);
     FW_close(&fw_handle);
@@ -258,3 +279,133 @@ shutdown:
 
     return 0;
 }
+
+/*
+ * Whitelist the captured addresses, looking them up and writing them
+ * as one batch within a single transaction. An address captured more
+ * than once in the batch has its pass count incremented for each.
+ * Addresses refreshed within the window are not written again until it
+ * has passed, as their expiry would barely move.
+ */
+static int
+whitelist_entries(struct whitelister* wl, List_T entries)
+{
+    struct List_entry* entry;
+    struct DB_key* keys;
+    struct DB_val* vals;
+    struct refresh* r;
+    Hash_T seen;
+    time_t now = time(NULL);
+    int *found, *counts, *count, i, m = 0, n = 0, size = List_size(entries);
+    int ret = -1;
+    char* ip;
+
+    if ((keys = calloc(size, sizeof(*keys))) == NULL)
+        i_critical("calloc: %s", strerror(errno));
+    if ((vals = calloc(size, sizeof(*vals))) == NULL)
+        i_critical("calloc: %s", strerror(errno));
+    if ((found = calloc(size, sizeof(*found))) == NULL)
+        i_critical("calloc: %s", strerror(errno));
+    if ((counts = calloc(size, sizeof(*counts))) == NULL)
+        i_critical("calloc: %s", strerror(errno));
+
+    seen = Hash_create(size, NULL);
+    LIST_EACH(entries, entry)
+    {
+        ip = List_entry_value(entry);
+        if ((count = Hash_get(seen, ip)) == NULL) {
+            keys[n].type = DB_KEY_IP;
+            keys[n].data.s = ip;
+            count = &counts[n++];
+            Hash_insert(seen, ip, count);
+        } else {
+            wl->skipped++;
+        }
+        (*count)++;
+    }
+
+    /* Only keep the addresses which are due a refresh. */
+    for (i = 0; i < n; i++) {
+        r = Hash_get(wl->recent, keys[i].data.s);
+        if (r && wl->window > 0 && now - r->refreshed < wl->window) {
+            r->pending += counts[i];
+            wl->skipped++;
+            continue;
+        }
+
+        keys[m] = keys[i];
+        counts[m++] = counts[i] + (r ? r->pending : 0);
+    }
+
+    if (m == 0) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    DB_start_txn(wl->db);
+    if (DB_get_many(wl->db, keys, vals, found, m) != GREYDB_OK) {
+        i_warning("error querying database for %d addresses", m);
+        DB_rollback_txn(wl->db);
+        goto cleanup;
+    }
+
+    for (i = 0; i < m; i++) {
+        if (found[i] == GREYDB_NOT_FOUND) {
+            /* Create new entry. */
+            memset(&vals[i], 0, sizeof(vals[i]));
+            vals[i].type = DB_VAL_GREY;
+            vals[i].data.gd.first = now;
+            vals[i].data.gd.pass = now;
+        }
+        vals[i].data.gd.pcount += counts[i];
+        vals[i].data.gd.expire = now + wl->white_expiry;
+    }
+
+    if (DB_put_many(wl->db, keys, vals, m) != GREYDB_OK) {
+        i_warning("error putting %d addresses", m);
+        DB_rollback_txn(wl->db);
+        goto cleanup;
+    }
+    DB_commit_txn(wl->db);
+    wl->updated += m;
+
+    /* Bound the memory used, at the cost of a few early refreshes. */
+    if (wl->recent->num_entries + m > GREYLOGD_REFRESH_MAX)
+        Hash_reset(wl->recent);
+
+    for (i = 0; i < m; i++) {
+        i_info("whitelisting %s", keys[i].data.s);
+        if (wl->syncer)
+            Sync_white(wl->syncer, keys[i].data.s, now,
+                now + wl->white_expiry, 0);
+
+        if (wl->window > 0) {
+            if ((r = malloc(sizeof(*r))) == NULL)
+                i_critical("malloc: %s", strerror(errno));
+            r->refreshed = now;
+            r->pending = 0;
+            Hash_insert(wl->recent, keys[i].data.s, r);
+        }
+    }
+
+    /* Send the batch's sync entries together. */
+    if (wl->syncer)
+        Sync_flush(wl->syncer);
+    ret = 0;
+
+cleanup:
+    Hash_destroy(&seen);
+    free(keys);
+    free(vals);
+    free(found);
+    free(counts);
+
+    return ret;
+}
+
+static void
+destroy_refresh(struct Hash_entry* entry)
+{
+    if (entry)
+        free(entry->v);
+}
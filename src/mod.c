@@ -79,6 +79,17 @@ extern void* Mod_get(void* handle, const char* sym)
     return mod_sym;
 }
 
+extern void* Mod_get_optional(void* handle, const char* sym)
+{
+    void* mod_sym;
+
+    mod_sym = lt_dlsym(handle, sym);
+    if (Mod_error() != NULL)
+        return NULL;
+
+    return mod_sym;
+}
+
 extern const char* Mod_error(void)
 {
     return lt_dlerror();
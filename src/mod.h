@@ -43,6 +43,12 @@ extern void Mod_close(void* handle);
  */
 extern void* Mod_get(void* handle, const char* sym);
 
+/**
+ * Fetch a symbol that the module is not required to implement. NULL is
+ * returned if the symbol is not defined.
+ */
+extern void* Mod_get_optional(void* handle, const char* sym);
+
 /**
  * Check for module errors and return if defined.
  */
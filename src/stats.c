@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   stats.c
+ * @brief  Implements the runtime statistics counters and histograms.
+ * @author Mikey Austin
+ * @date   2014
+ */
+
+#include <config.h>
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/* The upper bounds of the histogram buckets, in seconds. */
+static const double Stats_bounds[STATS_BUCKETS] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static void write_label_value(FILE* out, const char* value);
+
+extern void
+Stats_observe(struct Stats_histogram* hist, double value)
+{
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS && value > Stats_bounds[i]; i++)
+        ;
+
+    hist->buckets[i]++;
+    hist->count++;
+    hist->sum += value;
+}
+
+extern double
+Stats_elapsed(struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+extern void
+Stats_write_counter(FILE* out, const char* name, const char* help,
+    const char* label, const char* label_value, unsigned long value)
+{
+    if (help != NULL) {
+        fprintf(out, "# HELP %s %s\n", name, help);
+        fprintf(out, "# TYPE %s counter\n", name);
+    }
+
+    if (label != NULL) {
+        fprintf(out, "%s{%s=\"", name, label);
+        write_label_value(out, label_value);
+        fprintf(out, "\"} %lu\n", value);
+    } else {
+        fprintf(out, "%s %lu\n", name, value);
+    }
+}
+
+extern void
+Stats_write_gauge(FILE* out, const char* name, const char* help,
+    double value)
+{
+    fprintf(out, "# HELP %s %s\n", name, help);
+    fprintf(out, "# TYPE %s gauge\n", name);
+    fprintf(out, "%s %.17g\n", name, value);
+}
+
+extern void
+Stats_write_histogram(FILE* out, const char* name, const char* help,
+    struct Stats_histogram* hist)
+{
+    unsigned long cumulative = 0;
+    int i;
+
+    fprintf(out, "# HELP %s %s\n", name, help);
+    fprintf(out, "# TYPE %s histogram\n", name);
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        cumulative += hist->buckets[i];
+        fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, Stats_bounds[i],
+            cumulative);
+    }
+    cumulative += hist->buckets[STATS_BUCKETS];
+
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    fprintf(out, "%s_sum %.17g\n", name, hist->sum);
+    fprintf(out, "%s_count %lu\n", name, hist->count);
+}
+
+/*
+ * Escape a label value as required by the exposition format.
+ */
+static void
+write_label_value(FILE* out, const char* value)
+{
+    for (; *value; value++) {
+        switch (*value) {
+        case '\\':
+            fputs("\\\\", out);
+            break;
+
+        case '"':
+            fputs("\\\"", out);
+            break;
+
+        case '\n':
+            fputs("\\n", out);
+            break;
+
+        default:
+            fputc(*value, out);
+            break;
+        }
+    }
+}
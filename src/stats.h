@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2014, 2015 Mikey Austin <mikey@greyd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file   stats.h
+ * @brief  Defines the runtime statistics counters and histograms.
+ * @author Mikey Austin
+ * @date   2014
+ *
+ * The counters are plain fields updated in place by their owning process.
+ * They are only formatted, in the Prometheus text exposition format, when
+ * the statistics are read.
+ */
+
+#ifndef STATS_DEFINED
+#define STATS_DEFINED
+
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * The number of histogram buckets, excluding the implicit +Inf bucket.
+ */
+#define STATS_BUCKETS 16
+
+/**
+ * A histogram of durations in seconds. All histograms share the same
+ * bucket bounds, ranging from 100 microseconds to 10 seconds.
+ */
+struct Stats_histogram {
+    unsigned long buckets[STATS_BUCKETS + 1];
+    unsigned long count;
+    double sum;
+};
+
+/**
+ * Record a duration in seconds.
+ */
+extern void Stats_observe(struct Stats_histogram* hist, double value);
+
+/**
+ * Return the seconds elapsed since the start time on the monotonic clock.
+ */
+extern double Stats_elapsed(struct timespec* start);
+
+/**
+ * Write a counter, or a single labelled sample of a counter if label is
+ * non-NULL. The HELP and TYPE lines are only written if help is non-NULL,
+ * so that several labelled samples may follow a single header.
+ */
+extern void Stats_write_counter(FILE* out, const char* name, const char* help,
+    const char* label, const char* label_value, unsigned long value);
+
+/**
+ * Write a gauge.
+ */
+extern void Stats_write_gauge(FILE* out, const char* name, const char* help,
+    double value);
+
+/**
+ * Write a histogram as its cumulative buckets, sum and count.
+ */
+extern void Stats_write_histogram(FILE* out, const char* name,
+    const char* help, struct Stats_histogram* hist);
+
+#endif
@@ -22,6 +22,8 @@
  * @date   2014
  */
 
+#include <config.h>
+
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/resource.h>
@@ -44,30 +46,64 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <netdb.h>
 
 #include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <openssl/sha.h>
 
+#include "config_lexer.h"
 #include "config_value.h"
 #include "constants.h"
 #include "failures.h"
 #include "grey.h"
+#include "greydb.h"
 #include "list.h"
 #include "sync.h"
 #include "utils.h"
 
 #define KEY_BUF_SIZE 512
 
+#define SYNC_RECV_BATCH 32
+#define SYNC_RECV_MAX_BATCHES 8
+#define SYNC_IS_TRAP(type) ((type) == SYNC_TRAPPED || (type) == SYNC_DEL_TRAPPED)
+
 struct Sync_host {
     char* name;
     struct sockaddr_in addr;
 };
 
+struct sync_packet {
+    u_int8_t buf[SYNC_MAXSIZE];
+    ssize_t len;
+    struct sockaddr_in addr;
+};
+
 static void send_sync_message(Sync_engine_T, struct iovec*, int);
 static void send_address(Sync_engine_T, char*, time_t, time_t, u_int16_t);
+static void queue_tlv(Sync_engine_T, struct iovec*, int);
+static int recv_packets(Sync_engine_T, struct sync_packet*, int);
+static int process_packet(Sync_engine_T, struct sync_packet*, HMAC_CTX*,
+    FILE*, int);
+static void start_entry(FILE*, int);
+static void write_str(FILE*, const char*);
+static int suppress_update(Sync_engine_T, struct Grey_tuple*, time_t, int);
+static void snapshot_timeouts(int);
+static int read_full(int, void*, size_t);
+static int write_full(int, const void*, size_t);
+static void snapshot_hmac(Sync_engine_T, u_int8_t*, struct Sync_snapshot_hdr*,
+    u_int8_t*, u_int8_t*);
+static int send_chunk(Sync_engine_T, int, u_int8_t*, u_int32_t, u_int8_t*,
+    size_t, u_int32_t);
+static size_t encode_entry(struct DB_key*, struct Grey_data*, u_int8_t*,
+    size_t);
+static long send_entries(Sync_engine_T, int, u_int8_t*, DB_handle_T);
+static size_t decode_entry(u_int8_t*, size_t, struct DB_key*,
+    struct Grey_data*);
+static int apply_entry(DB_handle_T, struct DB_key*, struct Grey_data*);
 static void destroy_sync_host(void*);
 
 extern Sync_engine_T
@@ -96,6 +132,13 @@ Sync_init(Config_T config)
     engine->iface = NULL;
     engine->sync_hosts = List_create(destroy_sync_host);
     engine->port = Config_get_int(config, "port", "sync", GREYD_SYNC_PORT);
+    engine->flush_interval = Config_get_int(config, "flush_interval", "sync",
+        SYNC_FLUSH_INTERVAL);
+    engine->grey_enabled = Config_get_int(config, "enable", "grey",
+        GREYLISTING_ENABLED);
+    engine->suppress_window = Config_get_int(config, "suppress_window",
+        "sync", SYNC_SUPPRESS_WINDOW);
+    engine->suppress = Hash_create(GREY_SET_INIT_SIZE, NULL);
 
     if ((sync_hosts = Config_get_list(config, "hosts", "sync")) != NULL) {
         LIST_EACH(sync_hosts, entry)
@@ -297,8 +340,19 @@ extern void
 Sync_stop(Sync_engine_T* engine)
 {
     if (engine && *engine) {
+        if ((*engine)->sync_fd != -1)
+            Sync_flush(*engine);
+
+        i_debug("sync sent %lu packets (%lu entries), "
+                "received %lu packets (%lu entries), "
+                "suppressed %lu grey updates",
+            (*engine)->packets_sent, (*engine)->tlvs_sent,
+            (*engine)->packets_recv, (*engine)->tlvs_recv,
+            (*engine)->updates_suppressed);
+
         if ((*engine)->sync_hosts)
             List_destroy(&(*engine)->sync_hosts);
+        Hash_destroy(&(*engine)->suppress);
         free(*engine);
         *engine = NULL;
     }
@@ -357,196 +411,123 @@ Sync_add_host(Sync_engine_T engine, const char* name)
 extern void
 Sync_recv(Sync_engine_T engine, FILE* grey_out)
 {
-    struct Sync_hdr* hdr;
-    struct sockaddr_in addr;
-    struct Sync_tlv_hdr* tlv;
-    struct Sync_tlv_grey* sg;
-    struct Sync_tlv_addr* sd;
-    u_int8_t buf[SYNC_MAXSIZE];
-    u_int8_t hmac[2][SYNC_HMAC_LEN];
-    struct in_addr ip;
-    char *from, *to, *helo;
-    char src_ip[INET_ADDRSTRLEN + 1];
-    u_int8_t* p;
-    socklen_t addr_len;
-    ssize_t len;
-    short delete = 0;
-    u_int hmac_len;
-    u_int32_t expire;
-
-    memset(&addr, 0, sizeof(addr));
-    memset(buf, 0, sizeof(buf));
-
-    addr_len = sizeof(addr);
-    if ((len = recvfrom(engine->sync_fd, buf, sizeof(buf), 0,
-             (struct sockaddr*)&addr, &addr_len))
-        < 1) {
-        return;
-    }
+    static struct sync_packet packets[SYNC_RECV_BATCH];
+    int i, n, batches = 0, entries = 0;
 
-    if (addr.sin_addr.s_addr != htonl(INADDR_ANY) && memcmp(&engine->sync_in.sin_addr, &addr.sin_addr, sizeof(addr.sin_addr)) == 0) {
-        return;
-    }
+#ifdef OPENSSL_PRE_1_1_COMPAT
+    HMAC_CTX _ctx, *ctx = &_ctx;
+    HMAC_CTX_init(ctx);
+    HMAC_Init(ctx, engine->sync_key, sizeof(engine->sync_key),
+        EVP_sha1());
+#else
+    HMAC_CTX* ctx = HMAC_CTX_new();
+    HMAC_Init_ex(ctx, engine->sync_key, sizeof(engine->sync_key),
+        EVP_sha1(), NULL);
+#endif
 
-    /* Ignore invalid or truncated packets. */
-    hdr = (struct Sync_hdr*)buf;
-    if (len < sizeof(struct Sync_hdr) || hdr->sh_version != SYNC_VERSION || hdr->sh_af != AF_INET || len < ntohs(hdr->sh_length)) {
-        goto trunc;
+    /*
+     * Drain the socket in batches, bounded so as not to starve the
+     * caller, and hand the decoded entries of all packets to the
+     * greylister in a single message.
+     */
+    do {
+        n = recv_packets(engine, packets, SYNC_RECV_BATCH);
+        for (i = 0; i < n; i++)
+            entries += process_packet(engine, &packets[i], ctx, grey_out,
+                entries);
+    } while (n == SYNC_RECV_BATCH && ++batches < SYNC_RECV_MAX_BATCHES);
+
+    if (entries > 0) {
+        fprintf(grey_out, "]\n%%\n");
+        fflush(grey_out);
     }
-    len = ntohs(hdr->sh_length);
-
-    /* Compute and validate HMAC. */
-    memcpy(hmac[0], hdr->sh_hmac, SYNC_HMAC_LEN);
-    memset(hdr->sh_hmac, 0, SYNC_HMAC_LEN);
-    HMAC(EVP_sha1(), engine->sync_key, sizeof(engine->sync_key),
-        buf, len, hmac[1], &hmac_len);
-    if (memcmp(hmac[0], hmac[1], SYNC_HMAC_LEN) != 0)
-        goto trunc;
-
-    sstrncpy(src_ip, inet_ntoa(addr.sin_addr), sizeof(src_ip));
-    i_debug("%s (sync): received packet of %d bytes",
-        src_ip, (int)len);
-
-    p = (u_int8_t*)(hdr + 1);
-    while (len) {
-        tlv = (struct Sync_tlv_hdr*)p;
-
-        if (len < sizeof(struct Sync_tlv_hdr) || len < ntohs(tlv->st_length)) {
-            goto trunc;
-        }
-
-        switch (ntohs(tlv->st_type)) {
-        case SYNC_GREY:
-            sg = (struct Sync_tlv_grey*)tlv;
-            if ((sizeof(*sg) + ntohs(sg->sg_from_length) + ntohs(sg->sg_to_length) + ntohs(sg->sg_helo_length)) > ntohs(tlv->st_length)) {
-                goto trunc;
-            }
-
-            ip.s_addr = sg->sg_ip;
-            from = (char*)(sg + 1);
-            to = from + ntohs(sg->sg_from_length);
-            helo = to + ntohs(sg->sg_to_length);
-
-            i_debug("%s (sync): received grey entry "
-                    "from %s to %s, helo %s ip %s",
-                src_ip, from, to, helo, inet_ntoa(ip));
-
-            if (Config_get_int(engine->config, "enable", "grey",
-                    GREYLISTING_ENABLED)) {
-                /* Send this info to the greylister. */
-                fprintf(grey_out,
-                    "type = %d\n"
-                    "sync = 0\n"
-                    "ip = \"%s\"\n"
-                    "helo = \"%s\"\n"
-                    "from = \"%s\"\n"
-                    "to = \"%s\"\n"
-                    "%%\n",
-                    GREY_MSG_GREY, inet_ntoa(ip),
-                    helo, from, to);
-                fflush(grey_out);
-            }
-            break;
-
-        case SYNC_DEL_WHITE:
-            delete = 1;
-            /* Fallthrough. */
 
-        case SYNC_WHITE:
-            sd = (struct Sync_tlv_addr*)tlv;
-            if (sizeof(*sd) != ntohs(tlv->st_length))
-                goto trunc;
+#ifdef OPENSSL_PRE_1_1_COMPAT
+    HMAC_CTX_cleanup(ctx);
+#else
+    HMAC_CTX_free(ctx);
+#endif
+}
 
-            ip.s_addr = sd->sd_ip;
-            expire = ntohl(sd->sd_expire);
-            i_debug("%s (sync): received white entry ip %s (%s) ",
-                src_ip, inet_ntoa(ip),
-                delete ? "deletion" : "addition");
-
-            if (Config_get_int(engine->config, "enable", "grey",
-                    GREYLISTING_ENABLED)) {
-                /* Send this info to the greylister. */
-                fprintf(grey_out,
-                    "type = %d\n"
-                    "sync = 0\n"
-                    "ip = \"%s\"\n"
-                    "source = \"%s\"\n"
-                    "expires = \"%u\"\n"
-                    "delete = %u\n"
-                    "%%\n",
-                    GREY_MSG_WHITE, inet_ntoa(ip),
-                    src_ip, expire, delete);
-                fflush(grey_out);
-            }
-            break;
+extern void
+Sync_flush(Sync_engine_T engine)
+{
+    struct iovec iov;
+    struct Sync_hdr* hdr;
+    struct Sync_tlv_hdr end;
+    u_int8_t hmac[SYNC_HMAC_LEN];
+    u_int hmac_len;
 
-        case SYNC_DEL_TRAPPED:
-            delete = 1;
-            /* Fallthrough. */
+    if (engine->pkt_tlvs == 0)
+        return;
 
-        case SYNC_TRAPPED:
-            sd = (struct Sync_tlv_addr*)tlv;
-            if (sizeof(*sd) != ntohs(tlv->st_length))
-                goto trunc;
+    /* Add end marker. */
+    end.st_type = htons(SYNC_END);
+    end.st_length = htons(sizeof(end));
+    memcpy(engine->pkt + engine->pkt_len, &end, sizeof(end));
+    engine->pkt_len += sizeof(end);
+
+    /* Add SPAM sync packet header, signing the whole packet. */
+    hdr = (struct Sync_hdr*)engine->pkt;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->sh_version = SYNC_VERSION;
+    hdr->sh_af = AF_INET;
+    hdr->sh_counter = htonl(engine->sync_counter++);
+    hdr->sh_length = htons(engine->pkt_len);
+    HMAC(EVP_sha1(), engine->sync_key, sizeof(engine->sync_key),
+        engine->pkt, engine->pkt_len, hmac, &hmac_len);
+    memcpy(hdr->sh_hmac, hmac, SYNC_HMAC_LEN);
 
-            ip.s_addr = sd->sd_ip;
-            expire = ntohl(sd->sd_expire);
-            i_debug("%s (sync): received trapped entry ip %s (%s) ",
-                src_ip, inet_ntoa(ip),
-                delete ? "deletion" : "addition");
-
-            if (Config_get_int(engine->config, "enable", "grey",
-                    GREYLISTING_ENABLED)) {
-                /* Send this info to the greylister. */
-                fprintf(grey_out,
-                    "type = %d\n"
-                    "sync = 0\n"
-                    "ip = \"%s\"\n"
-                    "source = \"%s\"\n"
-                    "expires = \"%u\"\n"
-                    "delete = %u\n"
-                    "%%\n",
-                    GREY_MSG_TRAP, inet_ntoa(ip),
-                    src_ip, expire, delete);
-                fflush(grey_out);
-            }
-            break;
+    i_debug("sync packet of %d entries (%d bytes)",
+        engine->pkt_tlvs, (int)engine->pkt_len);
 
-        case SYNC_END:
-            goto done;
+    /* Send message to the target hosts. */
+    iov.iov_base = engine->pkt;
+    iov.iov_len = engine->pkt_len;
+    send_sync_message(engine, &iov, 1);
+
+    engine->packets_sent++;
+    engine->tlvs_sent += engine->pkt_tlvs;
+    engine->pkt_tlvs = 0;
+    engine->pkt_len = 0;
+}
 
-        default:
-            i_warning("unknown type: %d", ntohs(tlv->st_type));
-            goto trunc;
-        }
+extern int
+Sync_flush_timeout(Sync_engine_T engine)
+{
+    struct timespec now;
+    long elapsed;
 
-        len -= ntohs(tlv->st_length);
-        p = ((u_int8_t*)tlv) + ntohs(tlv->st_length);
-    }
+    if (engine->pkt_tlvs == 0)
+        return -1;
 
-done:
-    return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - engine->pkt_start.tv_sec) * 1000
+        + (now.tv_nsec - engine->pkt_start.tv_nsec) / 1000000;
 
-trunc:
-    i_debug("%s (sync): truncated or invalid packet", src_ip);
+    return (elapsed >= engine->flush_interval
+            ? 0
+            : engine->flush_interval - elapsed);
 }
 
 extern void
-Sync_update(Sync_engine_T engine, struct Grey_tuple* gt, time_t now)
+Sync_update(Sync_engine_T engine, struct Grey_tuple* gt, time_t now,
+    int changed)
 {
-    struct iovec iov[7];
-    struct Sync_hdr hdr;
+    struct iovec iov[5];
     struct Sync_tlv_grey sg;
-    struct Sync_tlv_hdr end;
     u_int16_t sglen, fromlen, tolen, helolen, padlen;
     char pad[SYNC_ALIGNBYTES];
     int i = 0;
-    u_int hmac_len;
+
+    if (suppress_update(engine, gt, now, changed)) {
+        engine->updates_suppressed++;
+        return;
+    }
 
     i_debug("sync grey update helo %s ip %s from %s to %s",
         gt->helo, gt->ip, gt->from, gt->to);
 
-    memset(&hdr, 0, sizeof(hdr));
     memset(&sg, 0, sizeof(sg));
     memset(&pad, 0, sizeof(pad));
 
@@ -554,30 +535,9 @@ Sync_update(Sync_engine_T engine, struct Grey_tuple* gt, time_t now)
     tolen = strlen(gt->to) + 1;
     helolen = strlen(gt->helo) + 1;
 
-#ifdef OPENSSL_PRE_1_1_COMPAT
-    HMAC_CTX _ctx, *ctx = &_ctx;
-    HMAC_CTX_init(ctx);
-    HMAC_Init(ctx, engine->sync_key, sizeof(engine->sync_key),
-        EVP_sha1());
-#else
-    HMAC_CTX* ctx = HMAC_CTX_new();
-    HMAC_Init_ex(ctx, engine->sync_key, sizeof(engine->sync_key),
-        EVP_sha1(), NULL);
-#endif
-
     sglen = sizeof(sg) + fromlen + tolen + helolen;
     padlen = SYNC_ALIGN(sglen) - sglen;
 
-    /* Add SPAM sync packet header */
-    hdr.sh_version = SYNC_VERSION;
-    hdr.sh_af = AF_INET;
-    hdr.sh_counter = htonl(engine->sync_counter++);
-    hdr.sh_length = htons(sizeof(hdr) + sglen + padlen + sizeof(end));
-    iov[i].iov_base = &hdr;
-    iov[i].iov_len = sizeof(hdr);
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
-    i++;
-
     /* Add single SPAM sync greylisting entry */
     sg.sg_type = htons(SYNC_GREY);
     sg.sg_length = htons(sglen + padlen);
@@ -588,46 +548,25 @@ Sync_update(Sync_engine_T engine, struct Grey_tuple* gt, time_t now)
     sg.sg_helo_length = htons(helolen);
     iov[i].iov_base = &sg;
     iov[i].iov_len = sizeof(sg);
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
     i++;
 
     iov[i].iov_base = gt->from;
     iov[i].iov_len = fromlen;
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
     i++;
 
     iov[i].iov_base = gt->to;
     iov[i].iov_len = tolen;
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
     i++;
 
     iov[i].iov_base = gt->helo;
     iov[i].iov_len = helolen;
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
     i++;
 
     iov[i].iov_base = pad;
     iov[i].iov_len = padlen;
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
-    i++;
-
-    /* Add end marker */
-    end.st_type = htons(SYNC_END);
-    end.st_length = htons(sizeof(end));
-    iov[i].iov_base = &end;
-    iov[i].iov_len = sizeof(end);
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
     i++;
 
-    HMAC_Final(ctx, hdr.sh_hmac, &hmac_len);
-
-    /* Send message to the target hosts. */
-    send_sync_message(engine, iov, i);
-#ifdef OPENSSL_PRE_1_1_COMPAT
-    HMAC_CTX_cleanup(ctx);
-#else
-    HMAC_CTX_free(ctx);
-#endif
+    queue_tlv(engine, iov, i);
 }
 
 extern void
@@ -642,115 +581,563 @@ Sync_trapped(Sync_engine_T engine, char* ip, time_t now, time_t expire, short de
     send_address(engine, ip, now, expire, (delete ? SYNC_DEL_TRAPPED : SYNC_TRAPPED));
 }
 
-static void
-send_address(Sync_engine_T engine, char* ip, time_t now, time_t expire, u_int16_t type)
+extern int
+Sync_snapshot_listen(Sync_engine_T engine)
 {
-    struct iovec iov[3];
-    struct Sync_hdr hdr;
-    struct Sync_tlv_addr sd;
-    struct Sync_tlv_hdr end;
-    int i = 0;
-    u_int hmac_len;
-    char* type_name = "";
-
-    switch (type) {
-    case SYNC_WHITE:
-        type_name = "white";
-        break;
+    struct sockaddr_in addr;
+    char* bind_addr;
+    int fd, one = 1;
 
-    case SYNC_DEL_WHITE:
-        type_name = "deletion of white";
-        break;
+    /* Without a key the handshake cannot authenticate the client. */
+    if (*engine->sync_key == '\0') {
+        i_warning("snapshot server requires a sync key");
+        return -1;
+    }
 
-    case SYNC_TRAPPED:
-        type_name = "trapped";
-        break;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(engine->port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    case SYNC_DEL_TRAPPED:
-        type_name = "deletion of trapped";
-        break;
+    /* An interface name as the bind address listens on all addresses. */
+    bind_addr = Config_get_str(engine->config, "bind_address", "sync", NULL);
+    if (bind_addr != NULL
+        && inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
     }
-    i_debug("sync %s %s", type_name, ip);
 
-    memset(&hdr, 0, sizeof(hdr));
-    memset(&sd, 0, sizeof(sd));
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        i_warning("socket: %s", strerror(errno));
+        return -1;
+    }
 
-#ifdef OPENSSL_PRE_1_1_COMPAT
-    HMAC_CTX _ctx, *ctx = &_ctx;
-    HMAC_CTX_init(ctx);
-    HMAC_Init(ctx, engine->sync_key, sizeof(engine->sync_key),
-        EVP_sha1());
-#else
-    HMAC_CTX* ctx = HMAC_CTX_new();
-    HMAC_Init_ex(ctx, engine->sync_key, sizeof(engine->sync_key), EVP_sha1(), NULL);
-#endif
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+        i_warning("setsockopt: %s", strerror(errno));
+        goto fail;
+    }
 
-    /* Add SPAM sync packet header. */
-    hdr.sh_version = SYNC_VERSION;
-    hdr.sh_af = AF_INET;
-    hdr.sh_counter = htonl(engine->sync_counter++);
-    hdr.sh_length = htons(sizeof(hdr) + sizeof(sd) + sizeof(end));
-    iov[i].iov_base = &hdr;
-    iov[i].iov_len = sizeof(hdr);
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
-    i++;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        i_warning("bind: %s", strerror(errno));
+        goto fail;
+    }
 
-    /* Add single SPAM sync address entry */
-    sd.sd_type = htons(type);
-    sd.sd_length = htons(sizeof(sd));
-    sd.sd_timestamp = htonl(now);
-    sd.sd_expire = htonl(expire);
-    sd.sd_ip = inet_addr(ip);
-    iov[i].iov_base = &sd;
-    iov[i].iov_len = sizeof(sd);
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
-    i++;
+    if (listen(fd, 5) == -1) {
+        i_warning("listen: %s", strerror(errno));
+        goto fail;
+    }
 
-    /* Add end marker */
-    end.st_type = htons(SYNC_END);
-    end.st_length = htons(sizeof(end));
-    iov[i].iov_base = &end;
-    iov[i].iov_len = sizeof(end);
-    HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
-    i++;
+    i_debug("listening for snapshot requests on port %d", engine->port);
 
-    HMAC_Final(ctx, hdr.sh_hmac, &hmac_len);
+    return fd;
 
-    /* Send message to the target hosts. */
-    send_sync_message(engine, iov, i);
-#ifdef OPENSSL_PRE_1_1_COMPAT
-    HMAC_CTX_cleanup(ctx);
-#else
-    HMAC_CTX_free(ctx);
-#endif
+fail:
+    close(fd);
+    return -1;
 }
 
-static void
-send_sync_message(Sync_engine_T engine, struct iovec* iov, int iovlen)
+extern int
+Sync_snapshot_connect(Sync_engine_T engine, const char* peer)
 {
-    struct List_entry* entry;
-    struct Sync_host* host;
-    struct msghdr msg;
-
-    /* setup buffer */
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_iov = iov;
-    msg.msg_iovlen = iovlen;
+    struct addrinfo hints, *res, *next;
+    char port[6];
+    int fd = -1, ret;
 
-    if (engine->send_mcast) {
-        i_debug("sending multicast sync message");
-        msg.msg_name = &engine->sync_out;
-        msg.msg_namelen = sizeof(engine->sync_out);
+    snprintf(port, sizeof(port), "%u", engine->port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
 
-        if (sendmsg(engine->sync_fd, &msg, 0) == -1)
-            i_warning("sendmsg: %s", strerror(errno));
+    if ((ret = getaddrinfo(peer, port, &hints, &next)) != 0) {
+        i_warning("could not resolve snapshot peer %s: %s", peer,
+            gai_strerror(ret));
+        return -1;
     }
 
-    LIST_EACH(engine->sync_hosts, entry)
-    {
-        host = List_entry_value(entry);
-        i_debug("sending sync message to %s (%s)",
-            host->name, inet_ntoa(host->addr.sin_addr));
+    for (res = next; res != NULL; res = res->ai_next) {
+        if ((fd = socket(res->ai_family, res->ai_socktype,
+                 res->ai_protocol))
+            == -1) {
+            continue;
+        }
+
+        if (connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(next);
+
+    if (fd == -1) {
+        i_warning("could not connect to snapshot peer %s: %s", peer,
+            strerror(errno));
+    }
+
+    return fd;
+}
+
+extern long
+Sync_snapshot_send(Sync_engine_T engine, int fd, DB_handle_T db)
+{
+    u_int8_t nonces[SYNC_SNAPSHOT_NONCE_LEN * 2], proof[2][SYNC_HMAC_LEN];
+
+    snapshot_timeouts(fd);
+
+    /*
+     * The client proves knowledge of the sync key by signing both
+     * nonces, which also key the signatures of every chunk sent.
+     */
+    if (RAND_bytes(nonces, SYNC_SNAPSHOT_NONCE_LEN) != 1) {
+        i_warning("could not generate snapshot nonce");
+        return -1;
+    }
+
+    if (write_full(fd, nonces, SYNC_SNAPSHOT_NONCE_LEN) == -1
+        || read_full(fd, nonces + SYNC_SNAPSHOT_NONCE_LEN,
+               SYNC_SNAPSHOT_NONCE_LEN)
+            == -1
+        || read_full(fd, proof[0], SYNC_HMAC_LEN) == -1) {
+        i_warning("snapshot handshake failed: %s", strerror(errno));
+        return -1;
+    }
+
+    snapshot_hmac(engine, nonces, NULL, NULL, proof[1]);
+    if (memcmp(proof[0], proof[1], SYNC_HMAC_LEN) != 0) {
+        i_warning("snapshot client failed authentication");
+        return -1;
+    }
+
+    return send_entries(engine, fd, nonces, db);
+}
+
+extern long
+Sync_snapshot_recv(Sync_engine_T engine, int fd, DB_handle_T db)
+{
+    static u_int8_t chunk[SYNC_SNAPSHOT_CHUNK];
+    u_int8_t nonces[SYNC_SNAPSHOT_NONCE_LEN * 2], hmac[SYNC_HMAC_LEN];
+    struct Sync_snapshot_hdr hdr;
+    struct DB_key key;
+    struct Grey_data gd;
+    u_int32_t seq, len, count, i;
+    size_t pos, entry_len;
+    long applied = 0, pending = 0, ret = -1;
+
+    snapshot_timeouts(fd);
+
+    if (RAND_bytes(nonces + SYNC_SNAPSHOT_NONCE_LEN,
+            SYNC_SNAPSHOT_NONCE_LEN)
+        != 1) {
+        i_warning("could not generate snapshot nonce");
+        return -1;
+    }
+
+    if (read_full(fd, nonces, SYNC_SNAPSHOT_NONCE_LEN) == -1) {
+        i_warning("snapshot handshake failed: %s", strerror(errno));
+        return -1;
+    }
+
+    snapshot_hmac(engine, nonces, NULL, NULL, hmac);
+    if (write_full(fd, nonces + SYNC_SNAPSHOT_NONCE_LEN,
+            SYNC_SNAPSHOT_NONCE_LEN)
+            == -1
+        || write_full(fd, hmac, SYNC_HMAC_LEN) == -1) {
+        i_warning("snapshot handshake failed: %s", strerror(errno));
+        return -1;
+    }
+
+    DB_open(db, 0);
+    DB_start_txn(db);
+
+    for (seq = 0;; seq++) {
+        if (read_full(fd, &hdr, sizeof(hdr)) == -1) {
+            i_warning("could not read snapshot: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        len = ntohl(hdr.ss_length);
+        count = ntohl(hdr.ss_count);
+        if (ntohl(hdr.ss_seq) != seq || len > sizeof(chunk)) {
+            i_warning("invalid snapshot chunk %u", seq);
+            goto cleanup;
+        }
+
+        if (read_full(fd, chunk, len) == -1) {
+            i_warning("could not read snapshot: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        snapshot_hmac(engine, nonces, &hdr, chunk, hmac);
+        if (memcmp(hdr.ss_hmac, hmac, SYNC_HMAC_LEN) != 0) {
+            i_warning("invalid snapshot chunk %u signature", seq);
+            goto cleanup;
+        }
+
+        if (count == 0)
+            break;
+
+        for (i = 0, pos = 0; i < count; i++, pos += entry_len) {
+            if ((entry_len = decode_entry(chunk + pos, len - pos, &key, &gd))
+                == 0) {
+                i_warning("invalid snapshot entry in chunk %u", seq);
+                goto cleanup;
+            }
+
+            switch (apply_entry(db, &key, &gd)) {
+            case -1:
+                goto cleanup;
+
+            case 1:
+                applied++;
+                break;
+            }
+
+            /* Keep transactions short, so as not to stall the reader. */
+            if (++pending >= SYNC_SNAPSHOT_BATCH) {
+                DB_commit_txn(db);
+                DB_start_txn(db);
+                pending = 0;
+            }
+        }
+    }
+
+    ret = applied;
+
+cleanup:
+    /* Entries applied before any failure are still valid. */
+    DB_commit_txn(db);
+
+    return ret;
+}
+
+static void
+send_address(Sync_engine_T engine, char* ip, time_t now, time_t expire, u_int16_t type)
+{
+    struct iovec iov;
+    struct Sync_tlv_addr sd;
+    char* type_name = "";
+
+    switch (type) {
+    case SYNC_WHITE:
+        type_name = "white";
+        break;
+
+    case SYNC_DEL_WHITE:
+        type_name = "deletion of white";
+        break;
+
+    case SYNC_TRAPPED:
+        type_name = "trapped";
+        break;
+
+    case SYNC_DEL_TRAPPED:
+        type_name = "deletion of trapped";
+        break;
+    }
+    i_debug("sync %s %s", type_name, ip);
+
+    memset(&sd, 0, sizeof(sd));
+
+    /* Add single SPAM sync address entry */
+    sd.sd_type = htons(type);
+    sd.sd_length = htons(sizeof(sd));
+    sd.sd_timestamp = htonl(now);
+    sd.sd_expire = htonl(expire);
+    sd.sd_ip = inet_addr(ip);
+    iov.iov_base = &sd;
+    iov.iov_len = sizeof(sd);
+
+    queue_tlv(engine, &iov, 1);
+}
+
+/*
+ * Append an entry to the pending packet, sending the packet first if
+ * the entry does not fit, and afterwards if the packet is due.
+ */
+static void
+queue_tlv(Sync_engine_T engine, struct iovec* iov, int iovlen)
+{
+    size_t len = 0, max;
+    int i;
+
+    for (i = 0; i < iovlen; i++)
+        len += iov[i].iov_len;
+
+    max = SYNC_MAXSIZE - sizeof(struct Sync_tlv_hdr);
+    if (sizeof(struct Sync_hdr) + len > max) {
+        i_warning("sync entry of %d bytes is too large", (int)len);
+        return;
+    }
+
+    if (engine->pkt_tlvs > 0 && engine->pkt_len + len > max)
+        Sync_flush(engine);
+
+    if (engine->pkt_tlvs == 0) {
+        engine->pkt_len = sizeof(struct Sync_hdr);
+        clock_gettime(CLOCK_MONOTONIC, &engine->pkt_start);
+    }
+
+    for (i = 0; i < iovlen; i++) {
+        memcpy(engine->pkt + engine->pkt_len, iov[i].iov_base,
+            iov[i].iov_len);
+        engine->pkt_len += iov[i].iov_len;
+    }
+    engine->pkt_tlvs++;
+
+    if (Sync_flush_timeout(engine) == 0)
+        Sync_flush(engine);
+}
+
+/*
+ * Receive up to max datagrams without blocking, returning the number
+ * received.
+ */
+static int
+recv_packets(Sync_engine_T engine, struct sync_packet* packets, int max)
+{
+    int i, n;
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[SYNC_RECV_BATCH];
+    struct iovec iov[SYNC_RECV_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < max; i++) {
+        iov[i].iov_base = packets[i].buf;
+        iov[i].iov_len = sizeof(packets[i].buf);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &packets[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(packets[i].addr);
+    }
+
+    if ((n = recvmmsg(engine->sync_fd, msgs, max, MSG_DONTWAIT, NULL)) < 1)
+        return 0;
+
+    for (i = 0; i < n; i++)
+        packets[i].len = msgs[i].msg_len;
+#else
+    socklen_t addr_len;
+    ssize_t len;
+
+    for (n = 0; n < max; n++) {
+        addr_len = sizeof(packets[n].addr);
+        if ((len = recvfrom(engine->sync_fd, packets[n].buf,
+                 sizeof(packets[n].buf), MSG_DONTWAIT,
+                 (struct sockaddr*)&packets[n].addr, &addr_len))
+            < 1) {
+            break;
+        }
+        packets[n].len = len;
+    }
+#endif
+
+    return n;
+}
+
+/*
+ * Validate a received packet and write its entries to the greylister,
+ * starting the batched message before the first entry. The number of
+ * entries written is returned.
+ */
+static int
+process_packet(Sync_engine_T engine, struct sync_packet* packet,
+    HMAC_CTX* ctx, FILE* grey_out, int written)
+{
+    struct Sync_hdr* hdr;
+    struct Sync_tlv_hdr* tlv;
+    struct Sync_tlv_grey* sg;
+    struct Sync_tlv_addr* sd;
+    u_int8_t hmac[2][SYNC_HMAC_LEN];
+    char ip[INET_ADDRSTRLEN];
+    char *from, *to, *helo;
+    char src_ip[INET_ADDRSTRLEN];
+    u_int8_t* p;
+    ssize_t len = packet->len;
+    short delete = 0;
+    u_int hmac_len;
+    u_int32_t expire;
+    int entries = 0;
+
+    if (packet->addr.sin_addr.s_addr != htonl(INADDR_ANY)
+        && memcmp(&engine->sync_in.sin_addr, &packet->addr.sin_addr,
+               sizeof(packet->addr.sin_addr))
+            == 0) {
+        return 0;
+    }
+
+    inet_ntop(AF_INET, &packet->addr.sin_addr, src_ip, sizeof(src_ip));
+
+    /* Ignore invalid or truncated packets. */
+    hdr = (struct Sync_hdr*)packet->buf;
+    if (len < sizeof(struct Sync_hdr) || hdr->sh_version != SYNC_VERSION || hdr->sh_af != AF_INET || len < ntohs(hdr->sh_length)) {
+        goto trunc;
+    }
+    len = ntohs(hdr->sh_length);
+
+    /* Compute and validate HMAC, reusing the keyed context. */
+    memcpy(hmac[0], hdr->sh_hmac, SYNC_HMAC_LEN);
+    memset(hdr->sh_hmac, 0, SYNC_HMAC_LEN);
+    HMAC_Init_ex(ctx, NULL, 0, NULL, NULL);
+    HMAC_Update(ctx, packet->buf, len);
+    HMAC_Final(ctx, hmac[1], &hmac_len);
+    if (memcmp(hmac[0], hmac[1], SYNC_HMAC_LEN) != 0)
+        goto trunc;
+
+    i_debug("%s (sync): received packet of %d bytes",
+        src_ip, (int)len);
+    engine->packets_recv++;
+
+    p = (u_int8_t*)(hdr + 1);
+    while (len) {
+        tlv = (struct Sync_tlv_hdr*)p;
+        delete = 0;
+
+        if (len < sizeof(struct Sync_tlv_hdr) || len < ntohs(tlv->st_length)) {
+            goto trunc;
+        }
+
+        switch (ntohs(tlv->st_type)) {
+        case SYNC_GREY:
+            sg = (struct Sync_tlv_grey*)tlv;
+            if ((sizeof(*sg) + ntohs(sg->sg_from_length) + ntohs(sg->sg_to_length) + ntohs(sg->sg_helo_length)) > ntohs(tlv->st_length)) {
+                goto trunc;
+            }
+
+            inet_ntop(AF_INET, &sg->sg_ip, ip, sizeof(ip));
+            from = (char*)(sg + 1);
+            to = from + ntohs(sg->sg_from_length);
+            helo = to + ntohs(sg->sg_to_length);
+
+            i_debug("%s (sync): received grey entry "
+                    "from %s to %s, helo %s ip %s",
+                src_ip, from, to, helo, ip);
+
+            if (!engine->grey_enabled)
+                break;
+
+            /* Longer strings cannot be read back whole by the greylister. */
+            if (strlen(helo) > CONFIG_LEXER_MAX_STR_LEN
+                || strlen(from) > CONFIG_LEXER_MAX_STR_LEN
+                || strlen(to) > CONFIG_LEXER_MAX_STR_LEN) {
+                i_debug("%s (sync): ignoring grey entry with long fields",
+                    src_ip);
+                break;
+            }
+
+            start_entry(grey_out, written + entries++);
+            fprintf(grey_out, "\"grey\",\"%s\",", ip);
+            write_str(grey_out, helo);
+            fputc(',', grey_out);
+            write_str(grey_out, from);
+            fputc(',', grey_out);
+            write_str(grey_out, to);
+            break;
+
+        case SYNC_DEL_WHITE:
+        case SYNC_DEL_TRAPPED:
+            delete = 1;
+            /* Fallthrough. */
+
+        case SYNC_WHITE:
+        case SYNC_TRAPPED:
+            sd = (struct Sync_tlv_addr*)tlv;
+            if (sizeof(*sd) != ntohs(tlv->st_length))
+                goto trunc;
+
+            inet_ntop(AF_INET, &sd->sd_ip, ip, sizeof(ip));
+            expire = ntohl(sd->sd_expire);
+            i_debug("%s (sync): received %s entry ip %s (%s) ",
+                src_ip, (SYNC_IS_TRAP(ntohs(tlv->st_type)) ? "trapped" : "white"),
+                ip, delete ? "deletion" : "addition");
+
+            if (engine->grey_enabled) {
+                start_entry(grey_out, written + entries++);
+                fprintf(grey_out, "\"%s\",\"%s\",\"%s\",\"%u\",\"%u\"",
+                    (SYNC_IS_TRAP(ntohs(tlv->st_type)) ? "trap" : "white"),
+                    ip, src_ip, expire, delete);
+            }
+            break;
+
+        case SYNC_END:
+            goto done;
+
+        default:
+            i_warning("unknown type: %d", ntohs(tlv->st_type));
+            goto trunc;
+        }
+
+        engine->tlvs_recv++;
+        len -= ntohs(tlv->st_length);
+        p = ((u_int8_t*)tlv) + ntohs(tlv->st_length);
+    }
+
+done:
+    return entries;
+
+trunc:
+    i_debug("%s (sync): truncated or invalid packet", src_ip);
+    return entries;
+}
+
+/*
+ * Each entry is a fixed number of list elements in the batched message
+ * sent to the greylister.
+ */
+static void
+start_entry(FILE* grey_out, int index)
+{
+    if (index == 0) {
+        fprintf(grey_out,
+            "type = %d\n"
+            "sync = 0\n"
+            "entries = [",
+            GREY_MSG_SYNC);
+    } else {
+        fprintf(grey_out, ",");
+    }
+}
+
+/*
+ * Write a quoted string into the batched message, escaping the quotes
+ * and backslashes which would otherwise end or corrupt the message.
+ */
+static void
+write_str(FILE* grey_out, const char* str)
+{
+    fputc('"', grey_out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', grey_out);
+        fputc(*str, grey_out);
+    }
+    fputc('"', grey_out);
+}
+
+static void
+send_sync_message(Sync_engine_T engine, struct iovec* iov, int iovlen)
+{
+    struct List_entry* entry;
+    struct Sync_host* host;
+    struct msghdr msg;
+
+    /* setup buffer */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovlen;
+
+    if (engine->send_mcast) {
+        i_debug("sending multicast sync message");
+        msg.msg_name = &engine->sync_out;
+        msg.msg_namelen = sizeof(engine->sync_out);
+
+        if (sendmsg(engine->sync_fd, &msg, 0) == -1)
+            i_warning("sendmsg: %s", strerror(errno));
+    }
+
+    LIST_EACH(engine->sync_hosts, entry)
+    {
+        host = List_entry_value(entry);
+        i_debug("sending sync message to %s (%s)",
+            host->name, inet_ntoa(host->addr.sin_addr));
         msg.msg_name = &host->addr;
         msg.msg_namelen = sizeof(host->addr);
 
@@ -772,3 +1159,416 @@ destroy_sync_host(void* entry)
         free(host);
     }
 }
+
+/*
+ * Bound the time a stalled peer may hold up a snapshot transfer.
+ */
+static void
+snapshot_timeouts(int fd)
+{
+    struct timeval tv;
+
+    memset(&tv, 0, sizeof(tv));
+    tv.tv_sec = SYNC_SNAPSHOT_TIMEOUT;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int
+read_full(int fd, void* buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = read(fd, buf, len)) == -1 && errno == EINTR)
+            continue;
+
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+
+        buf = (u_int8_t*)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int
+write_full(int fd, const void* buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf = (const u_int8_t*)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Sign the concatenated server and client nonces, followed by the
+ * chunk header and entries if present.
+ */
+static void
+snapshot_hmac(Sync_engine_T engine, u_int8_t* nonces,
+    struct Sync_snapshot_hdr* hdr, u_int8_t* entries, u_int8_t* hmac)
+{
+    struct Sync_snapshot_hdr unsigned_hdr;
+    u_int hmac_len;
+
+#ifdef OPENSSL_PRE_1_1_COMPAT
+    HMAC_CTX _ctx, *ctx = &_ctx;
+    HMAC_CTX_init(ctx);
+    HMAC_Init(ctx, engine->sync_key, sizeof(engine->sync_key),
+        EVP_sha1());
+#else
+    HMAC_CTX* ctx = HMAC_CTX_new();
+    HMAC_Init_ex(ctx, engine->sync_key, sizeof(engine->sync_key),
+        EVP_sha1(), NULL);
+#endif
+
+    HMAC_Update(ctx, nonces, SYNC_SNAPSHOT_NONCE_LEN * 2);
+    if (hdr != NULL) {
+        unsigned_hdr = *hdr;
+        memset(unsigned_hdr.ss_hmac, 0, SYNC_HMAC_LEN);
+        HMAC_Update(ctx, (u_int8_t*)&unsigned_hdr, sizeof(unsigned_hdr));
+        HMAC_Update(ctx, entries, ntohl(hdr->ss_length));
+    }
+    HMAC_Final(ctx, hmac, &hmac_len);
+
+#ifdef OPENSSL_PRE_1_1_COMPAT
+    HMAC_CTX_cleanup(ctx);
+#else
+    HMAC_CTX_free(ctx);
+#endif
+}
+
+static int
+send_chunk(Sync_engine_T engine, int fd, u_int8_t* nonces, u_int32_t seq,
+    u_int8_t* entries, size_t len, u_int32_t count)
+{
+    struct Sync_snapshot_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ss_seq = htonl(seq);
+    hdr.ss_length = htonl(len);
+    hdr.ss_count = htonl(count);
+    snapshot_hmac(engine, nonces, &hdr, entries, hdr.ss_hmac);
+
+    if (write_full(fd, &hdr, sizeof(hdr)) == -1
+        || write_full(fd, entries, len) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Encode an entry into the supplied buffer, returning the encoded
+ * length or 0 if there is not enough room.
+ */
+static size_t
+encode_entry(struct DB_key* key, struct Grey_data* gd, u_int8_t* buf,
+    size_t avail)
+{
+    struct Sync_snapshot_entry se;
+    char* strs[4] = { "", "", "", "" };
+    size_t lens[4], len = sizeof(se);
+    int i;
+
+    if (key->type == DB_KEY_IP) {
+        strs[0] = key->data.s;
+    } else {
+        strs[0] = key->data.gt.ip;
+        strs[1] = key->data.gt.helo;
+        strs[2] = key->data.gt.from;
+        strs[3] = key->data.gt.to;
+    }
+
+    for (i = 0; i < 4; i++) {
+        lens[i] = strlen(strs[i]) + 1;
+        len += lens[i];
+    }
+
+    if (len > avail || len > UINT16_MAX)
+        return 0;
+
+    memset(&se, 0, sizeof(se));
+    se.se_type = htons(key->type);
+    se.se_length = htons(len);
+    se.se_first = htonl(gd->first);
+    se.se_pass = htonl(gd->pass);
+    se.se_expire = htonl(gd->expire);
+    se.se_bcount = htonl(gd->bcount);
+    se.se_pcount = htonl(gd->pcount);
+    se.se_ip_length = htons(lens[0]);
+    se.se_helo_length = htons(lens[1]);
+    se.se_from_length = htons(lens[2]);
+    se.se_to_length = htons(lens[3]);
+
+    memcpy(buf, &se, sizeof(se));
+    buf += sizeof(se);
+    for (i = 0; i < 4; i++) {
+        memcpy(buf, strs[i], lens[i]);
+        buf += lens[i];
+    }
+
+    return len;
+}
+
+/*
+ * Send the unexpired address and tuple entries a chunk at a time,
+ * followed by the empty final chunk, returning the number of entries
+ * sent or -1 on error.
+ *
+ * Where the driver can resume an iteration, each chunk is read from its
+ * own snapshot, which is released before the chunk is sent, so that no
+ * transaction is held open while waiting on a slow client. Otherwise the
+ * entries are streamed from a single transaction. Either way only one
+ * chunk is held in memory.
+ */
+static long
+send_entries(Sync_engine_T engine, int fd, u_int8_t* nonces,
+    DB_handle_T db)
+{
+    struct DB_key key, after;
+    struct DB_val val;
+    struct Grey_data gd;
+    DB_itr_T itr = NULL;
+    u_int8_t *chunk, *resume;
+    size_t len, last = 0, entry_len;
+    u_int32_t count, seq = 0;
+    time_t now = time(NULL);
+    long sent = 0;
+    int ret, more, resumed = 0, txn = 0;
+
+    /* The last entry of a chunk is kept to resume the iteration after. */
+    if ((chunk = malloc(SYNC_SNAPSHOT_CHUNK * 2)) == NULL) {
+        i_warning("could not allocate snapshot chunk");
+        return -1;
+    }
+    resume = chunk + SYNC_SNAPSHOT_CHUNK;
+
+    DB_open(db, 0);
+
+    do {
+        more = 0;
+        len = count = 0;
+
+        if ((itr = DB_get_itr_after(db, (resumed ? &after : NULL)))
+            == NULL) {
+            DB_start_txn(db);
+            txn = 1;
+            itr = DB_get_itr(db, DB_ENTRIES);
+        }
+
+        while ((ret = DB_itr_next(itr, &key, &val)) == GREYDB_FOUND) {
+            if ((key.type != DB_KEY_IP && key.type != DB_KEY_TUPLE)
+                || val.data.gd.expire <= now) {
+                continue;
+            }
+
+            entry_len = encode_entry(&key, &val.data.gd, chunk + len,
+                SYNC_SNAPSHOT_CHUNK - len);
+
+            if (entry_len == 0 && len > 0) {
+                if (!txn) {
+                    /* Resume from this entry once the chunk is sent. */
+                    more = 1;
+                    break;
+                }
+
+                if (send_chunk(engine, fd, nonces, seq++, chunk, len, count)
+                    == -1) {
+                    goto send_error;
+                }
+                len = count = 0;
+                entry_len = encode_entry(&key, &val.data.gd, chunk,
+                    SYNC_SNAPSHOT_CHUNK);
+            }
+
+            if (entry_len == 0) {
+                i_warning("snapshot entry for %s is too large",
+                    (key.type == DB_KEY_IP ? key.data.s : key.data.gt.ip));
+                continue;
+            }
+
+            last = len;
+            len += entry_len;
+            count++;
+            sent++;
+        }
+
+        if (ret == GREYDB_ERR) {
+            i_warning("could not read snapshot entries");
+            goto error;
+        }
+
+        DB_close_itr(&itr);
+        if (txn) {
+            DB_commit_txn(db);
+            txn = 0;
+        }
+
+        if (more) {
+            memcpy(resume, chunk + last, len - last);
+            decode_entry(resume, len - last, &after, &gd);
+            resumed = 1;
+        }
+
+        if (count > 0
+            && send_chunk(engine, fd, nonces, seq++, chunk, len, count)
+                == -1) {
+            goto send_error;
+        }
+    } while (more);
+
+    if (send_chunk(engine, fd, nonces, seq, NULL, 0, 0) == -1)
+        goto send_error;
+
+    free(chunk);
+
+    return sent;
+
+send_error:
+    i_warning("could not send snapshot: %s", strerror(errno));
+
+error:
+    DB_close_itr(&itr);
+    if (txn)
+        DB_rollback_txn(db);
+    free(chunk);
+
+    return -1;
+}
+
+/*
+ * Decode an entry, pointing the key's strings into the buffer. The
+ * entry's length is returned, or 0 if it is malformed.
+ */
+static size_t
+decode_entry(u_int8_t* buf, size_t avail, struct DB_key* key,
+    struct Grey_data* gd)
+{
+    struct Sync_snapshot_entry se;
+    char* strs[4];
+    size_t lens[4], len, pos;
+    int i;
+
+    if (avail < sizeof(se))
+        return 0;
+
+    memcpy(&se, buf, sizeof(se));
+    len = ntohs(se.se_length);
+    lens[0] = ntohs(se.se_ip_length);
+    lens[1] = ntohs(se.se_helo_length);
+    lens[2] = ntohs(se.se_from_length);
+    lens[3] = ntohs(se.se_to_length);
+
+    if (len > avail)
+        return 0;
+
+    for (i = 0, pos = sizeof(se); i < 4; pos += lens[i++]) {
+        if (lens[i] == 0 || pos + lens[i] > len
+            || buf[pos + lens[i] - 1] != '\0') {
+            return 0;
+        }
+        strs[i] = (char*)buf + pos;
+    }
+
+    memset(key, 0, sizeof(*key));
+    key->type = ntohs(se.se_type);
+    switch (key->type) {
+    case DB_KEY_IP:
+        key->data.s = strs[0];
+        break;
+
+    case DB_KEY_TUPLE:
+        key->data.gt.ip = strs[0];
+        key->data.gt.helo = strs[1];
+        key->data.gt.from = strs[2];
+        key->data.gt.to = strs[3];
+        break;
+
+    default:
+        return 0;
+    }
+
+    gd->first = ntohl(se.se_first);
+    gd->pass = ntohl(se.se_pass);
+    gd->expire = ntohl(se.se_expire);
+    gd->bcount = (int32_t)ntohl(se.se_bcount);
+    gd->pcount = (int32_t)ntohl(se.se_pcount);
+
+    return len;
+}
+
+/*
+ * Store an entry unless a local one expires at the same time or later.
+ *
+ * @return 1 if applied, 0 if skipped, -1 on error.
+ */
+static int
+apply_entry(DB_handle_T db, struct DB_key* key, struct Grey_data* gd)
+{
+    struct DB_val val;
+
+    switch (DB_get(db, key, &val)) {
+    case GREYDB_FOUND:
+        if (val.data.gd.expire >= gd->expire)
+            return 0;
+        break;
+
+    case GREYDB_ERR:
+        return -1;
+    }
+
+    val.type = DB_VAL_GREY;
+    val.data.gd = *gd;
+
+    return (DB_put(db, key, &val) == GREYDB_OK ? 1 : -1);
+}
+
+/*
+ * Check whether a grey update may be dropped, as the tuple was sent
+ * within the suppression window. The send time is only recorded when
+ * the update goes out, so peers still see one update per window.
+ */
+static int
+suppress_update(Sync_engine_T engine, struct Grey_tuple* gt, time_t now,
+    int changed)
+{
+    char key[SYNC_MAXSIZE];
+    time_t sent;
+    int len;
+
+    if (engine->suppress_window <= 0)
+        return 0;
+
+    len = snprintf(key, sizeof(key), "%s\n%s\n%s\n%s", gt->ip, gt->helo,
+        gt->from, gt->to);
+    if (len < 0 || len >= (int)sizeof(key))
+        return 0;
+
+    sent = (time_t)(intptr_t)Hash_get(engine->suppress, key);
+    if (!changed && sent > 0 && now - sent < engine->suppress_window)
+        return 1;
+
+    /* Bound the memory used, at the cost of a few redundant updates. */
+    if (engine->suppress->num_entries >= SYNC_SUPPRESS_MAX)
+        Hash_reset(engine->suppress);
+
+    Hash_insert(engine->suppress, key, (void*)(intptr_t)now);
+
+    return 0;
+}
@@ -27,8 +27,12 @@
 
 #include <netinet/in.h>
 #include <openssl/sha.h>
+#include <time.h>
 
 #include "greyd_config.h"
+#include "hash.h"
+
+struct DB_handle_T;
 
 #define SYNC_VERSION 2
 #define SYNC_VERIFY_MSG 1
@@ -37,6 +41,16 @@
 #define SYNC_HMAC_LEN 20 /* SHA1 */
 #define SYNC_MAXSIZE 1408
 #define SYNC_KEY "/etc/greyd/greyd.key"
+#define SYNC_FLUSH_INTERVAL 100 /* In milliseconds. */
+#define SYNC_SUPPRESS_WINDOW 60 /* In seconds. */
+#define SYNC_SUPPRESS_MAX 65536 /* Tuples remembered. */
+
+/* Snapshot transfers over TCP. */
+#define SYNC_SNAPSHOT_ENABLED 0
+#define SYNC_SNAPSHOT_BATCH 1000 /* Entries applied per transaction. */
+#define SYNC_SNAPSHOT_TIMEOUT 30 /* In seconds. */
+#define SYNC_SNAPSHOT_CHUNK 65536
+#define SYNC_SNAPSHOT_NONCE_LEN 16
 
 /* Types compatible with spamd. */
 #define SYNC_END 0x0000
@@ -64,6 +78,30 @@ struct Sync_engine_T {
     int sync_counter;
     List_T sync_hosts;
     char* iface;
+
+    /*
+     * Outgoing entries are accumulated into a pending packet, which is
+     * sent once full or after the flush interval.
+     */
+    u_int8_t pkt[SYNC_MAXSIZE];
+    size_t pkt_len;
+    int pkt_tlvs;
+    struct timespec pkt_start;
+    int flush_interval;
+    int grey_enabled;
+
+    /*
+     * Grey tuples sent recently, mapped to the time they were sent,
+     * so that repeated updates within the window may be dropped.
+     */
+    Hash_T suppress;
+    int suppress_window;
+
+    unsigned long packets_sent;
+    unsigned long tlvs_sent;
+    unsigned long packets_recv;
+    unsigned long tlvs_recv;
+    unsigned long updates_suppressed;
 };
 
 struct Sync_hdr {
@@ -99,6 +137,32 @@ struct Sync_tlv_addr {
     u_int32_t sd_ip;
 } __attribute__((__packed__));
 
+/*
+ * A snapshot is streamed as a sequence of signed chunks, each holding
+ * a number of entries. A chunk of zero entries marks the end.
+ */
+struct Sync_snapshot_hdr {
+    u_int32_t ss_seq;
+    u_int32_t ss_length; /* Length of the entries following. */
+    u_int32_t ss_count;
+    u_int8_t ss_hmac[SYNC_HMAC_LEN];
+} __attribute__((__packed__));
+
+struct Sync_snapshot_entry {
+    u_int16_t se_type; /* DB_KEY_IP or DB_KEY_TUPLE. */
+    u_int16_t se_length;
+    u_int32_t se_first;
+    u_int32_t se_pass;
+    u_int32_t se_expire;
+    u_int32_t se_bcount;
+    u_int32_t se_pcount;
+    u_int16_t se_ip_length;
+    u_int16_t se_helo_length;
+    u_int16_t se_from_length;
+    u_int16_t se_to_length;
+    /* Strings go here, each NUL terminated. */
+} __attribute__((__packed__));
+
 /**
  * Create a new engine object and initialize the engine's
  * fields based on the supplied configuration.
@@ -113,7 +177,8 @@ extern Sync_engine_T Sync_init(Config_T config);
 extern int Sync_start(Sync_engine_T engine);
 
 /**
- * Stop the sync engine and cleanup all sync resources.
+ * Stop the sync engine and cleanup all sync resources. Any pending
+ * entries are sent first.
  */
 extern void Sync_stop(Sync_engine_T* engine);
 
@@ -123,30 +188,81 @@ extern void Sync_stop(Sync_engine_T* engine);
 extern int Sync_add_host(Sync_engine_T engine, const char* name);
 
 /**
- * Receive a sync message on the engine's socket and write grey
- * data to the greylister on the specified file handle.
+ * Receive the sync messages waiting on the engine's socket and write
+ * their entries to the greylister on the specified file handle, as a
+ * single batched message.
  */
 extern void Sync_recv(Sync_engine_T engine, FILE* grey_out);
 
 /**
- * Send out a sync message to notify others of a change to a grey
- * entry.
+ * Send the pending sync packet, if any entries have been queued.
+ */
+extern void Sync_flush(Sync_engine_T engine);
+
+/**
+ * Get the time remaining until the pending sync packet is due to be
+ * sent, suitable for use as a poll timeout.
+ *
+ * @return The time in milliseconds, 0 if the packet is due.
+ * @return -1 if there are no pending entries.
+ */
+extern int Sync_flush_timeout(Sync_engine_T engine);
+
+/**
+ * Queue a sync message to notify others of a change to a grey
+ * entry. If the change is only another sighting of a tuple already
+ * sent within the suppression window, and changed is not set, the
+ * message is dropped.
  */
 extern void Sync_update(Sync_engine_T engine, struct Grey_tuple* gt,
-    time_t now);
+    time_t now, int changed);
 
 /**
- * Send out a sync message to notify others of a change to a white
+ * Queue a sync message to notify others of a change to a white
  * entry.
  */
 extern void Sync_white(Sync_engine_T engine, char* ip, time_t now,
     time_t expire, short delete);
 
 /**
- * Send out a sync message to notify others of a change to a
+ * Queue a sync message to notify others of a change to a
  * grey-trapped entry.
  */
 extern void Sync_trapped(Sync_engine_T engine, char* ip, time_t now,
     time_t expire, short delete);
 
+/**
+ * Listen for snapshot requests on the engine's TCP port.
+ *
+ * @return the listening socket, or -1 on error.
+ */
+extern int Sync_snapshot_listen(Sync_engine_T engine);
+
+/**
+ * Connect to a peer's snapshot port.
+ *
+ * @return the connected socket, or -1 on error.
+ */
+extern int Sync_snapshot_connect(Sync_engine_T engine, const char* peer);
+
+/**
+ * Authenticate the client connected on fd and stream it the white,
+ * trapped and grey entries in the database.
+ *
+ * @return the number of entries sent, or -1 on error.
+ */
+extern long Sync_snapshot_send(Sync_engine_T engine, int fd,
+    struct DB_handle_T* db);
+
+/**
+ * Request a snapshot from the peer connected on fd and apply its
+ * entries to the database in batches. Existing entries are only
+ * replaced by entries expiring later, so that updates received whilst
+ * the transfer is in progress are kept.
+ *
+ * @return the number of entries applied, or -1 on error.
+ */
+extern long Sync_snapshot_recv(Sync_engine_T engine, int fd,
+    struct DB_handle_T* db);
+
 #endif